@@ -0,0 +1,26 @@
+// G-code line framing for the printer's numbered, checksummed protocol
+
+#include <string.h>
+
+#include "printer_protocol.h"
+
+size_t gcode_frame(char *buf, size_t size, uint32_t line, const char *cmd)
+{
+    json_writer_t w;
+    json_init(&w, buf, size);
+    json_lit(&w, "N");
+    json_uint(&w, line);
+    json_lit(&w, " ");
+    json_raw(&w, cmd, strlen(cmd));
+    if (w.full) return 0;
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < w.len; i++) {
+        checksum ^= (uint8_t)buf[i];
+    }
+    json_lit(&w, "*");
+    json_uint(&w, checksum);
+    json_lit(&w, "\n");
+    json_end(&w);
+    return w.full ? 0 : w.len;
+}
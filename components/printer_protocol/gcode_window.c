@@ -0,0 +1,340 @@
+// G-code sliding window: line numbering, batching, 'ok' credits, Resend:
+// and timeouts, driven through the owner's gcode_window_ops_t
+
+#include <string.h>
+
+#include "gcode_window.h"
+#include "printer_protocol.h"
+
+void gcode_window_init(gcode_window_t *w, const gcode_window_ops_t *ops)
+{
+    memset(w, 0, sizeof(*w));
+    w->ops = *ops;
+}
+
+void gcode_window_lock(gcode_window_t *w)
+{
+    if (w->ops.lock) w->ops.lock(w->ops.ctx);
+}
+
+void gcode_window_unlock(gcode_window_t *w)
+{
+    if (w->ops.unlock) w->ops.unlock(w->ops.ctx);
+}
+
+gcode_line_t *gcode_window_slot(gcode_window_t *w, uint32_t line)
+{
+    return &w->lines[line % GCODE_RESEND_WINDOW];
+}
+
+void gcode_opcode(const char *cmd, char out[8])
+{
+    size_t n = 0;
+
+    if ((cmd[0] >= 'A' && cmd[0] <= 'Z') || (cmd[0] >= 'a' && cmd[0] <= 'z')) {
+        out[n++] = (char)(cmd[0] & ~0x20);
+        while (n < 7 && cmd[n] >= '0' && cmd[n] <= '9') {
+            out[n] = cmd[n];
+            n++;
+        }
+    }
+    out[n] = '\0';
+}
+
+// Long operations are listed; everything else gets GCODE_OK_TIMEOUT_MS, so
+// a lost 'ok' costs a minute rather than five
+uint32_t gcode_timeout_for(const char *opcode)
+{
+    static const struct {
+        const char *opcode;
+        uint32_t timeout_ms;
+    } gcode_timeouts[] = {
+        { "G28",  180000 },   // Home
+        { "G29",  300000 },   // Mesh bed levelling
+        { "G80",  300000 },
+        { "G76",  600000 },   // Probe temperature calibration
+        { "M109", 600000 },   // Wait for hotend
+        { "M190", 900000 },   // Wait for bed
+        { "M303", 1200000 },  // PID autotune
+        { "M400", 300000 },   // Wait for moves
+        { "G4",   300000 },   // Dwell
+        { "M0",   3600000 },  // Wait for user
+        { "M1",   3600000 },
+        { "M600", 3600000 },  // Filament change
+        { "M105", GCODE_QUERY_TIMEOUT_MS },
+        { "M114", GCODE_QUERY_TIMEOUT_MS },
+        { "M115", GCODE_QUERY_TIMEOUT_MS },
+        { "M119", GCODE_QUERY_TIMEOUT_MS },
+        { "M27",  GCODE_QUERY_TIMEOUT_MS },
+        { "M31",  GCODE_QUERY_TIMEOUT_MS },
+        { "M110", GCODE_QUERY_TIMEOUT_MS },
+        { "M155", GCODE_QUERY_TIMEOUT_MS },
+        { "M420", GCODE_QUERY_TIMEOUT_MS },
+        { "M503", GCODE_QUERY_TIMEOUT_MS },
+    };
+
+    for (size_t i = 0; i < sizeof(gcode_timeouts) / sizeof(gcode_timeouts[0]); i++) {
+        if (strcmp(opcode, gcode_timeouts[i].opcode) == 0) {
+            return gcode_timeouts[i].timeout_ms;
+        }
+    }
+    return GCODE_OK_TIMEOUT_MS;
+}
+
+// Add a command as the next line. Comments are stripped - the printer drops
+// everything after ';', which would include the checksum. Returns false if
+// nothing is left to send.
+static bool gcode_window_push(gcode_window_t *w, const gcode_cmd_t *src)
+{
+    gcode_line_t *slot = gcode_window_slot(w, w->next_line);
+    const char *cmd = src->cmd;
+    size_t len = strcspn(cmd, ";\r\n");
+
+    while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t')) len--;
+    while (len > 0 && (*cmd == ' ' || *cmd == '\t')) {
+        cmd++;
+        len--;
+    }
+    if (len == 0) return false;
+    if (len >= GCODE_CMD_MAX_LEN) len = GCODE_CMD_MAX_LEN - 1;
+
+    memcpy(slot->cmd, cmd, len);
+    slot->cmd[len] = '\0';
+    slot->line = w->next_line++;
+    slot->sent_us = 0;
+    slot->from_stream = src->from_stream;
+    slot->timeout_ms = 0;                      // Filled in on first transmit
+    slot->reply_begin = src->reply_begin;
+    slot->reply_fd = src->reply_fd;
+    slot->request_id = src->request_id;
+    return true;
+}
+
+// Caller holds the lock
+static void gcode_window_reset(gcode_window_t *w)
+{
+    static const gcode_cmd_t set_line = { .cmd = "M110 N0", .reply_fd = -1 };
+
+    w->next_line = 0;
+    w->send_pos = 0;
+    w->acked = 0;
+    w->oks_to_swallow = 0;
+    w->resend_repeats = 0;
+    w->unanswered = 0;
+    w->oks_seen = 0;
+    w->priority_count = 0;
+    w->batch_len = 0;
+    w->batch_lines = 0;
+    w->log_pos = w->ops.log_head(w->ops.ctx);
+    gcode_window_push(w, &set_line);
+}
+
+void gcode_window_restart(gcode_window_t *w)
+{
+    gcode_window_lock(w);
+    gcode_window_reset(w);
+    gcode_window_unlock(w);
+}
+
+// Frame the next line after the batch. Returns false if it does not fit the
+// transfer behind the lines already in it.
+static bool gcode_window_frame(gcode_window_t *w)
+{
+    gcode_line_t *slot = gcode_window_slot(w, w->send_pos + w->batch_lines);
+
+    size_t n = gcode_frame((char *)w->batch + w->batch_len, sizeof(w->batch) - w->batch_len,
+                           slot->line, slot->cmd);
+    if (n == 0) return false;
+    w->batch_len += n;
+    w->batch_lines++;
+    return true;
+}
+
+// Submit the batch and move its lines onto the wire. On failure (usually all
+// OUT transfers still queued) nothing is counted as sent and the lines are
+// framed again on the next pass.
+static int gcode_window_flush(gcode_window_t *w)
+{
+    if (w->batch_lines == 0) return 0;
+
+    int err = w->ops.transmit(w->ops.ctx, w->batch, w->batch_len,
+                              gcode_window_slot(w, w->send_pos)->line, w->batch_lines);
+    if (err != 0) {
+        w->batch_len = 0;
+        w->batch_lines = 0;
+        return err;
+    }
+
+    int64_t now_us = w->ops.now_us(w->ops.ctx);
+    for (uint32_t i = 0; i < w->batch_lines; i++) {
+        gcode_line_t *slot = gcode_window_slot(w, w->send_pos);
+        if (slot->timeout_ms == 0) {
+            char opcode[8];
+            gcode_opcode(slot->cmd, opcode);
+            slot->timeout_ms = gcode_timeout_for(opcode);
+        }
+        slot->sent_us = now_us;
+        if (w->send_pos == w->acked) {
+            w->head_since_us = now_us;
+        }
+        w->send_pos++;
+        w->unanswered++;
+        w->sent++;
+    }
+    w->batch_len = 0;
+    w->batch_lines = 0;
+    return 0;
+}
+
+// A line is finished; a batched request collects from its first line's
+// start to its last line's ok
+static void gcode_window_complete(gcode_window_t *w, const gcode_line_t *line, size_t log_end,
+                                  bool timed_out)
+{
+    if (line->reply_begin) {
+        w->reply_start = w->log_pos;
+    }
+    w->ops.completed(w->ops.ctx, line, w->reply_start, log_end, timed_out);
+}
+
+static void gcode_window_event(gcode_window_t *w, const gcode_event_t *ev)
+{
+    if (ev->type == GCODE_EVENT_OK) {
+        w->oks_seen++;
+        if (w->priority_count > 0 && w->priority_ok[w->priority_head] == w->oks_seen) {
+            // Answer to a priority command, not a credit
+            uint32_t us = (uint32_t)(w->ops.now_us(w->ops.ctx) - w->priority_sent_us[w->priority_head]);
+            w->priority.last_ok_us = us;
+            if (us > w->priority.max_ok_us) w->priority.max_ok_us = us;
+            w->priority_head = (w->priority_head + 1) % GCODE_PRIORITY_PENDING;
+            w->priority_count--;
+            w->log_pos = ev->log_pos;
+            return;
+        }
+        if (w->unanswered > 0) w->unanswered--;
+        if (w->oks_to_swallow > 0) {
+            w->oks_to_swallow--;         // Belongs to a Resend:, not to a line
+        } else if (w->acked != w->send_pos) {
+            gcode_window_complete(w, gcode_window_slot(w, w->acked), ev->log_pos, false);
+            w->acked++;
+            w->head_since_us = w->ops.now_us(w->ops.ctx);  // The next line starts executing now
+        }
+        w->log_pos = ev->log_pos;
+        return;
+    }
+
+    // Resend: N - the printer accepted everything before N and discards the rest
+    w->oks_to_swallow++;
+    if (ev->line == w->resend_line && w->resend_repeats > 0) {
+        // Lines already on the wire behind N bounce with the same request
+        w->resend_repeats--;
+        return;
+    }
+    if (ev->line > w->next_line || w->next_line - ev->line > GCODE_RESEND_WINDOW ||
+        ev->line > w->send_pos) {
+        w->ops.resend(w->ops.ctx, ev->line, true);
+        gcode_window_reset(w);
+        return;
+    }
+
+    w->ops.resend(w->ops.ctx, ev->line, false);
+    w->resends += w->send_pos - ev->line;
+    w->resend_line = ev->line;
+    w->resend_repeats = w->send_pos > ev->line + 1 ? w->send_pos - ev->line - 1 : 0;
+    w->acked = ev->line;
+    w->send_pos = ev->line;
+}
+
+// Give up on the oldest line if its 'ok' is overdue. Its clock starts when
+// the line before it was acknowledged, not when it was sent - until then it
+// was only waiting in the printer's buffer behind e.g. a G29.
+static void gcode_window_check_timeout(gcode_window_t *w, int64_t now_us)
+{
+    if (w->acked == w->send_pos) return;
+
+    const gcode_line_t *oldest = gcode_window_slot(w, w->acked);
+    int64_t since_us = oldest->sent_us > w->head_since_us ? oldest->sent_us : w->head_since_us;
+    if (now_us - since_us <= (int64_t)oldest->timeout_ms * 1000) return;
+
+    w->timeouts++;
+    w->ops.timeout(w->ops.ctx, oldest);
+
+    // Requesters still get an answer, with whatever was printed so far
+    size_t log_end = w->ops.log_head(w->ops.ctx);
+    for (uint32_t n = w->acked; n != w->send_pos; n++) {
+        gcode_window_complete(w, gcode_window_slot(w, n), log_end, true);
+    }
+
+    w->acked = w->send_pos;
+    w->oks_to_swallow = 0;
+    w->unanswered = 0;
+    w->priority_count = 0;
+}
+
+int gcode_window_service(gcode_window_t *w, bool connected)
+{
+    gcode_event_t ev;
+    gcode_cmd_t cmd;
+    int err = 0;
+
+    gcode_window_lock(w);
+    while (w->ops.next_event(w->ops.ctx, &ev)) {
+        gcode_window_event(w, &ev);
+    }
+    gcode_window_check_timeout(w, w->ops.now_us(w->ops.ctx));
+
+    if (connected) {
+        // Retransmissions first, then new commands, framed back to back and
+        // flushed whenever a transfer is full
+        while (w->send_pos + w->batch_lines - w->acked < GCODE_WINDOW_SIZE) {
+            if (w->send_pos + w->batch_lines == w->next_line) {
+                if (!w->ops.next_cmd(w->ops.ctx, &cmd)) break;
+                if (!gcode_window_push(w, &cmd)) continue;
+            }
+            if (gcode_window_frame(w)) continue;
+            if ((err = gcode_window_flush(w)) != 0) break;  // Retried on the next pass
+            gcode_window_frame(w);     // GCODE_CMD_MAX_LEN always fits an empty transfer
+        }
+        if (err == 0) {
+            err = gcode_window_flush(w);
+        }
+    }
+    gcode_window_unlock(w);
+    return err;
+}
+
+// It is still answered with an 'ok' once the firmware reads it, after the
+// lines already on the wire - remember which one so it does not count as a
+// window credit
+int gcode_window_send_priority(gcode_window_t *w, const char *cmd, int64_t received_us)
+{
+    char frame[GCODE_CMD_MAX_LEN + 1];
+
+    size_t len = strcspn(cmd, ";\r\n");
+    if (len > GCODE_CMD_MAX_LEN - 1) len = GCODE_CMD_MAX_LEN - 1;
+    memcpy(frame, cmd, len);
+    frame[len++] = '\n';
+
+    gcode_window_lock(w);
+    int err = w->ops.transmit_now(w->ops.ctx, (const uint8_t *)frame, len);
+    int64_t now_us = w->ops.now_us(w->ops.ctx);
+    if (err == 0) {
+        if (w->priority_count < GCODE_PRIORITY_PENDING) {
+            uint8_t idx = (w->priority_head + w->priority_count) % GCODE_PRIORITY_PENDING;
+            w->priority_ok[idx] = w->oks_seen + w->unanswered + w->priority_count + 1;
+            w->priority_sent_us[idx] = now_us;
+            w->priority_count++;
+        } else {
+            w->priority.untracked++;
+        }
+        w->priority.sent++;
+        w->priority.last_tx_us = (uint32_t)(now_us - received_us);
+        if (w->priority.last_tx_us > w->priority.max_tx_us) {
+            w->priority.max_tx_us = w->priority.last_tx_us;
+        }
+    } else {
+        w->priority.failed++;
+    }
+    gcode_window_unlock(w);
+    return err;
+}
@@ -0,0 +1,346 @@
+/*
+ * Host benchmark of the serial protocol pipeline: lines from a device capture
+ * (or a built-in sample) through the tokenizer, the telemetry frame builders,
+ * the print analytics and G-code framing, with ns/line, heap allocations and
+ * bytes per message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "printer_protocol.h"
+
+#define BENCH_PASSES_DEFAULT    (200)
+#define BENCH_MAX_LINES         (20000)
+#define BENCH_LINE_MAX          (512)    // SERIAL_LINE_BUFFER_SIZE on the device
+
+// Representative Core One traffic: auto-reports, M114, M73 and plain replies
+static const char *const sample_lines[] = {
+    "ok",
+    "T:215.32/215.00 B:60.05/60.00 X:45.12/45.00 A:41.90/0.00 C@:31.40 @:127 B@:64 HBR@:89",
+    "ok T:215.10/215.00 B:59.98/60.00 X:45.00/45.00 A:41.88/0.00 C@:31.41 @:120 B@:60 HBR@:89",
+    "X:108.67 Y:90.41 Z:2.20 E:1234.56 Count A:24936 B:3858 Z:23331",
+    "M73 Progress: 42%; Time left: 1h 23m; Change: 16m;",
+    "echo:busy: processing",
+    "ok",
+    "E0:3200 RPM PRN1:5100 RPM E0@:51 PRN1@:128",
+};
+
+// Commands in the shape a sliced file streams them
+static const char *const sample_gcode[] = {
+    "G1 X104.682 Y96.532 E.02593",
+    "G1 F1800 X105.107 Y97.105 E.0184",
+    "M73 P42 R83",
+    "G0 Z2.2",
+    "M204 P1500",
+};
+
+typedef struct {
+    const char *text;
+    size_t len;
+} bench_line_t;
+
+static bench_line_t lines[BENCH_MAX_LINES];
+static size_t line_count;
+static char *line_storage;
+
+static size_t alloc_count;
+static size_t alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int env_int(const char *name, int fallback)
+{
+    const char *v = getenv(name);
+    return (v && atoi(v) > 0) ? atoi(v) : fallback;
+}
+
+// Split a capture's byte stream into lines as serial_parser_task does:
+// '\n' ends a line, '\r' is dropped, overlong lines are cut at BENCH_LINE_MAX
+static bool load_capture(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    serial_capture_hdr_t hdr;
+    serial_capture_rec_t rec;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC) {
+        fprintf(stderr, "%s is not a serial capture\n", path);
+        fclose(fp);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, sizeof(hdr), SEEK_SET);
+
+    line_storage = malloc(size > 0 ? (size_t)size : 1);
+    size_t used = 0;
+    size_t start = 0;
+    unsigned transfers = 0;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        for (uint32_t i = 0; i < rec.len; i++) {
+            int c = fgetc(fp);
+            if (c == EOF) break;
+            if (c == '\r') continue;
+            if (c == '\n' || used - start >= BENCH_LINE_MAX - 1) {
+                if (used > start && line_count < BENCH_MAX_LINES) {
+                    lines[line_count].text = &line_storage[start];
+                    lines[line_count].len = used - start;
+                    line_count++;
+                }
+                start = used;
+                if (c == '\n') continue;
+            }
+            line_storage[used++] = (char)c;
+        }
+        transfers++;
+    }
+    fclose(fp);
+    printf("Capture %s: %u transfers, %zu lines\n", path, transfers, line_count);
+    return line_count > 0;
+}
+
+static void load_sample(void)
+{
+    for (size_t i = 0; i < sizeof(sample_lines) / sizeof(sample_lines[0]); i++) {
+        lines[line_count].text = sample_lines[i];
+        lines[line_count].len = strlen(sample_lines[i]);
+        line_count++;
+    }
+    printf("Built-in sample: %zu lines\n", line_count);
+}
+
+typedef struct {
+    const char *name;
+    unsigned messages;
+    int64_t ns;
+    size_t json_bytes;
+    size_t bin_bytes;
+} frame_stats_t;
+
+static void frame_stats_add(frame_stats_t *st, const ws_message_t *msg, int64_t ns)
+{
+    st->messages++;
+    st->ns += ns;
+    st->json_bytes += strlen(msg->json_payload);
+    st->bin_bytes += msg->bin_len;
+}
+
+static bool deflate_discard(void *ctx, const uint8_t *data, size_t len, bool final)
+{
+    (void)ctx;
+    (void)data;
+    (void)len;
+    (void)final;
+    return true;
+}
+
+static void frame_stats_print(const frame_stats_t *st)
+{
+    if (st->messages == 0) {
+        printf("  %-12s          -\n", st->name);
+        return;
+    }
+    printf("  %-12s %8u msgs %7.1f ns/msg %6.1f B json %5.1f B bin\n", st->name, st->messages,
+           (double)st->ns / st->messages, (double)st->json_bytes / st->messages,
+           (double)st->bin_bytes / st->messages);
+}
+
+void app_main(void)
+{
+    const char *capture = getenv("PROTOCOL_BENCH_CAPTURE");
+    int passes = env_int("PROTOCOL_BENCH_PASSES", BENCH_PASSES_DEFAULT);
+    static parsed_line_t parsed[BENCH_MAX_LINES];
+    ws_message_t msg;
+    size_t input_bytes = 0;
+    int status = 0;
+
+    if (capture == NULL) {
+        load_sample();
+    } else if (!load_capture(capture)) {
+        exit(1);
+    }
+    for (size_t i = 0; i < line_count; i++) {
+        input_bytes += lines[i].len;
+    }
+
+    // Tokenizer
+    size_t allocs_before = alloc_count;
+    unsigned incomplete = 0;
+    int64_t start = now_ns();
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < line_count; i++) {
+            parse_serial_line(lines[i].text, lines[i].len, &parsed[i]);
+        }
+    }
+    int64_t parse_ns = now_ns() - start;
+    size_t parse_allocs = alloc_count - allocs_before;
+    for (size_t i = 0; i < line_count; i++) {
+        incomplete += parsed[i].incomplete;
+    }
+
+    uint64_t total_lines = (uint64_t)line_count * passes;
+    printf("\nparse_serial_line: %zu lines x %d passes, %.1f B/line\n", line_count, passes,
+           (double)input_bytes / line_count);
+    printf("  %.1f ns/line, %.1f MB/s, %zu allocations, %u incomplete reports per pass\n",
+           (double)parse_ns / total_lines, (double)input_bytes * passes * 1000.0 / parse_ns,
+           parse_allocs, incomplete);
+    if (parse_allocs != 0) {
+        printf("  FAIL: the tokenizer must not touch the heap\n");
+        status = 1;
+    }
+
+    // Frame builders, for every line that carried their topic
+    frame_stats_t frames[TELEMETRY_TOPIC_COUNT];
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        frames[id] = (frame_stats_t){ .name = telemetry_schema[id].name };
+    }
+    allocs_before = alloc_count;
+    size_t bytes_before = alloc_bytes;
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < line_count; i++) {
+            const parsed_line_t *pl = &parsed[i];
+            for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+                const telemetry_topic_schema_t *ts = &telemetry_schema[id];
+                if (!(pl->present & ts->line_fields)) continue;
+                start = now_ns();
+                telemetry_build_message(&msg, id, (const char *)pl + ts->parsed_offset);
+                frame_stats_add(&frames[id], &msg, now_ns() - start);
+            }
+        }
+    }
+    size_t frame_allocs = alloc_count - allocs_before;
+    printf("\nFrame builders: %zu allocations, %zu bytes\n", frame_allocs, alloc_bytes - bytes_before);
+    if (frame_allocs != 0) {
+        printf("  FAIL: the JSON writer must not touch the heap\n");
+        status = 1;
+    }
+    for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+        frame_stats_print(&frames[i]);
+    }
+
+    // Print analytics over the merged state, as the parser task feeds them
+    print_stats_t stats;
+    position_state_t pos = { 0 };
+    power_state_t power = { 0 };
+    progress_state_t progress = { .percent = 0, .time_left_mins = 60 };
+    unsigned stats_events = 0;
+    print_stats_init(&stats);
+    print_stats_update(&stats, LINE_FIELD_PROGRESS | LINE_FIELD_TIME_LEFT, &pos, &power, &progress, 0);
+    allocs_before = alloc_count;
+    uint32_t now_ms = 0;
+    start = now_ns();
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < line_count; i++) {
+            const parsed_line_t *pl = &parsed[i];
+            if (pl->present & LINE_FIELD_POSITION) pos = pl->position;
+            if (pl->present & LINE_FIELD_NOZZLE_PWM) power.nozzle_pwm = pl->power.nozzle_pwm;
+            if (pl->present & LINE_FIELD_BED_PWM) power.bed_pwm = pl->power.bed_pwm;
+            if (pl->present & LINE_FIELD_HEATBREAK_PWM) power.heatbreak_pwm = pl->power.heatbreak_pwm;
+            if (pl->present & LINE_FIELD_TIME_LEFT) progress.time_left_mins = pl->progress.time_left_mins;
+            // Keep the job running, whatever percent the capture reached
+            if (pl->present & LINE_FIELD_PROGRESS) progress.percent = pl->progress.percent % 100;
+            stats_events += print_stats_update(&stats, pl->present & ~LINE_FIELD_PRINT_DONE, &pos, &power,
+                                               &progress, now_ms += 100) != 0;
+        }
+    }
+    int64_t stats_ns = now_ns() - start;
+    size_t stats_allocs = alloc_count - allocs_before;
+    build_stats_message(&msg, &stats, now_ms);
+    printf("\nprint_stats_update: %.1f ns/line, %u events, %zu allocations, %zu B stats frame\n",
+           (double)stats_ns / total_lines, stats_events, stats_allocs, strlen(msg.json_payload));
+    if (stats_allocs != 0) {
+        printf("  FAIL: the analytics must not touch the heap\n");
+        status = 1;
+    }
+
+    // Bulk frame compression: the lines as the log backlog a new client gets
+    static ws_deflate_t deflate;
+    static char escaped[BENCH_LINE_MAX * 6];
+    uint64_t deflate_in = 0;
+    uint64_t deflate_out = 0;
+    allocs_before = alloc_count;
+    start = now_ns();
+    for (int pass = 0; pass < passes; pass++) {
+        ws_deflate_begin(&deflate, NULL, 0, deflate_discard, NULL);
+        ws_deflate_write(&deflate, "{\"type\":\"logs\",\"lines\":[", 24);
+        for (size_t i = 0; i < line_count; i++) {
+            size_t n = json_escape(escaped, sizeof(escaped), lines[i].text, lines[i].len);
+            ws_deflate_write(&deflate, i ? ",\"" : "\"", i ? 2 : 1);
+            ws_deflate_write(&deflate, escaped, n);
+            ws_deflate_write(&deflate, "\"", 1);
+        }
+        ws_deflate_write(&deflate, "]}", 2);
+        ws_deflate_finish(&deflate);
+        deflate_in += deflate.in_total;
+        deflate_out += deflate.out_total;
+    }
+    int64_t deflate_ns = now_ns() - start;
+    size_t deflate_allocs = alloc_count - allocs_before;
+    printf("\nws_deflate: %.2f ns/byte, %zu B logs frame to %.1f%%, %zu allocations\n",
+           (double)deflate_ns / deflate_in, (size_t)(deflate_in / passes),
+           100.0 * deflate_out / deflate_in, deflate_allocs);
+    if (deflate_allocs != 0) {
+        printf("  FAIL: the compressor must not touch the heap\n");
+        status = 1;
+    }
+
+    // G-code framing, as the sender fills a transfer
+    char frame[WS_MAX_PAYLOAD_SIZE];
+    size_t gcode_count = sizeof(sample_gcode) / sizeof(sample_gcode[0]);
+    size_t frame_bytes = 0;
+    size_t cmd_bytes = 0;
+    allocs_before = alloc_count;
+    start = now_ns();
+    for (int pass = 0; pass < passes * 100; pass++) {
+        for (size_t i = 0; i < gcode_count; i++) {
+            frame_bytes += gcode_frame(frame, sizeof(frame), (uint32_t)(pass * gcode_count + i), sample_gcode[i]);
+        }
+    }
+    int64_t gcode_ns = now_ns() - start;
+    for (size_t i = 0; i < gcode_count; i++) {
+        cmd_bytes += strlen(sample_gcode[i]) * passes * 100;
+    }
+    uint64_t total_frames = (uint64_t)gcode_count * passes * 100;
+    printf("\ngcode_frame: %.1f ns/line, %.1f B/line on the wire (+%.1f framing), %zu allocations\n",
+           (double)gcode_ns / total_frames, (double)frame_bytes / total_frames,
+           (double)(frame_bytes - cmd_bytes) / total_frames, alloc_count - allocs_before);
+
+    free(line_storage);
+    exit(status);
+}
@@ -0,0 +1,598 @@
+/*
+ * Host tests of the broadcast ring and the G-code window: wrap, overrun and
+ * unicast filtering of the ring, a writer and a reader thread behind an
+ * injected pthread lock, and the window's credits, batching, Resend:,
+ * timeouts and priority lane against a scripted printer. Also the split of
+ * the task stats into debug frames.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "printer_protocol.h"
+#include "ws_ring.h"
+#include "gcode_window.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// ============================================================================
+// BROADCAST RING
+// ============================================================================
+
+#define RING_SMALL              (256)    // A few frames, so every test wraps
+
+static uint8_t ring_buf[RING_SMALL] __attribute__((aligned(4)));
+static const ws_trace_t no_trace;
+
+static void ring_put(ws_ring_t *r, int8_t target, message_type_t type, const char *text)
+{
+    ws_message_t msg = { .type = type };
+
+    snprintf(msg.json_payload, sizeof(msg.json_payload), "%s", text);
+    ws_ring_write(r, target, &msg, &no_trace);
+}
+
+static void test_ring_filtering(void)
+{
+    ws_ring_t r;
+    ws_message_t out;
+    size_t c0 = 0;
+    size_t c1 = 0;
+    uint32_t all = WS_TOPIC_BIT(MSG_TYPE_COUNT) - 1;
+
+    printf("ring: unicast and topic filtering\n");
+    ws_ring_init(&r, ring_buf, sizeof(ring_buf), NULL);
+    ring_put(&r, WS_RING_ALL_CLIENTS, MSG_TYPE_STATUS, "status");
+    ring_put(&r, 1, MSG_TYPE_LOG, "for-1");
+    ring_put(&r, WS_RING_ALL_CLIENTS, MSG_TYPE_LOG, "log");
+
+    CHECK(ws_ring_read(&r, &c0, 0, WS_TOPIC_BIT(MSG_TYPE_LOG), &out) == 3);
+    CHECK(strcmp(out.json_payload, "log") == 0);
+    CHECK(ws_ring_read(&r, &c0, 0, all, &out) == 0);
+    CHECK(c0 == r.head);
+
+    CHECK(ws_ring_read(&r, &c1, 1, all, &out) == 6 && strcmp(out.json_payload, "status") == 0);
+    CHECK(ws_ring_read(&r, &c1, 1, 0, &out) == 5 && strcmp(out.json_payload, "for-1") == 0);
+    CHECK(out.type == MSG_TYPE_LOG);
+    CHECK(ws_ring_read(&r, &c1, 1, 0, &out) == 0);
+    CHECK(r.frames == 3);
+}
+
+static void test_ring_wrap_and_overrun(void)
+{
+    ws_ring_t r;
+    ws_message_t out;
+    char text[64];
+    size_t keeping_up = 0;
+    size_t stalled = 0;
+    unsigned next = 0;
+    uint32_t all = WS_TOPIC_BIT(MSG_TYPE_COUNT) - 1;
+
+    printf("ring: wrap with pad records, overrun and catch-up\n");
+    ws_ring_init(&r, ring_buf, sizeof(ring_buf), NULL);
+    for (unsigned i = 0; i < 200; i++) {
+        // Odd lengths, so records end short of the buffer end and need a pad
+        snprintf(text, sizeof(text), "%u:%.*s", i, (int)(i % 37), "abcdefghijklmnopqrstuvwxyzabcdefghijk");
+        ring_put(&r, WS_RING_ALL_CLIENTS, MSG_TYPE_LOG, text);
+        CHECK(r.head - r.tail <= r.size);
+        CHECK(ws_ring_catch_up(&r, &keeping_up) == 0);
+        CHECK(ws_ring_read(&r, &keeping_up, 0, all, &out) == strlen(text));
+        CHECK(strcmp(out.json_payload, text) == 0);
+    }
+
+    // The stalled reader lost the start and resumes at the oldest frame left
+    size_t missed = ws_ring_catch_up(&r, &stalled);
+    CHECK(missed > 0);
+    CHECK(stalled == r.tail);
+    CHECK(ws_ring_is_boundary(&r, stalled));
+    CHECK(!ws_ring_is_boundary(&r, stalled + 4));
+    CHECK(!ws_ring_is_boundary(&r, r.tail - 4));
+    CHECK(ws_ring_is_boundary(&r, r.head));
+
+    CHECK(ws_ring_read(&r, &stalled, 0, all, &out) > 0);
+    next = (unsigned)strtoul(out.json_payload, NULL, 10);
+    CHECK(next > 0 && next < 200);
+    while (ws_ring_read(&r, &stalled, 0, all, &out) > 0) {
+        CHECK((unsigned)strtoul(out.json_payload, NULL, 10) == ++next);
+    }
+    CHECK(next == 199);
+    CHECK(ws_ring_lag(&r, stalled) == 0);
+}
+
+// One writer and one reader thread through the injected lock: the reader
+// sees increasing sequence numbers with intact payloads, and skips only
+// what ws_ring_catch_up() reported
+#define RING_THREAD_FRAMES      (200000)
+
+typedef struct {
+    ws_ring_t ring;
+    pthread_mutex_t mutex;
+    unsigned read;
+    unsigned skipped_catch_ups;
+    unsigned bad;
+} ring_thread_ctx_t;
+
+static void pthread_take(void *ctx)
+{
+    pthread_mutex_lock(ctx);
+}
+
+static void pthread_give(void *ctx)
+{
+    pthread_mutex_unlock(ctx);
+}
+
+static void *ring_writer(void *arg)
+{
+    ring_thread_ctx_t *t = arg;
+    ws_message_t msg = { .type = MSG_TYPE_LOG };
+
+    for (unsigned i = 1; i <= RING_THREAD_FRAMES; i++) {
+        snprintf(msg.json_payload, sizeof(msg.json_payload), "%u %.*s", i, (int)(i % 23),
+                 "xxxxxxxxxxxxxxxxxxxxxxx");
+        ws_ring_lock(&t->ring);
+        ws_ring_write(&t->ring, WS_RING_ALL_CLIENTS, &msg, &no_trace);
+        ws_ring_unlock(&t->ring);
+    }
+    return NULL;
+}
+
+static void *ring_reader(void *arg)
+{
+    ring_thread_ctx_t *t = arg;
+    ws_message_t out;
+    size_t cursor = 0;
+    unsigned last = 0;
+
+    while (last < RING_THREAD_FRAMES) {
+        ws_ring_lock(&t->ring);
+        bool lapped = ws_ring_catch_up(&t->ring, &cursor) > 0;
+        size_t len = ws_ring_read(&t->ring, &cursor, 0, WS_TOPIC_BIT(MSG_TYPE_LOG), &out);
+        ws_ring_unlock(&t->ring);
+        if (len == 0) continue;
+
+        char *rest;
+        unsigned seq = (unsigned)strtoul(out.json_payload, &rest, 10);
+        size_t pad = strlen(rest + 1);
+        if (seq <= last || (seq != last + 1 && !lapped) || pad != seq % 23 ||
+            strspn(rest + 1, "x") != pad) {
+            t->bad++;
+        }
+        t->skipped_catch_ups += lapped;
+        t->read++;
+        last = seq;
+    }
+    return NULL;
+}
+
+static void test_ring_threads(void)
+{
+    static uint8_t buf[4096] __attribute__((aligned(4)));
+    static ring_thread_ctx_t t;
+    pthread_t writer;
+    pthread_t reader;
+
+    printf("ring: writer and reader threads behind a pthread lock\n");
+    pthread_mutex_init(&t.mutex, NULL);
+    ws_ring_init(&t.ring, buf, sizeof(buf),
+                 &(ws_ring_lock_t){ .take = pthread_take, .give = pthread_give, .ctx = &t.mutex });
+    pthread_create(&reader, NULL, ring_reader, &t);
+    pthread_create(&writer, NULL, ring_writer, &t);
+    pthread_join(writer, NULL);
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&t.mutex);
+
+    CHECK(t.bad == 0);
+    CHECK(t.ring.frames == RING_THREAD_FRAMES);
+    printf("  %u of %u frames read, %u catch-ups\n", t.read, RING_THREAD_FRAMES, t.skipped_catch_ups);
+}
+
+// ============================================================================
+// G-CODE WINDOW
+// ============================================================================
+
+#define FAKE_QUEUE              (64)
+
+// The printer side: queued commands and events, what went on the wire, and
+// what the window reported back
+typedef struct {
+    int64_t now_us;
+    size_t log_head;
+    bool locked;
+    unsigned lock_errors;
+    gcode_cmd_t cmds[FAKE_QUEUE];
+    unsigned cmd_head, cmd_tail;
+    gcode_event_t events[FAKE_QUEUE];
+    unsigned ev_head, ev_tail;
+    char wire[8192];
+    size_t wire_len;
+    unsigned transfers;
+    int fail_transmits;                        // Fail this many transmit calls
+    unsigned completed;
+    unsigned timed_out;
+    uint32_t last_completed;
+    size_t last_log_start, last_log_end;
+    unsigned timeouts;
+    unsigned resends;
+    unsigned renumbers;
+} fake_printer_t;
+
+static fake_printer_t fake;
+static gcode_window_t window;
+
+static void fake_lock(void *ctx)
+{
+    fake_printer_t *f = ctx;
+    if (f->locked) f->lock_errors++;
+    f->locked = true;
+}
+
+static void fake_unlock(void *ctx)
+{
+    fake_printer_t *f = ctx;
+    if (!f->locked) f->lock_errors++;
+    f->locked = false;
+}
+
+static int64_t fake_now_us(void *ctx)
+{
+    return ((fake_printer_t *)ctx)->now_us;
+}
+
+static size_t fake_log_head(void *ctx)
+{
+    return ((fake_printer_t *)ctx)->log_head;
+}
+
+static bool fake_next_event(void *ctx, gcode_event_t *ev)
+{
+    fake_printer_t *f = ctx;
+    if (f->ev_head == f->ev_tail) return false;
+    *ev = f->events[f->ev_head++ % FAKE_QUEUE];
+    return true;
+}
+
+static bool fake_next_cmd(void *ctx, gcode_cmd_t *cmd)
+{
+    fake_printer_t *f = ctx;
+    if (f->cmd_head == f->cmd_tail) return false;
+    *cmd = f->cmds[f->cmd_head++ % FAKE_QUEUE];
+    return true;
+}
+
+static int fake_transmit(void *ctx, const uint8_t *data, size_t len, uint32_t first, uint32_t lines)
+{
+    fake_printer_t *f = ctx;
+    (void)first;
+    (void)lines;
+    if (!f->locked) f->lock_errors++;
+    if (f->fail_transmits > 0) {
+        f->fail_transmits--;
+        return -1;
+    }
+    if (f->wire_len + len < sizeof(f->wire)) {
+        memcpy(f->wire + f->wire_len, data, len);
+        f->wire_len += len;
+        f->wire[f->wire_len] = '\0';
+    }
+    f->transfers++;
+    return 0;
+}
+
+static int fake_transmit_now(void *ctx, const uint8_t *data, size_t len)
+{
+    return fake_transmit(ctx, data, len, 0, 0);
+}
+
+static void fake_completed(void *ctx, const gcode_line_t *line, size_t log_start, size_t log_end,
+                           bool timed_out)
+{
+    fake_printer_t *f = ctx;
+    if (!f->locked) f->lock_errors++;
+    f->completed++;
+    f->timed_out += timed_out;
+    f->last_completed = line->line;
+    f->last_log_start = log_start;
+    f->last_log_end = log_end;
+}
+
+static void fake_timeout(void *ctx, const gcode_line_t *oldest)
+{
+    (void)oldest;
+    ((fake_printer_t *)ctx)->timeouts++;
+}
+
+static void fake_resend(void *ctx, uint32_t line, bool renumbered)
+{
+    fake_printer_t *f = ctx;
+    (void)line;
+    f->resends++;
+    f->renumbers += renumbered;
+}
+
+static const gcode_window_ops_t fake_ops = {
+    .lock = fake_lock,
+    .unlock = fake_unlock,
+    .now_us = fake_now_us,
+    .log_head = fake_log_head,
+    .next_event = fake_next_event,
+    .next_cmd = fake_next_cmd,
+    .transmit = fake_transmit,
+    .transmit_now = fake_transmit_now,
+    .completed = fake_completed,
+    .timeout = fake_timeout,
+    .resend = fake_resend,
+    .ctx = &fake,
+};
+
+static void fake_reset(void)
+{
+    memset(&fake, 0, sizeof(fake));
+    gcode_window_init(&window, &fake_ops);
+    gcode_window_restart(&window);
+}
+
+static void fake_cmd(const char *cmd, int reply_fd)
+{
+    gcode_cmd_t *c = &fake.cmds[fake.cmd_tail++ % FAKE_QUEUE];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->cmd, sizeof(c->cmd), "%s", cmd);
+    c->reply_fd = reply_fd;
+    c->reply_begin = reply_fd >= 0;
+}
+
+static void fake_event(gcode_event_type_t type, uint32_t line)
+{
+    fake.log_head += 10;                       // A reply line per event
+    fake.events[fake.ev_tail++ % FAKE_QUEUE] = (gcode_event_t){
+        .type = type, .line = line, .log_pos = fake.log_head
+    };
+}
+
+static void wire_clear(void)
+{
+    fake.wire_len = 0;
+    fake.wire[0] = '\0';
+}
+
+static void test_window_credits(void)
+{
+    printf("window: numbering, batching and 'ok' credits\n");
+    fake_reset();
+    for (int i = 0; i < 8; i++) {
+        fake_cmd("G1 X1 ; comment", -1);
+    }
+    CHECK(gcode_window_service(&window, true) == 0);
+    CHECK(strncmp(fake.wire, "N0 M110 N0*", 11) == 0);
+    CHECK(strstr(fake.wire, "N3 G1 X1*") != NULL);
+    CHECK(strstr(fake.wire, "comment") == NULL);
+    CHECK(strstr(fake.wire, "N4 ") == NULL);
+    CHECK(fake.transfers == 1);                // Short lines share one transfer
+    CHECK(gcode_window_in_flight(&window) == GCODE_WINDOW_SIZE);
+
+    // Full window: nothing more until an 'ok'
+    wire_clear();
+    CHECK(gcode_window_service(&window, true) == 0);
+    CHECK(fake.wire_len == 0);
+
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_OK, 0);
+    CHECK(gcode_window_service(&window, true) == 0);
+    CHECK(fake.completed == 2 && fake.last_completed == 1);
+    CHECK(strstr(fake.wire, "N4 G1 X1*") != NULL && strstr(fake.wire, "N5 G1 X1*") != NULL);
+    CHECK(window.sent == 6);
+
+    // Without a printer only acknowledgements are applied
+    fake_event(GCODE_EVENT_OK, 0);
+    wire_clear();
+    CHECK(gcode_window_service(&window, false) == 0);
+    CHECK(fake.completed == 3 && fake.wire_len == 0);
+    CHECK(fake.lock_errors == 0 && !fake.locked);
+}
+
+static void test_window_resend(void)
+{
+    printf("window: Resend: rewinds, stale repeats and renumbering\n");
+    fake_reset();
+    for (int i = 0; i < 3; i++) {
+        fake_cmd("G1 Y2", -1);
+    }
+    gcode_window_service(&window, true);      // N0..N3 on the wire
+
+    // N2 was garbled: the printer asks for it and N2, N3 go again
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_RESEND, 2);
+    wire_clear();
+    CHECK(gcode_window_service(&window, true) == 0);
+    CHECK(fake.resends == 1 && fake.renumbers == 0);
+    CHECK(window.resends == 2);
+    CHECK(strncmp(fake.wire, "N2 G1 Y2*", 9) == 0 && strstr(fake.wire, "N3 G1 Y2*") != NULL);
+    CHECK(fake.completed == 2);
+
+    // The Resend: is followed by an 'ok', and the first N3 bounces with
+    // the same request and its own 'ok' - none of them are credits
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_RESEND, 2);
+    fake_event(GCODE_EVENT_OK, 0);
+    wire_clear();
+    gcode_window_service(&window, true);
+    CHECK(fake.resends == 1 && fake.completed == 2 && fake.wire_len == 0);
+
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_OK, 0);
+    gcode_window_service(&window, true);
+    CHECK(fake.completed == 4 && gcode_window_in_flight(&window) == 0);
+
+    // A line no longer kept: restart numbering with M110
+    fake_event(GCODE_EVENT_RESEND, 40);
+    wire_clear();
+    gcode_window_service(&window, true);
+    CHECK(fake.renumbers == 1);
+    CHECK(window.next_line == 1 && strncmp(fake.wire, "N0 M110 N0*", 11) == 0);
+}
+
+static void test_window_timeout(void)
+{
+    printf("window: 'ok' timeout per opcode and GCODE#id: replies\n");
+    fake_reset();
+    fake_cmd("G28", 7);
+    fake_cmd("M105", -1);
+    gcode_window_service(&window, true);
+    fake_event(GCODE_EVENT_OK, 0);             // M110 done, G28 executing from now
+    gcode_window_service(&window, true);
+    CHECK(fake.completed == 1);
+
+    fake.now_us += 179000LL * 1000;
+    gcode_window_service(&window, true);
+    CHECK(fake.timeouts == 0);
+
+    fake.now_us += 2000LL * 1000;
+    fake.log_head = 500;
+    gcode_window_service(&window, true);
+    CHECK(fake.timeouts == 1 && window.timeouts == 1);
+    CHECK(fake.completed == 3 && fake.timed_out == 2);   // G28 and the M105 behind it
+    CHECK(gcode_window_in_flight(&window) == 0);
+    CHECK(fake.last_log_end == 500);
+    CHECK(gcode_timeout_for("G28") == 180000 && gcode_timeout_for("G1") == GCODE_OK_TIMEOUT_MS);
+
+    char opcode[8];
+    gcode_opcode("m109 S215", opcode);
+    CHECK(strcmp(opcode, "M109") == 0);
+    gcode_opcode("; comment", opcode);
+    CHECK(opcode[0] == '\0');
+}
+
+static void test_window_priority(void)
+{
+    printf("window: priority answers are not window credits\n");
+    fake_reset();
+    fake_cmd("G1 Z5", -1);
+    gcode_window_service(&window, true);      // N0 M110, N1 on the wire
+    CHECK(gcode_window_in_flight(&window) == 2);
+
+    wire_clear();
+    fake.now_us = 1000;
+    CHECK(gcode_window_send_priority(&window, "M108 ; break", 400) == 0);
+    CHECK(strcmp(fake.wire, "M108 \n") == 0);
+    CHECK(window.priority.sent == 1 && window.priority.last_tx_us == 600);
+
+    // The firmware answers the numbered lines first, then the M108
+    fake.now_us = 5000;
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_OK, 0);
+    fake_event(GCODE_EVENT_OK, 0);
+    gcode_window_service(&window, true);
+    CHECK(fake.completed == 2);
+    CHECK(window.priority_count == 0 && window.priority.last_ok_us == 4000);
+    CHECK(fake.lock_errors == 0);
+}
+
+static void test_window_transmit_failure(void)
+{
+    printf("window: a refused transfer is framed again\n");
+    fake_reset();
+    fake_cmd("G1 X3", -1);
+    fake.fail_transmits = 1;
+    CHECK(gcode_window_service(&window, true) != 0);
+    CHECK(window.sent == 0 && gcode_window_in_flight(&window) == 0);
+
+    CHECK(gcode_window_service(&window, true) == 0);
+    CHECK(window.sent == 2 && strstr(fake.wire, "N1 G1 X3*") != NULL);
+}
+
+// ============================================================================
+// TASK STATS FRAMES
+// ============================================================================
+
+static const uint16_t tasks_cores[2] = { 125, 30 };
+
+static void test_task_stats_parts(void)
+{
+    static const task_stat_t tasks[] = {
+        { "IDLE0", 0, 0, 875, 900 },
+        { "ws_sender", 1, 5, 41, 2100 },
+        { "gcode_sender", 1, 6, 3, 1800 },
+    };
+    char buf[WS_MAX_PAYLOAD_SIZE];
+    int next = 0;
+
+    printf("tasks: one frame, then split into parts\n");
+    size_t len = task_stats_frame(buf, sizeof(buf), 0, tasks_cores, 2, tasks, 3, &next);
+    CHECK(next == 3 && len == strlen(buf));
+    CHECK(strcmp(buf, "{\"type\":\"tasks\",\"part\":0,\"cores\":[12.5,3.0],\"tasks\":"
+                      "[[\"IDLE0\",0,0,87.5,900],[\"ws_sender\",1,5,4.1,2100],"
+                      "[\"gcode_sender\",1,6,0.3,1800]]}") == 0);
+
+    // Whatever the buffer, every part ends the document, fits, and takes
+    // at least one task
+    for (size_t size = 8; size <= 160; size++) {
+        int parts = 0;
+        next = 0;
+        while (next < 3 && parts <= 3) {
+            int was = next;
+            len = task_stats_frame(buf, size, parts, tasks_cores, 2, tasks, 3, &next);
+            CHECK(next > was);
+            CHECK(len < size && len == strlen(buf) && strcmp(&buf[len - 2], "]}") == 0);
+            parts++;
+        }
+        CHECK(next == 3 && parts <= 3);
+    }
+}
+
+static void test_task_stats_long_name(void)
+{
+    // Fifteen quotes, each escaped to two bytes
+    static const task_stat_t tasks[] = {
+        { "\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"", -1, 5, 25, 300 },
+        { "IDLE1", 1, 0, 970, 900 },
+    };
+    char buf[WS_MAX_PAYLOAD_SIZE];
+    int next = 0;
+
+    printf("tasks: a name too long for a part of its own\n");
+    // The frame without tasks: its header, then "]}"
+    size_t head = task_stats_frame(buf, sizeof(buf), 0, tasks_cores, 2, tasks, 0, &next) - 2;
+
+    // 40 bytes after the header: the whole entry needs 47, so the name is cut
+    size_t size = head + 40 + 3;
+    next = 0;
+    size_t len = task_stats_frame(buf, size, 0, tasks_cores, 2, tasks, 2, &next);
+    CHECK(next == 1 && len < size);
+    CHECK(strncmp(&buf[head], "[\"\\\"", 4) == 0);
+    CHECK(strcmp(&buf[len - 17], "\",-1,5,2.5,300]]}") == 0);
+    len = task_stats_frame(buf, size, 1, tasks_cores, 2, tasks, 2, &next);
+    CHECK(next == 2 && strcmp(&buf[head], "[\"IDLE1\",1,0,97.0,900]]}") == 0);
+
+    // 10 bytes: not even the numbers fit, so the task is left out
+    size = head + 10 + 3;
+    next = 0;
+    len = task_stats_frame(buf, size, 0, tasks_cores, 2, tasks, 2, &next);
+    CHECK(next == 1 && strcmp(&buf[head], "]}") == 0);
+}
+
+void app_main(void)
+{
+    test_ring_filtering();
+    test_ring_wrap_and_overrun();
+    test_ring_threads();
+    test_window_credits();
+    test_window_resend();
+    test_window_timeout();
+    test_window_priority();
+    test_window_transmit_failure();
+    test_task_stats_parts();
+    test_task_stats_long_name();
+
+    printf("\n%s (%d failure%s)\n", failures ? "FAILED" : "OK", failures, failures == 1 ? "" : "s");
+    exit(failures ? 1 : 0);
+}
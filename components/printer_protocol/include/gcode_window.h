@@ -0,0 +1,162 @@
+/*
+ * G-code sliding window: numbered, checksummed lines with up to
+ * GCODE_WINDOW_SIZE waiting for 'ok', "Resend: N" rewinding to line N, an
+ * 'ok' timeout per opcode, and the priority lane whose answers must not be
+ * taken for window credits.
+ *
+ * No ESP-IDF or FreeRTOS dependencies: the owner injects the lock, the
+ * clock, the USB transfers and where commands, printer events and finished
+ * lines come from and go (gcode_window_ops_t).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GCODE_CMD_MAX_LEN           (128)  // Max length of a single command
+#define GCODE_OK_TIMEOUT_MS         (60000) // Commands not listed in gcode_timeouts[]
+#define GCODE_QUERY_TIMEOUT_MS      (5000) // Reports and settings - answered immediately
+#define GCODE_WINDOW_SIZE           (4)    // Lines in flight; <= the printer's command buffer (BUFSIZE). 1 = stop-and-wait
+#define GCODE_RESEND_WINDOW         (16)   // Sent lines retained for Resend:, >= GCODE_WINDOW_SIZE
+#define GCODE_PRIORITY_PENDING      (4)    // Priority commands whose 'ok' can be told apart from the window's
+#define GCODE_TX_BATCH_SIZE         (512)  // One BULK OUT transfer of coalesced lines
+
+// A command waiting for the window
+typedef struct {
+    char cmd[GCODE_CMD_MAX_LEN];
+    bool from_stream;                          // Line of a POST /print upload
+    bool reply_begin;                          // First line of a GCODE#id: request
+    int reply_fd;                              // GCODE#id: requester (last line only), -1 for none
+    uint32_t request_id;
+} gcode_cmd_t;
+
+// Printer acknowledgements, in arrival order
+typedef enum {
+    GCODE_EVENT_OK,
+    GCODE_EVENT_RESEND
+} gcode_event_type_t;
+
+typedef struct {
+    gcode_event_type_t type;
+    uint32_t line;                             // GCODE_EVENT_RESEND only
+    size_t log_pos;                            // Serial log backlog position just past this line
+} gcode_event_t;
+
+typedef struct {
+    uint32_t line;
+    int64_t sent_us;
+    bool from_stream;
+    bool reply_begin;
+    int reply_fd;
+    uint32_t request_id;
+    uint32_t timeout_ms;                       // From gcode_timeouts[]
+    char cmd[GCODE_CMD_MAX_LEN];
+} gcode_line_t;
+
+typedef struct {
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t untracked;                        // Sent while priority_ok[] was full
+    uint32_t last_tx_us;                       // Receipt to bytes handed to USB
+    uint32_t max_tx_us;
+    uint32_t last_ok_us;                       // Bytes on the wire to the matching 'ok'
+    uint32_t max_ok_us;
+} gcode_priority_stats_t;
+
+// Everything the window does outside its own state. lock/unlock guard the
+// window against the priority lane and anyone else writing to the printer.
+typedef struct {
+    void (*lock)(void *ctx);
+    void (*unlock)(void *ctx);
+    int64_t (*now_us)(void *ctx);
+    size_t (*log_head)(void *ctx);             // Current end of the serial log backlog
+    bool (*next_event)(void *ctx, gcode_event_t *ev);
+    bool (*next_cmd)(void *ctx, gcode_cmd_t *cmd);
+    // Queue one transfer of lines [first, first + lines); 0 if it was taken
+    int (*transmit)(void *ctx, const uint8_t *data, size_t len, uint32_t first, uint32_t lines);
+    // Write a priority command and wait until it is handed over; 0 on success
+    int (*transmit_now)(void *ctx, const uint8_t *data, size_t len);
+    // The printer acknowledged a line, or gave up on it (timed_out). The reply
+    // of a GCODE#id: request is the log between log_start and log_end.
+    void (*completed)(void *ctx, const gcode_line_t *line, size_t log_start, size_t log_end,
+                      bool timed_out);
+    void (*timeout)(void *ctx, const gcode_line_t *oldest);
+    // Rewound to a Resend: line, or restarted numbering (renumbered) when
+    // the line asked for is no longer kept
+    void (*resend)(void *ctx, uint32_t line, bool renumbered);
+    void *ctx;
+} gcode_window_ops_t;
+
+// Lines in [acked, send_pos) are on the wire, [send_pos, next_line) wait
+// for (re)transmission; the last GCODE_RESEND_WINDOW lines are kept for
+// Resend:.
+typedef struct {
+    gcode_line_t lines[GCODE_RESEND_WINDOW];
+    uint32_t next_line;                        // Number for the next new command
+    uint32_t send_pos;                         // Next line to put on the wire
+    uint32_t acked;                            // Oldest line without an 'ok'
+    uint32_t oks_to_swallow;                   // Each Resend: is followed by an 'ok'
+    uint32_t resend_line;                      // Last line we rewound to
+    uint32_t resend_repeats;                   // Stale Resend: for that line still expected
+    uint32_t unanswered;                       // Numbered lines on the wire still owed an 'ok'
+    uint32_t oks_seen;                         // Every 'ok' processed this session
+    uint32_t priority_ok[GCODE_PRIORITY_PENDING]; // oks_seen value that answers each priority command
+    int64_t priority_sent_us[GCODE_PRIORITY_PENDING];
+    uint8_t priority_head;
+    uint8_t priority_count;
+    size_t log_pos;                            // Backlog position after the last 'ok'
+    size_t reply_start;                        // Where the current GCODE#id: reply began
+    int64_t head_since_us;                     // When the oldest line became the one executing
+    uint32_t sent;                             // Stats
+    uint32_t resends;
+    uint32_t timeouts;
+    gcode_priority_stats_t priority;
+    // Lines framed for the next transfer, always starting at send_pos. Short
+    // lines share one transfer instead of costing a USB transaction each.
+    uint8_t batch[GCODE_TX_BATCH_SIZE];
+    size_t batch_len;
+    uint32_t batch_lines;
+    gcode_window_ops_t ops;
+} gcode_window_t;
+
+void gcode_window_init(gcode_window_t *w, const gcode_window_ops_t *ops);
+void gcode_window_lock(gcode_window_t *w);
+void gcode_window_unlock(gcode_window_t *w);
+
+// Start a fresh numbering session: drop everything in flight and queue
+// "N0 M110 N0" so the printer's expected line number matches ours
+void gcode_window_restart(gcode_window_t *w);
+
+// One pass of the sender: apply the printer's events, check the 'ok'
+// timeout, then fill the window from next_cmd, retransmissions first.
+// Without a printer (connected false) only the events and timeout run.
+// Returns the first transmit failure, 0 if there was none.
+int gcode_window_service(gcode_window_t *w, bool connected);
+
+// Send a priority command ahead of the window, unnumbered. Returns
+// transmit_now's result.
+int gcode_window_send_priority(gcode_window_t *w, const char *cmd, int64_t received_us);
+
+gcode_line_t *gcode_window_slot(gcode_window_t *w, uint32_t line);
+
+// Lines put on the wire but not yet acknowledged
+static inline uint32_t gcode_window_in_flight(const gcode_window_t *w)
+{
+    return w->send_pos - w->acked;
+}
+
+// Opcode of a command, e.g. "G1" for "G1 X10", "" if there is none
+void gcode_opcode(const char *cmd, char out[8]);
+
+// How long the printer may take to answer once a command is the one executing
+uint32_t gcode_timeout_for(const char *opcode);
+
+#ifdef __cplusplus
+}
+#endif
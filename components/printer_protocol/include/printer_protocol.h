@@ -0,0 +1,445 @@
+/*
+ * Prusa Core One serial protocol: the line tokenizer, the telemetry frame
+ * builders, bulk frame compression, G-code line framing and the task stats
+ * frame. Plain C with no ESP-IDF or FreeRTOS dependencies, so it also builds
+ * for the linux target (see host_test/). The
+ * broadcast ring and the G-code window are in ws_ring.h and gcode_window.h.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WS_MAX_PAYLOAD_SIZE         (512)
+#define WS_BIN_MAX_PAYLOAD          (24)
+
+typedef enum {
+    MSG_TYPE_TEMPERATURE,
+    MSG_TYPE_PROGRESS,
+    MSG_TYPE_POSITION,
+    MSG_TYPE_LOG,
+    MSG_TYPE_STATUS,
+    MSG_TYPE_POWER,
+    MSG_TYPE_ERROR,
+    MSG_TYPE_MESH,
+    MSG_TYPE_STATS,                            // Print analytics, JSON only
+    MSG_TYPE_DEBUG,                            // Diagnostics, only sent on SUB:debug
+    MSG_TYPE_COUNT
+} message_type_t;
+
+// Pipeline timestamps of a frame: esp_timer microseconds truncated to 32 bits,
+// so only differences are meaningful. rx_us is 0 for frames that did not come
+// from a serial line.
+typedef struct {
+    uint32_t rx_us;                            // USB transfer that carried the source line
+    uint32_t enqueued_us;                      // Stored for ws_sender_task
+} ws_trace_t;
+
+typedef struct {
+    message_type_t type;
+    char json_payload[WS_MAX_PAYLOAD_SIZE];
+    uint8_t bin_len;                           // 0 if the message has no binary form
+    uint8_t bin_payload[WS_BIN_MAX_PAYLOAD];
+    ws_trace_t trace;                          // Set by the ring/slot readers only
+} ws_message_t;
+
+// prusa-bin record ids - first byte of every binary frame. All fields that
+// follow are little-endian and match the page's decoder in webpage_remote.html.
+typedef enum {
+    WS_BIN_STATUS = 1,                         // u8 connected
+    WS_BIN_TEMPERATURE = 2,                    // 7 x i16, 0.1 degC
+    WS_BIN_PROGRESS = 3,                       // 3 x i16: percent, time left, change (mins)
+    WS_BIN_POSITION = 4,                       // 4 x i32, 0.01 mm
+    WS_BIN_POWER = 5,                          // 3 x i16 PWM
+    WS_BIN_HISTORY = 6,                        // u16 interval ms, u16 count, u8 fields,
+                                               // then count x fields i16, oldest first
+    WS_BIN_DEFLATE = 7                         // u8 1 = binary inside, 0 = text, then the
+                                               // frame as raw deflate (see ws_deflate_t)
+} ws_bin_record_t;
+
+// Temperature state
+typedef struct {
+    float nozzle_current;
+    float nozzle_target;
+    float bed_current;
+    float bed_target;
+    float heatbreak_current;
+    float heatbreak_target;
+    float chamber_current;
+} temp_state_t;
+
+// Progress state
+typedef struct {
+    int percent;
+    int time_left_mins;
+    int change_mins;
+} progress_state_t;
+
+// Position state
+typedef struct {
+    float x;
+    float y;
+    float z;
+    float e;
+} position_state_t;
+
+// Power state
+typedef struct {
+    int nozzle_pwm;
+    int bed_pwm;
+    int heatbreak_pwm;
+} power_state_t;
+
+// Fields that can be extracted from a single serial line
+typedef enum {
+    LINE_FIELD_NOZZLE_TEMP    = 1 << 0,   // T:cur/target
+    LINE_FIELD_BED_TEMP       = 1 << 1,   // B:cur/target
+    LINE_FIELD_HEATBREAK_TEMP = 1 << 2,   // X:cur/target (temperature report)
+    LINE_FIELD_CHAMBER_TEMP   = 1 << 3,   // C@:cur
+    LINE_FIELD_NOZZLE_PWM     = 1 << 4,   // @:pwm
+    LINE_FIELD_BED_PWM        = 1 << 5,   // B@:pwm
+    LINE_FIELD_HEATBREAK_PWM  = 1 << 6,   // HBR@:pwm
+    LINE_FIELD_POSITION       = 1 << 7,   // X: Y: Z: E: (position report)
+    LINE_FIELD_PROGRESS       = 1 << 8,   // M73 Progress: N%
+    LINE_FIELD_TIME_LEFT      = 1 << 9,   // M73 Time left: 1h 23m
+    LINE_FIELD_CHANGE_TIME    = 1 << 10,  // M73 Change: 16m
+    LINE_FIELD_PRINT_DONE     = 1 << 11,  // Done printing file
+    LINE_FIELD_OK             = 1 << 12,  // ok / ok <report>
+    LINE_FIELD_RESEND         = 1 << 13,  // Resend: N
+    LINE_FIELD_NO_M154        = 1 << 14,  // Unknown command: "M154 ..." (no position autoreport)
+} line_field_t;
+
+#define LINE_FIELDS_TEMPERATURE (LINE_FIELD_NOZZLE_TEMP | LINE_FIELD_BED_TEMP | \
+                                 LINE_FIELD_HEATBREAK_TEMP | LINE_FIELD_CHAMBER_TEMP)
+#define LINE_FIELDS_POWER       (LINE_FIELD_NOZZLE_PWM | LINE_FIELD_BED_PWM | LINE_FIELD_HEATBREAK_PWM)
+#define LINE_FIELDS_PROGRESS    (LINE_FIELD_PROGRESS | LINE_FIELD_TIME_LEFT | \
+                                 LINE_FIELD_CHANGE_TIME | LINE_FIELD_PRINT_DONE)
+
+// Result of a single tokenizing pass over one serial line
+typedef struct {
+    uint32_t present;            // LINE_FIELD_* found on the line
+    uint32_t resend_line;        // Line number requested by "Resend: N"
+    uint32_t changed;            // LINE_FIELD_* whose value differs from printer state
+    temp_state_t temps;
+    power_state_t power;
+    position_state_t position;
+    progress_state_t progress;
+    bool incomplete;             // A report was missing required fields
+} parsed_line_t;
+
+// Telemetry topic schema. Every field of a state topic is listed once, here;
+// the JSON and prusa-bin frames, deadband checks, the merge of a parsed line
+// into printer state and the /api/state document are all driven from these
+// lists (printer_messages.c). A new field is a member in the topic's state
+// struct and one row in its list.
+//
+// X(T, member, JSON group, JSON key, REST key, decimals, binary type, binary
+//   scale, deadband, LINE_FIELD_* that carries it)
+// T is the state struct, passed through. The C type comes from the member
+// (float or int). Fields of one group ("" for none) must be consecutive, and
+// binary records follow the list order - the page's decoder reads them so.
+// Floats move at deadband resolution, which matches their JSON precision;
+// ints once they differ by the deadband.
+#define TEMP_DEADBAND_C             (0.1f)
+#define POSITION_DEADBAND_MM        (0.01f)
+#define PWM_DEADBAND                (1)
+
+#define TELEMETRY_FIELDS_TEMPERATURE(X, T) \
+    X(T, nozzle_current,    "nozzle",    "current", "current", 1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_NOZZLE_TEMP) \
+    X(T, nozzle_target,     "nozzle",    "target",  "target",  1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_NOZZLE_TEMP) \
+    X(T, bed_current,       "bed",       "current", "current", 1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_BED_TEMP) \
+    X(T, bed_target,        "bed",       "target",  "target",  1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_BED_TEMP) \
+    X(T, heatbreak_current, "heatbreak", "current", "current", 1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_HEATBREAK_TEMP) \
+    X(T, heatbreak_target,  "heatbreak", "target",  "target",  1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_HEATBREAK_TEMP) \
+    X(T, chamber_current,   "chamber",   "current", "current", 1, I16, 10, TEMP_DEADBAND_C, LINE_FIELD_CHAMBER_TEMP)
+
+#define TELEMETRY_FIELDS_POWER(X, T) \
+    X(T, nozzle_pwm,        "", "nozzle",    "nozzle",    0, I16, 1, PWM_DEADBAND, LINE_FIELD_NOZZLE_PWM) \
+    X(T, bed_pwm,           "", "bed",       "bed",       0, I16, 1, PWM_DEADBAND, LINE_FIELD_BED_PWM) \
+    X(T, heatbreak_pwm,     "", "heatbreak", "heatbreak", 0, I16, 1, PWM_DEADBAND, LINE_FIELD_HEATBREAK_PWM)
+
+#define TELEMETRY_FIELDS_POSITION(X, T) \
+    X(T, x,                 "", "x", "x", 2, I32, 100, POSITION_DEADBAND_MM, LINE_FIELD_POSITION) \
+    X(T, y,                 "", "y", "y", 2, I32, 100, POSITION_DEADBAND_MM, LINE_FIELD_POSITION) \
+    X(T, z,                 "", "z", "z", 2, I32, 100, POSITION_DEADBAND_MM, LINE_FIELD_POSITION) \
+    X(T, e,                 "", "e", "e", 2, I32, 100, POSITION_DEADBAND_MM, LINE_FIELD_POSITION)
+
+#define TELEMETRY_FIELDS_PROGRESS(X, T) \
+    X(T, percent,           "", "percent",    "percent",     0, I16, 1, 1, LINE_FIELD_PROGRESS) \
+    X(T, time_left_mins,    "", "timeLeft",   "time_left",   0, I16, 1, 1, LINE_FIELD_TIME_LEFT) \
+    X(T, change_mins,       "", "changeTime", "change_time", 0, I16, 1, 1, LINE_FIELD_CHANGE_TIME)
+
+// X(id, name, message type, prusa-bin record, state struct, member of
+//   parsed_line_t and of the printer state, LINE_FIELD_* of the topic, fields)
+#define TELEMETRY_TOPICS(X) \
+    X(TEMPERATURE, "temperature", MSG_TYPE_TEMPERATURE, WS_BIN_TEMPERATURE, temp_state_t,     temps,    \
+      LINE_FIELDS_TEMPERATURE, TELEMETRY_FIELDS_TEMPERATURE) \
+    X(POWER,       "power",       MSG_TYPE_POWER,       WS_BIN_POWER,       power_state_t,    power,    \
+      LINE_FIELDS_POWER,       TELEMETRY_FIELDS_POWER) \
+    X(POSITION,    "position",    MSG_TYPE_POSITION,    WS_BIN_POSITION,    position_state_t, position, \
+      LINE_FIELD_POSITION,     TELEMETRY_FIELDS_POSITION) \
+    X(PROGRESS,    "progress",    MSG_TYPE_PROGRESS,    WS_BIN_PROGRESS,    progress_state_t, progress, \
+      LINE_FIELDS_PROGRESS,    TELEMETRY_FIELDS_PROGRESS)
+
+#define TELEMETRY_TOPIC_ENUM(id, ...)   TELEMETRY_TOPIC_##id,
+typedef enum {
+    TELEMETRY_TOPICS(TELEMETRY_TOPIC_ENUM)
+    TELEMETRY_TOPIC_COUNT
+} telemetry_topic_id_t;
+
+typedef enum {
+    TELEMETRY_F32,
+    TELEMETRY_INT,
+} telemetry_type_t;
+
+typedef enum {
+    TELEMETRY_BIN_I16,
+    TELEMETRY_BIN_I32,
+} telemetry_bin_t;
+
+typedef struct {
+    const char *group;                         // '"group":{' as written, "" at the top level
+    const char *key;                           // '"key":' as written
+    const char *rest_key;                      // The same for /api/state
+    uint8_t group_len;
+    uint8_t key_len;
+    uint8_t rest_key_len;
+    uint8_t type;                              // telemetry_type_t
+    uint16_t offset;                           // Of the member in the state struct
+    uint8_t decimals;
+    uint8_t bin;                               // telemetry_bin_t
+    uint16_t bin_scale;
+    float deadband;
+    uint32_t line_field;
+} telemetry_field_t;
+
+typedef struct {
+    const char *name;
+    uint8_t name_len;
+    uint8_t bin_record;                        // ws_bin_record_t
+    uint8_t field_count;
+    message_type_t msg_type;
+    uint32_t line_fields;                      // LINE_FIELD_* that feed the topic
+    uint16_t parsed_offset;                    // Of the topic's state in parsed_line_t
+    uint16_t state_size;                       // sizeof the state struct
+    const telemetry_field_t *fields;
+} telemetry_topic_schema_t;
+
+extern const telemetry_topic_schema_t telemetry_schema[TELEMETRY_TOPIC_COUNT];
+
+// Serial capture file (CAPTURE:START on the device, GET /capture): a
+// serial_capture_hdr_t, then for every USB IN transfer a serial_capture_rec_t
+// followed by its bytes, exactly as they arrived. Little-endian.
+#define CAPTURE_MAGIC               (0x50414353)  // "SCAP"
+
+typedef struct {
+    uint32_t magic;                            // CAPTURE_MAGIC
+    uint32_t reserved;
+} serial_capture_hdr_t;
+
+typedef struct {
+    uint32_t delta_us;                         // Since the previous record, or the start
+    uint32_t len;
+} serial_capture_rec_t;
+
+// Single pass over a line - no locks, no allocation, O(line length)
+void parse_serial_line(const char *line, size_t len, parsed_line_t *out);
+
+// Tokenizer helpers, also used for the bed mesh report
+bool line_starts_with(const char *p, const char *end, const char *prefix);
+const char *skip_spaces(const char *p, const char *end);
+bool parse_number(const char **p, const char *end, float *out);
+
+
+// Print analytics, folded in one applied serial update at a time: constant
+// work per update and constant state, nothing kept per layer. Times are the
+// caller's milliseconds and may wrap.
+#define PRINT_STATS_LAYER_MIN_MM    (0.05f)    // Smallest Z rise taken for a new layer
+#define PRINT_STATS_E_RESET_MM      (10.0f)    // A larger E drop is a G92 reset, not a retract
+
+typedef enum {
+    PRINT_STATS_JOB_START = 1 << 0,
+    PRINT_STATS_JOB_END   = 1 << 1,
+    PRINT_STATS_LAYER     = 1 << 2,
+} print_stats_event_t;
+
+typedef struct {
+    bool active;                               // M73 reports a job in progress
+    uint32_t jobs;                             // Jobs seen since boot
+    uint32_t start_ms;
+    uint32_t end_ms;                           // Of the last job, once !active
+
+    // Layers: a Z rise counts once extrusion is seen there on two position
+    // reports running, so Z-hops on travel moves are not layers
+    uint32_t layers;
+    float layer_z;
+    float pending_z;                           // Extruded at once, NAN if none
+    uint32_t pending_ms;
+    uint32_t layer_start_ms;
+    uint32_t last_layer_ms;                    // Duration of the last finished layer
+    uint32_t layers_done_ms;                   // Sum over finished layers
+
+    // Extrusion counts E above its high-water mark, so a retract and the
+    // matching unretract add nothing
+    bool e_valid;
+    float e_mark;
+    float extruded_mm;
+
+    // Heater duty: PWM integrated over job time
+    power_state_t power;                       // PWM since power_ms
+    uint32_t power_ms;
+    uint64_t pwm_ms[3];                        // Nozzle, bed, heatbreak
+    uint32_t duty_ms;
+
+    // Slicer estimate: elapsed plus time left at the job's first M73 report
+    int32_t estimate_s;
+    int32_t drift_s;                           // Latest elapsed + time left, less the estimate
+} print_stats_t;
+
+void print_stats_init(print_stats_t *st);
+// Returns the print_stats_event_t the update caused
+uint32_t print_stats_update(print_stats_t *st, uint32_t present, const position_state_t *pos,
+                            const power_state_t *power, const progress_state_t *progress, uint32_t now_ms);
+void build_stats_message(ws_message_t *msg, const print_stats_t *st, uint32_t now_ms);
+
+// prusa-bin encoding helpers
+static inline uint8_t *bin_put_i16(uint8_t *p, int32_t v)
+{
+    if (v > INT16_MAX) v = INT16_MAX;
+    if (v < INT16_MIN) v = INT16_MIN;
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)((uint32_t)v >> 8);
+    return p + 2;
+}
+
+static inline uint8_t *bin_put_i32(uint8_t *p, int32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)((uint32_t)v >> (8 * i));
+    }
+    return p + 4;
+}
+
+static inline void bin_finish(ws_message_t *msg, const uint8_t *end)
+{
+    msg->bin_len = (uint8_t)(end - msg->bin_payload);
+}
+
+// Append-only JSON writer over a caller's buffer. Each call appends its whole
+// piece or, if that would not fit, drops it and every later one and sets
+// full, so the text is always a prefix of the intended document.
+typedef struct {
+    char *buf;
+    size_t cap;                                // Usable bytes, one is kept for the NUL
+    size_t len;
+    bool full;
+} json_writer_t;
+
+void json_init(json_writer_t *w, char *buf, size_t size);
+void json_raw(json_writer_t *w, const char *s, size_t n);
+#define json_lit(w, s)  json_raw((w), (s), sizeof(s) - 1)
+void json_uint(json_writer_t *w, uint32_t v);
+void json_int(json_writer_t *w, int32_t v);
+// v with 0-3 decimals, rounded as printf("%.*f") does; non-finite values
+// as null and negative zero as 0
+void json_fixed(json_writer_t *w, float v, unsigned decimals);
+void json_bool(json_writer_t *w, bool v);
+// Quoted and escaped s[0..len), stopping at a NUL. Keeps as much as fits
+// while leaving keep bytes free after the closing quote; returns false if
+// the string was cut short.
+bool json_str(json_writer_t *w, const char *s, size_t len, size_t keep);
+// NUL-terminate; returns the length
+size_t json_end(json_writer_t *w);
+
+// Telemetry frames, JSON and prusa-bin, from one topic's state struct
+void telemetry_build_message(ws_message_t *msg, telemetry_topic_id_t id, const void *state);
+// The topic's members, '"key":value,...' with groups nested, for a document
+// the caller opens and closes; rest selects the /api/state keys
+void telemetry_json_members(json_writer_t *w, telemetry_topic_id_t id, const void *state, bool rest);
+// Whether any field of now moved past its deadband from sent
+bool telemetry_exceeds_deadband(telemetry_topic_id_t id, const void *now, const void *sent);
+// Copy the fields of a parsed line's topic state that the line carried into
+// state; returns the LINE_FIELD_* whose value changed
+uint32_t telemetry_apply(telemetry_topic_id_t id, void *state, const parsed_line_t *parsed);
+
+// Escape src[0..len) as JSON string content into dst (not NUL-terminated).
+// Stops before an escape sequence that would not fit; returns bytes written.
+size_t json_escape(char *dst, size_t cap, const char *src, size_t len);
+
+// Raw deflate (RFC 1951) of bulk frames, streamed: greedy LZ77 over a small
+// window primed with a preset dictionary of the bridge's frame and Marlin log
+// vocabulary, coded with the fixed Huffman table as one final block. No heap:
+// the caller provides the state. The stream alone does not carry the
+// dictionary; the page inflates a stored block of ws_deflate_dict ahead of it
+// and drops that part of the output.
+#define WS_DEFLATE_WINDOW_BITS      (11)
+#define WS_DEFLATE_WINDOW           (1 << WS_DEFLATE_WINDOW_BITS)  // Longest match distance
+#define WS_DEFLATE_HASH_BITS        (10)
+#define WS_DEFLATE_CHAIN_MAX        (16)       // Candidates tried per position
+#define WS_DEFLATE_OUT_SIZE         (1024)     // Compressed bytes per emit() call
+
+// Hands out compressed bytes; final is set on the last call of a stream.
+// Returns false to abandon the stream.
+typedef bool (*ws_deflate_emit_t)(void *ctx, const uint8_t *data, size_t len, bool final);
+
+typedef struct {
+    uint8_t window[2 * WS_DEFLATE_WINDOW];     // History, then input not yet coded
+    uint16_t head[1 << WS_DEFLATE_HASH_BITS];  // Newest position + 1 per hash, 0 = none
+    uint16_t prev[WS_DEFLATE_WINDOW];          // Next older position + 1, same hash
+    size_t pos;                                // Next window byte to code
+    size_t end;                                // Window bytes filled
+    uint32_t bits;                             // Output bits not yet a whole byte
+    unsigned bit_count;
+    uint8_t out[WS_DEFLATE_OUT_SIZE];
+    size_t out_len;
+    ws_deflate_emit_t emit;
+    void *ctx;
+    bool failed;                               // emit() gave up
+    size_t in_total;                           // Input bytes of this stream
+    size_t out_total;                          // Compressed bytes, with the prefix
+} ws_deflate_t;
+
+extern const char ws_deflate_dict[];
+extern const size_t ws_deflate_dict_len;
+// FNV-1a of ws_deflate_dict, for a client to prove it holds the same one
+uint32_t ws_deflate_dict_id(void);
+
+// Start a stream; prefix (a record header) goes out ahead of the deflate data
+void ws_deflate_begin(ws_deflate_t *z, const void *prefix, size_t prefix_len,
+                      ws_deflate_emit_t emit, void *ctx);
+void ws_deflate_write(ws_deflate_t *z, const void *data, size_t len);
+// Code what is left, end the block and emit the last bytes with final set.
+// Returns false if emit() gave up on the stream.
+bool ws_deflate_finish(ws_deflate_t *z);
+
+// Frame a command as "N<line> <cmd>*<checksum>\n" into buf. Returns the
+// length, or 0 if it does not fit in size bytes.
+size_t gcode_frame(char *buf, size_t size, uint32_t line, const char *cmd);
+
+// One task's share of the CPU and stack, from FreeRTOS run-time stats
+#define TASK_STAT_NAME_LEN          (16)       // configMAX_TASK_NAME_LEN; longer names are cut
+typedef struct {
+    char name[TASK_STAT_NAME_LEN];
+    int core;                                  // -1 if not pinned
+    uint32_t priority;
+    uint16_t cpu_x10;                          // Percent of a core, tenths
+    uint32_t stack_free;                       // Bytes never used since the task started
+} task_stat_t;
+
+// One part of the task list as a debug frame into buf:
+// {"type":"tasks","part":0,"cores":[..],"tasks":[[name,core,prio,cpu%,stack_free],..]}
+// It holds tasks[*next..) up to what fits, and *next is advanced past them.
+// That is always at least one task: one too long for a part of its own goes
+// in with its name cut short, or is left out. Returns the length.
+size_t task_stats_frame(char *buf, size_t size, int part, const uint16_t *core_load_x10, int cores,
+                        const task_stat_t *tasks, int count, int *next);
+
+#ifdef __cplusplus
+}
+#endif
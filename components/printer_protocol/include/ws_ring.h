@@ -0,0 +1,82 @@
+/*
+ * Broadcast ring shared by the WebSocket, SSE and MQTT readers. Frames for
+ * every reader and unicast frames for one are stored back to back; each
+ * reader keeps its own cursor and skips what is not for it. The writer
+ * never waits: a full ring drops its oldest frames and a reader that was
+ * still on them catches up with ws_ring_catch_up().
+ *
+ * No ESP-IDF or FreeRTOS dependencies. The owner injects the lock; every
+ * call but ws_ring_init() expects it to be held.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "printer_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WS_TOPIC_BIT(type)          (1u << (type))
+
+// Record header. Records are 4-byte aligned and never wrap; a WS_RING_PAD
+// record fills the gap at the end of the buffer instead.
+typedef struct {
+    uint16_t len;                              // Payload bytes, or WS_RING_PAD
+    uint8_t type;                              // message_type_t
+    int8_t target;                             // Reader id, or WS_RING_ALL_CLIENTS
+    ws_trace_t trace;
+} ws_ring_hdr_t;
+
+#define WS_RING_PAD                 (0xFFFF)
+#define WS_RING_ALL_CLIENTS         (-1)
+#define WS_RING_RECORD_SIZE(len)    ((sizeof(ws_ring_hdr_t) + (len) + 3) & ~(size_t)3)
+
+// A mutex on the device, a pthread one (or nothing) on the host
+typedef struct {
+    void (*take)(void *ctx);
+    void (*give)(void *ctx);
+    void *ctx;
+} ws_ring_lock_t;
+
+typedef struct {
+    uint8_t *buf;                              // size bytes, 4-byte aligned
+    size_t size;                               // Power of two, > WS_RING_RECORD_SIZE(WS_MAX_PAYLOAD_SIZE)
+    size_t head;                               // Free-running write position
+    size_t tail;                               // Free-running position of oldest record
+    uint32_t frames;                           // Records written since init
+    ws_ring_lock_t lock;
+} ws_ring_t;
+
+void ws_ring_init(ws_ring_t *r, void *buf, size_t size, const ws_ring_lock_t *lock);
+void ws_ring_lock(ws_ring_t *r);
+void ws_ring_unlock(ws_ring_t *r);
+
+// Append one frame's JSON payload, overwriting the oldest frames if needed
+void ws_ring_write(ws_ring_t *r, int8_t target, const ws_message_t *msg, const ws_trace_t *trace);
+
+// Move a cursor the ring has lapped to the oldest record. Returns how many
+// bytes of frames it missed, 0 if it was still valid.
+size_t ws_ring_catch_up(const ws_ring_t *r, size_t *cursor);
+
+// Copy the next frame for reader id (unicast to it, or broadcast with its
+// type in topics) into out and advance the cursor past it. Returns the
+// payload length, 0 if the reader is caught up. The cursor must be valid.
+size_t ws_ring_read(const ws_ring_t *r, size_t *cursor, int id, uint32_t topics, ws_message_t *out);
+
+// True if pos is where a record starts, between tail and head
+bool ws_ring_is_boundary(const ws_ring_t *r, size_t pos);
+
+// Bytes between a cursor and the head
+static inline size_t ws_ring_lag(const ws_ring_t *r, size_t cursor)
+{
+    return r->head - cursor;
+}
+
+#ifdef __cplusplus
+}
+#endif
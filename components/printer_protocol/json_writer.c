@@ -0,0 +1,160 @@
+// Append-only JSON writer. Numbers are formatted with integer arithmetic and
+// strings escaped in one pass, straight into the frame buffer.
+
+#include <math.h>
+#include <string.h>
+
+#include "printer_protocol.h"
+
+#define JSON_NUM_MAX    (16)    // "-4294967295", or "-4294967.295"
+
+// json_escape() that also reports how much of src it consumed
+static size_t json_escape_part(char *dst, size_t cap, const char *src, size_t len, size_t *used)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+    size_t j = 0;
+
+    for (i = 0; i < len && src[i]; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c == '"' || c == '\\') {
+            if (j + 2 > cap) break;
+            dst[j++] = '\\';
+            dst[j++] = (char)c;
+        } else if (c < 0x20) {
+            // Control characters are not valid inside JSON strings
+            if (j + 6 > cap) break;
+            memcpy(&dst[j], "\\u00", 4);
+            dst[j + 4] = hex[c >> 4];
+            dst[j + 5] = hex[c & 0x0F];
+            j += 6;
+        } else {
+            if (j + 1 > cap) break;
+            dst[j++] = (char)c;
+        }
+    }
+    *used = i;
+    return j;
+}
+
+size_t json_escape(char *dst, size_t cap, const char *src, size_t len)
+{
+    size_t used;
+    return json_escape_part(dst, cap, src, len, &used);
+}
+
+void json_init(json_writer_t *w, char *buf, size_t size)
+{
+    w->buf = buf;
+    w->cap = size - 1;
+    w->len = 0;
+    w->full = false;
+}
+
+void json_raw(json_writer_t *w, const char *s, size_t n)
+{
+    if (w->full || n > w->cap - w->len) {
+        w->full = true;
+        return;
+    }
+    memcpy(&w->buf[w->len], s, n);
+    w->len += n;
+}
+
+// Digits of v, right-aligned so they end at end; returns the first digit
+static char *json_digits(char *end, uint32_t v)
+{
+    do {
+        *--end = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    return end;
+}
+
+void json_uint(json_writer_t *w, uint32_t v)
+{
+    char tmp[JSON_NUM_MAX];
+    char *p = json_digits(tmp + sizeof(tmp), v);
+    json_raw(w, p, tmp + sizeof(tmp) - p);
+}
+
+void json_int(json_writer_t *w, int32_t v)
+{
+    char tmp[JSON_NUM_MAX];
+    uint32_t mag = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+    char *p = json_digits(tmp + sizeof(tmp), mag);
+    if (v < 0) *--p = '-';
+    json_raw(w, p, tmp + sizeof(tmp) - p);
+}
+
+void json_fixed(json_writer_t *w, float v, unsigned decimals)
+{
+    static const uint32_t scale[] = { 1, 10, 100, 1000 };
+    char tmp[JSON_NUM_MAX];
+    char *end = tmp + sizeof(tmp);
+
+    if (decimals > 3) decimals = 3;
+    if (!isfinite(v)) {
+        // printf would emit "nan", which no JSON parser accepts
+        json_raw(w, "null", 4);
+        return;
+    }
+
+    // Integer and fraction are rounded apart: scaling the whole value first
+    // would run out of float mantissa on e.g. a 99999.99 mm extruder total
+    float a = fabsf(v);
+    uint32_t ip = a < 4294967040.0f ? (uint32_t)a : UINT32_MAX;
+    float rest = ip < UINT32_MAX ? a - (float)ip : 0.0f;
+    float frac = rest * (float)scale[decimals];
+    uint32_t fq = (uint32_t)(frac + 0.5f);
+    if ((float)fq - frac == 0.5f) {
+        // A rounded tie: settle it on the exact product, ties to even, as
+        // printf does
+        float err = fmaf(rest, (float)scale[decimals], -frac);
+        if (err < 0.0f || (err == 0.0f && (fq & 1))) fq--;
+    }
+    if (fq >= scale[decimals] && ip < UINT32_MAX) {
+        ip++;
+        fq -= scale[decimals];
+    }
+    bool negative = v < 0 && (ip != 0 || fq != 0);    // No "-0.0" for values that round to zero
+    char *p = end;
+    for (unsigned i = 0; i < decimals; i++) {
+        *--p = (char)('0' + fq % 10);
+        fq /= 10;
+    }
+    if (decimals) *--p = '.';
+    p = json_digits(p, ip);
+    if (negative) *--p = '-';
+    json_raw(w, p, end - p);
+}
+
+void json_bool(json_writer_t *w, bool v)
+{
+    if (v) {
+        json_raw(w, "true", 4);
+    } else {
+        json_raw(w, "false", 5);
+    }
+}
+
+bool json_str(json_writer_t *w, const char *s, size_t len, size_t keep)
+{
+    // Both quotes and the bytes kept for the caller's closers must fit
+    if (w->full || w->cap - w->len < 2 + keep) {
+        w->full = true;
+        return false;
+    }
+    size_t room = w->cap - w->len - 2 - keep;
+    w->buf[w->len++] = '"';
+    size_t used;
+    w->len += json_escape_part(&w->buf[w->len], room, s, len, &used);
+    w->buf[w->len++] = '"';
+    return used == len || s[used] == '\0';
+}
+
+size_t json_end(json_writer_t *w)
+{
+    w->buf[w->len] = '\0';
+    return w->len;
+}
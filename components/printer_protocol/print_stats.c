@@ -0,0 +1,187 @@
+// Print analytics from the parsed serial stream: job time, layers, extrusion,
+// heater duty and drift from the slicer estimate. Every update is a handful
+// of comparisons and adds, however long the print.
+
+#include <math.h>
+#include <string.h>
+
+#include "printer_protocol.h"
+
+#define PRINT_STATS_PWM_MAX         (255)      // @:, B@: and HBR@: full scale
+#define PRINT_STATS_EXTRUDING_MM    (0.01f)    // Less E between reports is not extrusion
+
+void print_stats_init(print_stats_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->pending_z = NAN;
+}
+
+// Account E up to its high-water mark; returns whether the head extruded
+static bool print_stats_extrude(print_stats_t *st, float e)
+{
+    if (!st->e_valid || e < st->e_mark - PRINT_STATS_E_RESET_MM) {
+        st->e_valid = true;
+        st->e_mark = e;
+        return false;
+    }
+    if (e <= st->e_mark) return false;
+
+    float delta = e - st->e_mark;
+    st->extruded_mm += delta;
+    st->e_mark = e;
+    return delta >= PRINT_STATS_EXTRUDING_MM;
+}
+
+static void print_stats_close_layer(print_stats_t *st, uint32_t now_ms)
+{
+    if (st->layers == 0) return;
+    st->last_layer_ms = now_ms - st->layer_start_ms;
+    st->layers_done_ms += st->last_layer_ms;
+}
+
+// Returns whether z, extruded at, starts a new layer
+static bool print_stats_layer(print_stats_t *st, float z, bool extruding, uint32_t now_ms)
+{
+    if (!extruding) return false;
+    if (z < st->layer_z + PRINT_STATS_LAYER_MIN_MM) {
+        // Still on the layer, or a one-off sample caught mid Z-hop
+        st->pending_z = NAN;
+        return false;
+    }
+    if (isnan(st->pending_z) || fabsf(z - st->pending_z) >= PRINT_STATS_LAYER_MIN_MM) {
+        st->pending_z = z;
+        st->pending_ms = now_ms;
+        return false;
+    }
+
+    // The layer started when it was first seen
+    print_stats_close_layer(st, st->pending_ms);
+    st->layers++;
+    st->layer_z = st->pending_z;
+    st->layer_start_ms = st->pending_ms;
+    st->pending_z = NAN;
+    return true;
+}
+
+static void print_stats_integrate(print_stats_t *st, uint32_t now_ms)
+{
+    uint32_t dt = now_ms - st->power_ms;
+    const int pwm[3] = { st->power.nozzle_pwm, st->power.bed_pwm, st->power.heatbreak_pwm };
+
+    for (int i = 0; i < 3; i++) {
+        if (pwm[i] > 0) st->pwm_ms[i] += (uint64_t)pwm[i] * dt;
+    }
+    st->duty_ms += dt;
+    st->power_ms = now_ms;
+}
+
+uint32_t print_stats_update(print_stats_t *st, uint32_t present, const position_state_t *pos,
+                            const power_state_t *power, const progress_state_t *progress, uint32_t now_ms)
+{
+    uint32_t events = 0;
+
+    if (present & LINE_FIELDS_PROGRESS) {
+        bool active = progress->percent < 100 && progress->time_left_mins > 0;
+        if (active && !st->active) {
+            uint32_t jobs = st->jobs;
+            print_stats_init(st);
+            st->jobs = jobs + 1;
+            st->active = true;
+            st->start_ms = now_ms;
+            st->layer_start_ms = now_ms;
+            st->power_ms = now_ms;
+            st->power = *power;
+            events |= PRINT_STATS_JOB_START;
+        } else if (!active && st->active) {
+            print_stats_integrate(st, now_ms);
+            print_stats_close_layer(st, now_ms);
+            st->active = false;
+            st->end_ms = now_ms;
+            if (st->estimate_s > 0) {
+                st->drift_s = (int32_t)((now_ms - st->start_ms) / 1000) - st->estimate_s;
+            }
+            events |= PRINT_STATS_JOB_END;
+        }
+    }
+    if (!st->active) return events;
+
+    // The previous PWM held until now
+    print_stats_integrate(st, now_ms);
+    st->power = *power;
+
+    if (present & LINE_FIELD_POSITION) {
+        bool extruding = print_stats_extrude(st, pos->e);
+        if (print_stats_layer(st, pos->z, extruding, now_ms)) {
+            events |= PRINT_STATS_LAYER;
+        }
+    }
+    if ((present & LINE_FIELDS_PROGRESS) && progress->time_left_mins > 0) {
+        int32_t expected_s = (int32_t)((now_ms - st->start_ms) / 1000) + progress->time_left_mins * 60;
+        if (st->estimate_s == 0) st->estimate_s = expected_s;
+        st->drift_s = expected_s - st->estimate_s;
+    }
+    return events;
+}
+
+static void json_seconds(json_writer_t *w, uint32_t ms)
+{
+    json_fixed(w, ms / 1000.0f, 1);
+}
+
+static void json_duty(json_writer_t *w, uint64_t pwm_ms, uint32_t duty_ms)
+{
+    json_fixed(w, duty_ms ? (float)pwm_ms * 100.0f / ((float)duty_ms * PRINT_STATS_PWM_MAX) : 0.0f, 1);
+}
+
+void build_stats_message(ws_message_t *msg, const print_stats_t *st, uint32_t now_ms)
+{
+    uint32_t elapsed_ms = 0;
+    uint32_t layer_ms = 0;
+    uint32_t layers_done = st->layers;
+
+    if (st->active) {
+        elapsed_ms = now_ms - st->start_ms;
+        if (st->layers > 0) {
+            layer_ms = now_ms - st->layer_start_ms;
+            layers_done--;
+        }
+    } else if (st->jobs > 0) {
+        elapsed_ms = st->end_ms - st->start_ms;
+    }
+
+    msg->type = MSG_TYPE_STATS;
+    msg->bin_len = 0;
+
+    json_writer_t w;
+    json_init(&w, msg->json_payload, WS_MAX_PAYLOAD_SIZE);
+    json_lit(&w, "{\"type\":\"stats\",\"active\":");
+    json_bool(&w, st->active);
+    json_lit(&w, ",\"jobs\":");
+    json_uint(&w, st->jobs);
+    json_lit(&w, ",\"elapsed\":");
+    json_uint(&w, elapsed_ms / 1000);
+    json_lit(&w, ",\"layer\":");
+    json_uint(&w, st->layers);
+    json_lit(&w, ",\"z\":");
+    json_fixed(&w, st->layer_z, 2);
+    json_lit(&w, ",\"layerTime\":");
+    json_seconds(&w, layer_ms);
+    json_lit(&w, ",\"lastLayerTime\":");
+    json_seconds(&w, st->last_layer_ms);
+    json_lit(&w, ",\"avgLayerTime\":");
+    json_seconds(&w, layers_done ? st->layers_done_ms / layers_done : 0);
+    json_lit(&w, ",\"extruded\":");
+    json_fixed(&w, st->extruded_mm, 1);
+    json_lit(&w, ",\"duty\":{\"nozzle\":");
+    json_duty(&w, st->pwm_ms[0], st->duty_ms);
+    json_lit(&w, ",\"bed\":");
+    json_duty(&w, st->pwm_ms[1], st->duty_ms);
+    json_lit(&w, ",\"heatbreak\":");
+    json_duty(&w, st->pwm_ms[2], st->duty_ms);
+    json_lit(&w, "},\"estimate\":");
+    json_int(&w, st->estimate_s);
+    json_lit(&w, ",\"drift\":");
+    json_int(&w, st->drift_s);
+    json_lit(&w, "}");
+    json_end(&w);
+}
@@ -0,0 +1,159 @@
+// Telemetry frame builders. Every message carries its JSON text and, for
+// clients that negotiated prusa-bin, the equivalent binary record - both
+// written field by field from the topic schema in printer_protocol.h.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "printer_protocol.h"
+
+// The member's C type picks how its four bytes are read
+#define TELEMETRY_TYPE_OF(T, member) \
+    _Generic(((T *)0)->member, float: TELEMETRY_F32, int: TELEMETRY_INT)
+
+#define TELEMETRY_FIELD_ENTRY(T, member, group_, key_, rest_key_, decimals_, bin_, scale_, deadband_, field_) \
+    {                                                                                           \
+        .group = sizeof(group_) > 1 ? "\"" group_ "\":{" : "",                                  \
+        .key = "\"" key_ "\":",                                                                 \
+        .rest_key = "\"" rest_key_ "\":",                                                       \
+        .group_len = sizeof(group_) > 1 ? sizeof("\"" group_ "\":{") - 1 : 0,                   \
+        .key_len = sizeof("\"" key_ "\":") - 1,                                                 \
+        .rest_key_len = sizeof("\"" rest_key_ "\":") - 1,                                       \
+        .type = TELEMETRY_TYPE_OF(T, member),                                                   \
+        .offset = offsetof(T, member),                                                          \
+        .decimals = decimals_,                                                                  \
+        .bin = TELEMETRY_BIN_##bin_,                                                            \
+        .bin_scale = scale_,                                                                    \
+        .deadband = deadband_,                                                                  \
+        .line_field = field_,                                                                   \
+    },
+
+#define TELEMETRY_FIELD_TABLE(id, name, msg_type, bin_record, T, member, line_fields, fields) \
+    static const telemetry_field_t telemetry_fields_##id[] = { fields(TELEMETRY_FIELD_ENTRY, T) };
+TELEMETRY_TOPICS(TELEMETRY_FIELD_TABLE)
+
+#define TELEMETRY_TOPIC_ENTRY(id, name_, type_, record_, T, member, fields_, field_list) \
+    [TELEMETRY_TOPIC_##id] = {                                                                  \
+        .name = name_,                                                                          \
+        .name_len = sizeof(name_) - 1,                                                          \
+        .bin_record = record_,                                                                  \
+        .field_count = sizeof(telemetry_fields_##id) / sizeof(telemetry_field_t),               \
+        .msg_type = type_,                                                                      \
+        .line_fields = fields_,                                                                 \
+        .parsed_offset = offsetof(parsed_line_t, member),                                       \
+        .state_size = sizeof(T),                                                                \
+        .fields = telemetry_fields_##id,                                                        \
+    },
+
+const telemetry_topic_schema_t telemetry_schema[TELEMETRY_TOPIC_COUNT] = {
+    TELEMETRY_TOPICS(TELEMETRY_TOPIC_ENTRY)
+};
+
+_Static_assert(sizeof(int) == sizeof(float), "telemetry_apply() copies fields as four bytes");
+
+static inline float field_f32(const telemetry_field_t *f, const void *state)
+{
+    float v;
+    memcpy(&v, (const char *)state + f->offset, sizeof(v));
+    return v;
+}
+
+static inline int field_int(const telemetry_field_t *f, const void *state)
+{
+    int v;
+    memcpy(&v, (const char *)state + f->offset, sizeof(v));
+    return v;
+}
+
+void telemetry_json_members(json_writer_t *w, telemetry_topic_id_t id, const void *state, bool rest)
+{
+    const telemetry_topic_schema_t *topic = &telemetry_schema[id];
+    const char *group = "";
+
+    for (unsigned i = 0; i < topic->field_count; i++) {
+        const telemetry_field_t *f = &topic->fields[i];
+        if (f->group != group && strcmp(f->group, group) != 0) {
+            if (group[0]) json_lit(w, "}");
+            if (i) json_lit(w, ",");
+            json_raw(w, f->group, f->group_len);
+            group = f->group;
+        } else if (i) {
+            json_lit(w, ",");
+        }
+        if (rest) {
+            json_raw(w, f->rest_key, f->rest_key_len);
+        } else {
+            json_raw(w, f->key, f->key_len);
+        }
+        if (f->type == TELEMETRY_F32) {
+            json_fixed(w, field_f32(f, state), f->decimals);
+        } else {
+            json_int(w, field_int(f, state));
+        }
+    }
+    if (group[0]) json_lit(w, "}");
+}
+
+void telemetry_build_message(ws_message_t *msg, telemetry_topic_id_t id, const void *state)
+{
+    const telemetry_topic_schema_t *topic = &telemetry_schema[id];
+
+    msg->type = topic->msg_type;
+    uint8_t *b = msg->bin_payload;
+    *b++ = topic->bin_record;
+    for (unsigned i = 0; i < topic->field_count; i++) {
+        const telemetry_field_t *f = &topic->fields[i];
+        int32_t v = f->type == TELEMETRY_F32 ? (int32_t)lroundf(field_f32(f, state) * f->bin_scale)
+                                             : field_int(f, state) * f->bin_scale;
+        b = f->bin == TELEMETRY_BIN_I16 ? bin_put_i16(b, v) : bin_put_i32(b, v);
+    }
+    bin_finish(msg, b);
+
+    json_writer_t w;
+    json_init(&w, msg->json_payload, WS_MAX_PAYLOAD_SIZE);
+    json_lit(&w, "{\"type\":\"");
+    json_raw(&w, topic->name, topic->name_len);
+    json_lit(&w, "\",");
+    telemetry_json_members(&w, id, state, false);
+    json_lit(&w, "}");
+    json_end(&w);
+}
+
+bool telemetry_exceeds_deadband(telemetry_topic_id_t id, const void *now, const void *sent)
+{
+    const telemetry_topic_schema_t *topic = &telemetry_schema[id];
+
+    for (unsigned i = 0; i < topic->field_count; i++) {
+        const telemetry_field_t *f = &topic->fields[i];
+        if (f->type == TELEMETRY_F32) {
+            if (lroundf(field_f32(f, now) / f->deadband) != lroundf(field_f32(f, sent) / f->deadband)) {
+                return true;
+            }
+        } else if (abs(field_int(f, now) - field_int(f, sent)) >= (int)f->deadband) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t telemetry_apply(telemetry_topic_id_t id, void *state, const parsed_line_t *parsed)
+{
+    const telemetry_topic_schema_t *topic = &telemetry_schema[id];
+    const char *update = (const char *)parsed + topic->parsed_offset;
+    uint32_t changed = 0;
+
+    if (!(parsed->present & topic->line_fields)) return 0;
+    for (unsigned i = 0; i < topic->field_count; i++) {
+        const telemetry_field_t *f = &topic->fields[i];
+        if (!(parsed->present & f->line_field)) continue;
+        bool differs = f->type == TELEMETRY_F32 ? field_f32(f, state) != field_f32(f, update)
+                                                : field_int(f, state) != field_int(f, update);
+        if (differs) {
+            memcpy((char *)state + f->offset, update + f->offset, sizeof(float));
+            changed |= f->line_field;
+        }
+    }
+    return changed;
+}
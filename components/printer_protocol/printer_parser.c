@@ -0,0 +1,359 @@
+// SERIAL LINE PARSER - THE HEART OF V3!
+// One pass per line: the first character selects the report type, then the
+// line is walked once as KEY:VALUE tokens. Plain "ok" lines cost a compare.
+
+#include <string.h>
+
+#include "printer_protocol.h"
+
+bool line_starts_with(const char *p, const char *end, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return (size_t)(end - p) >= n && memcmp(p, prefix, n) == 0;
+}
+
+const char *skip_spaces(const char *p, const char *end)
+{
+    while (p < end && *p == ' ') p++;
+    return p;
+}
+
+// Parse a decimal number ("215.3", "-0.02", "127") at *p, advancing *p past it.
+// Telemetry never uses exponents, so this avoids newlib's locale-aware float
+// scanner: digits are accumulated as a fixed-point integer and scaled once.
+bool parse_number(const char **p, const char *end, float *out)
+{
+    static const float pow10_table[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f };
+    const char *c = *p;
+    bool negative = false;
+
+    if (c < end && (*c == '-' || *c == '+')) {
+        negative = (*c == '-');
+        c++;
+    }
+
+    uint32_t mantissa = 0;
+    int frac_digits = 0;
+    bool digits = false;
+
+    while (c < end && *c >= '0' && *c <= '9') {
+        if (mantissa < 100000000u) {
+            mantissa = mantissa * 10 + (uint32_t)(*c - '0');
+        }
+        c++;
+        digits = true;
+    }
+    if (c < end && *c == '.') {
+        c++;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (frac_digits < 6 && mantissa < 100000000u) {
+                mantissa = mantissa * 10 + (uint32_t)(*c - '0');
+                frac_digits++;
+            }
+            c++;
+            digits = true;
+        }
+    }
+    if (!digits) return false;
+
+    float v = (float)mantissa / pow10_table[frac_digits];
+    *out = negative ? -v : v;
+    *p = c;
+    return true;
+}
+
+// Telemetry keys recognised inside temperature and position reports
+typedef enum {
+    TELEMETRY_KEY_UNKNOWN,
+    TELEMETRY_KEY_T,        // T:
+    TELEMETRY_KEY_B,        // B:
+    TELEMETRY_KEY_X,        // X:
+    TELEMETRY_KEY_Y,        // Y:
+    TELEMETRY_KEY_Z,        // Z:
+    TELEMETRY_KEY_E,        // E:
+    TELEMETRY_KEY_AT,       // @:
+    TELEMETRY_KEY_B_AT,     // B@:
+    TELEMETRY_KEY_C_AT,     // C@:
+    TELEMETRY_KEY_HBR_AT,   // HBR@:
+} telemetry_key_t;
+
+static telemetry_key_t lookup_telemetry_key(const char *key, size_t len)
+{
+    switch (len) {
+        case 1:
+            switch (key[0]) {
+                case 'T': return TELEMETRY_KEY_T;
+                case 'B': return TELEMETRY_KEY_B;
+                case 'X': return TELEMETRY_KEY_X;
+                case 'Y': return TELEMETRY_KEY_Y;
+                case 'Z': return TELEMETRY_KEY_Z;
+                case 'E': return TELEMETRY_KEY_E;
+                case '@': return TELEMETRY_KEY_AT;
+                default:  return TELEMETRY_KEY_UNKNOWN;  // A: (mainboard) and friends
+            }
+        case 2:
+            if (key[1] != '@') return TELEMETRY_KEY_UNKNOWN;
+            if (key[0] == 'B') return TELEMETRY_KEY_B_AT;
+            if (key[0] == 'C') return TELEMETRY_KEY_C_AT;
+            return TELEMETRY_KEY_UNKNOWN;
+        case 4:
+            return memcmp(key, "HBR@", 4) == 0 ? TELEMETRY_KEY_HBR_AT : TELEMETRY_KEY_UNKNOWN;
+        default:
+            return TELEMETRY_KEY_UNKNOWN;
+    }
+}
+
+// Walk "KEY:cur[/target]" tokens of a temperature report ("T:215.0/215.0 B:60.0/60.0
+// X:45.0/45.0 A:40.1/0.0 C@:22.5 @:127 B@:64 HBR@:89") or a position report
+// ("X:108.67 Y:90.41 Z:2.20 E:0.00 Count A:24936 ...").
+static void parse_kv_report(const char *p, const char *end, bool position_report, parsed_line_t *out)
+{
+    uint32_t axes = 0;
+
+    while (p < end) {
+        p = skip_spaces(p, end);
+        const char *word = p;
+        while (p < end && *p != ':' && *p != ' ') p++;
+
+        if (p >= end || *p == ' ') {
+            // Bare word - the stepper counts after "Count" are not positions
+            if (position_report && p - word == 5 && memcmp(word, "Count", 5) == 0) {
+                break;
+            }
+            continue;
+        }
+
+        telemetry_key_t key = lookup_telemetry_key(word, p - word);
+        p++;  // skip ':'
+
+        float value = 0, target = 0;
+        bool has_value = parse_number(&p, end, &value);
+        bool has_target = false;
+        if (has_value && p < end && *p == '/') {
+            p++;
+            has_target = parse_number(&p, end, &target);
+        }
+
+        if (has_value) {
+            if (position_report) {
+                switch (key) {
+                    case TELEMETRY_KEY_X: out->position.x = value; axes |= 1; break;
+                    case TELEMETRY_KEY_Y: out->position.y = value; axes |= 2; break;
+                    case TELEMETRY_KEY_Z: out->position.z = value; axes |= 4; break;
+                    case TELEMETRY_KEY_E: out->position.e = value; axes |= 8; break;
+                    default: break;
+                }
+            } else {
+                switch (key) {
+                    case TELEMETRY_KEY_T:
+                        if (has_target) {
+                            out->temps.nozzle_current = value;
+                            out->temps.nozzle_target = target;
+                            out->present |= LINE_FIELD_NOZZLE_TEMP;
+                        }
+                        break;
+                    case TELEMETRY_KEY_B:
+                        if (has_target) {
+                            out->temps.bed_current = value;
+                            out->temps.bed_target = target;
+                            out->present |= LINE_FIELD_BED_TEMP;
+                        }
+                        break;
+                    case TELEMETRY_KEY_X:
+                        if (has_target) {
+                            out->temps.heatbreak_current = value;
+                            out->temps.heatbreak_target = target;
+                            out->present |= LINE_FIELD_HEATBREAK_TEMP;
+                        }
+                        break;
+                    case TELEMETRY_KEY_C_AT:
+                        out->temps.chamber_current = value;
+                        out->present |= LINE_FIELD_CHAMBER_TEMP;
+                        break;
+                    case TELEMETRY_KEY_AT:
+                        out->power.nozzle_pwm = (int)value;
+                        out->present |= LINE_FIELD_NOZZLE_PWM;
+                        break;
+                    case TELEMETRY_KEY_B_AT:
+                        out->power.bed_pwm = (int)value;
+                        out->present |= LINE_FIELD_BED_PWM;
+                        break;
+                    case TELEMETRY_KEY_HBR_AT:
+                        out->power.heatbreak_pwm = (int)value;
+                        out->present |= LINE_FIELD_HEATBREAK_PWM;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        // Skip whatever is left of this token
+        while (p < end && *p != ' ') p++;
+    }
+
+    if (position_report) {
+        if (axes == 0x0F) {
+            out->present |= LINE_FIELD_POSITION;
+        } else {
+            out->incomplete = true;
+        }
+    } else if ((out->present & (LINE_FIELD_NOZZLE_TEMP | LINE_FIELD_BED_TEMP)) !=
+               (LINE_FIELD_NOZZLE_TEMP | LINE_FIELD_BED_TEMP)) {
+        // Not a complete temperature report - ignore partial matches
+        out->present &= ~(LINE_FIELDS_TEMPERATURE | LINE_FIELDS_POWER);
+        out->incomplete = true;
+    }
+}
+
+// Parse "1h 23m" / "19m" into minutes, returns false if no number was found
+static bool parse_duration_mins(const char *p, const char *end, int *mins_out)
+{
+    int total = 0;
+    bool found = false;
+
+    while (p < end) {
+        p = skip_spaces(p, end);
+        if (p >= end || *p < '0' || *p > '9') break;
+        int n = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            n = n * 10 + (*p++ - '0');
+        }
+        found = true;
+        if (p < end && *p == 'h') {
+            total += n * 60;
+            p++;
+        } else {
+            total += n;
+            if (p < end && *p == 'm') p++;
+        }
+    }
+
+    if (found) *mins_out = total;
+    return found;
+}
+
+// "M73 Progress: 9%; Time left: 1h 23m; Change: 16m;"
+static void parse_m73_report(const char *p, const char *end, parsed_line_t *out)
+{
+    while (p < end) {
+        const char *seg_end = memchr(p, ';', end - p);
+        if (!seg_end) seg_end = end;
+
+        const char *colon = memchr(p, ':', seg_end - p);
+        if (colon) {
+            const char *key = skip_spaces(p, colon);
+            size_t key_len = colon - key;
+            const char *value = skip_spaces(colon + 1, seg_end);
+
+            if (key_len == 8 && memcmp(key, "Progress", 8) == 0) {
+                int percent = 0;
+                const char *v = value;
+                while (v < seg_end && *v >= '0' && *v <= '9') {
+                    percent = percent * 10 + (*v++ - '0');
+                }
+                if (v > value && v < seg_end && *v == '%') {
+                    out->progress.percent = percent;
+                    out->present |= LINE_FIELD_PROGRESS;
+                }
+            } else if (key_len == 9 && memcmp(key, "Time left", 9) == 0) {
+                if (parse_duration_mins(value, seg_end, &out->progress.time_left_mins)) {
+                    out->present |= LINE_FIELD_TIME_LEFT;
+                }
+            } else if (key_len == 6 && memcmp(key, "Change", 6) == 0) {
+                if (parse_duration_mins(value, seg_end, &out->progress.change_mins)) {
+                    out->present |= LINE_FIELD_CHANGE_TIME;
+                }
+            }
+        }
+
+        p = (seg_end < end) ? seg_end + 1 : end;
+    }
+}
+
+void parse_serial_line(const char *line, size_t len, parsed_line_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    const char *end = line + len;
+    const char *p = skip_spaces(line, end);
+    bool echo_stripped = false;
+
+    while (p < end) {
+        switch (*p) {
+            case 'o':
+                // "ok" or "ok T:..." (M105 reply carries a temperature report)
+                if (line_starts_with(p, end, "ok") && (end - p == 2 || p[2] == ' ')) {
+                    out->present |= LINE_FIELD_OK;
+                    p = skip_spaces(p + 2, end);
+                    if (line_starts_with(p, end, "T:")) {
+                        parse_kv_report(p, end, false, out);
+                    }
+                }
+                return;
+
+            case 'T':
+                if (line_starts_with(p, end, "T:")) {
+                    parse_kv_report(p, end, false, out);
+                }
+                return;
+
+            case 'X':
+                if (line_starts_with(p, end, "X:")) {
+                    parse_kv_report(p, end, true, out);
+                }
+                return;
+
+            case 'M':
+                if (line_starts_with(p, end, "M73 ")) {
+                    parse_m73_report(p + 4, end, out);
+                }
+                return;
+
+            case 'R':
+                // "Resend: 123" - printer rejected a line and wants it again
+                if (line_starts_with(p, end, "Resend:")) {
+                    const char *q = skip_spaces(p + 7, end);
+                    uint32_t n = 0;
+                    bool digits = false;
+                    while (q < end && *q >= '0' && *q <= '9') {
+                        n = n * 10 + (uint32_t)(*q++ - '0');
+                        digits = true;
+                    }
+                    if (digits) {
+                        out->present |= LINE_FIELD_RESEND;
+                        out->resend_line = n;
+                    }
+                }
+                return;
+
+            case 'U':
+                if (line_starts_with(p, end, "Unknown command:")) {
+                    const char *q = skip_spaces(p + 16, end);
+                    if (q < end && *q == '"') q++;
+                    if (line_starts_with(q, end, "M154")) {
+                        out->present |= LINE_FIELD_NO_M154;
+                    }
+                }
+                return;
+
+            case 'D':
+                if (line_starts_with(p, end, "Done printing file")) {
+                    out->present |= LINE_FIELD_PRINT_DONE;
+                }
+                return;
+
+            case 'e':
+                // "echo:<payload>" - dispatch once more on the payload
+                if (!echo_stripped && line_starts_with(p, end, "echo:")) {
+                    echo_stripped = true;
+                    p = skip_spaces(p + 5, end);
+                    continue;
+                }
+                return;
+
+            default:
+                return;
+        }
+    }
+}
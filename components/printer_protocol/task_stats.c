@@ -0,0 +1,75 @@
+// Task stats debug frames, split into parts that each fit one frame
+
+#include <string.h>
+
+#include "printer_protocol.h"
+
+#define TASK_STATS_ENTRY_TAIL       (32)       // ",-1,4294967295,100.0,4294967295]" after the name
+
+static void task_stats_entry(json_writer_t *w, const task_stat_t *t, bool first, size_t keep)
+{
+    // Not json_lit(w, first ? ..): sizeof would be that of a pointer
+    if (first) {
+        json_lit(w, "[");
+    } else {
+        json_lit(w, ",[");
+    }
+    json_str(w, t->name, sizeof(t->name), keep);
+    json_lit(w, ",");
+    json_int(w, t->core);
+    json_lit(w, ",");
+    json_uint(w, t->priority);
+    json_lit(w, ",");
+    json_uint(w, t->cpu_x10 / 10);
+    json_lit(w, ".");
+    json_uint(w, t->cpu_x10 % 10);
+    json_lit(w, ",");
+    json_uint(w, t->stack_free);
+    json_lit(w, "]");
+}
+
+size_t task_stats_frame(char *buf, size_t size, int part, const uint16_t *core_load_x10, int cores,
+                        const task_stat_t *tasks, int count, int *next)
+{
+    json_writer_t w;
+    int first = *next;
+    int i;
+
+    // Short of the closing "]}", which always goes on after the last task that fits
+    json_init(&w, buf, size - 2);
+    json_lit(&w, "{\"type\":\"tasks\",\"part\":");
+    json_int(&w, part);
+    json_lit(&w, ",\"cores\":[");
+    for (int c = 0; c < cores; c++) {
+        if (c) json_lit(&w, ",");
+        json_uint(&w, core_load_x10[c] / 10);
+        json_lit(&w, ".");
+        json_uint(&w, core_load_x10[c] % 10);
+    }
+    json_lit(&w, "],\"tasks\":[");
+
+    for (i = first; i < count; i++) {
+        size_t mark = w.len;
+        task_stats_entry(&w, &tasks[i], i == first, 0);
+        if (!w.full) continue;
+
+        w.len = mark;
+        w.full = false;
+        if (i == first) {
+            // Not even a part of its own holds it: cut the name to what does,
+            // and if not even that fits, leave the task out. Either way the
+            // next part starts after it.
+            task_stats_entry(&w, &tasks[i], true, TASK_STATS_ENTRY_TAIL);
+            if (w.full) {
+                w.len = mark;
+                w.full = false;
+            }
+            i++;
+        }
+        break;                                 // Starts the next part
+    }
+    *next = i;
+
+    memcpy(&w.buf[w.len], "]}", 3);
+    return w.len + 2;
+}
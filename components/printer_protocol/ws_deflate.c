@@ -0,0 +1,300 @@
+// Streaming raw deflate for bulk WebSocket frames. Matching is greedy over a
+// hash chain capped at WS_DEFLATE_CHAIN_MAX candidates, and the fixed Huffman
+// code needs no table to be built or sent, so the cost per byte stays flat and
+// small next to the WiFi time it saves on repetitive JSON.
+
+#include <string.h>
+
+#include "printer_protocol.h"
+
+#define DEFLATE_MIN_MATCH       (3)
+#define DEFLATE_MAX_MATCH       (258)
+#define DEFLATE_END_OF_BLOCK    (256)
+
+// Rarest first: the most common strings sit at the end, nearest the data,
+// where their distances are shortest. Must match DEFLATE_DICT in
+// webpage_remote.html byte for byte; the page sends its FNV-1a with DEFLATE:.
+const char ws_deflate_dict[] =
+    "Error:Printer halted. kill() called!"
+    "echo:Unknown command: \""
+    "Unknown command: \""
+    "Done printing file"
+    "Resend: "
+    "//action:"
+    "echo:enqueueing \""
+    "echo:SD card ok"
+    "echo:Now fresh file: "
+    "File opened: "
+    "File selected"
+    "Bed Topography Report"
+    "{\"type\":\"mesh\",\"generation\":"
+    ",\"rows\":21,\"cols\":21,\"scale\":1000,\"z\":[["
+    "{\"type\":\"historyBuckets\",\"intervalMs\":2000,\"start\":"
+    ",\"end\":"
+    ",\"points\":"
+    ",\"fields\":[\"nozzle\",\"nozzleTarget\",\"bed\",\"bedTarget\",\"heatbreak\",\"chamber\",\"nozzlePwm\",\"bedPwm\",\"heatbreakPwm\"],\"buckets\":[["
+    "{\"type\":\"history\",\"intervalMs\":2000,\"tempScale\":10,\"count\":"
+    ",\"nozzle\":["
+    "],\"nozzleTarget\":["
+    "],\"bed\":["
+    "],\"bedTarget\":["
+    "],\"heatbreak\":["
+    "],\"chamber\":["
+    "],\"nozzlePwm\":["
+    "],\"bedPwm\":["
+    "],\"heatbreakPwm\":["
+    "{\"type\":\"result\",\"id\":"
+    ",\"cmd\":\""
+    "\",\"lines\":[\""
+    "\"],\"elapsed_ms\":"
+    "{\"type\":\"logs\",\"lines\":[\""
+    "E0:0 RPM PRN1:0 RPM E0@:0 PRN1@:0\",\""
+    "M73 Progress: "
+    "%; Time left: "
+    "h "
+    "m; Change: "
+    "m;\",\""
+    "X:0.00 Y:0.00 Z:0.00 E:0.00 Count A:0 B:0 Z:0\",\""
+    "echo:busy: processing\",\""
+    "ok\",\""
+    "ok T:0.00/0.00 B:0.00/0.00 X:0.00/0.00 A:0.00/0.00 C@:0.00 @:0 B@:0 HBR@:0\",\""
+    "T:0.00/0.00 B:0.00/0.00 X:0.00/0.00 A:0.00/0.00 C@:0.00 @:0 B@:0 HBR@:0\",\"";
+const size_t ws_deflate_dict_len = sizeof(ws_deflate_dict) - 1;
+
+_Static_assert(sizeof(ws_deflate_dict) - 1 <= WS_DEFLATE_WINDOW,
+               "The dictionary must fit the match window");
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+uint32_t ws_deflate_dict_id(void)
+{
+    uint32_t h = 0x811c9dc5;
+    for (size_t i = 0; i < ws_deflate_dict_len; i++) {
+        h = (h ^ (uint8_t)ws_deflate_dict[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static void put_byte(ws_deflate_t *z, uint8_t b)
+{
+    z->out[z->out_len++] = b;
+    if (z->out_len == sizeof(z->out)) {
+        if (!z->failed && !z->emit(z->ctx, z->out, z->out_len, false)) {
+            z->failed = true;
+        }
+        z->out_total += z->out_len;
+        z->out_len = 0;
+    }
+}
+
+// LSB first, as deflate packs everything but the Huffman codes
+static void put_bits(ws_deflate_t *z, uint32_t v, unsigned n)
+{
+    z->bits |= v << z->bit_count;
+    z->bit_count += n;
+    while (z->bit_count >= 8) {
+        put_byte(z, (uint8_t)z->bits);
+        z->bits >>= 8;
+        z->bit_count -= 8;
+    }
+}
+
+// Huffman codes go out MSB first
+static void put_code(ws_deflate_t *z, uint32_t code, unsigned n)
+{
+    uint32_t r = 0;
+    for (unsigned i = 0; i < n; i++) {
+        r = (r << 1) | ((code >> i) & 1);
+    }
+    put_bits(z, r, n);
+}
+
+// Fixed literal/length code (RFC 1951 3.2.6)
+static void put_symbol(ws_deflate_t *z, unsigned sym)
+{
+    if (sym < 144) {
+        put_code(z, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        put_code(z, 0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+        put_code(z, sym - 256, 7);
+    } else {
+        put_code(z, 0xC0 + sym - 280, 8);
+    }
+}
+
+static void put_match(ws_deflate_t *z, unsigned len, unsigned dist)
+{
+    unsigned l = 0;
+    while (l < 28 && len_base[l + 1] <= len) l++;
+    put_symbol(z, 257 + l);
+    put_bits(z, len - len_base[l], len_extra[l]);
+
+    unsigned d = 0;
+    while (d < 29 && dist_base[d + 1] <= dist) d++;
+    put_code(z, d, 5);
+    put_bits(z, dist - dist_base[d], dist_extra[d]);
+}
+
+static unsigned hash3(const uint8_t *p)
+{
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - WS_DEFLATE_HASH_BITS);
+}
+
+static void insert(ws_deflate_t *z, size_t p)
+{
+    unsigned h = hash3(&z->window[p]);
+    z->prev[p & (WS_DEFLATE_WINDOW - 1)] = z->head[h];
+    z->head[h] = (uint16_t)(p + 1);
+}
+
+// Longest earlier match for the bytes at pos, at most max long
+static unsigned longest_match(const ws_deflate_t *z, unsigned max, unsigned *dist)
+{
+    const uint8_t *cur = &z->window[z->pos];
+    // prev[] slots are reused a window later, so older chain links are stale
+    size_t oldest = z->pos >= WS_DEFLATE_WINDOW ? z->pos - WS_DEFLATE_WINDOW + 1 : 0;
+    unsigned best = 0;
+    uint16_t s = z->head[hash3(cur)];
+
+    for (int chain = 0; s != 0 && chain < WS_DEFLATE_CHAIN_MAX; chain++) {
+        size_t cand = s - 1u;
+        if (cand < oldest) break;
+
+        const uint8_t *p = &z->window[cand];
+        if (p[best] == cur[best]) {
+            unsigned n = 0;
+            while (n < max && p[n] == cur[n]) n++;
+            if (n > best) {
+                best = n;
+                *dist = (unsigned)(z->pos - cand);
+                if (n == max) break;
+            }
+        }
+        s = z->prev[cand & (WS_DEFLATE_WINDOW - 1)];
+        if (s > cand) break;                   // Links only lead back in time
+    }
+    return best;
+}
+
+// Code the window up to where a full-length match still has its lookahead,
+// or all of it at the end of the stream
+static void compress(ws_deflate_t *z, bool flush)
+{
+    size_t keep = flush ? 0 : DEFLATE_MAX_MATCH;
+
+    while (z->pos + keep < z->end) {
+        size_t avail = z->end - z->pos;
+        unsigned max = avail < DEFLATE_MAX_MATCH ? (unsigned)avail : DEFLATE_MAX_MATCH;
+        unsigned len = 0, dist = 0;
+
+        if (max >= DEFLATE_MIN_MATCH) {
+            len = longest_match(z, max, &dist);
+            insert(z, z->pos);
+        }
+        if (len >= DEFLATE_MIN_MATCH) {
+            put_match(z, len, dist);
+            for (unsigned k = 1; k < len; k++) {
+                if (z->pos + k + DEFLATE_MIN_MATCH <= z->end) insert(z, z->pos + k);
+            }
+            z->pos += len;
+        } else {
+            put_symbol(z, z->window[z->pos]);
+            z->pos++;
+        }
+    }
+}
+
+// Drop the oldest window half to make room for input
+static void slide(ws_deflate_t *z)
+{
+    memmove(z->window, &z->window[WS_DEFLATE_WINDOW], z->end - WS_DEFLATE_WINDOW);
+    z->pos -= WS_DEFLATE_WINDOW;
+    z->end -= WS_DEFLATE_WINDOW;
+    for (size_t i = 0; i < sizeof(z->head) / sizeof(z->head[0]); i++) {
+        z->head[i] = z->head[i] > WS_DEFLATE_WINDOW ? z->head[i] - WS_DEFLATE_WINDOW : 0;
+    }
+    for (size_t i = 0; i < WS_DEFLATE_WINDOW; i++) {
+        z->prev[i] = z->prev[i] > WS_DEFLATE_WINDOW ? z->prev[i] - WS_DEFLATE_WINDOW : 0;
+    }
+}
+
+void ws_deflate_begin(ws_deflate_t *z, const void *prefix, size_t prefix_len,
+                      ws_deflate_emit_t emit, void *ctx)
+{
+    memset(z->head, 0, sizeof(z->head));
+    z->bits = 0;
+    z->bit_count = 0;
+    z->out_len = 0;
+    z->emit = emit;
+    z->ctx = ctx;
+    z->failed = false;
+    z->in_total = 0;
+    z->out_total = 0;
+
+    const uint8_t *p = prefix;
+    for (size_t i = 0; i < prefix_len; i++) {
+        put_byte(z, p[i]);
+    }
+
+    // The dictionary is history the page inflated just before this stream
+    memcpy(z->window, ws_deflate_dict, ws_deflate_dict_len);
+    for (size_t i = 0; i + DEFLATE_MIN_MATCH <= ws_deflate_dict_len; i++) {
+        insert(z, i);
+    }
+    z->pos = ws_deflate_dict_len;
+    z->end = ws_deflate_dict_len;
+
+    put_bits(z, 1, 1);                         // BFINAL: the only block
+    put_bits(z, 1, 2);                         // BTYPE 01, fixed Huffman
+}
+
+void ws_deflate_write(ws_deflate_t *z, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    z->in_total += len;
+    while (len > 0 && !z->failed) {
+        if (z->end == sizeof(z->window)) {
+            compress(z, false);
+            slide(z);
+        }
+        size_t n = sizeof(z->window) - z->end;
+        if (n > len) n = len;
+        memcpy(&z->window[z->end], p, n);
+        z->end += n;
+        p += n;
+        len -= n;
+    }
+}
+
+bool ws_deflate_finish(ws_deflate_t *z)
+{
+    if (!z->failed) {
+        compress(z, true);
+        put_symbol(z, DEFLATE_END_OF_BLOCK);
+        if (z->bit_count > 0) put_bits(z, 0, 8 - z->bit_count);
+    }
+    if (!z->failed && !z->emit(z->ctx, z->out, z->out_len, true)) {
+        z->failed = true;
+    }
+    z->out_total += z->out_len;
+    z->out_len = 0;
+    return !z->failed;
+}
@@ -0,0 +1,115 @@
+// Broadcast ring: variable-length frames, one writer, a cursor per reader
+
+#include <string.h>
+
+#include "ws_ring.h"
+
+void ws_ring_init(ws_ring_t *r, void *buf, size_t size, const ws_ring_lock_t *lock)
+{
+    r->buf = buf;
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+    r->frames = 0;
+    if (lock) {
+        r->lock = *lock;
+    } else {
+        memset(&r->lock, 0, sizeof(r->lock));
+    }
+}
+
+void ws_ring_lock(ws_ring_t *r)
+{
+    if (r->lock.take) r->lock.take(r->lock.ctx);
+}
+
+void ws_ring_unlock(ws_ring_t *r)
+{
+    if (r->lock.give) r->lock.give(r->lock.ctx);
+}
+
+// Bytes from pos to the start of the record after it
+static size_t ws_ring_step(const ws_ring_t *r, size_t pos)
+{
+    size_t off = pos & (r->size - 1);
+    const ws_ring_hdr_t *hdr = (const ws_ring_hdr_t *)&r->buf[off];
+
+    return hdr->len == WS_RING_PAD ? r->size - off : WS_RING_RECORD_SIZE(hdr->len);
+}
+
+void ws_ring_write(ws_ring_t *r, int8_t target, const ws_message_t *msg, const ws_trace_t *trace)
+{
+    size_t len = strnlen(msg->json_payload, WS_MAX_PAYLOAD_SIZE - 1);
+    size_t rec = WS_RING_RECORD_SIZE(len);
+    size_t off = r->head & (r->size - 1);
+    size_t pad = (r->size - off < rec) ? r->size - off : 0;
+
+    // Overwrite the oldest frames rather than stall the producer; readers
+    // still on them notice the overrun on their next read
+    while (r->size - (r->head - r->tail) < pad + rec) {
+        r->tail += ws_ring_step(r, r->tail);
+    }
+
+    if (pad) {
+        ((ws_ring_hdr_t *)&r->buf[off])->len = WS_RING_PAD;
+        r->head += pad;
+        off = 0;
+    }
+
+    ws_ring_hdr_t *hdr = (ws_ring_hdr_t *)&r->buf[off];
+    hdr->len = (uint16_t)len;
+    hdr->type = (uint8_t)msg->type;
+    hdr->target = target;
+    hdr->trace = *trace;
+    memcpy(&r->buf[off + sizeof(ws_ring_hdr_t)], msg->json_payload, len);
+    r->head += rec;
+    r->frames++;
+}
+
+size_t ws_ring_catch_up(const ws_ring_t *r, size_t *cursor)
+{
+    if (r->head - *cursor <= r->head - r->tail) return 0;
+
+    size_t missed = r->tail - *cursor;
+    *cursor = r->tail;
+    return missed;
+}
+
+size_t ws_ring_read(const ws_ring_t *r, size_t *cursor, int id, uint32_t topics, ws_message_t *out)
+{
+    while (*cursor != r->head) {
+        size_t off = *cursor & (r->size - 1);
+        const ws_ring_hdr_t *hdr = (const ws_ring_hdr_t *)&r->buf[off];
+
+        *cursor += ws_ring_step(r, *cursor);
+        if (hdr->len == WS_RING_PAD) {
+            continue;
+        }
+        if (hdr->target != WS_RING_ALL_CLIENTS && hdr->target != id) {
+            continue;
+        }
+        if (hdr->target == WS_RING_ALL_CLIENTS && !(topics & WS_TOPIC_BIT(hdr->type))) {
+            continue;
+        }
+
+        out->type = (message_type_t)hdr->type;
+        out->trace = hdr->trace;
+        out->bin_len = 0;
+        memcpy(out->json_payload, &r->buf[off + sizeof(ws_ring_hdr_t)], hdr->len);
+        out->json_payload[hdr->len] = '\0';
+        return hdr->len;
+    }
+    return 0;
+}
+
+bool ws_ring_is_boundary(const ws_ring_t *r, size_t pos)
+{
+    if (r->head - pos > r->head - r->tail) return false;
+
+    size_t at = r->tail;
+    while (at != pos) {
+        if (at == r->head) return false;
+        at += ws_ring_step(r, at);
+    }
+    return true;
+}
@@ -87,6 +87,7 @@ static void in_xfer_cb(usb_transfer_t *transfer);
  * @param[in] transfer Transfer that triggered the callback
  */
 static void out_xfer_cb(usb_transfer_t *transfer);
+static void out_async_xfer_cb(usb_transfer_t *transfer);
 
 /**
  * @brief USB Host Client event callback
@@ -103,14 +104,17 @@ static void usb_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg
  *
  * In in_xfer_cb() we can modify IN transfer parameters, this function resets the transfer to its defaults
  *
- * @param[in] cdc_dev Pointer to CDC device
+ * @param[in] cdc_dev  Pointer to CDC device
+ * @param[in] transfer IN transfer of this device to reset
  */
-static void cdc_acm_reset_in_transfer(cdc_dev_t *cdc_dev)
+static void cdc_acm_reset_in_transfer(cdc_dev_t *cdc_dev, usb_transfer_t *transfer)
 {
-    assert(cdc_dev->data.in_xfer);
-    usb_transfer_t *transfer = cdc_dev->data.in_xfer;
-    uint8_t **ptr = (uint8_t **)(&(transfer->data_buffer));
-    *ptr = cdc_dev->data.in_data_buffer_base;
+    assert(transfer);
+    if (transfer == cdc_dev->data.in_xfer) {
+        // Only the first transfer is used in append mode, the others never move their buffer
+        uint8_t **ptr = (uint8_t **)(&(transfer->data_buffer));
+        *ptr = cdc_dev->data.in_data_buffer_base;
+    }
     transfer->num_bytes = transfer->data_buffer_size;
     // This is a hotfix for IDF changes, where 'transfer->data_buffer_size' does not contain actual buffer length,
     // but *allocated* buffer length, which can be larger if CONFIG_HEAP_POISONING_COMPREHENSIVE is enabled
@@ -198,6 +202,9 @@ static esp_err_t cdc_acm_start(cdc_dev_t *cdc_dev, cdc_acm_host_dev_callback_t e
     if (cdc_dev->data.in_xfer) {
         ESP_LOGD(TAG, "Submitting poll for BULK IN transfer");
         ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_xfer));
+        for (int i = 0; i < cdc_dev->data.in_xfer_count - 1; i++) {
+            ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_xfer_extra[i]));
+        }
     }
 
     // If notification are supported, claim its interface and start polling its IN endpoint
@@ -252,7 +259,7 @@ static void cdc_acm_device_remove(cdc_dev_t *cdc_dev)
 }
 
 /**
- * @brief Open USB device with requested VID/PID
+ * @brief Open USB device with requested VID/PID, and address if dev_addr is not 0
  *
  * This function has two regular return paths:
  * 1. USB device with matching VID/PID is already opened by this driver: allocate new CDC device on top of the already opened USB device.
@@ -261,11 +268,12 @@ static void cdc_acm_device_remove(cdc_dev_t *cdc_dev)
  * @note This function will block for timeout_ms, if the device is not enumerated at the moment of calling this function.
  * @param[in] vid Vendor ID
  * @param[in] pid Product ID
+ * @param[in] dev_addr USB address, 0 for any
  * @param[in] timeout_ms Connection timeout [ms]
  * @param[out] dev CDC-ACM device
  * @return esp_err_t
  */
-static esp_err_t cdc_acm_find_and_open_usb_device(uint16_t vid, uint16_t pid, int timeout_ms, cdc_dev_t **dev)
+static esp_err_t cdc_acm_find_and_open_usb_device(uint16_t vid, uint16_t pid, uint8_t dev_addr, int timeout_ms, cdc_dev_t **dev)
 {
     assert(p_cdc_acm_obj);
     assert(dev);
@@ -281,6 +289,13 @@ static esp_err_t cdc_acm_find_and_open_usb_device(uint16_t vid, uint16_t pid, in
     SLIST_FOREACH(cdc_dev, &p_cdc_acm_obj->cdc_devices_list, list_entry) {
         const usb_device_desc_t *device_desc;
         ESP_ERROR_CHECK(usb_host_get_device_descriptor(cdc_dev->dev_hdl, &device_desc));
+        if (dev_addr != 0) {
+            usb_device_info_t dev_info;
+            ESP_ERROR_CHECK(usb_host_device_info(cdc_dev->dev_hdl, &dev_info));
+            if (dev_info.dev_addr != dev_addr) {
+                continue;
+            }
+        }
         if ((vid == device_desc->idVendor || vid == CDC_HOST_ANY_VID) &&
                 (pid == device_desc->idProduct || pid == CDC_HOST_ANY_PID)) {
             // Return path 1:
@@ -302,6 +317,9 @@ static esp_err_t cdc_acm_find_and_open_usb_device(uint16_t vid, uint16_t pid, in
 
         // Go through device address list and find the one we are looking for
         for (int i = 0; i < num_of_devices; i++) {
+            if (dev_addr != 0 && dev_addr_list[i] != dev_addr) {
+                continue;
+            }
             usb_device_handle_t current_device;
             // Open USB device
             if (usb_host_device_open(p_cdc_acm_obj->cdc_acm_client_hdl, dev_addr_list[i], &current_device) == ESP_OK) {
@@ -462,9 +480,14 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
         usb_host_transfer_free(cdc_dev->notif.xfer);
     }
     if (cdc_dev->data.in_xfer != NULL) {
-        cdc_acm_reset_in_transfer(cdc_dev);
+        cdc_acm_reset_in_transfer(cdc_dev, cdc_dev->data.in_xfer);
         usb_host_transfer_free(cdc_dev->data.in_xfer);
     }
+    for (int i = 0; i < CDC_ACM_IN_TRANSFERS_MAX - 1; i++) {
+        if (cdc_dev->data.in_xfer_extra[i] != NULL) {
+            usb_host_transfer_free(cdc_dev->data.in_xfer_extra[i]);
+        }
+    }
     if (cdc_dev->data.out_xfer != NULL) {
         if (cdc_dev->data.out_xfer->context != NULL) {
             vSemaphoreDelete((SemaphoreHandle_t)cdc_dev->data.out_xfer->context);
@@ -474,6 +497,11 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
         }
         usb_host_transfer_free(cdc_dev->data.out_xfer);
     }
+    for (int i = 0; i < CDC_ACM_OUT_TRANSFERS_MAX; i++) {
+        if (cdc_dev->data.out_async[i].xfer != NULL) {
+            usb_host_transfer_free(cdc_dev->data.out_async[i].xfer);
+        }
+    }
     if (cdc_dev->ctrl_transfer != NULL) {
         if (cdc_dev->ctrl_transfer->context != NULL) {
             vSemaphoreDelete((SemaphoreHandle_t)cdc_dev->ctrl_transfer->context);
@@ -492,14 +520,16 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
  * @param[in] notif_ep_desc Pointer to notification EP descriptor
  * @param[in] in_ep_desc-   Pointer to data IN EP descriptor
  * @param[in] in_buf_len    Length of data IN buffer
+ * @param[in] in_xfer_count Number of data IN transfers, each of in_buf_len
  * @param[in] out_ep_desc   Pointer to data OUT EP descriptor
  * @param[in] out_buf_len   Length of data OUT buffer
+ * @param[in] out_async_count Number of asynchronous data OUT transfers, each of out_buf_len
  * @return
  *     - ESP_OK:            Success
  *     - ESP_ERR_NO_MEM:    Not enough memory for transfers and semaphores allocation
  *     - ESP_ERR_NOT_FOUND: IN or OUT endpoints were not found in the selected interface
  */
-static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_desc_t *notif_ep_desc, const usb_ep_desc_t *in_ep_desc, size_t in_buf_len, const usb_ep_desc_t *out_ep_desc, size_t out_buf_len)
+static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_desc_t *notif_ep_desc, const usb_ep_desc_t *in_ep_desc, size_t in_buf_len, uint8_t in_xfer_count, const usb_ep_desc_t *out_ep_desc, size_t out_buf_len, uint8_t out_async_count)
 {
     assert(in_ep_desc);
     assert(out_ep_desc);
@@ -544,6 +574,20 @@ static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_des
         cdc_dev->data.in_xfer->context = cdc_dev;
         cdc_dev->data.in_mps = USB_EP_DESC_GET_MPS(in_ep_desc);
         cdc_dev->data.in_data_buffer_base = cdc_dev->data.in_xfer->data_buffer;
+        cdc_dev->data.in_xfer_count = 1;
+
+        // 3a. Further IN transfers, so one is always queued while the user callback runs
+        for (int i = 0; i < in_xfer_count - 1; i++) {
+            usb_transfer_t *xfer;
+            ESP_GOTO_ON_ERROR(usb_host_transfer_alloc(in_buf_len, 0, &xfer), err, TAG,);
+            xfer->callback = in_xfer_cb;
+            xfer->num_bytes = in_buf_len;
+            xfer->bEndpointAddress = in_ep_desc->bEndpointAddress;
+            xfer->device_handle = cdc_dev->dev_hdl;
+            xfer->context = cdc_dev;
+            cdc_dev->data.in_xfer_extra[i] = xfer;
+            cdc_dev->data.in_xfer_count++;
+        }
     }
 
     // 4. Setup OUT bulk transfer (if it is required (out_buf_len > 0))
@@ -560,6 +604,18 @@ static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_des
         ESP_GOTO_ON_FALSE(cdc_dev->data.out_mux, ESP_ERR_NO_MEM, err, TAG,);
         cdc_dev->data.out_xfer->bEndpointAddress = out_ep_desc->bEndpointAddress;
         cdc_dev->data.out_xfer->callback = out_xfer_cb;
+
+        // 4a. Pool for cdc_acm_host_data_tx_async()
+        for (int i = 0; i < out_async_count; i++) {
+            cdc_tx_async_t *slot = &cdc_dev->data.out_async[i];
+            ESP_GOTO_ON_ERROR(usb_host_transfer_alloc(out_buf_len, 0, &slot->xfer), err, TAG,);
+            slot->cdc_dev = cdc_dev;
+            slot->xfer->device_handle = cdc_dev->dev_hdl;
+            slot->xfer->bEndpointAddress = out_ep_desc->bEndpointAddress;
+            slot->xfer->callback = out_async_xfer_cb;
+            slot->xfer->context = slot;
+            cdc_dev->data.out_async_count++;
+        }
     }
     return ESP_OK;
 
@@ -578,7 +634,7 @@ esp_err_t cdc_acm_host_open(uint16_t vid, uint16_t pid, uint8_t interface_idx, c
     xSemaphoreTake(p_cdc_acm_obj->open_close_mutex, portMAX_DELAY);
     // Find underlying USB device
     cdc_dev_t *cdc_dev;
-    ret =  cdc_acm_find_and_open_usb_device(vid, pid, dev_config->connection_timeout_ms, &cdc_dev);
+    ret =  cdc_acm_find_and_open_usb_device(vid, pid, dev_config->dev_addr, dev_config->connection_timeout_ms, &cdc_dev);
     if (ESP_OK != ret) {
         goto exit;
     }
@@ -616,10 +672,13 @@ esp_err_t cdc_acm_host_open(uint16_t vid, uint16_t pid, uint8_t interface_idx, c
     // The following line is here for backward compatibility with v1.0.*
     // where fixed size of IN buffer (equal to IN Maximum Packet Size) was used
     const size_t in_buf_size = (dev_config->data_cb && (dev_config->in_buffer_size == 0)) ? USB_EP_DESC_GET_MPS(cdc_info.in_ep) : dev_config->in_buffer_size;
+    ESP_GOTO_ON_FALSE(dev_config->in_transfers <= CDC_ACM_IN_TRANSFERS_MAX, ESP_ERR_INVALID_ARG, err, TAG, "Too many IN transfers");
+    ESP_GOTO_ON_FALSE(dev_config->out_transfers <= CDC_ACM_OUT_TRANSFERS_MAX, ESP_ERR_INVALID_ARG, err, TAG, "Too many OUT transfers");
+    const uint8_t in_xfer_count = dev_config->in_transfers ? dev_config->in_transfers : 1;
 
     // Allocate USB transfers, claim CDC interfaces and return CDC-ACM handle
     ESP_GOTO_ON_ERROR(
-        cdc_acm_transfers_allocate(cdc_dev, cdc_info.notif_ep, cdc_info.in_ep, in_buf_size, cdc_info.out_ep, dev_config->out_buffer_size),
+        cdc_acm_transfers_allocate(cdc_dev, cdc_info.notif_ep, cdc_info.in_ep, in_buf_size, in_xfer_count, cdc_info.out_ep, dev_config->out_buffer_size, dev_config->out_transfers),
         err, TAG,);
     ESP_GOTO_ON_ERROR(cdc_acm_start(cdc_dev, dev_config->event_cb, dev_config->data_cb, dev_config->user_arg), err, TAG,);
     *cdc_hdl_ret = (cdc_acm_dev_hdl_t)cdc_dev;
@@ -671,6 +730,13 @@ esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl)
     if (cdc_dev->notif.xfer != NULL) {
         ESP_ERROR_CHECK(cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->notif.xfer));
     }
+    // Asynchronous OUT transfers may still be queued; their callbacks report cancellation
+    CDC_ACM_ENTER_CRITICAL();
+    const bool out_async_busy = cdc_dev->data.out_async_busy != 0;
+    CDC_ACM_EXIT_CRITICAL();
+    if (out_async_busy) {
+        ESP_ERROR_CHECK(cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->data.out_async[0].xfer));
+    }
 
     // Release all interfaces
     ESP_ERROR_CHECK(usb_host_interface_release(p_cdc_acm_obj->cdc_acm_client_hdl, cdc_dev->dev_hdl, cdc_dev->data.intf_desc->bInterfaceNumber));
@@ -700,6 +766,15 @@ void cdc_acm_host_desc_print(cdc_acm_dev_hdl_t cdc_hdl)
     usb_print_config_descriptor(config_desc, cdc_print_desc);
 }
 
+esp_err_t cdc_acm_host_device_info_get(cdc_acm_dev_hdl_t cdc_hdl, usb_device_info_t *info)
+{
+    CDC_ACM_CHECK(cdc_hdl, ESP_ERR_INVALID_ARG);
+    CDC_ACM_CHECK(info, ESP_ERR_INVALID_ARG);
+    cdc_dev_t *cdc_dev = (cdc_dev_t *)cdc_hdl;
+
+    return usb_host_device_info(cdc_dev->dev_hdl, info);
+}
+
 /**
  * @brief Check finished transfer status
  *
@@ -750,13 +825,19 @@ static void in_xfer_cb(usb_transfer_t *transfer)
     }
 
     if (cdc_dev->data.in_cb) {
+        // With several IN transfers the others are still queued on the endpoint
+        // while the callback runs, and complete in submission order
         const bool data_processed = cdc_dev->data.in_cb(transfer->data_buffer, transfer->actual_num_bytes, cdc_dev->cb_arg);
 
         // Information for developers:
         // In order to save RAM and CPU time, the application can indicate that the received data was not processed and that the application expects more data.
         // In this case, the next received data must be appended to the existing buffer.
         // Since the data_buffer in usb_transfer_t is a constant pointer, we must cast away to const qualifier.
-        if (!data_processed) {
+        if (!data_processed && cdc_dev->data.in_xfer_count > 1) {
+            // The next data is already being received into another buffer, so it cannot be appended
+            ESP_LOGW(TAG, "RX buffer append is not supported with multiple IN transfers");
+            cdc_acm_reset_in_transfer(cdc_dev, transfer);
+        } else if (!data_processed) {
 #if !SOC_CACHE_INTERNAL_MEM_VIA_L1CACHE
             // In case the received data was not processed, the next RX data must be appended to current buffer
             uint8_t **ptr = (uint8_t **)(&(transfer->data_buffer));
@@ -779,7 +860,7 @@ static void in_xfer_cb(usb_transfer_t *transfer)
                     cdc_dev->notif.cb(&serial_state_event, cdc_dev->cb_arg);
                 }
 
-                cdc_acm_reset_in_transfer(cdc_dev);
+                cdc_acm_reset_in_transfer(cdc_dev, transfer);
                 cdc_dev->serial_state.bOverRun = false;
             }
 #else
@@ -788,12 +869,12 @@ static void in_xfer_cb(usb_transfer_t *transfer)
             ESP_LOGW(TAG, "RX buffer append is not yet supported on ESP32-P4!");
 #endif
         } else {
-            cdc_acm_reset_in_transfer(cdc_dev);
+            cdc_acm_reset_in_transfer(cdc_dev, transfer);
         }
     }
 
     ESP_LOGD(TAG, "Submitting poll for BULK IN transfer");
-    usb_host_transfer_submit(cdc_dev->data.in_xfer);
+    usb_host_transfer_submit(transfer);
 }
 
 static void notif_xfer_cb(usb_transfer_t *transfer)
@@ -845,6 +926,33 @@ static void out_xfer_cb(usb_transfer_t *transfer)
     xSemaphoreGive((SemaphoreHandle_t)transfer->context);
 }
 
+static void out_async_xfer_cb(usb_transfer_t *transfer)
+{
+    ESP_LOGD(TAG, "out async xfer cb");
+    cdc_tx_async_t *slot = (cdc_tx_async_t *)transfer->context;
+    cdc_dev_t *cdc_dev = slot->cdc_dev;
+    const cdc_acm_tx_done_callback_t done_cb = slot->done_cb;
+    void *user_arg = slot->user_arg;
+
+    esp_err_t status;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && transfer->actual_num_bytes == transfer->num_bytes) {
+        status = ESP_OK;
+    } else if (transfer->status == USB_TRANSFER_STATUS_CANCELED || transfer->status == USB_TRANSFER_STATUS_NO_DEVICE) {
+        status = ESP_ERR_INVALID_STATE;
+    } else {
+        status = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // Free the slot first, so the callback can submit the next transfer
+    CDC_ACM_ENTER_CRITICAL();
+    cdc_dev->data.out_async_busy &= ~(1u << (slot - cdc_dev->data.out_async));
+    CDC_ACM_EXIT_CRITICAL();
+
+    if (done_cb) {
+        done_cb(status, user_arg);
+    }
+}
+
 /**
  * @brief Resume CDC device
  *
@@ -861,6 +969,9 @@ static void cdc_acm_resume(cdc_dev_t *cdc_dev)
     if (cdc_dev->data.in_xfer) {
         ESP_LOGD(TAG, "Submitting poll for BULK IN transfer");
         ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_xfer));
+        for (int i = 0; i < cdc_dev->data.in_xfer_count - 1; i++) {
+            ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_xfer_extra[i]));
+        }
     }
 
     if (cdc_dev->notif.xfer) {
@@ -1026,6 +1137,43 @@ unblock:
     return ret;
 }
 
+esp_err_t cdc_acm_host_data_tx_async(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, cdc_acm_tx_done_callback_t done_cb, void *user_arg)
+{
+    CDC_ACM_CHECK(cdc_hdl, ESP_ERR_INVALID_ARG);
+    cdc_dev_t *cdc_dev = (cdc_dev_t *)cdc_hdl;
+    CDC_ACM_CHECK(data && (data_len > 0), ESP_ERR_INVALID_ARG);
+    CDC_ACM_CHECK(cdc_dev->data.out_async_count > 0, ESP_ERR_NOT_SUPPORTED);
+    CDC_ACM_CHECK(data_len <= cdc_dev->data.out_async[0].xfer->data_buffer_size, ESP_ERR_INVALID_SIZE);
+
+    // Claim a free transfer of the pool
+    cdc_tx_async_t *slot = NULL;
+    CDC_ACM_ENTER_CRITICAL();
+    for (int i = 0; i < cdc_dev->data.out_async_count; i++) {
+        if (!(cdc_dev->data.out_async_busy & (1u << i))) {
+            cdc_dev->data.out_async_busy |= 1u << i;
+            slot = &cdc_dev->data.out_async[i];
+            break;
+        }
+    }
+    CDC_ACM_EXIT_CRITICAL();
+    if (slot == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memcpy(slot->xfer->data_buffer, data, data_len);
+    slot->xfer->num_bytes = data_len;
+    slot->done_cb = done_cb;
+    slot->user_arg = user_arg;
+    ESP_LOGV(TAG, "Submitting async BULK OUT transfer: %zu bytes", data_len);
+    const esp_err_t ret = usb_host_transfer_submit(slot->xfer);
+    if (ret != ESP_OK) {
+        CDC_ACM_ENTER_CRITICAL();
+        cdc_dev->data.out_async_busy &= ~(1u << (slot - cdc_dev->data.out_async));
+        CDC_ACM_EXIT_CRITICAL();
+    }
+    return ret;
+}
+
 esp_err_t cdc_acm_host_send_custom_request(cdc_acm_dev_hdl_t cdc_hdl, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data)
 {
     CDC_ACM_CHECK(cdc_hdl, ESP_ERR_INVALID_ARG);
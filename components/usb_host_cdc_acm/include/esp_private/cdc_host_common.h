@@ -32,6 +32,15 @@
 })
 
 typedef struct cdc_dev_s cdc_dev_t;
+
+// One transfer of the asynchronous OUT pool, used as the transfer's context
+typedef struct {
+    usb_transfer_t *xfer;
+    cdc_dev_t *cdc_dev;
+    cdc_acm_tx_done_callback_t done_cb;   // User's completion callback, can be NULL
+    void *user_arg;
+} cdc_tx_async_t;
+
 struct cdc_dev_s {
     cdc_acm_intf_t intf_func;             // CDC interface function table
     usb_device_handle_t dev_hdl;          // USB device handle
@@ -39,11 +48,16 @@ struct cdc_dev_s {
     struct {
         usb_transfer_t *out_xfer;         // OUT data transfer
         usb_transfer_t *in_xfer;          // IN data transfer
+        usb_transfer_t *in_xfer_extra[CDC_ACM_IN_TRANSFERS_MAX - 1]; // Further IN transfers, rotated with in_xfer
+        uint8_t in_xfer_count;            // Number of IN transfers, in_xfer included
         cdc_acm_data_callback_t in_cb;    // User's callback for async (non-blocking) data IN
         uint16_t in_mps;                  // IN endpoint Maximum Packet Size
         uint8_t *in_data_buffer_base;     // Pointer to IN data buffer in usb_transfer_t
         const usb_intf_desc_t *intf_desc; // Pointer to data interface descriptor
         SemaphoreHandle_t out_mux;        // OUT mutex
+        cdc_tx_async_t out_async[CDC_ACM_OUT_TRANSFERS_MAX]; // Pool for cdc_acm_host_data_tx_async()
+        uint8_t out_async_count;          // Transfers in the pool
+        uint8_t out_async_busy;           // Bit per pool transfer in flight, under CDC_ACM_ENTER_CRITICAL
     } data;
 
     struct {
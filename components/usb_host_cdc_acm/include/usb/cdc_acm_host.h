@@ -139,6 +139,27 @@ esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl);
  */
 esp_err_t cdc_acm_host_data_tx_blocking(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, uint32_t timeout_ms);
 
+/**
+ * @brief Transmit data - non-blocking mode
+ *
+ * Data is copied into a free transfer of the device's asynchronous OUT pool (see cdc_acm_host_device_config_t::out_transfers),
+ * which is submitted before this function returns. Transfers reach the device in the order they were submitted,
+ * also relative to cdc_acm_host_data_tx_blocking().
+ *
+ * @param cdc_hdl CDC handle obtained from cdc_acm_host_open()
+ * @param[in] data     Data to be sent
+ * @param[in] data_len Data length, at most out_buffer_size
+ * @param[in] done_cb  Called when the transfer finished, can be NULL
+ * @param[in] user_arg Argument passed to done_cb
+ * @return
+ *   - ESP_OK: Transfer submitted
+ *   - ESP_ERR_INVALID_ARG: Invalid device or data pointer
+ *   - ESP_ERR_NOT_SUPPORTED: Device was opened without out_transfers
+ *   - ESP_ERR_INVALID_SIZE: data_len is larger than out_buffer_size
+ *   - ESP_ERR_NO_MEM: All transfers of the pool are in flight
+ */
+esp_err_t cdc_acm_host_data_tx_async(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, cdc_acm_tx_done_callback_t done_cb, void *user_arg);
+
 /**
  * @brief Print device's descriptors
  *
@@ -148,6 +169,19 @@ esp_err_t cdc_acm_host_data_tx_blocking(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t
  */
 void cdc_acm_host_desc_print(cdc_acm_dev_hdl_t cdc_hdl);
 
+/**
+ * @brief Get information about the USB device underlying a CDC device
+ *
+ * String descriptors in the result stay valid until the device is closed.
+ *
+ * @param cdc_hdl   CDC handle obtained from cdc_acm_host_open()
+ * @param[out] info Device information: address, speed and string descriptors
+ * @return
+ *   - ESP_OK: Success
+ *   - ESP_ERR_INVALID_ARG: Invalid device or info is NULL
+ */
+esp_err_t cdc_acm_host_device_info_get(cdc_acm_dev_hdl_t cdc_hdl, usb_device_info_t *info);
+
 /**
  * @brief Get protocols defined in USB-CDC interface descriptors
  *
@@ -64,6 +64,27 @@ typedef bool (*cdc_acm_data_callback_t)(const uint8_t *data, size_t data_len, vo
  */
 typedef void (*cdc_acm_host_dev_callback_t)(const cdc_acm_host_dev_event_data_t *event, void *user_ctx);
 
+/**
+ * @brief Maximum number of BULK IN transfers that can be kept in flight, see cdc_acm_host_device_config_t::in_transfers
+ */
+#define CDC_ACM_IN_TRANSFERS_MAX 4
+
+/**
+ * @brief Maximum number of asynchronous BULK OUT transfers, see cdc_acm_host_device_config_t::out_transfers
+ */
+#define CDC_ACM_OUT_TRANSFERS_MAX 4
+
+/**
+ * @brief Asynchronous transmit finished callback type
+ *
+ * Called from the USB Host client context, must not block.
+ *
+ * @param[in] status   ESP_OK if all data was sent, ESP_ERR_INVALID_STATE if the transfer was cancelled
+ *                     (device closed or disconnected), ESP_ERR_INVALID_RESPONSE on a transfer error
+ * @param[in] user_arg Argument passed to cdc_acm_host_data_tx_async()
+ */
+typedef void (*cdc_acm_tx_done_callback_t)(esp_err_t status, void *user_arg);
+
 /**
  * @brief Configuration structure of CDC-ACM device
  */
@@ -74,4 +95,11 @@ typedef struct {
     cdc_acm_host_dev_callback_t event_cb; /**< Device's event callback function. Can be NULL */
     cdc_acm_data_callback_t data_cb;      /**< Device's data RX callback function. Can be NULL for write-only devices */
     void *user_arg;                       /**< User's argument that will be passed to the callbacks */
+    uint8_t in_transfers;                 /**< Number of BULK IN transfers of in_buffer_size kept in flight, up to CDC_ACM_IN_TRANSFERS_MAX.
+                                               0 or 1: single transfer. With 2 or more, another transfer is always queued while data_cb runs.
+                                               Data is still delivered in order, but data_cb must consume it: returning false is not supported */
+    uint8_t out_transfers;                /**< Number of BULK OUT transfers of out_buffer_size for cdc_acm_host_data_tx_async(), up to CDC_ACM_OUT_TRANSFERS_MAX.
+                                               0: asynchronous transmit not supported */
+    uint8_t dev_addr;                     /**< USB address of the device to open, e.g. from usb_host_device_info() in the new device callback.
+                                               0: the first device matching VID/PID */
 } cdc_acm_host_device_config_t;
@@ -27,12 +27,26 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 // ESP32 System includes
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#if CONFIG_SPIRAM
+#include "esp_psram.h"
+#endif
 
 // FreeRTOS includes
 #include "freertos/FreeRTOS.h"
@@ -50,12 +64,20 @@
 #include "esp_event.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
+#include "esp_netif_sntp.h"
+#include "lwip/sockets.h"
 #include "esp_http_server.h"
 #include "esp_http_client.h"
 #include "esp_crt_bundle.h"
 #include "esp_spiffs.h"
+#include "esp_partition.h"
 #include "mdns.h"
 
+// Serial protocol: tokenizer, telemetry frames, G-code framing
+#include "printer_protocol.h"
+#include "ws_ring.h"
+#include "gcode_window.h"
+
 // GPIO for status LED
 #include "driver/gpio.h"
 
@@ -87,50 +109,318 @@
 // USB communication settings
 #define USB_HOST_TASK_PRIORITY      (20)
 #define USB_TX_TIMEOUT_MS           (1000)
+#define USB_IN_TRANSFERS            (3)      // BULK IN transfers kept queued, so the endpoint is never unpolled
+#define USB_IN_TRANSFER_SIZE        (4096)   // Each; 12 KB absorbs a burst while handle_rx runs
+#define USB_OUT_TRANSFERS           (3)      // BULK OUT transfers for the G-code window, queued back to back
+#define USB_OUT_TRANSFER_SIZE       (512)    // Each; a multiple of the 64-byte MPS, several coalesced lines
+#define PRINTER_OPEN_RETRY_MS       (500)    // After an open that failed for another reason
+#define PRINTER_ATTACH_POLL_MS      (30000)  // Safety net should an attach event be missed
+#define PRINTER_SERIAL_MAX_LEN      (32)     // USB iSerialNumber, ASCII
+#define PRINTER_ATTACH_QUEUE_SIZE   (4)      // Enumerations not yet looked at by printer_connect_task
 #define INITIAL_BEEP_COMMAND        ("M300 S2000 P50\n")
+#define AUTOREPORT_FAST_S           (1)    // M155/M154 period while watched or printing
+#define AUTOREPORT_IDLE_S           (10)   // ...with no clients and nothing running
 
 // WiFi credentials
 #define WIFI_SSID                   "BT-"
 #define WIFI_PASS                   ""
 
+// Optional static address, "" for DHCP. A DHCP lease is reused across boots
+// by lwIP itself (CONFIG_LWIP_DHCP_RESTORE_LAST_IP), which skips the discover.
+#define WIFI_STATIC_IP              ""
+#define WIFI_STATIC_NETMASK         "255.255.255.0"
+#define WIFI_STATIC_GATEWAY         ""
+#define WIFI_STATIC_DNS             ""         // "" = the gateway
+
+// Optional MQTT publisher: state topics retained under MQTT_TOPIC_PREFIX,
+// log batches on <prefix>/log, G-code accepted on <prefix>/gcode
+#define ENABLE_MQTT                 (0)
+#define MQTT_BROKER_URI             "mqtt://192.168.1.10"
+#define MQTT_USERNAME               ""
+#define MQTT_PASSWORD               ""
+#define MQTT_TOPIC_PREFIX           "prusa/coreone"
+#define MQTT_TOPIC_MAX_LEN          (64)
+#define MQTT_COMMAND_MAX_LEN        (1024) // Longest G-code message, all of it in one fragment
+#define MQTT_GCODE_BATCH            (8)    // Commands per command-topic message
+#define MQTT_BUFFER_SIZE            (MQTT_COMMAND_MAX_LEN + 256)
+#define MQTT_TASK_STACK             (4096) // Publishes run the TCP/TLS write in this task
+
+// Optional multicast feed of the prusa-bin state records: one datagram per
+// published update, whatever the number of listeners
+#define ENABLE_UDP_TELEMETRY        (0)
+#define UDP_TELEMETRY_GROUP         "239.255.80.1"
+#define UDP_TELEMETRY_PORT          (5580)
+#define UDP_TELEMETRY_TTL           (1)    // Stay on the local segment
+
 // Remote HTML configuration
 #define ENABLE_REMOTE_HTML          (1)
 #define REMOTE_HTML_URL             "https://raw.githubusercontent.com/gb160/prusa-esp/main/main/webpage_remote.html"
-#define REMOTE_HTML_FLASH_PATH      "/spiffs/remote.html"
-#define REMOTE_HTML_TEMP_PATH       "/spiffs/remote.tmp"
+// Two page slots: downloads write the one not being served, then swap
+#define REMOTE_HTML_SLOT_A_PATH     "/spiffs/remote_a.html"
+#define REMOTE_HTML_SLOT_B_PATH     "/spiffs/remote_b.html"
+#define REMOTE_HTML_CURRENT_PATH    "/spiffs/current"       // Which slot is live, "a" or "b"
+#define REMOTE_HTML_LEGACY_PATH     "/spiffs/remote.html"   // Single-file cache of older firmware
+#define REMOTE_HTML_DRAIN_TIMEOUT_MS (30000) // Wait for readers of the old slot before overwriting it
+#define REMOTE_HTML_NVS_NAMESPACE   "webui"    // ETag/Last-Modified of the live page
+#define HTML_VALIDATOR_MAX_LEN      (96)
+#define WEB_ASSET_MAX_AGE_S         (31536000) // Asset names carry the version, so cache for a year
+#define WEB_ASSET_MAX_BYTES         (96 * 1024) // Per stored asset, gzip-encoded
+#define WEB_ASSET_SPIFFS_RESERVE    (CAPTURE_MAX_BYTES + 2 * MACRO_MAX_BYTES) // Never spent on assets
+#define HTML_CHUNK_SIZE             (4096)     // Flash-to-socket copy size when serving from SPIFFS
+#define HTML_REFRESH_TASK_STACK     (8192)     // TLS handshake runs on this stack
+#define HTML_REFRESH_REPORT_MS      (500)      // Progress frames during a /refresh download
 
 // Status LED GPIO (adjust for your ESP32-S3 SuperMini)
 #define STATUS_LED_GPIO             (GPIO_NUM_48)  // Built-in LED on most ESP32-S3
 #define LED_BLINK_DISCONNECTED_MS   (1000)
 #define LED_BLINK_CONNECTED_MS      (100)
 
-// WebSocket message queue configuration
+// Synthetic telemetry for the WebSocket soak test (tools/ws_soak.py).
+// SYNTH:<frames/s>[:<pad bytes>] starts it, SYNTH:0 stops it.
+#define WS_SYNTH_MAX_RATE           (2000)   // Frames per second
+#define WS_SYNTH_TASK_STACK         (3072)
+
+// Housekeeping - periodic jobs run off one esp_timer instead of their own
+// tasks: the LED blink, the mDNS TXT check, and every MONITOR_INTERVAL_MS
+// task stats, the monitor report and keepalive pings, which the WS sender
+// task runs
+#define MONITOR_INTERVAL_MS         (2000)
+#define TASK_STATS_MAX              (32)   // Tasks tracked by the CPU/stack sampler
+
+// mDNS TXT state summary on _http._tcp and _prusa-ws._tcp, checked every
+// MDNS_TXT_CHECK_MS and re-announced on change, at most once per
+// MDNS_TXT_MIN_INTERVAL_MS so a heating bed does not flood the LAN
+#define MDNS_HOSTNAME               "coreone"
+#define MDNS_TXT_CHECK_MS           (2000)
+#define MDNS_TXT_MIN_INTERVAL_MS    (10000)
+
+// WebSocket broadcast configuration
 #define WS_MAX_CLIENTS              (4)
-#define WS_MESSAGE_QUEUE_SIZE       (50)
-#define WS_MAX_PAYLOAD_SIZE         (512)
+// Shared ring of encoded frames that every client reads with its own cursor.
+// Must be a power of two. Memory no longer scales with the client count.
+#define WS_BROADCAST_RING_SIZE      (16 * 1024)
+#define WS_CLIENT_LAG_WARN_BYTES    (WS_BROADCAST_RING_SIZE * 3 / 4)
+#define WS_SENDER_BURST_PER_CLIENT  (8)    // Frames sent to one client before moving to the next
+#define WS_RX_STACK_BUF_SIZE        (128)  // Incoming frames up to this size avoid the heap
+#define WS_RX_MAX_FRAME_SIZE        (4096) // Largest incoming frame, e.g. a GCODE: macro batch
+#define WS_TRACE_FRAME_SIZE         (WS_MAX_PAYLOAD_SIZE + 80)  // A frame with its _trace object added
+
+// Opt-in binary telemetry, negotiated with Sec-WebSocket-Protocol on /ws.
+// JSON text stays the default; logs are always sent as text.
+#define WS_BINARY_SUBPROTOCOL       "prusa-bin"
+
+// Optional compression of the bulk frames - history, log backlog, mesh and
+// command results - for clients that send DEFLATE:<dictionary id> before
+// CONNECT. A frame is only compressed once it outgrows WS_DEFLATE_MIN_SIZE;
+// live telemetry is never touched. This is not RFC 7692 permessage-deflate:
+// esp_http_server neither negotiates extensions nor sets RSV1, so the result
+// goes out as a WS_BIN_DEFLATE record the page inflates itself.
+#define ENABLE_WS_DEFLATE           (1)
+#define WS_DEFLATE_MIN_SIZE         (WS_HISTORY_CHUNK_SIZE)  // At most one fragment
+
+// HTTP/WebSocket socket budget. httpd gets what lwIP has left after its own
+// three internal sockets and the other socket users, cut down at boot to what
+// the free internal heap affords. Each new connection leaves SOCKET_SPARE
+// free, purging idle keep-alive HTTP sockets oldest-first, so a WebSocket
+// upgrade or page load never meets a full table. WebSocket and SSE sessions
+// and sockets with an upload in flight are never purged.
+#define SOCKET_HTTPD_INTERNAL       (3)    // httpd's listening and control sockets
+#define SOCKET_OTHER_USERS          (1 + ENABLE_MQTT + ENABLE_UDP_TELEMETRY)  // Page download, MQTT, UDP
+#define SOCKET_LIMIT_MAX            (CONFIG_LWIP_MAX_SOCKETS - SOCKET_HTTPD_INTERNAL - SOCKET_OTHER_USERS)
+#define SOCKET_LIMIT_MIN            (3)    // One WebSocket, one page request, one spare
+#define SOCKET_HTTP_MIN             (2)    // Sockets WebSocket clients cannot take
+#define SOCKET_SPARE                (1)
+#define SOCKET_IDLE_MS              (1000) // Quieter than this counts as an idle keep-alive
+#define SOCKET_HEAP_COST            (12 * 1024)  // TCP send buffer + window + httpd session, full tilt
+#define SOCKET_HEAP_RESERVE         (64 * 1024)  // Internal heap no socket budget may touch
+
+_Static_assert(SOCKET_LIMIT_MAX >= SOCKET_LIMIT_MIN, "CONFIG_LWIP_MAX_SOCKETS too small for httpd");
+
+// Log batching - serial lines are collected into one {"type":"logs"} frame
+// until the frame is full or the oldest line has waited LOG_BATCH_MAX_MS
+#define LOG_BATCH_MAX_MS            (50)
+#define LOG_BATCH_MAX_BYTES         (WS_MAX_PAYLOAD_SIZE)  // Must not exceed WS_MAX_PAYLOAD_SIZE
+
+// Recent raw serial lines; the newest SERIAL_LOG_BACKLOG_SIZE bytes are
+// replayed to each new client as one logs frame. Must be a power of two;
+// oldest lines are dropped first. PSRAM builds keep more for G-code results.
+#define SERIAL_LOG_BACKLOG_SIZE     (8 * 1024)
+#define SERIAL_LOG_BACKLOG_LINE_MAX (255)  // Longer lines are truncated in the backlog
 
 // Serial parsing buffer
 #define SERIAL_LINE_BUFFER_SIZE     (512)
 
-// HTML download buffer size
-// Must be larger than the HTML file. TLS consumes ~50KB internal RAM while open,
-// so this is pre-allocated BEFORE the TLS connection to guarantee it fits.
-#define HTML_PREALLOC_SIZE          (96 * 1024)  // 96KB - headroom above current ~73KB file
+// Serial RX ring between the USB callback and the parser task.
+// Must be a power of two. Sized to absorb a couple of full 8KB IN transfers
+// while the parser is busy broadcasting.
+#define SERIAL_RX_RING_SIZE         (16 * 1024)
+#define SERIAL_PARSER_TASK_PRIORITY (8)    // Below the CDC driver task, above networking
+#define SERIAL_PARSER_TASK_STACK    (6144)
+
+// Serial capture and replay - raw IN transfers are recorded to SPIFFS with
+// their arrival times and can be fed back through the parser with no printer
+// attached, as a regression input and a benchmark of the whole pipeline
+#define CAPTURE_PATH                "/spiffs/capture.bin"
+#define CAPTURE_RING_SIZE           (4096)   // handle_rx -> capture writer, power of two
+#define CAPTURE_MAX_BYTES           (96 * 1024)  // SPIFFS also holds both remote page slots
+#define CAPTURE_FLUSH_MS            (250)    // Writer drains at least this often
+#define CAPTURE_TASK_STACK          (3072)
+#define REPLAY_CHUNK_SIZE           (512)    // Bytes moved into the RX ring per write
+#define REPLAY_SPEED_MAX            (100)    // REPLAY:<n>, n times real time; REPLAY:MAX is unpaced
+#define REPLAY_YIELD_MS             (100)    // Unpaced replay sleeps a tick this often, for the idle task
+#define REPLAY_TASK_PRIORITY        (3)      // Below the parser on the same core, so it always drains
+#define REPLAY_TASK_STACK           (3072)
+
+// Telemetry change suppression. A topic is only broadcast once a value moves
+// by at least its deadband; those are set per field in the topic schema
+// (TELEMETRY_TOPICS in printer_protocol.h).
+// Optional minimum spacing between broadcasts per topic, 0 = no limit.
+// A change held back by the interval is sent once the interval expires.
+#define TOPIC_MIN_INTERVAL_TEMPERATURE_MS   (0)
+#define TOPIC_MIN_INTERVAL_POWER_MS         (0)
+#define TOPIC_MIN_INTERVAL_POSITION_MS      (0)
+#define TOPIC_MIN_INTERVAL_PROGRESS_MS      (0)
+#define TOPIC_FLUSH_CHECK_MS                (250)  // How often held-back changes are re-checked
+#define PRINT_STATS_INTERVAL_MS             (5000) // "stats" frames between layer changes during a job
+
+// Telemetry history - the last TELEMETRY_HISTORY_SAMPLES go to each new client
+// in one bulk frame so graphs start populated. 1800 samples x 18 bytes = ~32KB
+// of internal RAM; PSRAM builds hold more, reachable through /api/history.
+#define TELEMETRY_HISTORY_INTERVAL_MS       (2000) // Autoreport runs at 1-10 s depending on demand
+#define TELEMETRY_HISTORY_SAMPLES           (1800) // 60 minutes, and the most sent on connect
+#define API_HISTORY_BATCH                   (16)   // Samples copied per printer_state_mutex hold
+#define HISTORY_QUERY_MAX_POINTS            (600)  // Buckets per downsampled query
+#define WS_HISTORY_CHUNK_SIZE               (1024) // Fragment size when streaming history
+
+// Bed mesh cache - M420 V output is parsed once and pushed to clients, instead
+// of every page load querying the printer
+#define MESH_GRID_SIZE                      (21)    // Core One UBL grid is 21 x 21
+#define MESH_REFRESH_HOLDOFF_MS             (30000) // Ignore automatic re-queries this soon after one
+
+// Web UI partition ("webui" in partitions.csv): split into the two page slots,
+// each a header followed by the page, served straight from memory-mapped flash.
+// Without the partition the slots fall back to SPIFFS files.
+#define WEBUI_PARTITION_LABEL       "webui"
+#define WEBUI_HEADER_SIZE           (64)          // Page data starts this far into a slot
+#define WEBUI_MAGIC                 (0x49555750)  // "PWUI"
+#define WEBUI_FLAG_GZIP             (1u << 0)
+
+// Flash recorder ("recorder" in partitions.csv): downsampled telemetry and job
+// events, batched in RAM and appended one flash page per write to a ring of
+// sectors that rotates in place. Without the partition nothing is recorded.
+#define RECORDER_PARTITION_LABEL    "recorder"
+#define RECORDER_MAGIC              (0x31435250)  // "PRC1"
+#define RECORDER_PAGE_SIZE          (256)         // One flash program page, one write
+#define RECORDER_MAX_SECTORS        (256)         // Index entries, 1 MB of 4 KB sectors
+#define RECORDER_SAMPLE_INTERVAL_S  (60)
+#define RECORDER_TASK_STACK         (3072)
+#define RECORDER_NTP_SERVER         "pool.ntp.org"
+#define RECORDER_CLOCK_VALID        (1704067200)  // 2024-01-01: earlier means SNTP has not synced
 
 // G-code command queue configuration
-// Commands are queued and sent one at a time, waiting for 'ok' before sending next
+// Commands are sent as "N<line> <cmd>*<checksum>" with up to GCODE_WINDOW_SIZE
+// waiting for 'ok'. Each 'ok' returns one credit; "Resend: N" rewinds to line N.
 #define GCODE_QUEUE_SIZE            (32)   // Max queued commands
-#define GCODE_CMD_MAX_LEN           (128)  // Max length of a single command
-#define GCODE_OK_TIMEOUT_MS         (300000) // 5 minutes - covers long operations like G29
+// GCODE_CMD_MAX_LEN, the window sizes and the 'ok' timeouts are in gcode_window.h
+#define GCODE_LATENCY_OPCODES       (24)   // Distinct opcodes profiled, the rest count as "other"
+#define GCODE_LATENCY_BUCKETS       (32)   // log2(us) histogram buckets for p99
+#define TRACE_BUCKETS               (24)   // log2(us) buckets for pipeline latency, up to ~16 s
+#define SERIAL_RX_STAMPS            (32)   // Recent USB transfers remembered for line timestamps
+#define GCODE_EVENT_QUEUE_SIZE      (32)   // ok / Resend: events from the parser task
+#define GCODE_SENDER_POLL_MS        (1000) // Timeout and reconnect check when idle
+#define GCODE_RESULT_QUEUE_SIZE     (8)    // GCODE#id: results waiting for the WS sender
+
+// POST /print streaming upload - the body is split into lines as it arrives
+// and fed to the G-code window; a full gcode_queue stops the reads, so TCP
+// flow control holds the uploader back instead of buffering the file
+#define GCODE_STREAM_CHUNK_SIZE     (1024) // Receive buffer, also the longest line accepted before stripping
+#define GCODE_STREAM_REPORT_MS      (1000) // Progress in the status message at most this often
+#define GCODE_STREAM_RECV_RETRIES   (6)    // Consecutive recv timeouts (5s each) before giving up
+
+// Stored G-code macros - SPIFFS files that MACRO:<name> feeds through the same
+// path as an upload, at the printer's pace, whatever the browser does meanwhile.
+// Managed with GET/POST/DELETE /api/macros.
+#define MACRO_PATH_PREFIX           "/spiffs/macro_"
+#define MACRO_PATH_SUFFIX           ".gcode"
+#define MACRO_NAME_MAX              (16)   // [A-Za-z0-9_-]; the path fits CONFIG_SPIFFS_OBJ_NAME_LEN
+#define MACRO_MAX_BYTES             (16 * 1024)
+#define MACRO_MAX_COUNT             (16)
+#define MACRO_TASK_STACK            (3072)
+
+// Store-and-forward printing ("spool" in partitions.csv): POST /api/spool puts
+// a whole job in flash first, CRC-checked, and SPOOL:START feeds it from there
+// through the same path as an upload, so WiFi no longer paces the print.
+#define SPOOL_PARTITION_LABEL       "spool"
+#define SPOOL_MAGIC                 (0x4c505350)  // "PSPL"
+#define SPOOL_NAME_MAX              (47)          // File name, for display only
+#define SPOOL_ERASE_CHUNK           (64 * 1024)   // Erased this far ahead of the upload
+#define SPOOL_UPLOAD_CHUNK          (1024)
+#define SPOOL_TASK_STACK            (4096)
+#define SPOOL_PAUSE_POLL_MS         (100)
 
 // WiFi event group bits
 #define WIFI_CONNECTED_BIT          BIT0   // Set when IP is obtained
-#define WIFI_CONNECT_TIMEOUT_MS     30000  // Max wait for IP on boot
+#define WIFI_CONNECT_TIMEOUT_MS     30000  // Boot page download warns after this long without IP
+#define WIFI_NVS_NAMESPACE          "wifi"     // BSSID and channel of the last AP that gave us an IP
+#define WIFI_FAST_CONNECT_TRIES     (2)    // Attempts on the cached AP before a full scan
+#define WIFI_SCAN_RETRY_MS          (1000) // Backoff between full-scan attempts
+
+// Latency profile: modem sleep is off while a client is connected or a job
+// runs, and back to WIFI_PS_IDLE_MODE once neither has been true for
+// WIFI_PS_IDLE_HOLD_MS, so page reloads do not flap it
+#define WIFI_PS_IDLE_MODE           WIFI_PS_MIN_MODEM
+#define WIFI_PS_IDLE_HOLD_MS        (30000)
+
+// Parser micro-benchmark - runs canned Core One lines through the legacy
+// sscanf path and the tokenizer at boot and logs cycles per line, then
+// times the snprintf temperature frame against the JSON writer
+#define ENABLE_PARSER_BENCHMARK     (0)
+#define PARSER_BENCHMARK_ITERATIONS (2000)
+
+// GET /bench - the same lines through the dispatch path, the frame builders,
+// json_escape() and the broadcast, reported as JSON. Development builds only:
+// a run holds the HTTP server for its duration.
+#define ENABLE_BENCH_ENDPOINT       (0)
+#define BENCH_ITERATIONS            (1000)     // Per stage, unless ?iterations= says otherwise
+#define BENCH_MAX_ITERATIONS        (5000)     // Keeps a stage's cycle count inside 32 bits
+#define BENCH_STAGE_STACK           (6144)
+
+// Pipeline placement - core and priority of the USB, parse, fan-out, HTTP and
+// G-code stages, from the profile saved in NVS and applied at boot. Latency
+// and CPU measured under each profile are saved beside it for comparison.
+#define PLACEMENT_NVS_NAMESPACE     "placement"
+#define PLACEMENT_SAVE_INTERVAL_MS  (600000)   // Live report to NVS; also saved before a switch
+#define PLACEMENT_MIN_FRAMES        (100)      // Traced frames before a report is worth keeping
+
+// Stacks of the tasks that run for the whole uptime. They are allocated
+// statically, like the queues and semaphores, and counted in the memory budget.
+#define USB_LIB_TASK_STACK          (4096)
+#define LOG_DRAIN_TASK_STACK        (3072)
+#define WS_SENDER_TASK_STACK        (4096)
+#define GCODE_SENDER_TASK_STACK     (4096)
+#define PRINTER_CONNECT_TASK_STACK  (4096)
+
+// Fixed RAM the bridge's own buffers may take, checked at compile time
+#define STATIC_RAM_BUDGET_BYTES     (168 * 1024)
+
+// Bulk storage on PSRAM builds (CONFIG_SPIRAM), scaled by the size detected
+// at boot. Without PSRAM the internal baselines above are used.
+#define PSRAM_LOG_BACKLOG_PER_MB        (32 * 1024)   // Rounded down to a power of two
+#define PSRAM_LOG_BACKLOG_MAX           (256 * 1024)
+#define PSRAM_HISTORY_SAMPLES_PER_MB    (3600)        // 2 hours per MB
+#define PSRAM_HISTORY_SAMPLES_MAX       (43200)       // 24 hours
+#define PSRAM_UPLOAD_CHUNK_SIZE         (16 * 1024)   // POST /print receive window
+#define PSRAM_HTML_CACHE_MAX            (256 * 1024)  // SPIFFS page copied to PSRAM up to this size
 
 // Debug UART configuration
 #define DEBUG_UART_NUM              UART_NUM_1
 #define DEBUG_UART_TX_PIN           8
 #define DEBUG_UART_BAUD             115200
+#define LOG_RING_SLOTS              (32)   // Deferred log lines, power of two
+#define LOG_LINE_MAX                (256)  // Longer lines are truncated
+#define LOG_DRAIN_IDLE_MS           (10)   // Drain task poll interval when the ring is empty
+#define LOG_TAG_FILTERS             (8)    // Runtime [TAG] level overrides
+#define LOG_TAG_MAX_LEN             (12)
 
 static const char *TAG = "PRUSA-WS-V3";
 
@@ -138,60 +428,103 @@ static const char *TAG = "PRUSA-WS-V3";
 // MESSAGE TYPES AND STRUCTURES
 // ============================================================================
 
-typedef enum {
-    MSG_TYPE_TEMPERATURE,
-    MSG_TYPE_PROGRESS,
-    MSG_TYPE_POSITION,
-    MSG_TYPE_LOG,
-    MSG_TYPE_STATUS,
-    MSG_TYPE_POWER,
-    MSG_TYPE_ERROR
-} message_type_t;
 
-typedef struct {
-    message_type_t type;
-    char json_payload[WS_MAX_PAYLOAD_SIZE];
-} ws_message_t;
+// Message type names, for MQTT topics and /metrics labels
+static const char *const msg_type_names[MSG_TYPE_COUNT] = {
+    "temperature", "progress", "position", "log", "status", "power", "error", "mesh", "stats", "debug"
+};
+
+// Client topic subscriptions are a bitmask of message types
+#define WS_TOPICS_ALL               (WS_TOPIC_BIT(MSG_TYPE_COUNT) - 1)
+#define WS_TOPICS_DEFAULT           (WS_TOPICS_ALL & ~WS_TOPIC_BIT(MSG_TYPE_DEBUG))
+// GET /events carries the ring and state slots only: mesh grids, history
+// and the log backlog are sent as WebSocket frames of their own
+#define SSE_TOPICS                  (WS_TOPICS_DEFAULT & ~WS_TOPIC_BIT(MSG_TYPE_MESH))
+#define SSE_KEEPALIVE               ": keepalive\n\n"
+#define SSE_RETRY_MS                (3000)
+
+
 
 typedef struct {
     int fd;                                    // WebSocket file descriptor
     bool active;                               // Is this slot active?
     bool ping_pending;                         // Ping sent, waiting for pong
-    QueueHandle_t message_queue;               // Per-client message queue
+    bool lag_warned;                           // Lag warning already logged
+    bool binary;                               // Negotiated prusa-bin telemetry
+    bool deflate;                              // Bulk frames may be compressed
+    uint32_t topics;                           // WS_TOPIC_BIT mask set by SUB:
+    bool history_pending;                      // Telemetry history not yet sent
+    bool log_backlog_pending;                  // Serial log backlog not yet sent
+    size_t log_backlog_end;                    // Backlog position reached by live frames at connect
+    uint32_t mesh_generation;                  // Mesh generation last sent, 0 = none
+    uint16_t history_points;                   // HISTORY: query not yet sent, 0 = none
+    uint32_t history_from;                     // Its sample range [from, to)
+    uint32_t history_to;
+    size_t cursor;                             // Ring position of next frame to send
+    uint32_t overruns;                         // Times the ring lapped this client
+    uint8_t state_pending;                     // Bit per state slot not yet sent
+    bool trace;                                // TRACE:1 - JSON frames carry "_trace"
+    uint32_t ping_sent_us;                     // trace_now() of the pending ping
+    bool sse;                                  // GET /events stream, not a WebSocket
+    bool paused;                               // PAUSE: nothing sent until RESUME
 } ws_client_t;
 
-// Temperature state
+// State topics are conflated: one latest-value slot each, shared by all
+// clients, so a slow client only ever gets the newest frame. Logs, errors
+// and other events still go through the broadcast ring in order.
+typedef enum {
+    WS_SLOT_STATUS,
+    WS_SLOT_TEMPERATURE,
+    WS_SLOT_POWER,
+    WS_SLOT_POSITION,
+    WS_SLOT_PROGRESS,
+    WS_SLOT_STATS,
+    WS_SLOT_COUNT
+} ws_state_slot_id_t;
+
 typedef struct {
-    float nozzle_current;
-    float nozzle_target;
-    float bed_current;
-    float bed_target;
-    float heatbreak_current;
-    float heatbreak_target;
-    float chamber_current;
-} temp_state_t;
-
-// Progress state
+    ws_message_t msg;
+    uint16_t len;
+    uint32_t updates;                          // Times overwritten since boot
+    size_t ring_pos;                           // ws_ring.head when last stored
+} ws_state_slot_t;
+
+
+// One telemetry history sample: temperatures in 0.1 degC, PWM as reported
+typedef enum {
+    HIST_NOZZLE,
+    HIST_NOZZLE_TARGET,
+    HIST_BED,
+    HIST_BED_TARGET,
+    HIST_HEATBREAK,
+    HIST_CHAMBER,
+    HIST_NOZZLE_PWM,
+    HIST_BED_PWM,
+    HIST_HEATBREAK_PWM,
+    HIST_FIELD_COUNT
+} history_field_t;
+
 typedef struct {
-    int percent;
-    int time_left_mins;
-    int change_mins;
-} progress_state_t;
+    int16_t v[HIST_FIELD_COUNT];
+} history_sample_t;
 
-// Position state
 typedef struct {
-    float x;
-    float y;
-    float z;
-    float e;
-} position_state_t;
+    history_sample_t *samples;                 // Set by mem_tier_init()
+    uint32_t capacity;                         // TELEMETRY_HISTORY_SAMPLES, more in PSRAM
+    uint32_t recorded;                         // Samples written since boot
+    int64_t last_sample_us;
+} telemetry_history_t;
 
-// Power state
+// Bed mesh parsed from a "Bed Topography Report" (M420 V / after G29)
 typedef struct {
-    int nozzle_pwm;
-    int bed_pwm;
-    int heatbreak_pwm;
-} power_state_t;
+    int16_t z_um[MESH_GRID_SIZE][MESH_GRID_SIZE];  // Indexed [row][col] as printed, microns
+    uint32_t generation;                       // Bumped on every complete report, 0 = none yet
+    uint32_t rows_seen;                        // Bit per row of the report being collected
+    bool collecting;
+    int16_t pending[MESH_GRID_SIZE][MESH_GRID_SIZE];
+    int64_t last_query_us;
+} mesh_cache_t;
+
 
 // ============================================================================
 // GLOBAL STATE
@@ -199,7 +532,14 @@ typedef struct {
 
 // Synchronization primitives
 static SemaphoreHandle_t device_disconnected_sem;
-static SemaphoreHandle_t html_mutex;
+// One enumeration of a device with the printer's VID/PID
+typedef struct {
+    uint8_t dev_addr;                          // USB address to open
+    int64_t us;                                // When it enumerated
+} printer_attach_t;
+
+static QueueHandle_t printer_attach_queue;     // printer_attach_t, from handle_new_dev
+static SemaphoreHandle_t html_mutex;     // Serialises downloads; page readers never take it
 static SemaphoreHandle_t ws_clients_mutex;
 static SemaphoreHandle_t printer_state_mutex;
 static EventGroupHandle_t wifi_event_group;
@@ -208,1177 +548,9247 @@ static EventGroupHandle_t wifi_event_group;
 static cdc_acm_dev_hdl_t g_prusa_dev = NULL;
 static bool initial_chirp_sent = false;
 
-// WebSocket clients
+// WebSocket clients and their shared broadcast ring (protected by ws_clients_mutex)
 static ws_client_t ws_clients[WS_MAX_CLIENTS];
+static uint8_t ws_ring_buf[WS_BROADCAST_RING_SIZE] __attribute__((aligned(4)));
+static ws_ring_t ws_ring;                        // Its injected lock is ws_clients_mutex
+
+// The MQTT publisher reads the ring and state slots like one more client,
+// with an id no unicast targets. Active while the broker connection is up.
+#define MQTT_READER_ID              (WS_MAX_CLIENTS)
+#define MQTT_READER_TOPICS          (WS_TOPIC_BIT(MSG_TYPE_STATUS) | WS_TOPIC_BIT(MSG_TYPE_TEMPERATURE) | \
+                                     WS_TOPIC_BIT(MSG_TYPE_PROGRESS) | WS_TOPIC_BIT(MSG_TYPE_POSITION) | \
+                                     WS_TOPIC_BIT(MSG_TYPE_POWER) | WS_TOPIC_BIT(MSG_TYPE_LOG) | \
+                                     WS_TOPIC_BIT(MSG_TYPE_ERROR) | WS_TOPIC_BIT(MSG_TYPE_STATS))
+static ws_client_t mqtt_reader;
+static TaskHandle_t mqtt_task_handle = NULL;
+
+// Multicast telemetry. pending holds state slots updated since the last
+// datagram, under ws_clients_mutex; ws_sender_task sends them. sock >= 0
+// once the publisher is running.
+#define UDP_TELEMETRY_MAGIC         (0x5042)    // "PB", little-endian on the wire
+#define UDP_TELEMETRY_VERSION       (1)
+#define UDP_TELEMETRY_HDR_SIZE      (8)         // u16 magic, u8 version, u8 rsvd, u32 seq
+
+static struct {
+    int sock;
+    uint32_t pending;
+    uint32_t seq;
+    struct sockaddr_in group;
+} udp_telemetry = { .sock = -1 };
+static ws_state_slot_t ws_state_slots[WS_SLOT_COUNT];
+static TaskHandle_t ws_sender_task_handle = NULL;
+
+// Send statistics, written by ws_sender_task only. 32-bit so the monitor can
+// read them from the other core without tearing; rates are taken from deltas.
+typedef struct {
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t send_us;                          // Time spent inside the send call
+    uint32_t errors;
+} ws_sender_stats_t;
+
+static ws_sender_stats_t ws_sender_stats;
+
+// Pipeline counters for GET /metrics. Producers only do relaxed atomic adds,
+// so counting never takes a lock on the USB, parser or sender paths. 32-bit,
+// so byte counters wrap after 4 GiB like any counter reset.
+typedef struct {
+    atomic_uint usb_rx_bytes;
+    atomic_uint usb_rx_transfers;
+    atomic_uint usb_tx_bytes;                  // G-code window transfers, completed
+    atomic_uint usb_tx_transfers;
+    atomic_uint usb_tx_lines;                  // Numbered lines carried by them
+    atomic_uint usb_tx_failed;                 // Completed with an error; Resend:/timeout recovers
+    atomic_uint serial_lines;
+    atomic_uint parse_errors;                  // Telemetry reports missing required fields
+    atomic_uint line_overflows;                // Lines force-parsed at SERIAL_LINE_BUFFER_SIZE
+    atomic_uint ws_frames_sent[MSG_TYPE_COUNT];
+    atomic_uint ws_frames_dropped[MSG_TYPE_COUNT];  // Conflated before a client got them
+    atomic_uint log_lines;                     // Written to the debug UART
+    atomic_uint log_dropped;                   // Deferred log ring was full
+    atomic_uint printer_attaches;              // Opens triggered by an attach event
+    atomic_uint printer_attach_us;             // Enumeration to open, last attach
+    atomic_uint ws_ping_rtt_us;                // Keepalive ping to pong, last answered
+    atomic_uint wifi_ps_switches;              // Latency profile changes
+    atomic_uint mqtt_published[MSG_TYPE_COUNT];
+    atomic_uint mqtt_publish_errors;           // Not handed to the broker connection
+    atomic_uint mqtt_commands;                 // Command-topic messages accepted
+    atomic_uint mqtt_connects;
+    atomic_uint ws_deflate_in_bytes;           // Bulk frames compressed, before
+    atomic_uint ws_deflate_out_bytes;          // and after
+    atomic_uint udp_datagrams;                 // Multicast telemetry, handed to lwIP
+    atomic_uint udp_send_errors;
+    atomic_uint udp_conflated;                 // Replaced by a newer value before sending
+    atomic_uint recorder_pages;                // Flash pages written
+    atomic_uint recorder_erases;               // Sectors erased ahead of the write position
+    atomic_uint recorder_write_errors;
+    atomic_uint recorder_dropped;              // Records lost to a page still being written
+} metrics_t;
+
+static metrics_t metrics;
+
+#define METRIC_ADD(counter, n)      atomic_fetch_add_explicit(&metrics.counter, (n), memory_order_relaxed)
+#define METRIC_INC(counter)         METRIC_ADD(counter, 1)
+
+// End-to-end latency of serial-derived frames, one log2 histogram per stage
+typedef enum {
+    TRACE_RX_TO_PARSE,                         // USB transfer to message built
+    TRACE_PARSE_TO_ENQUEUE,                    // Built to stored in ring/slot
+    TRACE_ENQUEUE_TO_SEND,                     // Stored to httpd_ws_send_frame_async returned
+    TRACE_RX_TO_SEND,                          // USB transfer to frame sent
+    TRACE_PING_RTT,                            // Keepalive ping sent to pong received
+    TRACE_STAGE_COUNT
+} trace_stage_t;
+
+typedef struct {
+    atomic_uint count;
+    atomic_uint hist[TRACE_BUCKETS];           // hist[k]: frames in [2^k, 2^(k+1)) us
+} trace_hist_t;
+
+static trace_hist_t trace_hists[TRACE_STAGE_COUNT];
+static const char *const trace_stage_names[TRACE_STAGE_COUNT] = {
+    "rx_to_parse", "parse_to_enqueue", "enqueue_to_send", "rx_to_send", "ping_rtt"
+};
+
+// Pipeline stages a placement profile puts on a core, at a priority
+typedef enum {
+    PIPE_USB,                                  // usb_lib; the CDC-ACM driver task follows its core
+    PIPE_PARSE,                                // serial_parser
+    PIPE_FANOUT,                               // ws_sender
+    PIPE_HTTP,                                 // httpd
+    PIPE_GCODE,                                // gcode_sender
+    PIPE_STAGE_COUNT
+} pipe_stage_t;
+
+typedef struct {
+    uint8_t core;
+    uint8_t priority;
+} pipe_slot_t;
+
+// Applied at this boot by placement_load(), before any stage starts. The
+// on-demand tasks follow their stage: replay and the synthetic source the
+// parser's core, gcode_stream the G-code sender's.
+static pipe_slot_t pipe_placement[PIPE_STAGE_COUNT];
 static httpd_handle_t server = NULL;
 
-// Printer state (protected by printer_state_mutex)
+// One httpd session, tracked from open to close. last_ms and held are also
+// written by upload tasks, hence the atomics; fd changes in the httpd task only.
+typedef struct {
+    atomic_int fd;                             // -1 = unused
+    atomic_uint last_ms;                       // Last byte received
+    atomic_bool held;                          // An async request owns it
+} socket_entry_t;
+
+static struct {
+    socket_entry_t sessions[SOCKET_LIMIT_MAX];
+    int limit;                                 // max_open_sockets, set by socket_budget_init()
+    int ws_limit;                              // WebSocket/SSE client slots usable
+    atomic_int open;
+    atomic_int open_peak;
+    atomic_uint purged;                        // Idle HTTP sockets closed to make room
+    atomic_uint ws_closed;                     // Evicted clients' sockets closed
+} socket_budget = { .ws_limit = WS_MAX_CLIENTS };
+
+// Printer state. Written with printer_state_mutex held by the parser task
+// (current_*) and by attach/detach (printer_connected, printer_serial); only
+// the parser task reads current_* directly. Other tasks copy the snapshot
+// below, so none of them waits on a lock the USB path takes.
 static temp_state_t current_temps = {0};
 static progress_state_t current_progress = {0};
 static position_state_t current_position = {0};
 static power_state_t current_power = {0};
 static bool printer_connected = false;
+static uint32_t printer_state_generation = 0;  // Bumped on every change above
+// USB serial number of the open printer, "" if it has none. Only changed by
+// printer_connect_task before printer_connected is set.
+static char printer_serial[PRINTER_SERIAL_MAX_LEN + 1] = "";
+
+typedef struct {
+    temp_state_t temps;
+    progress_state_t progress;
+    position_state_t position;
+    power_state_t power;
+    bool connected;
+    uint32_t generation;
+    char serial[PRINTER_SERIAL_MAX_LEN + 1];
+} printer_snapshot_t;
+
+// Seqlock: the writer makes seq odd, copies, makes it even again; a reader
+// retries until it saw the same even seq before and after its copy.
+typedef struct {
+    atomic_uint seq;
+    printer_snapshot_t data;
+    atomic_uint read_retries;
+} printer_state_seqlock_t;
+
+static printer_state_seqlock_t printer_state_published;
+
+// Serial log backlog: [u8 len][bytes] records in a byte ring that may wrap.
+// Written by the parser task, read by ws_sender_task (protected by log_backlog_mutex).
+typedef struct {
+    uint8_t *buf;                // Set by mem_tier_init()
+    size_t size;                 // Power of two: SERIAL_LOG_BACKLOG_SIZE, more in PSRAM
+    size_t head;                 // Free-running write position
+    size_t tail;                 // Free-running position of the oldest record
+    size_t replay;               // Oldest record in the newest SERIAL_LOG_BACKLOG_SIZE bytes
+    size_t live_end;             // Lines before this position have been broadcast live
+} serial_log_backlog_t;
+
+static serial_log_backlog_t serial_log_backlog;
+static SemaphoreHandle_t log_backlog_mutex;
+
+// Bed mesh cache (protected by printer_state_mutex)
+static mesh_cache_t mesh_cache;
+
+// Telemetry history ring (protected by printer_state_mutex)
+static telemetry_history_t telemetry_history;
 
-// Serial line buffer for parsing
+// Carry buffer for a line that straddles the RX ring wrap point (or overflows).
+// Complete lines are parsed in place from the ring and never copied here.
 static char serial_line_buffer[SERIAL_LINE_BUFFER_SIZE];
 static size_t serial_line_pos = 0;
+static uint32_t serial_line_rx_us = 0;         // Trace: USB arrival of the line being parsed
 
-// G-code command queue
+// Single-producer (handle_rx) / single-consumer (serial_parser_task) byte ring.
+// Indices are free-running; the producer only writes head, the consumer only tail.
 typedef struct {
-    char cmd[GCODE_CMD_MAX_LEN];
-} gcode_cmd_t;
+    uint8_t buf[SERIAL_RX_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_size_t high_water;
+    atomic_uint dropped_bytes;
+    // When each recent transfer arrived and the head position it ended at.
+    // Entry k is valid while k >= stamps - SERIAL_RX_STAMPS.
+    uint32_t stamp_end[SERIAL_RX_STAMPS];
+    uint32_t stamp_us[SERIAL_RX_STAMPS];
+    atomic_uint stamps;
+} serial_rx_ring_t;
+
+static serial_rx_ring_t serial_rx_ring;
+static TaskHandle_t serial_parser_task_handle = NULL;
+
+typedef enum {
+    SERIAL_CAPTURE_IDLE,
+    SERIAL_CAPTURE_RECORDING,                  // handle_rx copies into serial_capture_ring
+    SERIAL_CAPTURE_REPLAYING                   // Replay task owns the producer side of serial_rx_ring
+} serial_capture_mode_t;
 
+// Single-producer (handle_rx) / single-consumer (capture writer) byte ring,
+// carrying whole records in the file format
+typedef struct {
+    uint8_t buf[CAPTURE_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint dropped;                       // Records that did not fit
+    atomic_uint records;
+    size_t bytes;                              // Producer only: file size so far
+    int64_t last_us;                           // Producer only
+} serial_capture_ring_t;
+
+static serial_capture_ring_t serial_capture_ring;
+static atomic_int serial_capture_mode = SERIAL_CAPTURE_IDLE;
+static TaskHandle_t serial_capture_task_handle = NULL;  // Writer or replay, whichever runs
+static uint32_t serial_replay_speed;                    // Read by the replay task at start
+
+// G-code command queue of gcode_cmd_t
 static QueueHandle_t gcode_queue = NULL;
-static SemaphoreHandle_t gcode_ok_sem = NULL;  // Signalled when printer sends 'ok'
+static SemaphoreHandle_t gcode_queue_mutex = NULL;  // Keeps a multi-line batch contiguous
+static TaskHandle_t gcode_sender_task_handle = NULL;
+
+// Printer acknowledgements, posted by the parser task in arrival order
+static QueueHandle_t gcode_event_queue = NULL;
+
+// Sliding window of numbered lines, run by gcode_sender_task. Its injected
+// lock is gcode_tx_mutex, which also orders priority writes on the wire.
+static gcode_window_t gcode_window;
+static SemaphoreHandle_t gcode_tx_mutex = NULL;
+static cdc_acm_dev_hdl_t gcode_sender_dev = NULL;  // Printer the window's session is with
+
+// Round trip (sent to 'ok') per opcode, updated by gcode_sender_task under
+// gcode_tx_mutex and read by /api/gcode/latency
+typedef struct {
+    char code[8];                              // "G1", "M109", ... or "other"
+    uint32_t count;
+    uint32_t timeouts;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t hist[GCODE_LATENCY_BUCKETS];      // hist[k]: round trips in [2^k, 2^(k+1)) us
+} gcode_latency_t;
+
+static gcode_latency_t gcode_latency[GCODE_LATENCY_OPCODES + 1];
+static int gcode_latency_count = 0;
+
+// Reply to GCODE#id:, the backlog lines printed between the previous 'ok'
+// and the command's own. Sent by ws_sender_task to the requester only.
+typedef struct {
+    int fd;
+    uint32_t request_id;
+    size_t log_start;
+    size_t log_end;
+    uint32_t elapsed_ms;
+    bool timed_out;
+    char cmd[GCODE_CMD_MAX_LEN];
+} gcode_result_t;
+
+static QueueHandle_t gcode_result_queue = NULL;
+
+// Progress of the current (or last) POST /print upload. Written by the upload
+// task and, for 'acked', by the G-code sender; read by build_status_message().
+typedef struct {
+    atomic_bool busy;                          // An upload task owns the request
+    atomic_bool receiving;                     // Body still arriving
+    atomic_uint bytes;                         // Body bytes received
+    atomic_uint total;                         // Content-Length
+    atomic_uint lines;                         // Lines handed to the window
+    atomic_uint acked;                         // Of those, acknowledged by the printer
+    int64_t start_us;
+    int64_t end_us;                            // When the body finished, 0 while receiving
+    int64_t last_report_us;
+    char *buf;                                 // Receive window, set by mem_tier_init()
+    size_t buf_size;                           // GCODE_STREAM_CHUNK_SIZE, more in PSRAM
+    char macro[MACRO_NAME_MAX + 1];            // Stored macro being fed, "" for an upload
+    atomic_bool stop;                          // MACRO:STOP - feed no further lines
+    bool spool;                                // Fed from the spool partition
+    atomic_bool paused;                        // SPOOL:PAUSE - hold the next line back
+    uint32_t rate_acked;                       // acked at the last rate sample (G-code sender only)
+    int64_t rate_us;
+    atomic_uint rate;                          // Lines acked per second over the last report interval
+} gcode_stream_t;
+
+static gcode_stream_t gcode_stream;
+
+typedef enum {
+    SPOOL_EMPTY,
+    SPOOL_UPLOADING,
+    SPOOL_READY,                               // A verified job is stored
+    SPOOL_FEEDING                              // Being fed to the printer
+} spool_state_t;
+
+// First sector of the spool partition; the job follows from the second. The
+// header is written last, so a cut-short upload leaves no job behind.
+typedef struct {
+    uint32_t magic;                            // SPOOL_MAGIC
+    uint32_t len;
+    uint32_t crc;                              // CRC-32 of the job
+    char name[SPOOL_NAME_MAX + 1];
+    uint32_t hdr_crc;                          // Of the fields above
+} spool_hdr_t;
+
+// The stored job. state moves by compare-and-swap; len, crc and name are only
+// written while one task owns the spool in SPOOL_UPLOADING.
+static struct {
+    const esp_partition_t *part;               // NULL without the partition
+    atomic_int state;                          // spool_state_t
+    uint32_t len;
+    uint32_t crc;
+    char name[SPOOL_NAME_MAX + 1];
+} spool;
 
-// LED task handle
-static TaskHandle_t led_task_handle = NULL;
+typedef enum {
+    HTML_REFRESH_IDLE,                         // No refresh since boot
+    HTML_REFRESH_RUNNING,
+    HTML_REFRESH_DONE,
+    HTML_REFRESH_FAILED
+} html_refresh_state_t;
+
+// Background page refresh started by GET /refresh. Written by the refresh
+// task and the download event handler; read by build_status_message().
+typedef struct {
+    atomic_int state;                          // html_refresh_state_t
+    atomic_uint bytes;                         // Page bytes downloaded so far
+    atomic_uint total;                         // Content-Length, 0 if chunked
+    int64_t last_report_us;
+} html_refresh_t;
+
+static html_refresh_t html_refresh;
+
+// Storage of the long-lived RTOS objects. They are all created from here at
+// boot, so creating them cannot fail, however fragmented the heap is by then.
+static struct {
+    StaticSemaphore_t device_disconnected;
+    StaticSemaphore_t html;
+    StaticSemaphore_t ws_clients;
+    StaticSemaphore_t printer_state;
+    StaticSemaphore_t log_backlog;
+    StaticSemaphore_t task_stats;
+    StaticSemaphore_t autoreport;
+    StaticSemaphore_t wifi_ps;
+    StaticSemaphore_t recorder;
+    StaticSemaphore_t gcode_tx;
+    StaticSemaphore_t gcode_queue_lock;
+    StaticEventGroup_t wifi_events;
+    StaticQueue_t gcode_queue;
+    StaticQueue_t gcode_events;
+    StaticQueue_t gcode_results;
+    StaticQueue_t printer_attach;
+    uint8_t printer_attach_storage[PRINTER_ATTACH_QUEUE_SIZE * sizeof(printer_attach_t)];
+    uint8_t gcode_queue_storage[GCODE_QUEUE_SIZE * sizeof(gcode_cmd_t)];
+    uint8_t gcode_events_storage[GCODE_EVENT_QUEUE_SIZE * sizeof(gcode_event_t)];
+    uint8_t gcode_results_storage[GCODE_RESULT_QUEUE_SIZE * sizeof(gcode_result_t)];
+} rtos_objects;
+
+// Stacks and control blocks of the tasks that never exit. Tasks started on
+// demand (page refresh, upload, capture, replay, synth) and the boot download
+// keep using the heap: a static stack would stay claimed after they are gone.
+static struct {
+    StackType_t usb_lib[USB_LIB_TASK_STACK / sizeof(StackType_t)];
+    StackType_t log_drain[LOG_DRAIN_TASK_STACK / sizeof(StackType_t)];
+    StackType_t serial_parser[SERIAL_PARSER_TASK_STACK / sizeof(StackType_t)];
+    StackType_t ws_sender[WS_SENDER_TASK_STACK / sizeof(StackType_t)];
+    StackType_t gcode_sender[GCODE_SENDER_TASK_STACK / sizeof(StackType_t)];
+    StackType_t printer_connect[PRINTER_CONNECT_TASK_STACK / sizeof(StackType_t)];
+    StackType_t recorder[RECORDER_TASK_STACK / sizeof(StackType_t)];
+#if ENABLE_MQTT
+    StackType_t mqtt_publish[MQTT_TASK_STACK / sizeof(StackType_t)];
+#endif
+} task_stacks;
+
+static struct {
+    StaticTask_t usb_lib;
+    StaticTask_t log_drain;
+    StaticTask_t serial_parser;
+    StaticTask_t ws_sender;
+    StaticTask_t gcode_sender;
+    StaticTask_t printer_connect;
+    StaticTask_t recorder;
+#if ENABLE_MQTT
+    StaticTask_t mqtt_publish;
+#endif
+} task_tcbs;
 
 // Embedded webpage (fallback)
 extern const uint8_t webpage_start[] asm("_binary_webpage_html_start");
 extern const uint8_t webpage_end[] asm("_binary_webpage_html_end");
 
 // Remote HTML cache
-static size_t cached_html_size = 0;
 static char last_download_error[256] = "Not attempted yet";
 static bool remote_html_fs_mounted = false;
 
+// A downloaded page version. Readers pin the live slot with a reference; the
+// downloader only rewrites the other slot once its references drain, and
+// publishes it by storing html_current. Slot fields are written only while
+// the slot is not live.
+typedef struct {
+    const char *path;                              // SPIFFS backend
+    const uint8_t *data;                           // Page in mapped flash, or a SPIFFS page's PSRAM copy
+    size_t offset;                                 // Partition backend: slot start
+    uint32_t sequence;                             // Partition backend: higher is newer
+    atomic_int refs;
+    size_t size;
+    bool gzip;                                     // Stored as received with Content-Encoding: gzip
+    char etag[24];                                 // Validator, so browsers revalidate instead of re-downloading
+} html_slot_t;
+
+static html_slot_t html_slots[2] = {
+    { .path = REMOTE_HTML_SLOT_A_PATH },
+    { .path = REMOTE_HTML_SLOT_B_PATH },
+};
+static atomic_int html_current = -1;               // Live slot, -1 = embedded page only
+
+// Slot header, written last so a slot with an interrupted download stays invalid
+typedef struct {
+    uint32_t magic;                                // WEBUI_MAGIC
+    uint32_t sequence;
+    uint32_t length;                               // Page bytes after the header
+    uint32_t flags;                                // WEBUI_FLAG_*
+    uint64_t hash;                                 // FNV-1a of the page, the ETag
+} webui_header_t;
+
+static const esp_partition_t *webui_partition = NULL;
+static const uint8_t *webui_map = NULL;
+static size_t webui_slot_size = 0;
+static char embedded_html_etag[24] = "";
+
 // ============================================================================
-// UART DEBUG LOGGING SETUP
+// DEFERRED UART LOGGING
 // ============================================================================
 
-static int uart_log_vprintf(const char *fmt, va_list args)
+// esp_log hands every line to log_vprintf(). Writing it to the UART there made
+// the caller wait for the line to go out at 115200 baud (~20 ms for a long
+// one), so the USB callback and the WebSocket sender were throttled by their
+// own debug output. Lines are formatted into a bounded multi-producer ring
+// instead - each slot carries a sequence number, so producers on both cores
+// claim slots without a lock - and a low-priority task writes them out. A full
+// ring drops the line and counts it rather than blocking the caller.
+typedef struct {
+    atomic_uint seq;                           // == position when free, position + 1 when filled
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+} log_slot_t;
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static atomic_uint log_head;                   // Next position a producer claims
+static unsigned log_tail;                      // Next position to write, drain task only
+
+// Level overrides for the "[USB]"-style prefixes used throughout this file.
+// Entries are only appended (from the httpd task), never removed.
+typedef struct {
+    char tag[LOG_TAG_MAX_LEN];                 // Prefix without brackets, e.g. "USB"
+    atomic_int level;                          // esp_log_level_t
+} log_tag_filter_t;
+
+static log_tag_filter_t log_tag_filters[LOG_TAG_FILTERS];
+static atomic_int log_tag_filter_count;
+
+static void log_ring_init(void)
 {
-    char log_buffer[256];
-    int len = vsnprintf(log_buffer, sizeof(log_buffer), fmt, args);
-    
-    if (len > 0) {
-        uart_write_bytes(DEBUG_UART_NUM, log_buffer, len);
+    for (unsigned i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&log_ring[i].seq, i);
     }
-    
+}
+
+// Checked before anything is formatted, so a muted prefix costs a short
+// string scan. esp_log passes LOG_FORMAT(), e.g. "I (%lu) %s: [USB] RX: ...".
+static bool log_line_allowed(const char *fmt)
+{
+    int count = atomic_load_explicit(&log_tag_filter_count, memory_order_acquire);
+    if (count == 0) {
+        return true;
+    }
+    if (fmt[0] == '\033') {                    // CONFIG_LOG_COLORS escape
+        const char *m = strchr(fmt, 'm');
+        if (m == NULL) {
+            return true;
+        }
+        fmt = m + 1;
+    }
+    esp_log_level_t level;
+    switch (fmt[0]) {
+        case 'E': level = ESP_LOG_ERROR; break;
+        case 'W': level = ESP_LOG_WARN; break;
+        case 'I': level = ESP_LOG_INFO; break;
+        case 'D': level = ESP_LOG_DEBUG; break;
+        case 'V': level = ESP_LOG_VERBOSE; break;
+        default: return true;
+    }
+    const char *open = strstr(fmt, ": [");
+    if (open == NULL) {
+        return true;
+    }
+    open += 3;
+    const char *close = strchr(open, ']');
+    if (close == NULL || close - open >= LOG_TAG_MAX_LEN) {
+        return true;
+    }
+    size_t n = close - open;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(log_tag_filters[i].tag, open, n) == 0 && log_tag_filters[i].tag[n] == '\0') {
+            return level <= atomic_load_explicit(&log_tag_filters[i].level, memory_order_relaxed);
+        }
+    }
+    return true;
+}
+
+static int log_vprintf(const char *fmt, va_list args)
+{
+    if (!log_line_allowed(fmt)) {
+        return 0;
+    }
+
+    unsigned pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_slot_t *slot;
+    for (;;) {
+        slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Drain task hasn't written this slot from the previous lap yet
+            METRIC_INC(log_dropped);
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int)sizeof(slot->text)) {
+        len = sizeof(slot->text) - 1;
+        slot->text[len - 1] = '\n';            // Keep the line break of a truncated line
+    }
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
     return len;
 }
 
+static void log_drain_task(void *arg)
+{
+    unsigned reported_drops = 0;
+
+    while (1) {
+        log_slot_t *slot = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+        while (atomic_load_explicit(&slot->seq, memory_order_acquire) == log_tail + 1) {
+            uart_write_bytes(DEBUG_UART_NUM, slot->text, slot->len);
+            atomic_store_explicit(&slot->seq, log_tail + LOG_RING_SLOTS, memory_order_release);
+            log_tail++;
+            METRIC_INC(log_lines);
+            slot = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+        }
+
+        unsigned drops = atomic_load_explicit(&metrics.log_dropped, memory_order_relaxed);
+        if (drops != reported_drops) {
+            char note[80];
+            int n = snprintf(note, sizeof(note), "W (%lu) %s: [LOG] %u lines dropped\n",
+                             (unsigned long)esp_log_timestamp(), TAG, drops - reported_drops);
+            uart_write_bytes(DEBUG_UART_NUM, note, n);
+            reported_drops = drops;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_IDLE_MS));
+    }
+}
+
+static bool log_level_parse(const char *name, esp_log_level_t *level)
+{
+    static const char *const names[] = { "none", "error", "warn", "info", "debug", "verbose" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (esp_log_level_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Set the level of a "[TAG]" prefix in this file and of the esp_log tag of the
+// same name, so both "USB" and component tags such as "wifi" work.
+static esp_err_t log_tag_level_set(const char *tag, esp_log_level_t level)
+{
+    size_t n = strlen(tag);
+    if (n == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_log_level_set(tag, level);
+    if (n >= LOG_TAG_MAX_LEN) {
+        return ESP_OK;                         // Can't be a prefix, esp_log tag only
+    }
+
+    int count = atomic_load_explicit(&log_tag_filter_count, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(log_tag_filters[i].tag, tag) == 0) {
+            atomic_store_explicit(&log_tag_filters[i].level, level, memory_order_relaxed);
+            return ESP_OK;
+        }
+    }
+    if (count == LOG_TAG_FILTERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(log_tag_filters[count].tag, tag, n + 1);
+    atomic_store_explicit(&log_tag_filters[count].level, level, memory_order_relaxed);
+    atomic_store_explicit(&log_tag_filter_count, count + 1, memory_order_release);
+    return ESP_OK;
+}
+
 // ============================================================================
 // STATUS LED CONTROL
 // ============================================================================
 
-static void led_task(void *arg)
+// Toggled from the housekeeping timer: fast blink when connected, slow
+// when disconnected
+static void led_init(void)
 {
     gpio_reset_pin(STATUS_LED_GPIO);
     gpio_set_direction(STATUS_LED_GPIO, GPIO_MODE_OUTPUT);
-    
-    bool led_state = false;
-    
-    while (1) {
-        if (printer_connected) {
-            // Fast blink when connected
-            led_state = !led_state;
-            gpio_set_level(STATUS_LED_GPIO, led_state);
-            vTaskDelay(pdMS_TO_TICKS(LED_BLINK_CONNECTED_MS));
-        } else {
-            // Slow blink when disconnected
-            led_state = !led_state;
-            gpio_set_level(STATUS_LED_GPIO, led_state);
-            vTaskDelay(pdMS_TO_TICKS(LED_BLINK_DISCONNECTED_MS));
-        }
-    }
+}
+
+static void led_toggle(void)
+{
+    static bool led_state = false;
+
+    led_state = !led_state;
+    gpio_set_level(STATUS_LED_GPIO, led_state);
+}
+
+static uint32_t led_period_ms(void)
+{
+    return printer_connected ? LED_BLINK_CONNECTED_MS : LED_BLINK_DISCONNECTED_MS;
 }
 
 // ============================================================================
 // WEBSOCKET CLIENT MANAGEMENT
 // ============================================================================
 
+static void ws_clients_lock_take(void *ctx)
+{
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+}
+
+static void ws_clients_lock_give(void *ctx)
+{
+    xSemaphoreGive(ws_clients_mutex);
+}
+
 static void ws_clients_init(void)
 {
-    ws_clients_mutex = xSemaphoreCreateMutex();
-    
+    static const ws_ring_lock_t ring_lock = {
+        .take = ws_clients_lock_take,
+        .give = ws_clients_lock_give,
+    };
+
+    ws_clients_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.ws_clients);
+
     for (int i = 0; i < WS_MAX_CLIENTS; i++) {
         ws_clients[i].fd = -1;
         ws_clients[i].active = false;
-        ws_clients[i].message_queue = xQueueCreate(WS_MESSAGE_QUEUE_SIZE, sizeof(ws_message_t));
     }
-
-    // Initialise G-code command queue and ok semaphore
-    gcode_queue = xQueueCreate(GCODE_QUEUE_SIZE, sizeof(gcode_cmd_t));
-    gcode_ok_sem = xSemaphoreCreateCounting(32, 0);  // Counting semaphore, starts at 0
+    // Ring calls are made under ws_clients_mutex, held for the client table too
+    ws_ring_init(&ws_ring, ws_ring_buf, sizeof(ws_ring_buf), &ring_lock);
+
+    // Initialise G-code command queue and the printer acknowledgement queue
+    gcode_queue = xQueueCreateStatic(GCODE_QUEUE_SIZE, sizeof(gcode_cmd_t),
+                                     rtos_objects.gcode_queue_storage, &rtos_objects.gcode_queue);
+    gcode_event_queue = xQueueCreateStatic(GCODE_EVENT_QUEUE_SIZE, sizeof(gcode_event_t),
+                                           rtos_objects.gcode_events_storage, &rtos_objects.gcode_events);
+    gcode_tx_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.gcode_tx);
+    gcode_queue_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.gcode_queue_lock);
+    gcode_result_queue = xQueueCreateStatic(GCODE_RESULT_QUEUE_SIZE, sizeof(gcode_result_t),
+                                            rtos_objects.gcode_results_storage, &rtos_objects.gcode_results);
 
     ESP_LOGI(TAG, "WebSocket client manager initialized");
 }
 
-static int ws_client_add(int fd)
+// Queue commands for gcode_sender_task and wake it. All or none of the batch
+// is queued, back to back, so no other producer's line lands in between.
+// The mutex only covers the check-and-send; waiting for space happens with
+// it released, so a slow stream never stalls a caller passing wait = 0.
+static bool gcode_enqueue_batch(const gcode_cmd_t *cmds, size_t count, TickType_t wait)
 {
-    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-    
-    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-        if (!ws_clients[i].active) {
-            ws_clients[i].fd = fd;
-            ws_clients[i].active = true;
-            ws_clients[i].ping_pending = false;
-            // Clear any stale messages
-            xQueueReset(ws_clients[i].message_queue);
-            
-            xSemaphoreGive(ws_clients_mutex);
-            ESP_LOGI(TAG, "WebSocket client %d connected (fd=%d)", i, fd);
-            DEBUG_LOG(TAG, "[WS] Client %d added successfully", i);
-            return i;
+    if (!gcode_queue || count == 0 || count > GCODE_QUEUE_SIZE) return false;
+
+    TickType_t start = xTaskGetTickCount();
+    bool queued = false;
+
+    for (;;) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        TickType_t left = elapsed < wait ? wait - elapsed : 0;
+
+        if (xSemaphoreTake(gcode_queue_mutex, left) != pdTRUE) break;
+        if (uxQueueSpacesAvailable(gcode_queue) >= count) {
+            for (size_t i = 0; i < count; i++) {
+                xQueueSend(gcode_queue, &cmds[i], 0);
+            }
+            queued = true;
         }
+        xSemaphoreGive(gcode_queue_mutex);
+
+        if (queued || xTaskGetTickCount() - start >= wait) break;
+        vTaskDelay(pdMS_TO_TICKS(10));   // The sender drains without taking the mutex
     }
-    
-    xSemaphoreGive(ws_clients_mutex);
-    ESP_LOGW(TAG, "No available client slots (fd=%d)", fd);
-    return -1;
+
+    if (queued && gcode_sender_task_handle) {
+        xTaskNotifyGive(gcode_sender_task_handle);
+    }
+    return queued;
 }
 
-static void ws_client_remove(int fd)
+static bool gcode_enqueue_cmd(const gcode_cmd_t *gcode_cmd, TickType_t wait)
 {
-    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-    
-    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-        if (ws_clients[i].active && ws_clients[i].fd == fd) {
-            ws_clients[i].active = false;
-            ws_clients[i].fd = -1;
-            xQueueReset(ws_clients[i].message_queue);
-            
-            ESP_LOGI(TAG, "WebSocket client %d disconnected (fd=%d)", i, fd);
-            DEBUG_LOG(TAG, "[WS] Client %d removed", i);
-            break;
+    return gcode_enqueue_batch(gcode_cmd, 1, wait);
+}
+
+static bool gcode_enqueue(const char *cmd, bool from_stream, TickType_t wait)
+{
+    gcode_cmd_t gcode_cmd = { .from_stream = from_stream, .reply_fd = -1 };
+
+    strncpy(gcode_cmd.cmd, cmd, GCODE_CMD_MAX_LEN - 1);
+    return gcode_enqueue_cmd(&gcode_cmd, wait);
+}
+
+// Take the queued lines of the stream out of gcode_queue, keeping everything
+// else in order; returns how many went. Holding both locks keeps producers
+// and gcode_sender_task out while the queue is rotated.
+static unsigned gcode_queue_drop_stream(void)
+{
+    gcode_cmd_t cmd;
+    unsigned dropped = 0;
+
+    xSemaphoreTake(gcode_queue_mutex, portMAX_DELAY);
+    gcode_window_lock(&gcode_window);
+    for (UBaseType_t n = uxQueueMessagesWaiting(gcode_queue); n > 0; n--) {
+        if (xQueueReceive(gcode_queue, &cmd, 0) != pdTRUE) break;
+        if (cmd.from_stream) {
+            dropped++;
+        } else {
+            xQueueSend(gcode_queue, &cmd, 0);
         }
     }
-    
-    xSemaphoreGive(ws_clients_mutex);
+    gcode_window_unlock(&gcode_window);
+    xSemaphoreGive(gcode_queue_mutex);
+    return dropped;
 }
 
-static void ws_broadcast_message(const ws_message_t *msg)
+// ============================================================================
+// PRINTER STATE SNAPSHOT
+// ============================================================================
+
+// Copy the state into the published snapshot, once per applied change.
+// Caller must hold printer_state_mutex, which keeps writers from interleaving.
+static void printer_state_publish(void)
 {
-    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-    
-    int sent_count = 0;
-    int dropped_count = 0;
-    
-    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-        if (ws_clients[i].active) {
-            // Fix 4: Skip clients whose queue is backing up - likely dead or very slow
-            UBaseType_t spaces = uxQueueSpacesAvailable(ws_clients[i].message_queue);
-            if (spaces < 5) {
-                ESP_LOGW(TAG, "Client %d queue near full (%d spaces left), skipping", i, (int)spaces);
-                dropped_count++;
-            } else if (xQueueSend(ws_clients[i].message_queue, msg, 0) != pdTRUE) {
-                ESP_LOGW(TAG, "Client %d message queue full, dropping message", i);
-                dropped_count++;
-            } else {
-                sent_count++;
+    printer_state_seqlock_t *sl = &printer_state_published;
+    unsigned seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sl->data.temps = current_temps;
+    sl->data.progress = current_progress;
+    sl->data.position = current_position;
+    sl->data.power = current_power;
+    sl->data.connected = printer_connected;
+    sl->data.generation = printer_state_generation;
+    memcpy(sl->data.serial, printer_serial, sizeof(sl->data.serial));
+    atomic_store_explicit(&sl->seq, seq + 2, memory_order_release);
+}
+
+// Lock-free read of the latest snapshot, for any task but not from an ISR
+static void printer_state_read(printer_snapshot_t *out)
+{
+    printer_state_seqlock_t *sl = &printer_state_published;
+
+    for (int attempt = 1; ; attempt++) {
+        unsigned before = atomic_load_explicit(&sl->seq, memory_order_acquire);
+        if (!(before & 1)) {
+            memcpy(out, &sl->data, sizeof(*out));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&sl->seq, memory_order_relaxed) == before) {
+                return;
             }
         }
+        atomic_fetch_add_explicit(&sl->read_retries, 1, memory_order_relaxed);
+        // A writer preempted on this core by the reader can only finish if
+        // the reader gets out of its way
+        if (attempt % 4 == 0) {
+            vTaskDelay(1);
+        }
     }
-    
-    if (dropped_count > 0) {
-        DEBUG_LOG(TAG, "[WS] Broadcast: sent=%d, dropped=%d", sent_count, dropped_count);
-    }
-    
-    xSemaphoreGive(ws_clients_mutex);
 }
 
 // ============================================================================
-// JSON MESSAGE BUILDERS
+// PRINTER AUTO-REPORT RATE
 // ============================================================================
 
-static void build_temperature_message(ws_message_t *msg, const temp_state_t *temps)
+// The printer pushes temperatures (M155) and, where the firmware has it,
+// position (M154) by itself. Fast while anyone is watching or a job is
+// running, slow otherwise, so an unwatched idle printer costs little USB and
+// parser time. Re-evaluated on client connect/disconnect and by the monitor.
+static SemaphoreHandle_t autoreport_mutex;
+static int autoreport_interval_s = 0;          // Last period sent, 0 = to be sent (autoreport_mutex)
+static atomic_bool autoreport_position = true; // Cleared when the printer rejects M154
+
+static bool printer_job_active(void)
 {
-    msg->type = MSG_TYPE_TEMPERATURE;
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"temperature\","
-        "\"nozzle\":{\"current\":%.1f,\"target\":%.1f},"
-        "\"bed\":{\"current\":%.1f,\"target\":%.1f},"
-        "\"heatbreak\":{\"current\":%.1f,\"target\":%.1f},"
-        "\"chamber\":{\"current\":%.1f}}",
-        temps->nozzle_current, temps->nozzle_target,
-        temps->bed_current, temps->bed_target,
-        temps->heatbreak_current, temps->heatbreak_target,
-        temps->chamber_current);
+    if (atomic_load(&gcode_stream.receiving) ||
+        atomic_load(&gcode_stream.acked) != atomic_load(&gcode_stream.lines)) {
+        return true;
+    }
+
+    printer_snapshot_t snap;
+    printer_state_read(&snap);
+    return snap.temps.nozzle_target > 0.0f || snap.temps.bed_target > 0.0f ||
+           (snap.progress.percent < 100 && snap.progress.time_left_mins > 0);
 }
 
-static void build_progress_message(ws_message_t *msg, const progress_state_t *progress)
+static bool ws_clients_watching(void)
 {
-    msg->type = MSG_TYPE_PROGRESS;
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"progress\","
-        "\"percent\":%d,"
-        "\"timeLeft\":%d,"
-        "\"changeTime\":%d}",
-        progress->percent,
-        progress->time_left_mins,
-        progress->change_mins);
+    bool watched = false;
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        // A background tab has paused itself and does not need the fast rate
+        watched |= ws_clients[i].active && !ws_clients[i].paused;
+    }
+    xSemaphoreGive(ws_clients_mutex);
+    return watched;
 }
 
-static void build_position_message(ws_message_t *msg, const position_state_t *pos)
+// force: resend even if unchanged, after the printer (re)connects
+static void autoreport_update(bool force)
 {
-    msg->type = MSG_TYPE_POSITION;
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"position\","
-        "\"x\":%.2f,\"y\":%.2f,\"z\":%.2f,\"e\":%.2f}",
-        pos->x, pos->y, pos->z, pos->e);
+    if (!printer_connected || !autoreport_mutex) return;
+
+    // A connected broker keeps the fast rate: its subscribers are watching too
+    bool watched = ws_clients_watching() || mqtt_reader.active;
+
+    int interval = (watched || printer_job_active()) ? AUTOREPORT_FAST_S : AUTOREPORT_IDLE_S;
+
+    xSemaphoreTake(autoreport_mutex, portMAX_DELAY);
+    if (force || interval != autoreport_interval_s) {
+        gcode_cmd_t batch[2] = {
+            { .reply_fd = -1 },
+            { .reply_fd = -1 },
+        };
+        size_t count = 1;
+        snprintf(batch[0].cmd, sizeof(batch[0].cmd), "M155 S%d", interval);
+        if (atomic_load(&autoreport_position)) {
+            snprintf(batch[1].cmd, sizeof(batch[1].cmd), "M154 S%d", interval);
+            count = 2;
+        }
+        // Never wait here: callers include the httpd task. On a full queue
+        // the monitor report retries on its next pass.
+        if (gcode_enqueue_batch(batch, count, 0)) {
+            autoreport_interval_s = interval;
+            DEBUG_LOG(TAG, "[AUTOREPORT] Every %d s (%s)", interval, watched ? "watched" : "unwatched");
+        } else {
+            autoreport_interval_s = 0;
+        }
+    }
+    xSemaphoreGive(autoreport_mutex);
 }
 
-static void build_power_message(ws_message_t *msg, const power_state_t *power)
+static void autoreport_position_unsupported(void)
 {
-    msg->type = MSG_TYPE_POWER;
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"power\","
-        "\"nozzle\":%d,\"bed\":%d,\"heatbreak\":%d}",
-        power->nozzle_pwm,
-        power->bed_pwm,
-        power->heatbreak_pwm);
+    if (atomic_exchange(&autoreport_position, false)) {
+        ESP_LOGI(TAG, "Printer has no M154 position autoreport");
+    }
 }
 
-static void build_log_message(ws_message_t *msg, const char *log_line)
+// Modem sleep holds frames for the AP's next DTIM beacon, tens to hundreds of
+// ms, which shows as jitter on pushes and command round-trips. Re-evaluated
+// on the same events as the autoreport rate.
+static SemaphoreHandle_t wifi_ps_mutex;
+static atomic_int wifi_ps_mode = WIFI_PS_MIN_MODEM;   // esp_wifi_start() default
+static int64_t wifi_ps_busy_us = 0;            // Last time low latency was wanted (wifi_ps_mutex)
+
+static void wifi_latency_update(void)
 {
-    msg->type = MSG_TYPE_LOG;
-    
-    // Escape quotes and backslashes in log line for JSON
-    char escaped[WS_MAX_PAYLOAD_SIZE / 2];
-    size_t j = 0;
-    for (size_t i = 0; log_line[i] && j < sizeof(escaped) - 2; i++) {
-        if (log_line[i] == '"' || log_line[i] == '\\') {
-            escaped[j++] = '\\';
-        }
-        escaped[j++] = log_line[i];
+    if (!wifi_ps_mutex) return;
+
+    bool busy = ws_clients_watching() || printer_job_active();
+    int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(wifi_ps_mutex, portMAX_DELAY);
+    if (busy) {
+        wifi_ps_busy_us = now_us;
     }
-    escaped[j] = '\0';
-    
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"log\",\"message\":\"%s\"}", escaped);
+    wifi_ps_type_t want = busy ? WIFI_PS_NONE : atomic_load(&wifi_ps_mode);
+    if (!busy && now_us - wifi_ps_busy_us >= (int64_t)WIFI_PS_IDLE_HOLD_MS * 1000) {
+        want = WIFI_PS_IDLE_MODE;
+    }
+    if (want != atomic_load(&wifi_ps_mode) && esp_wifi_set_ps(want) == ESP_OK) {
+        atomic_store(&wifi_ps_mode, want);
+        METRIC_INC(wifi_ps_switches);
+        ESP_LOGI(TAG, "[WIFI] Power save %s", want == WIFI_PS_NONE ? "off (low latency)" : "on (idle)");
+    }
+    xSemaphoreGive(wifi_ps_mutex);
 }
 
-static void build_status_message(ws_message_t *msg, bool connected)
+// Backlog position the live frames have reached, as log_backlog_mark_live()
+// left it. log_backlog_mutex is a leaf lock, so it can be taken here with
+// ws_clients_mutex held.
+static size_t log_backlog_live_end(void)
 {
-    msg->type = MSG_TYPE_STATUS;
-    snprintf(msg->json_payload, WS_MAX_PAYLOAD_SIZE,
-        "{\"type\":\"status\",\"connected\":%s}",
-        connected ? "true" : "false");
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    size_t end = serial_log_backlog.live_end;
+    xSemaphoreGive(log_backlog_mutex);
+    return end;
 }
 
-// ============================================================================
-// SERIAL LINE PARSER - THE HEART OF V3!
-// ============================================================================
-
-static void parse_and_broadcast_line(const char *line)
+// Take a free client slot and reset it for a new WebSocket connection.
+// Returns the slot, -1 if all are taken. Caller holds ws_clients_mutex.
+static int ws_client_claim(int fd, bool binary)
 {
-    ws_message_t msg;
-    bool state_changed = false;
-    
-    // Always send log message
-    build_log_message(&msg, line);
-    ws_broadcast_message(&msg);
-    
-    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
-    
-    // Temperature parsing - handle A: field (mainboard temp, not displayed)
-    if (strstr(line, "T:") && strstr(line, "B:")) {
-        const char *t_pos = strstr(line, "T:");
-        const char *b_pos = strstr(line, "B:");
-        
-        float nozzle_cur, nozzle_tgt, bed_cur, bed_tgt;
-        
-        // Parse T: and B: separately to handle A: field in between
-        if (t_pos && sscanf(t_pos, "T:%f/%f", &nozzle_cur, &nozzle_tgt) == 2 &&
-            b_pos && sscanf(b_pos, "B:%f/%f", &bed_cur, &bed_tgt) == 2) {
-            
-            current_temps.nozzle_current = nozzle_cur;
-            current_temps.nozzle_target = nozzle_tgt;
-            current_temps.bed_current = bed_cur;
-            current_temps.bed_target = bed_tgt;
-            state_changed = true;
-        }
-        
-        // Heatbreak temperature: X:45.0/45.0
-        const char *x_pos = strstr(line, "X:");
-        if (x_pos) {
-            float hb_cur, hb_tgt;
-            if (sscanf(x_pos, "X:%f/%f", &hb_cur, &hb_tgt) == 2) {
-                current_temps.heatbreak_current = hb_cur;
-                current_temps.heatbreak_target = hb_tgt;
-            }
-        }
-        
-        // Chamber temperature: C@:22.5
-        const char *c_pos = strstr(line, "C@:");
-        if (c_pos) {
-            float chamber;
-            if (sscanf(c_pos, "C@:%f", &chamber) == 1) {
-                current_temps.chamber_current = chamber;
-            }
-        }
-        
-        if (state_changed) {
-            build_temperature_message(&msg, &current_temps);
-            ws_broadcast_message(&msg);
-        }
-        
-        // Power parsing: @:127 B@:64 HBR@:89
-        const char *nozzle_pwr = strstr(line, "@:");
-        const char *bed_pwr = strstr(line, "B@:");
-        const char *hb_pwr = strstr(line, "HBR@:");
-        
-        bool power_changed = false;
-        if (nozzle_pwr && sscanf(nozzle_pwr, "@:%d", &current_power.nozzle_pwm) == 1) {
-            power_changed = true;
-        }
-        if (bed_pwr && sscanf(bed_pwr, "B@:%d", &current_power.bed_pwm) == 1) {
-            power_changed = true;
-        }
-        if (hb_pwr && sscanf(hb_pwr, "HBR@:%d", &current_power.heatbreak_pwm) == 1) {
-            power_changed = true;
-        }
-        
-        if (power_changed) {
-            build_power_message(&msg, &current_power);
-            ws_broadcast_message(&msg);
+    for (int i = 0; i < socket_budget.ws_limit; i++) {
+        if (!ws_clients[i].active) {
+            ws_clients[i].fd = fd;
+            ws_clients[i].active = true;
+            ws_clients[i].ping_pending = false;
+            ws_clients[i].lag_warned = false;
+            ws_clients[i].binary = binary;
+            ws_clients[i].deflate = false;
+            ws_clients[i].topics = WS_TOPICS_DEFAULT;
+            ws_clients[i].history_pending = true;
+            ws_clients[i].log_backlog_pending = true;
+            // Later lines reach this client through the ring, so stop the replay here
+            ws_clients[i].log_backlog_end = log_backlog_live_end();
+            ws_clients[i].mesh_generation = 0;
+            ws_clients[i].history_points = 0;
+            ws_clients[i].overruns = 0;
+            ws_clients[i].state_pending = 0;
+            ws_clients[i].trace = false;
+            ws_clients[i].sse = false;
+            ws_clients[i].paused = false;
+            // Start at the ring head - nothing already queued belongs to this client
+            ws_clients[i].cursor = ws_ring.head;
+            return i;
         }
     }
+    ESP_LOGW(TAG, "No available client slots (fd=%d)", fd);
+    return -1;
+}
+
+static int ws_client_add(int fd, bool binary, bool deflate)
+{
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    int i = ws_client_claim(fd, binary);
+    if (i >= 0) ws_clients[i].deflate = deflate;
+    xSemaphoreGive(ws_clients_mutex);
+    if (i < 0) return -1;
+
+    ESP_LOGI(TAG, "WebSocket client %d connected (fd=%d, %s%s)", i, fd, binary ? "binary" : "json",
+             deflate ? ", deflate" : "");
+    DEBUG_LOG(TAG, "[WS] Client %d added successfully", i);
+    autoreport_update(false);
+    wifi_latency_update();
+    return i;
+}
+
+static void ws_client_remove(int fd)
+{
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
     
-    // Progress parsing: "M73 Progress: 9%;"
-    if (strstr(line, "Progress:")) {
-        int percent;
-        if (sscanf(line, "%*[^P]Progress: %d%%", &percent) == 1) {
-            current_progress.percent = percent;
-            build_progress_message(&msg, &current_progress);
-            ws_broadcast_message(&msg);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (ws_clients[i].active && ws_clients[i].fd == fd) {
+            ws_clients[i].active = false;
+            ws_clients[i].fd = -1;
+            
+            ESP_LOGI(TAG, "WebSocket client %d disconnected (fd=%d)", i, fd);
+            DEBUG_LOG(TAG, "[WS] Client %d removed", i);
+            break;
         }
     }
     
-    // Time left parsing: "Time left: 19m;" or "Time left: 1h 23m;"
-    if (strstr(line, "Time left:")) {
-        int hours = 0, mins = 0;
-        const char *time_str = strstr(line, "Time left:");
-        if (time_str) {
-            if (sscanf(time_str, "Time left: %dh %dm", &hours, &mins) == 2) {
-                current_progress.time_left_mins = hours * 60 + mins;
-            } else if (sscanf(time_str, "Time left: %dm", &mins) == 1) {
-                current_progress.time_left_mins = mins;
-            }
-            build_progress_message(&msg, &current_progress);
-            ws_broadcast_message(&msg);
-        }
+    xSemaphoreGive(ws_clients_mutex);
+    autoreport_update(false);
+    wifi_latency_update();
+}
+
+// Close the socket of a client just evicted from its slot, rather than leave
+// it to httpd, which only notices a dead peer when a send or receive fails.
+// Call without ws_clients_mutex: the close ends in ws_session_close().
+static void ws_client_close_evicted(int fd)
+{
+    if (server != NULL && fd >= 0 && httpd_sess_trigger_close(server, fd) == ESP_OK) {
+        atomic_fetch_add(&socket_budget.ws_closed, 1);
     }
-    
-    // Change time parsing: "Change: 16m;" or "Change: 1h 5m;"
-    if (strstr(line, "Change:")) {
-        int hours = 0, mins = 0;
-        const char *change_str = strstr(line, "Change:");
-        if (change_str) {
-            if (sscanf(change_str, "Change: %dh %dm", &hours, &mins) == 2) {
-                current_progress.change_mins = hours * 60 + mins;
-            } else if (sscanf(change_str, "Change: %dm", &mins) == 1) {
-                current_progress.change_mins = mins;
-            }
-            build_progress_message(&msg, &current_progress);
-            ws_broadcast_message(&msg);
-        }
+}
+
+// SSE event ids are "<epoch>-<ring position>". The epoch is drawn at boot,
+// so an id from before a reboot never passes for a position in this ring.
+static uint32_t sse_epoch;
+
+// Claim a client slot for an SSE stream. A valid Last-Event-ID resumes at
+// that ring position and resends only the state slots stored since; anything
+// else starts at the head with every known state slot, as a snapshot.
+static int sse_client_add(int fd, uint32_t topics, const char *last_event_id)
+{
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    int i = ws_client_claim(fd, false);
+    if (i < 0) {
+        xSemaphoreGive(ws_clients_mutex);
+        return -1;
     }
-    
-    // Position parsing: X:108.67 Y:90.41 Z:2.20 E:0.00
-    if (strstr(line, "X:") && strstr(line, "Y:") && strstr(line, "Z:") && strstr(line, "E:")) {
-        // Split at "Count" if present
-        char temp_line[SERIAL_LINE_BUFFER_SIZE];
-        strncpy(temp_line, line, sizeof(temp_line) - 1);
-        temp_line[sizeof(temp_line) - 1] = '\0';
-        
-        char *count_pos = strstr(temp_line, "Count");
-        if (count_pos) *count_pos = '\0';
-        
-        float x, y, z, e;
-        if (sscanf(temp_line, "%*[^X]X:%f Y:%f Z:%f E:%f", &x, &y, &z, &e) == 4) {
-            current_position.x = x;
-            current_position.y = y;
-            current_position.z = z;
-            current_position.e = e;
-            build_position_message(&msg, &current_position);
-            ws_broadcast_message(&msg);
+    ws_client_t *client = &ws_clients[i];
+    client->sse = true;
+    client->topics = topics & SSE_TOPICS;
+    client->history_pending = false;
+    client->log_backlog_pending = false;
+
+    unsigned epoch;
+    unsigned pos;
+    bool resume = last_event_id && sscanf(last_event_id, "%x-%u", &epoch, &pos) == 2 &&
+                  epoch == sse_epoch && ws_ring_is_boundary(&ws_ring, pos);
+    if (resume) {
+        client->cursor = pos;
+    }
+    for (int slot = 0; slot < WS_SLOT_COUNT; slot++) {
+        const ws_state_slot_t *st = &ws_state_slots[slot];
+        if (st->updates == 0 || !(client->topics & WS_TOPIC_BIT(st->msg.type))) continue;
+        // ring_pos == pos may not have been sent yet, so it goes again
+        if (!resume || ws_ring.head - st->ring_pos <= ws_ring.head - (size_t)pos) {
+            client->state_pending |= 1u << slot;
         }
     }
-    
-    // Print completion detection
-    if (strstr(line, "Done printing file")) {
-        current_progress.percent = 100;
-        current_progress.time_left_mins = 0;
-        build_progress_message(&msg, &current_progress);
-        ws_broadcast_message(&msg);
+    xSemaphoreGive(ws_clients_mutex);
+
+    ESP_LOGI(TAG, "SSE client %d connected (fd=%d, %s)", i, fd, resume ? "resumed" : "new");
+    autoreport_update(false);
+    wifi_latency_update();
+    if (ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
     }
+    return i;
+}
 
-    // Signal G-code queue that printer is ready for next command
-    if (strcmp(line, "ok") == 0 || strncmp(line, "ok ", 3) == 0) {
-        if (gcode_ok_sem) {
-            xSemaphoreGive(gcode_ok_sem);
+// Write all of buf to an SSE stream's socket
+static esp_err_t sse_send(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        int n = httpd_socket_send(server, fd, buf, len, 0);
+        if (n <= 0) return ESP_FAIL;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return ESP_OK;
+}
+
+// One event for a frame: id, event name and the JSON on a single data line
+// (the payloads never contain a raw newline). Returns 0 if it does not fit.
+static size_t sse_event_format(const ws_message_t *msg, size_t len, size_t event_id, char *out, size_t cap)
+{
+    int n = snprintf(out, cap, "id: %x-%u\nevent: %s\ndata: ", (unsigned)sse_epoch, (unsigned)event_id,
+                     msg_type_names[msg->type]);
+    if (n < 0 || (size_t)n + len + 2 >= cap) return 0;
+    memcpy(out + n, msg->json_payload, len);
+    memcpy(out + n + len, "\n\n", 2);
+    return (size_t)n + len + 2;
+}
+
+// Trace clock. Never 0, which marks a frame as untraced.
+static uint32_t trace_now(void)
+{
+    uint32_t t = (uint32_t)esp_timer_get_time();
+    return t ? t : 1;
+}
+
+static void trace_record(trace_stage_t stage, uint32_t delta_us)
+{
+    int bucket = 0;
+
+    while (bucket < TRACE_BUCKETS - 1 && (delta_us >> (bucket + 1)) != 0) bucket++;
+    atomic_fetch_add_explicit(&trace_hists[stage].hist[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&trace_hists[stage].count, 1, memory_order_relaxed);
+}
+
+// Upper edge of the bucket holding the given percentile, 0 if empty
+static uint32_t trace_percentile(trace_stage_t stage, unsigned percent)
+{
+    uint32_t count = atomic_load_explicit(&trace_hists[stage].count, memory_order_relaxed);
+    uint32_t need = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    uint32_t seen = 0;
+
+    if (count == 0) return 0;
+    for (int k = 0; k < TRACE_BUCKETS; k++) {
+        seen += atomic_load_explicit(&trace_hists[stage].hist[k], memory_order_relaxed);
+        if (seen >= need) {
+            return (uint32_t)((2ULL << k) - 1);
         }
     }
+    return UINT32_MAX;
+}
 
-    xSemaphoreGive(printer_state_mutex);
+// Copy the next frame for reader i (a client slot or MQTT_READER_ID) into
+// out, advancing its cursor. Returns the payload length, 0 if the reader is
+// caught up. Caller holds ws_clients_mutex.
+static size_t ws_reader_ring_next(ws_client_t *client, int i, ws_message_t *out)
+{
+    // Cursor fell behind the tail - the frames it pointed at are gone
+    size_t missed = ws_ring_catch_up(&ws_ring, &client->cursor);
+    if (missed > 0) {
+        client->overruns++;
+        ESP_LOGW(TAG, "Client %d fell %u bytes behind, skipping to oldest frame", i, (unsigned)missed);
+    }
+
+    size_t len = ws_ring_read(&ws_ring, &client->cursor, i, client->topics, out);
+    if (len > 0 && client->lag_warned &&
+        ws_ring_lag(&ws_ring, client->cursor) < WS_CLIENT_LAG_WARN_BYTES / 2) {
+        client->lag_warned = false;
+    }
+    return len;
 }
 
-// ============================================================================
-// USB CDC COMMUNICATION
-// ============================================================================
+// Latest-value slot for a message type, -1 for types that must not be conflated
+static int ws_state_slot_for(message_type_t type)
+{
+    switch (type) {
+        case MSG_TYPE_STATUS:      return WS_SLOT_STATUS;
+        case MSG_TYPE_TEMPERATURE: return WS_SLOT_TEMPERATURE;
+        case MSG_TYPE_POWER:       return WS_SLOT_POWER;
+        case MSG_TYPE_POSITION:    return WS_SLOT_POSITION;
+        case MSG_TYPE_PROGRESS:    return WS_SLOT_PROGRESS;
+        case MSG_TYPE_STATS:       return WS_SLOT_STATS;
+        default:                   return -1;
+    }
+}
 
-static bool handle_rx(const uint8_t *data, size_t data_len, void *arg)
+// Overwrite a state slot in place. Caller holds ws_clients_mutex.
+static void ws_state_slot_store(int slot, const ws_message_t *msg, const ws_trace_t *trace)
 {
-    DEBUG_LOG(TAG, "[USB] RX: %zu bytes", data_len);
+    ws_state_slot_t *s = &ws_state_slots[slot];
+    s->len = (uint16_t)strnlen(msg->json_payload, WS_MAX_PAYLOAD_SIZE - 1);
+    s->msg.type = msg->type;
+    s->msg.trace = *trace;
+    memcpy(s->msg.json_payload, msg->json_payload, s->len);
+    s->msg.json_payload[s->len] = '\0';
+    s->msg.bin_len = msg->bin_len;
+    memcpy(s->msg.bin_payload, msg->bin_payload, msg->bin_len);
+    s->updates++;
+    s->ring_pos = ws_ring.head;
+}
+
+// Next frame for reader i: pending state first, then the ring.
+// Returns the payload length, 0 if nothing is waiting. Caller holds
+// ws_clients_mutex.
+static size_t ws_reader_next_frame(ws_client_t *client, int i, ws_message_t *out)
+{
+    if (client->state_pending) {
+        int slot = __builtin_ctz(client->state_pending);
+        client->state_pending &= ~(1u << slot);
+        const ws_state_slot_t *s = &ws_state_slots[slot];
+        out->type = s->msg.type;
+        out->trace = s->msg.trace;
+        memcpy(out->json_payload, s->msg.json_payload, s->len + 1);
+        out->bin_len = s->msg.bin_len;
+        memcpy(out->bin_payload, s->msg.bin_payload, s->msg.bin_len);
+        return s->len;
+    }
+    return ws_reader_ring_next(client, i, out);
+}
+
+static size_t ws_client_next_frame(int i, ws_message_t *out)
+{
+    return ws_reader_next_frame(&ws_clients[i], i, out);
+}
+
+// Broadcast a frame built from a serial line that arrived at rx_us and was
+// parsed into msg at parsed_us; both 0 for frames with no serial source.
+static void ws_broadcast_traced(const ws_message_t *msg, uint32_t rx_us, uint32_t parsed_us)
+{
+    int slot = ws_state_slot_for(msg->type);
+    ws_trace_t trace = { .rx_us = rx_us, .enqueued_us = 0 };
+
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
     
-    // Process incoming serial data byte by byte, building complete lines
-    for (size_t i = 0; i < data_len; i++) {
-        char c = (char)data[i];
-        
-        // Handle line endings
-        if (c == '\n' || c == '\r') {
-            if (serial_line_pos > 0) {
-                serial_line_buffer[serial_line_pos] = '\0';
-                
-                // Parse and broadcast the complete line
-                parse_and_broadcast_line(serial_line_buffer);
-                
-                // Reset buffer for next line
-                serial_line_pos = 0;
+    if (rx_us) {
+        trace.enqueued_us = trace_now();
+        trace_record(TRACE_RX_TO_PARSE, parsed_us - rx_us);
+        trace_record(TRACE_PARSE_TO_ENQUEUE, trace.enqueued_us - parsed_us);
+    }
+    if (slot >= 0) {
+        ws_state_slot_store(slot, msg, &trace);
+        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+            if (ws_clients[i].active && !ws_clients[i].paused &&
+                (ws_clients[i].topics & WS_TOPIC_BIT(msg->type))) {
+                if (ws_clients[i].state_pending & (1u << slot)) {
+                    METRIC_INC(ws_frames_dropped[msg->type]);
+                }
+                ws_clients[i].state_pending |= 1u << slot;
             }
-        } else {
-            // Add character to buffer
-            if (serial_line_pos < SERIAL_LINE_BUFFER_SIZE - 1) {
-                serial_line_buffer[serial_line_pos++] = c;
-            } else {
-                // Buffer overflow - parse what we have and reset
-                serial_line_buffer[SERIAL_LINE_BUFFER_SIZE - 1] = '\0';
-                ESP_LOGW(TAG, "Line buffer overflow, forcing parse");
-                parse_and_broadcast_line(serial_line_buffer);
-                serial_line_pos = 0;
+        }
+        if (mqtt_reader.active && (mqtt_reader.topics & WS_TOPIC_BIT(msg->type))) {
+            mqtt_reader.state_pending |= 1u << slot;
+        }
+        if (udp_telemetry.sock >= 0 && msg->bin_len > 0) {
+            if (udp_telemetry.pending & (1u << slot)) {
+                METRIC_INC(udp_conflated);
             }
+            udp_telemetry.pending |= 1u << slot;
         }
+    } else {
+        ws_ring_write(&ws_ring, WS_RING_ALL_CLIENTS, msg, &trace);
     }
+    bool wake_mqtt = mqtt_reader.active && (mqtt_reader.topics & WS_TOPIC_BIT(msg->type));
+    bool wake_sender = udp_telemetry.pending != 0;
     
-    return true;
+    // Slow clients show up as cursor lag instead of a filling queue
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        wake_sender |= ws_clients[i].active;
+        if (ws_clients[i].active && !ws_clients[i].paused && !ws_clients[i].lag_warned) {
+            size_t lag = ws_ring.head - ws_clients[i].cursor;
+            if (lag > WS_CLIENT_LAG_WARN_BYTES) {
+                ESP_LOGW(TAG, "Client %d lagging %u bytes behind broadcast", i, (unsigned)lag);
+                ws_clients[i].lag_warned = true;
+            }
+        }
+    }
+    
+    xSemaphoreGive(ws_clients_mutex);
+
+    if (wake_sender && ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+    if (wake_mqtt && mqtt_task_handle) {
+        xTaskNotifyGive(mqtt_task_handle);
+    }
 }
 
-static void handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_ctx)
+static void ws_broadcast_message(const ws_message_t *msg)
 {
-    switch (event->type) {
-        case CDC_ACM_HOST_ERROR:
-            ESP_LOGE(TAG, "CDC-ACM error has occurred, err_no = %d", event->data.error);
-            break;
-        case CDC_ACM_HOST_DEVICE_DISCONNECTED:
-            ESP_LOGW(TAG, "Printer disconnected");
-            xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
-            printer_connected = false;
-            xSemaphoreGive(printer_state_mutex);
-            
-            // Broadcast disconnection status
-            ws_message_t msg;
-            build_status_message(&msg, false);
-            ws_broadcast_message(&msg);
-            
-            xSemaphoreGive(device_disconnected_sem);
-            break;
-        case CDC_ACM_HOST_SERIAL_STATE:
-            ESP_LOGI(TAG, "Serial state notif 0x%04X", event->data.serial_state.val);
-            break;
-        case CDC_ACM_HOST_NETWORK_CONNECTION:
-        default:
+    ws_broadcast_traced(msg, 0, 0);
+}
+
+// True if any active client subscribes to this message type, so producers can
+// skip formatting frames nobody will receive. Read without the mutex: a stale
+// answer costs at most one unneeded or one missed frame, and SUB: and RESUME
+// resend the current state. Paused clients want nothing.
+static bool ws_topic_wanted(message_type_t type)
+{
+    if (mqtt_reader.active && (mqtt_reader.topics & WS_TOPIC_BIT(type))) {
+        return true;
+    }
+    if (udp_telemetry.sock >= 0 && ws_state_slot_for(type) >= 0) {
+        return true;
+    }
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (ws_clients[i].active && !ws_clients[i].paused && (ws_clients[i].topics & WS_TOPIC_BIT(type))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int ws_client_find(int fd)
+{
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    int found = -1;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (ws_clients[i].active && ws_clients[i].fd == fd) {
+            found = i;
             break;
+        }
     }
+    xSemaphoreGive(ws_clients_mutex);
+    return found;
 }
 
-static void usb_lib_task(void *arg)
+// Queue a frame for a single client, in order with its broadcasts. State
+// messages refresh the shared slot and mark it pending for this client only -
+// the slot content is current state, so other clients lose nothing.
+static void ws_unicast_message(int client_id, const ws_message_t *msg)
 {
-    while (1) {
-        uint32_t event_flags;
-        usb_host_lib_handle_events(portMAX_DELAY, &event_flags);
-        
-        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS) {
-            ESP_LOGI(TAG, "No more USB clients");
+    int slot = ws_state_slot_for(msg->type);
+
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    bool queued = ws_clients[client_id].active;
+    static const ws_trace_t untraced = { 0 };
+    if (queued && slot >= 0) {
+        ws_state_slot_store(slot, msg, &untraced);
+        ws_clients[client_id].state_pending |= 1u << slot;
+    } else if (queued) {
+        ws_ring_write(&ws_ring, (int8_t)client_id, msg, &untraced);
+    }
+    xSemaphoreGive(ws_clients_mutex);
+
+    if (queued && ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+}
+
+// ============================================================================
+// JSON MESSAGE BUILDERS
+// ============================================================================
+
+static void build_status_message(ws_message_t *msg, bool connected)
+{
+    static const char *const refresh_names[] = { "idle", "running", "done", "failed" };
+    json_writer_t w;
+
+    msg->type = MSG_TYPE_STATUS;
+    msg->bin_payload[0] = WS_BIN_STATUS;
+    msg->bin_payload[1] = connected ? 1 : 0;
+    msg->bin_len = 2;
+
+    json_init(&w, msg->json_payload, WS_MAX_PAYLOAD_SIZE);
+    json_lit(&w, "{\"type\":\"status\",\"connected\":");
+    json_bool(&w, connected);
+    if (connected && printer_serial[0]) {
+        json_lit(&w, ",\"serial\":");
+        json_str(&w, printer_serial, sizeof(printer_serial), 0);
+    }
+
+    uint32_t lines = atomic_load(&gcode_stream.lines);
+    bool receiving = atomic_load(&gcode_stream.receiving);
+    if (lines != 0 || receiving) {
+        // Upload progress rides along until the next upload replaces it
+        uint32_t bytes = atomic_load(&gcode_stream.bytes);
+        uint32_t acked = atomic_load(&gcode_stream.acked);
+        int64_t end_us = gcode_stream.end_us ? gcode_stream.end_us : esp_timer_get_time();
+        int64_t elapsed_us = end_us - gcode_stream.start_us;
+        uint32_t bps = elapsed_us > 0 ? (uint32_t)((int64_t)bytes * 1000000 / elapsed_us) : 0;
+
+        uint8_t *b = msg->bin_payload + 2;
+        *b++ = receiving ? 1 : 0;
+        b = bin_put_i32(b, (int32_t)bytes);
+        b = bin_put_i32(b, (int32_t)lines);
+        b = bin_put_i32(b, (int32_t)acked);
+        b = bin_put_i32(b, (int32_t)bps);
+        bin_finish(msg, b);
+
+        json_lit(&w, ",\"stream\":{\"receiving\":");
+        json_bool(&w, receiving);
+        json_lit(&w, ",\"bytes\":");
+        json_uint(&w, bytes);
+        json_lit(&w, ",\"total\":");
+        json_uint(&w, atomic_load(&gcode_stream.total));
+        json_lit(&w, ",\"lines\":");
+        json_uint(&w, lines);
+        json_lit(&w, ",\"acked\":");
+        json_uint(&w, acked);
+        json_lit(&w, ",\"bps\":");
+        json_uint(&w, bps);
+        if (gcode_stream.macro[0]) {
+            // The binary record has no room for the name
+            msg->bin_len = 0;
+            json_lit(&w, ",\"macro\":");
+            json_str(&w, gcode_stream.macro, sizeof(gcode_stream.macro), 2);
+        } else if (gcode_stream.spool) {
+            // Lines waiting in gcode_queue or in flight: what the printer can
+            // run on if the feed stalls. Unlocked reads are fine for a readout.
+            bool paused = atomic_load(&gcode_stream.paused);
+            uint32_t buffered = uxQueueMessagesWaiting(gcode_queue) +
+                                (gcode_window.next_line - gcode_window.acked);
+            msg->bin_len = 0;
+            json_lit(&w, ",\"paused\":");
+            json_bool(&w, paused);
+            json_lit(&w, ",\"rate\":");
+            json_uint(&w, paused ? 0 : atomic_load(&gcode_stream.rate));
+            json_lit(&w, ",\"buffered\":");
+            json_uint(&w, buffered);
+            json_lit(&w, ",\"bufferSize\":");
+            json_uint(&w, GCODE_QUEUE_SIZE + GCODE_WINDOW_SIZE);
+            json_lit(&w, ",\"spool\":");
+            json_str(&w, spool.name, sizeof(spool.name), 2);
         }
-        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE) {
-            ESP_LOGI(TAG, "All USB devices freed");
+        json_lit(&w, "}");
+    }
+
+    // Refresh progress has no binary form, so while there is any to report
+    // binary clients get this frame as JSON too
+    int refresh = atomic_load(&html_refresh.state);
+    if (refresh != HTML_REFRESH_IDLE) {
+        msg->bin_len = 0;
+        json_lit(&w, ",\"refresh\":{\"state\":\"");
+        json_raw(&w, refresh_names[refresh], strlen(refresh_names[refresh]));
+        json_lit(&w, "\",\"bytes\":");
+        json_uint(&w, atomic_load(&html_refresh.bytes));
+        json_lit(&w, ",\"total\":");
+        json_uint(&w, atomic_load(&html_refresh.total));
+        if (refresh == HTML_REFRESH_FAILED) {
+            // The error is cut short rather than the closing braces
+            json_lit(&w, ",\"error\":");
+            json_str(&w, last_download_error, sizeof(last_download_error), 2);
         }
+        json_lit(&w, "}");
     }
+    json_lit(&w, "}");
+    json_end(&w);
+}
+
+static void gcode_stream_publish(void)
+{
+    ws_message_t msg;
+
+    gcode_stream.last_report_us = esp_timer_get_time();
+    build_status_message(&msg, g_prusa_dev != NULL);
+    ws_broadcast_message(&msg);
+}
+
+static void html_refresh_publish(void)
+{
+    ws_message_t msg;
+
+    html_refresh.last_report_us = esp_timer_get_time();
+    build_status_message(&msg, g_prusa_dev != NULL);
+    ws_broadcast_message(&msg);
 }
 
 // ============================================================================
-// REMOTE HTML DOWNLOAD (Preserved from V2)
+// MEMORY TIERS
+// Hot buffers - USB transfers, the RX ring, WS frames and per-client rings -
+// always stay in internal RAM. Bulk storage (telemetry history, the serial
+// log backlog, the upload window, a RAM copy of a SPIFFS page) moves to PSRAM
+// on CONFIG_SPIRAM builds, sized from the PSRAM found at boot. Other builds
+// keep the static baselines, so nothing here can fail at runtime.
 // ============================================================================
 
 typedef struct {
-    FILE *fp;
-    size_t len;
-    bool failed;
-} download_buffer_t;
+    size_t psram_bytes;                        // Detected at boot, 0 = none
+    size_t psram_used;                         // Taken by the bulk buffers below
+} mem_tier_t;
 
-esp_err_t http_event_handler(esp_http_client_event_t *evt)
-{
-    download_buffer_t *output = (download_buffer_t *)evt->user_data;
+static mem_tier_t mem_tier;
 
-    switch (evt->event_id) {
-        case HTTP_EVENT_ON_DATA:
-            if (output->failed) return ESP_OK;
+#if CONFIG_SPIRAM
+#define MEM_BULK_STATIC(bytes)      (0)        // Allocated at boot instead
+#else
+#define MEM_BULK_STATIC(bytes)      (bytes)
 
-            if (output->fp == NULL) {
-                ESP_LOGE(TAG, "No flash file open - aborting download");
+static uint8_t serial_log_backlog_storage[SERIAL_LOG_BACKLOG_SIZE];
+static history_sample_t telemetry_history_storage[TELEMETRY_HISTORY_SAMPLES];
+static char gcode_stream_storage[GCODE_STREAM_CHUNK_SIZE];
+#endif
+
+#if CONFIG_SPIRAM
+// size bytes of PSRAM, or the internal baseline when PSRAM is missing or
+// short (CONFIG_SPIRAM_IGNORE_NOTFOUND boots without it). Boot time only.
+static void *mem_bulk_alloc(size_t *size, size_t baseline)
+{
+    void *p = NULL;
+
+    if (mem_tier.psram_bytes > 0 && *size > baseline) {
+        p = heap_caps_calloc(1, *size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (p != NULL) {
+            mem_tier.psram_used += *size;
+            return p;
+        }
+    }
+    *size = baseline;
+    p = heap_caps_calloc(1, baseline, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ESP_ERROR_CHECK(p != NULL ? ESP_OK : ESP_ERR_NO_MEM);
+    return p;
+}
+#endif
+
+// Point the bulk buffers at their storage. Called from app_main before any
+// task that uses them is started.
+static void mem_tier_init(void)
+{
+#if CONFIG_SPIRAM
+    if (esp_psram_is_initialized()) {
+        mem_tier.psram_bytes = esp_psram_get_size();
+    }
+    size_t mb = mem_tier.psram_bytes / (1024 * 1024);
+
+    size_t backlog = SERIAL_LOG_BACKLOG_SIZE;
+    while (backlog * 2 <= mb * PSRAM_LOG_BACKLOG_PER_MB && backlog * 2 <= PSRAM_LOG_BACKLOG_MAX) {
+        backlog *= 2;
+    }
+    serial_log_backlog.buf = mem_bulk_alloc(&backlog, SERIAL_LOG_BACKLOG_SIZE);
+    serial_log_backlog.size = backlog;
+
+    size_t samples = mb * PSRAM_HISTORY_SAMPLES_PER_MB;
+    if (samples > PSRAM_HISTORY_SAMPLES_MAX) samples = PSRAM_HISTORY_SAMPLES_MAX;
+    size_t history = samples * sizeof(history_sample_t);
+    telemetry_history.samples = mem_bulk_alloc(&history, TELEMETRY_HISTORY_SAMPLES * sizeof(history_sample_t));
+    telemetry_history.capacity = history / sizeof(history_sample_t);
+
+    size_t upload = PSRAM_UPLOAD_CHUNK_SIZE;
+    gcode_stream.buf = mem_bulk_alloc(&upload, GCODE_STREAM_CHUNK_SIZE);
+    gcode_stream.buf_size = upload;
+#else
+    serial_log_backlog.buf = serial_log_backlog_storage;
+    serial_log_backlog.size = SERIAL_LOG_BACKLOG_SIZE;
+    telemetry_history.samples = telemetry_history_storage;
+    telemetry_history.capacity = TELEMETRY_HISTORY_SAMPLES;
+    gcode_stream.buf = gcode_stream_storage;
+    gcode_stream.buf_size = GCODE_STREAM_CHUNK_SIZE;
+#endif
+
+    ESP_LOGI(TAG, "[MEM] PSRAM %u KB (%u KB used): log backlog %u KB, history %u samples, upload window %u bytes",
+             (unsigned)(mem_tier.psram_bytes / 1024), (unsigned)(mem_tier.psram_used / 1024),
+             (unsigned)(serial_log_backlog.size / 1024), (unsigned)telemetry_history.capacity,
+             (unsigned)gcode_stream.buf_size);
+}
+
+// ============================================================================
+// SERIAL LOG BACKLOG
+// Byte-bounded ring of the most recent raw lines, so a client opening the page
+// mid-print sees the firmware messages it missed.
+// ============================================================================
+
+static void log_backlog_copy_out(size_t pos, uint8_t *dst, size_t len)
+{
+    for (size_t k = 0; k < len; k++) {
+        dst[k] = serial_log_backlog.buf[(pos + k) & (serial_log_backlog.size - 1)];
+    }
+}
+
+// Called from the parser task for every line. Returns the backlog position
+// just past the new line.
+static size_t log_backlog_append(const char *line, size_t len)
+{
+    serial_log_backlog_t *b = &serial_log_backlog;
+
+    if (len > SERIAL_LOG_BACKLOG_LINE_MAX) len = SERIAL_LOG_BACKLOG_LINE_MAX;
+
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    size_t mask = b->size - 1;
+    while (b->size - (b->head - b->tail) < len + 1) {
+        b->tail += 1 + b->buf[b->tail & mask];
+    }
+    b->buf[b->head & mask] = (uint8_t)len;
+    for (size_t k = 0; k < len; k++) {
+        b->buf[(b->head + 1 + k) & mask] = (uint8_t)line[k];
+    }
+    b->head += 1 + len;
+
+    // Keep the replay start on a record boundary within the newest
+    // SERIAL_LOG_BACKLOG_SIZE bytes, however large the ring is
+    if (b->head - b->replay > b->head - b->tail) {
+        b->replay = b->tail;
+    }
+    while (b->head - b->replay > SERIAL_LOG_BACKLOG_SIZE) {
+        b->replay += 1 + b->buf[b->replay & mask];
+    }
+    size_t pos = b->head;
+    xSemaphoreGive(log_backlog_mutex);
+    return pos;
+}
+
+// Lines up to pos are in the broadcast ring (or were not wanted by anyone)
+static void log_backlog_mark_live(size_t pos)
+{
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    serial_log_backlog.live_end = pos;
+    xSemaphoreGive(log_backlog_mutex);
+}
+
+// Copy the line at *pos into out (SERIAL_LOG_BACKLOG_LINE_MAX bytes) and
+// advance *pos. Returns the line length, or -1 once *pos reaches end. Lines
+// overwritten since *pos was taken are skipped.
+static int log_backlog_read(size_t *pos, size_t end, uint8_t *out)
+{
+    serial_log_backlog_t *b = &serial_log_backlog;
+    int len = -1;
+
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    if (b->head - *pos > b->head - b->tail) {
+        *pos = b->tail;
+    }
+    // After skipping overwritten lines *pos may have passed end
+    if (*pos != end && end - *pos <= b->head - *pos) {
+        len = b->buf[*pos & (b->size - 1)];
+        log_backlog_copy_out(*pos + 1, out, len);
+        *pos += 1 + len;
+    }
+    xSemaphoreGive(log_backlog_mutex);
+    return len;
+}
+
+// ============================================================================
+// LOG BATCHER
+// Serial lines are packed into {"type":"logs","lines":[...]} frames so a burst
+// of output costs one queue slot per client instead of one per line.
+// Only used from the serial parser task.
+// ============================================================================
+
+#define LOG_BATCH_PREFIX        "{\"type\":\"logs\",\"lines\":["
+#define LOG_BATCH_SUFFIX        "]}"
+
+typedef struct {
+    ws_message_t msg;
+    json_writer_t w;             // Over msg.json_payload, short of room for the suffix
+    int lines;
+    int64_t first_line_us;       // When the oldest line in the batch arrived
+    uint32_t first_line_rx_us;   // Trace: its USB transfer
+    size_t backlog_end;          // Log backlog position just past the last line
+} log_batch_t;
+
+static log_batch_t log_batch;
+
+static void log_batch_flush(void)
+{
+    if (log_batch.lines == 0) return;
+
+    memcpy(&log_batch.msg.json_payload[log_batch.w.len], LOG_BATCH_SUFFIX, sizeof(LOG_BATCH_SUFFIX));
+    log_batch.msg.type = MSG_TYPE_LOG;
+    log_backlog_mark_live(log_batch.backlog_end);
+    ws_broadcast_traced(&log_batch.msg, log_batch.first_line_rx_us, trace_now());
+
+    log_batch.lines = 0;
+}
+
+// Lines are escaped straight into the frame; one that does not fit behind
+// the lines already batched is taken back out and starts the next frame
+static void log_batch_add(const char *line, size_t len, size_t backlog_end)
+{
+    json_writer_t *w = &log_batch.w;
+
+    if (log_batch.lines > 0) {
+        size_t mark = w->len;
+        json_lit(w, ",");
+        if (json_str(w, line, len, 0) && !w->full) {
+            log_batch.lines++;
+            log_batch.backlog_end = backlog_end;
+            return;
+        }
+        w->len = mark;
+        w->full = false;
+        log_batch_flush();
+    }
+
+    // An empty batch takes the line, cut short if it must be
+    json_init(w, log_batch.msg.json_payload, LOG_BATCH_MAX_BYTES - (sizeof(LOG_BATCH_SUFFIX) - 1));
+    json_lit(w, LOG_BATCH_PREFIX);
+    json_str(w, line, len, 0);
+    log_batch.first_line_us = esp_timer_get_time();
+    log_batch.first_line_rx_us = serial_line_rx_us;
+    log_batch.lines = 1;
+    log_batch.backlog_end = backlog_end;
+}
+
+// Milliseconds until the pending batch must go out, -1 if nothing is pending
+static int log_batch_ms_until_due(void)
+{
+    if (log_batch.lines == 0) return -1;
+    int64_t age_ms = (esp_timer_get_time() - log_batch.first_line_us) / 1000;
+    return age_ms >= LOG_BATCH_MAX_MS ? 0 : (int)(LOG_BATCH_MAX_MS - age_ms);
+}
+
+// ============================================================================
+// TELEMETRY TOPICS - change suppression and coalescing
+// Each state topic is broadcast at most once per parsed line, only when a value
+// has moved past its deadband relative to what clients last received.
+// ============================================================================
+
+// Runtime state of each schema topic (telemetry_schema[], TELEMETRY_TOPICS)
+typedef struct {
+    uint32_t min_interval_ms;
+    int64_t last_sent_us;
+    bool pending;                // Past its deadband, held back by min_interval_ms
+    uint32_t rx_us;              // Trace: USB arrival of the oldest unsent change
+    uint32_t sent_count;
+    uint32_t suppressed_count;
+} telemetry_topic_t;
+
+// Parser task only, like current_*. /metrics reads the counters unlocked.
+static telemetry_topic_t telemetry_topics[TELEMETRY_TOPIC_COUNT] = {
+    [TELEMETRY_TOPIC_TEMPERATURE] = { TOPIC_MIN_INTERVAL_TEMPERATURE_MS },
+    [TELEMETRY_TOPIC_POWER]       = { TOPIC_MIN_INTERVAL_POWER_MS },
+    [TELEMETRY_TOPIC_POSITION]    = { TOPIC_MIN_INTERVAL_POSITION_MS },
+    [TELEMETRY_TOPIC_PROGRESS]    = { TOPIC_MIN_INTERVAL_PROGRESS_MS },
+};
+
+// Last values actually broadcast - deadbands are measured against these
+#define TELEMETRY_SENT_STATE(id, name, type, record, T, member, ...)    static T sent_##member;
+TELEMETRY_TOPICS(TELEMETRY_SENT_STATE)
+
+// Each topic's state, current and as last sent, by topic id
+#define TELEMETRY_CURRENT_PTR(id, name, type, record, T, member, ...)   [TELEMETRY_TOPIC_##id] = &current_##member,
+#define TELEMETRY_SENT_PTR(id, name, type, record, T, member, ...)      [TELEMETRY_TOPIC_##id] = &sent_##member,
+#define TELEMETRY_SNAPSHOT_OFFSET(id, name, type, record, T, member, ...) \
+    [TELEMETRY_TOPIC_##id] = offsetof(printer_snapshot_t, member),
+static void *const telemetry_current[TELEMETRY_TOPIC_COUNT] = { TELEMETRY_TOPICS(TELEMETRY_CURRENT_PTR) };
+static void *const telemetry_sent[TELEMETRY_TOPIC_COUNT] = { TELEMETRY_TOPICS(TELEMETRY_SENT_PTR) };
+static const uint16_t telemetry_snapshot_offset[TELEMETRY_TOPIC_COUNT] = {
+    TELEMETRY_TOPICS(TELEMETRY_SNAPSHOT_OFFSET)
+};
+
+static const void *telemetry_snapshot_state(const printer_snapshot_t *snap, telemetry_topic_id_t id)
+{
+    return (const char *)snap + telemetry_snapshot_offset[id];
+}
+
+static void telemetry_topic_send(telemetry_topic_id_t id, int64_t now_us)
+{
+    ws_message_t msg;
+
+    // Nobody subscribed - skip formatting; SUB: sends a fresh snapshot later
+    if (!ws_topic_wanted(telemetry_schema[id].msg_type)) {
+        telemetry_topics[id].pending = false;
+        return;
+    }
+
+    telemetry_build_message(&msg, id, telemetry_current[id]);
+    memcpy(telemetry_sent[id], telemetry_current[id], telemetry_schema[id].state_size);
+
+    ws_broadcast_traced(&msg, telemetry_topics[id].rx_us, trace_now());
+    telemetry_topics[id].last_sent_us = now_us;
+    telemetry_topics[id].pending = false;
+    telemetry_topics[id].sent_count++;
+}
+
+static bool telemetry_topic_interval_elapsed(const telemetry_topic_t *topic, int64_t now_us)
+{
+    return topic->min_interval_ms == 0 ||
+           now_us - topic->last_sent_us >= (int64_t)topic->min_interval_ms * 1000;
+}
+
+// Called after a parsed line was applied to the printer state (parser task)
+static void telemetry_topics_publish(uint32_t present)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        telemetry_topic_t *topic = &telemetry_topics[id];
+        if (!(present & telemetry_schema[id].line_fields)) continue;
+
+        if (telemetry_exceeds_deadband(id, telemetry_current[id], telemetry_sent[id])) {
+            if (!topic->pending) {
+                topic->rx_us = serial_line_rx_us;
+            }
+            topic->pending = true;
+        } else if (!topic->pending) {
+            topic->suppressed_count++;
+            continue;
+        }
+
+        if (telemetry_topic_interval_elapsed(topic, now_us)) {
+            telemetry_topic_send(id, now_us);
+        }
+    }
+}
+
+// Sends changes that were held back by a topic's minimum interval (parser task)
+static void telemetry_topics_flush_pending(void)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        if (telemetry_topics[id].pending && telemetry_topic_interval_elapsed(&telemetry_topics[id], now_us)) {
+            telemetry_topic_send(id, now_us);
+        }
+    }
+}
+
+// ============================================================================
+// TELEMETRY HISTORY
+// A fixed ring of quantized samples taken every TELEMETRY_HISTORY_INTERVAL_MS
+// while the printer is connected. New clients get it in one bulk frame.
+// ============================================================================
+
+static int16_t history_quantize(float v, float scale)
+{
+    long q = lroundf(v * scale);
+    if (q > INT16_MAX) return INT16_MAX;
+    if (q < INT16_MIN) return INT16_MIN;
+    return (int16_t)q;
+}
+
+// Called from the parser task on every wakeup
+static void telemetry_history_sample(int64_t now_us)
+{
+    if (now_us - telemetry_history.last_sample_us < (int64_t)TELEMETRY_HISTORY_INTERVAL_MS * 1000) {
+        return;
+    }
+
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    telemetry_history.last_sample_us = now_us;
+    if (printer_connected) {
+        history_sample_t *s = &telemetry_history.samples[telemetry_history.recorded % telemetry_history.capacity];
+        s->v[HIST_NOZZLE]        = history_quantize(current_temps.nozzle_current, 10.0f);
+        s->v[HIST_NOZZLE_TARGET] = history_quantize(current_temps.nozzle_target, 10.0f);
+        s->v[HIST_BED]           = history_quantize(current_temps.bed_current, 10.0f);
+        s->v[HIST_BED_TARGET]    = history_quantize(current_temps.bed_target, 10.0f);
+        s->v[HIST_HEATBREAK]     = history_quantize(current_temps.heatbreak_current, 10.0f);
+        s->v[HIST_CHAMBER]       = history_quantize(current_temps.chamber_current, 10.0f);
+        s->v[HIST_NOZZLE_PWM]    = (int16_t)current_power.nozzle_pwm;
+        s->v[HIST_BED_PWM]       = (int16_t)current_power.bed_pwm;
+        s->v[HIST_HEATBREAK_PWM] = (int16_t)current_power.heatbreak_pwm;
+        telemetry_history.recorded++;
+    }
+    xSemaphoreGive(printer_state_mutex);
+}
+
+// Oldest sample still held and number of samples available
+static void telemetry_history_range(uint32_t *first, uint32_t *count)
+{
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    uint32_t recorded = telemetry_history.recorded;
+    *count = recorded < telemetry_history.capacity ? recorded : telemetry_history.capacity;
+    *first = recorded - *count;
+    xSemaphoreGive(printer_state_mutex);
+}
+
+// Copy samples [first, first + n) out of the ring
+static void telemetry_history_copy(uint32_t first, uint32_t n, history_sample_t *out)
+{
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    for (uint32_t k = 0; k < n; k++) {
+        out[k] = telemetry_history.samples[(first + k) % telemetry_history.capacity];
+    }
+    xSemaphoreGive(printer_state_mutex);
+}
+
+// Clip the sample range [from, to) to what the ring still holds
+static void telemetry_history_clip(uint32_t from, uint32_t to, uint32_t *start, uint32_t *end)
+{
+    uint32_t first, count;
+
+    telemetry_history_range(&first, &count);
+    *start = from > first ? from : first;
+    *end = to < first + count ? to : first + count;
+    if (*start > *end) *start = *end;
+}
+
+// One downsampled point: min, max and sum per field over its samples
+typedef struct {
+    uint32_t seq;                              // First sample
+    uint32_t n;
+    int16_t min[HIST_FIELD_COUNT];
+    int16_t max[HIST_FIELD_COUNT];
+    int32_t sum[HIST_FIELD_COUNT];
+} history_bucket_t;
+
+typedef esp_err_t (*history_emit_fn)(void *ctx, const char *text, size_t len);
+
+// Temperatures in degC, PWM as reported
+static int history_format_value(char *buf, size_t size, int field, float v)
+{
+    return snprintf(buf, size, field < HIST_NOZZLE_PWM ? ",%.1f" : ",%.0f", field < HIST_NOZZLE_PWM ? v / 10.0f : v);
+}
+
+// "[seq,n,min...,max...,avg...]" per field in history_field_t order
+static int history_bucket_format(char *buf, size_t size, const history_bucket_t *b, bool first)
+{
+    int n = snprintf(buf, size, "%s[%u,%u", first ? "" : ",", (unsigned)b->seq, (unsigned)b->n);
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        n += history_format_value(buf + n, size - n, f, b->min[f]);
+    }
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        n += history_format_value(buf + n, size - n, f, b->max[f]);
+    }
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        n += history_format_value(buf + n, size - n, f, (float)b->sum[f] / b->n);
+    }
+    n += snprintf(buf + n, size - n, "]");
+    return n;
+}
+
+// Fold samples [start, end) into at most points equal buckets in a single pass
+// over the ring, handing the formatted buckets to emit. The output grows with
+// points, however long the range.
+static esp_err_t history_downsample(uint32_t start, uint32_t end, uint32_t points,
+                                    history_emit_fn emit, void *ctx)
+{
+    history_sample_t batch[API_HISTORY_BATCH];
+    history_bucket_t b = { 0 };
+    char chunk[512];
+    uint32_t count = end - start;
+    uint32_t bucket = 0;
+    uint32_t bucket_end = start + (uint32_t)((uint64_t)count / points);
+    int n = 0;
+    esp_err_t err = ESP_OK;
+
+    for (uint32_t seq = start; seq < end && err == ESP_OK; ) {
+        uint32_t take = end - seq < API_HISTORY_BATCH ? end - seq : API_HISTORY_BATCH;
+        telemetry_history_copy(seq, take, batch);
+
+        for (uint32_t k = 0; k < take && err == ESP_OK; k++) {
+            const int16_t *v = batch[k].v;
+            if (b.n == 0) {
+                b.seq = seq + k;
+                memcpy(b.min, v, sizeof(b.min));
+                memcpy(b.max, v, sizeof(b.max));
+                memset(b.sum, 0, sizeof(b.sum));
+            }
+            for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+                if (v[f] < b.min[f]) b.min[f] = v[f];
+                if (v[f] > b.max[f]) b.max[f] = v[f];
+                b.sum[f] += v[f];
+            }
+            b.n++;
+            if (seq + k + 1 < bucket_end) continue;
+
+            n += history_bucket_format(chunk + n, sizeof(chunk) - n, &b, bucket == 0);
+            if (n >= (int)sizeof(chunk) - 256) {
+                err = emit(ctx, chunk, n);
+                n = 0;
+            }
+            b.n = 0;
+            bucket++;
+            bucket_end = start + (uint32_t)((uint64_t)count * (bucket + 1) / points);
+        }
+        seq += take;
+    }
+    if (n > 0 && err == ESP_OK) {
+        err = emit(ctx, chunk, n);
+    }
+    return err;
+}
+
+// ============================================================================
+// FLASH RECORDER
+// Append-only log of downsampled telemetry and job events that survives
+// reboots. Producers only copy a 16-byte record into the RAM page under
+// recorder.mutex; a full page is handed to recorder_task, which alone touches
+// flash, so nothing on the USB or parse path ever waits for an erase. Each
+// page is written once and each sector erased once per lap of the ring: at
+// the default sample rate a 512 KB partition laps in about three weeks.
+// ============================================================================
+
+typedef enum {
+    REC_NONE = 0,                              // Padding in a page flushed early
+    REC_SAMPLE,                                // arg percent or REC_NO_JOB; data 4 x i16 0.1 degC:
+                                               // nozzle, nozzle target, bed, bed target
+    REC_JOB_START,                             // arg percent; data i16 time left (mins)
+    REC_JOB_END,                               // arg percent: 100 finished, less if stopped
+    REC_PRINTER_ERROR,                         // data: start of the message text
+    REC_BOOT,                                  // arg esp_reset_reason()
+    REC_TYPE_COUNT
+} recorder_type_t;
+
+#define REC_NO_JOB                  (0xFFFF)
+#define REC_FLAG_UPTIME             (1u << 0)  // t is seconds since boot: the clock was not set
+
+typedef struct {
+    uint32_t t;                                // Unix seconds, see REC_FLAG_UPTIME
+    uint8_t type;                              // recorder_type_t
+    uint8_t flags;
+    uint16_t arg;
+    uint8_t data[8];
+} recorder_rec_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;                              // Pages written since the partition was new
+    uint32_t t_first;                          // t of the first record
+    uint32_t crc;                              // Over recs
+} recorder_page_hdr_t;
+
+#define RECORDER_RECS_PER_PAGE      ((RECORDER_PAGE_SIZE - sizeof(recorder_page_hdr_t)) / sizeof(recorder_rec_t))
+
+typedef struct {
+    recorder_page_hdr_t hdr;
+    recorder_rec_t recs[RECORDER_RECS_PER_PAGE];
+} recorder_page_t;
+
+_Static_assert(sizeof(recorder_page_t) == RECORDER_PAGE_SIZE, "Recorder page must fill one flash page");
+
+#define RECORDER_SECTOR_EMPTY       (UINT32_MAX)
+
+// First page of each sector, for time-range lookups without reading flash
+typedef struct {
+    uint32_t seq;                              // RECORDER_SECTOR_EMPTY if never written
+    uint32_t t_first;
+} recorder_index_t;
+
+#define RECORDER_WORK_SAMPLE        (1u << 0)
+#define RECORDER_WORK_FLUSH         (1u << 1)  // Write the full page
+#define RECORDER_WORK_SYNC          (1u << 2)  // Write the partial page too, before a reboot
+
+static struct {
+    const esp_partition_t *part;
+    SemaphoreHandle_t mutex;                   // Everything below
+    uint32_t pages;                            // Ring size in pages
+    uint32_t pages_per_sector;
+    uint32_t sectors;
+    uint32_t next_seq;                         // Sequence number of the next page written
+    recorder_page_t fill;                      // Being batched
+    uint32_t fill_count;
+    recorder_page_t flush;                     // Full, waiting for recorder_task
+    bool flush_ready;
+    bool job_active;                           // Parser task only
+    recorder_index_t index[RECORDER_MAX_SECTORS];
+} recorder;
+
+static TaskHandle_t recorder_task_handle = NULL;
+
+static bool recorder_clock_valid(void)
+{
+    return time(NULL) >= RECORDER_CLOCK_VALID;
+}
+
+// Queue one record. Callable from any task, never blocks on flash.
+static void recorder_append(recorder_type_t type, uint16_t arg, const uint8_t *data, size_t len)
+{
+    if (recorder.mutex == NULL || recorder.part == NULL) return;
+
+    recorder_rec_t rec = { .type = (uint8_t)type, .arg = arg };
+    if (recorder_clock_valid()) {
+        rec.t = (uint32_t)time(NULL);
+    } else {
+        rec.t = (uint32_t)(esp_timer_get_time() / 1000000);
+        rec.flags = REC_FLAG_UPTIME;
+    }
+    memcpy(rec.data, data, len < sizeof(rec.data) ? len : sizeof(rec.data));
+
+    bool full = false;
+    xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+    recorder.fill.recs[recorder.fill_count++] = rec;
+    if (recorder.fill_count == RECORDER_RECS_PER_PAGE) {
+        if (recorder.flush_ready) {
+            // The previous page is still being written: lose this one's records
+            METRIC_ADD(recorder_dropped, RECORDER_RECS_PER_PAGE);
+        } else {
+            recorder.flush = recorder.fill;
+            recorder.flush_ready = true;
+            full = true;
+        }
+        memset(&recorder.fill, 0, sizeof(recorder.fill));
+        recorder.fill_count = 0;
+    }
+    xSemaphoreGive(recorder.mutex);
+
+    if (full && recorder_task_handle) {
+        xTaskNotify(recorder_task_handle, RECORDER_WORK_FLUSH, eSetBits);
+    }
+}
+
+// Job start and end, from the progress fields printer_state_apply() changed.
+// Parser task; only appends to RAM.
+static void recorder_note_progress(uint32_t changed)
+{
+    if (!(changed & LINE_FIELDS_PROGRESS)) return;
+
+    printer_snapshot_t snap;
+    printer_state_read(&snap);
+    bool active = snap.progress.percent < 100 && snap.progress.time_left_mins > 0;
+    if (active != recorder.job_active) {
+        uint8_t data[2];
+        bin_put_i16(data, snap.progress.time_left_mins);
+        recorder_append(active ? REC_JOB_START : REC_JOB_END, (uint16_t)snap.progress.percent, data,
+                        active ? sizeof(data) : 0);
+        recorder.job_active = active;
+    }
+}
+
+// Printer errors ("Error:..." and "!! ..." lines), from the parser task
+static void recorder_note_error(const char *line, size_t len)
+{
+    size_t skip;
+
+    if (len >= 6 && memcmp(line, "Error:", 6) == 0) {
+        skip = 6;
+    } else if (len >= 2 && memcmp(line, "!!", 2) == 0) {
+        skip = 2;
+    } else {
+        return;
+    }
+    recorder_append(REC_PRINTER_ERROR, 0, (const uint8_t *)line + skip, len - skip);
+}
+
+static void recorder_sample(void)
+{
+    printer_snapshot_t snap;
+    uint8_t data[8];
+    uint8_t *p = data;
+
+    printer_state_read(&snap);
+    if (!snap.connected) return;
+    p = bin_put_i16(p, history_quantize(snap.temps.nozzle_current, 10.0f));
+    p = bin_put_i16(p, history_quantize(snap.temps.nozzle_target, 10.0f));
+    p = bin_put_i16(p, history_quantize(snap.temps.bed_current, 10.0f));
+    bin_put_i16(p, history_quantize(snap.temps.bed_target, 10.0f));
+    bool active = snap.progress.percent < 100 && snap.progress.time_left_mins > 0;
+    recorder_append(REC_SAMPLE, active ? (uint16_t)snap.progress.percent : REC_NO_JOB, data, sizeof(data));
+}
+
+// Bytes held in RAM, not yet on flash
+static size_t recorder_buffered_bytes(void)
+{
+    if (recorder.mutex == NULL) return 0;
+    xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+    size_t bytes = recorder.fill_count * sizeof(recorder_rec_t) + (recorder.flush_ready ? RECORDER_PAGE_SIZE : 0);
+    xSemaphoreGive(recorder.mutex);
+    return bytes;
+}
+
+static bool recorder_page_valid(const recorder_page_t *page, uint32_t page_no)
+{
+    return page->hdr.magic == RECORDER_MAGIC && page->hdr.seq % recorder.pages == page_no &&
+           page->hdr.crc == esp_rom_crc32_le(0, (const uint8_t *)page->recs, sizeof(page->recs));
+}
+
+// Write page at the next position, erasing its sector first when the page
+// opens one. recorder_task only.
+static void recorder_write_page(recorder_page_t *page)
+{
+    uint32_t page_no = recorder.next_seq % recorder.pages;
+    uint32_t sector = page_no / recorder.pages_per_sector;
+
+    page->hdr.magic = RECORDER_MAGIC;
+    page->hdr.seq = recorder.next_seq;
+    page->hdr.t_first = page->recs[0].t;
+    page->hdr.crc = esp_rom_crc32_le(0, (const uint8_t *)page->recs, sizeof(page->recs));
+
+    if (page_no % recorder.pages_per_sector == 0) {
+        xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+        recorder.index[sector].seq = RECORDER_SECTOR_EMPTY;
+        xSemaphoreGive(recorder.mutex);
+        esp_err_t err = esp_partition_erase_range(recorder.part, sector * recorder.part->erase_size,
+                                                  recorder.part->erase_size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "[REC] Erase of sector %u failed: %s", (unsigned)sector, esp_err_to_name(err));
+            METRIC_INC(recorder_write_errors);
+            return;
+        }
+        METRIC_INC(recorder_erases);
+    }
+    esp_err_t err = esp_partition_write(recorder.part, page_no * RECORDER_PAGE_SIZE, page, RECORDER_PAGE_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[REC] Page write failed: %s", esp_err_to_name(err));
+        METRIC_INC(recorder_write_errors);
+    } else {
+        METRIC_INC(recorder_pages);
+    }
+
+    xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+    if (page_no % recorder.pages_per_sector == 0) {
+        recorder.index[sector].seq = page->hdr.seq;
+        recorder.index[sector].t_first = page->hdr.t_first;
+    }
+    // Skipped past a failed page too: retrying would write it twice
+    recorder.next_seq++;
+    xSemaphoreGive(recorder.mutex);
+}
+
+// Rebuild the index from each sector's first page and find the write
+// position: one read per sector plus one per page of the newest sector.
+static void recorder_scan(void)
+{
+    recorder_page_hdr_t hdr;
+    uint32_t newest = RECORDER_SECTOR_EMPTY;
+    uint32_t newest_sector = 0;
+
+    for (uint32_t s = 0; s < recorder.sectors; s++) {
+        recorder.index[s].seq = RECORDER_SECTOR_EMPTY;
+        if (esp_partition_read(recorder.part, s * recorder.part->erase_size, &hdr, sizeof(hdr)) != ESP_OK ||
+            hdr.magic != RECORDER_MAGIC || hdr.seq % recorder.pages != s * recorder.pages_per_sector) {
+            continue;
+        }
+        recorder.index[s].seq = hdr.seq;
+        recorder.index[s].t_first = hdr.t_first;
+        if (newest == RECORDER_SECTOR_EMPTY || hdr.seq > newest) {
+            newest = hdr.seq;
+            newest_sector = s;
+        }
+    }
+    if (newest == RECORDER_SECTOR_EMPTY) {
+        recorder.next_seq = 0;
+        return;
+    }
+
+    // Any page that is not blank is used, torn writes included
+    uint32_t used = 1;
+    for (; used < recorder.pages_per_sector; used++) {
+        size_t off = newest_sector * recorder.part->erase_size + used * RECORDER_PAGE_SIZE;
+        if (esp_partition_read(recorder.part, off, &hdr, sizeof(hdr)) != ESP_OK ||
+            (hdr.magic == UINT32_MAX && hdr.seq == UINT32_MAX)) {
+            break;
+        }
+    }
+    recorder.next_seq = newest + used;
+}
+
+static void recorder_task(void *arg)
+{
+    static recorder_page_t partial;             // This task only
+
+    recorder_scan();
+    ESP_LOGI(TAG, "[REC] %u KB ring, next page %u", (unsigned)(recorder.part->size / 1024),
+             (unsigned)recorder.next_seq);
+    recorder_append(REC_BOOT, (uint16_t)esp_reset_reason(), NULL, 0);
+
+    while (1) {
+        uint32_t work = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &work, portMAX_DELAY);
+
+        if (work & RECORDER_WORK_SAMPLE) {
+            recorder_sample();
+        }
+
+        xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+        bool have_full = recorder.flush_ready;
+        bool have_partial = false;
+        if ((work & RECORDER_WORK_SYNC) && recorder.fill_count > 0) {
+            // The rest of the page stays REC_NONE padding
+            partial = recorder.fill;
+            memset(&recorder.fill, 0, sizeof(recorder.fill));
+            recorder.fill_count = 0;
+            have_partial = true;
+        }
+        xSemaphoreGive(recorder.mutex);
+
+        if (have_full) {
+            // Only this task clears flush_ready, so the page is stable meanwhile
+            recorder_write_page(&recorder.flush);
+            xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+            recorder.flush_ready = false;
+            xSemaphoreGive(recorder.mutex);
+        }
+        if (have_partial) {
+            recorder_write_page(&partial);
+        }
+    }
+}
+
+// Write out whatever is batched, e.g. before a reboot. Returns at once; the
+// write takes a page time.
+static void recorder_sync(void)
+{
+    if (recorder_task_handle) {
+        xTaskNotify(recorder_task_handle, RECORDER_WORK_SYNC, eSetBits);
+    }
+}
+
+static void recorder_start(void)
+{
+    recorder.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                             RECORDER_PARTITION_LABEL);
+    if (recorder.part == NULL) {
+        ESP_LOGW(TAG, "No '%s' partition, flash recorder disabled", RECORDER_PARTITION_LABEL);
+        return;
+    }
+    recorder.pages_per_sector = recorder.part->erase_size / RECORDER_PAGE_SIZE;
+    recorder.sectors = recorder.part->size / recorder.part->erase_size;
+    if (recorder.sectors > RECORDER_MAX_SECTORS) recorder.sectors = RECORDER_MAX_SECTORS;
+    if (recorder.sectors < 2) {
+        // Erasing the only sector would lose the whole history at once
+        ESP_LOGW(TAG, "'%s' partition too small for a ring, flash recorder disabled", RECORDER_PARTITION_LABEL);
+        recorder.part = NULL;
+        return;
+    }
+    recorder.pages = recorder.sectors * recorder.pages_per_sector;
+    recorder.mutex = xSemaphoreCreateMutexStatic(&rtos_objects.recorder);
+
+    // Timestamps are wall-clock once SNTP syncs; until then seconds since boot
+    esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(RECORDER_NTP_SERVER);
+    esp_netif_sntp_init(&sntp_config);
+
+    recorder_task_handle = xTaskCreateStaticPinnedToCore(recorder_task, "recorder", RECORDER_TASK_STACK,
+        NULL, 1, task_stacks.recorder, &task_tcbs.recorder, 1);
+}
+
+// ============================================================================
+// SERIAL LINE PARSER - THE HEART OF V3!
+// parse_serial_line() (components/printer_protocol) tokenizes each line in a
+// single pass; its result is merged into printer state and published here.
+// ============================================================================
+
+// Merge a parsed line into the printer state, returns the LINE_FIELD_* that changed.
+// Caller must hold printer_state_mutex.
+static uint32_t printer_state_apply(const parsed_line_t *parsed)
+{
+    uint32_t present = parsed->present;
+    uint32_t changed = 0;
+
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        changed |= telemetry_apply(id, telemetry_current[id], parsed);
+    }
+    if (present & LINE_FIELD_PRINT_DONE) {
+        if (current_progress.percent != 100 || current_progress.time_left_mins != 0) {
+            changed |= LINE_FIELD_PRINT_DONE;
+        }
+        current_progress.percent = 100;
+        current_progress.time_left_mins = 0;
+    }
+
+    if (changed) {
+        printer_state_generation++;
+    }
+    return changed;
+}
+
+// ============================================================================
+// BED MESH CACHE
+// The printer's topography report is parsed into a numeric grid once and kept
+// with a generation counter. Clients get it from the cache; the printer is
+// only re-queried after bed levelling or on explicit request.
+// ============================================================================
+
+// Queue M420 V unless one went out recently. force skips the holdoff.
+// Called from several tasks; last_query_us is only a rate limit, so an
+// unlocked read that races another caller at worst queues one extra query.
+static void mesh_request_refresh(bool force)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    if (!g_prusa_dev) return;
+    if (!force && mesh_cache.last_query_us != 0 &&
+        now_us - mesh_cache.last_query_us < (int64_t)MESH_REFRESH_HOLDOFF_MS * 1000) {
+        return;
+    }
+
+    if (gcode_enqueue("M420 V", false, 0)) {
+        mesh_cache.last_query_us = now_us;
+        DEBUG_LOG(TAG, "[MESH] Queued M420 V");
+    }
+}
+
+// Parse "  7 | +0.012 -0.034 [+0.001] ..." into pending row 7
+static void mesh_parse_row(const char *p, const char *end)
+{
+    int row = 0;
+    bool digits = false;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        row = row * 10 + (*p++ - '0');
+        digits = true;
+    }
+    p = skip_spaces(p, end);
+    if (!digits || row >= MESH_GRID_SIZE || p >= end || *p != '|') return;
+    p++;
+
+    int col = 0;
+    while (p < end && col < MESH_GRID_SIZE) {
+        // Skip separators and the markers around the current probe point
+        if (!(*p == '-' || *p == '+' || *p == '.' || (*p >= '0' && *p <= '9'))) {
+            p++;
+            continue;
+        }
+        float z;
+        if (!parse_number(&p, end, &z)) {
+            p++;
+            continue;
+        }
+        mesh_cache.pending[row][col++] = (int16_t)lroundf(z * 1000.0f);
+    }
+    if (col == MESH_GRID_SIZE) {
+        mesh_cache.rows_seen |= 1u << row;
+    }
+}
+
+// Feed one serial line through the mesh report state machine (parser task)
+static void mesh_cache_line(const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *p = skip_spaces(line, end);
+
+    if (p >= end) return;
+
+    if (mesh_cache.collecting) {
+        if (*p >= '0' && *p <= '9') {
+            mesh_parse_row(p, end);
+            return;
+        }
+        if (line_starts_with(p, end, "Mesh is ")) {
+            mesh_cache.collecting = false;
+            if (line_starts_with(p, end, "Mesh is valid") &&
+                mesh_cache.rows_seen == (1u << MESH_GRID_SIZE) - 1) {
+                xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+                memcpy(mesh_cache.z_um, mesh_cache.pending, sizeof(mesh_cache.z_um));
+                mesh_cache.generation++;
+                xSemaphoreGive(printer_state_mutex);
+                ESP_LOGI(TAG, "Bed mesh cached (generation %u)", (unsigned)mesh_cache.generation);
+                if (ws_sender_task_handle) {
+                    xTaskNotifyGive(ws_sender_task_handle);
+                }
+            } else {
+                ESP_LOGW(TAG, "Bed mesh report not cached, rows=0x%06x", (unsigned)mesh_cache.rows_seen);
+            }
+            return;
+        }
+        // Other output (temperature reports, echo:) can be interleaved; keep collecting
+    }
+
+    if (*p == 'B' && line_starts_with(p, end, "Bed Topography Report")) {
+        mesh_cache.collecting = true;
+        mesh_cache.rows_seen = 0;
+    } else if (*p == 'U' && line_starts_with(p, end, "Unified Bed Leveling System") &&
+               len >= 6 && memcmp(end - 6, "active", 6) == 0) {
+        // Printed once levelling finishes - including G29 run from a print file
+        mesh_request_refresh(false);
+    }
+}
+
+// ============================================================================
+// PRINT ANALYTICS
+// Layer times, extrusion, heater duty and drift from the slicer estimate,
+// folded in from every applied line by print_stats_update() in the protocol
+// component. Published on the conflated "stats" topic at each layer change,
+// job start and end, and every PRINT_STATS_INTERVAL_MS during a job.
+// ============================================================================
+
+static print_stats_t print_stats;              // Guarded by printer_state_mutex
+static int64_t print_stats_sent_us;            // Parser task only
+
+// Fold in a line just merged into the printer state; returns whether a
+// "stats" frame is due. Caller holds printer_state_mutex.
+static bool print_stats_apply(uint32_t present, int64_t now_us)
+{
+    uint32_t events = print_stats_update(&print_stats, present, &current_position, &current_power,
+                                         &current_progress, (uint32_t)(now_us / 1000));
+
+    return events != 0 ||
+           (print_stats.active && now_us - print_stats_sent_us >= (int64_t)PRINT_STATS_INTERVAL_MS * 1000);
+}
+
+static void print_stats_build(ws_message_t *msg)
+{
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    build_stats_message(msg, &print_stats, (uint32_t)(esp_timer_get_time() / 1000));
+    xSemaphoreGive(printer_state_mutex);
+}
+
+// Parser task, outside printer_state_mutex
+static void print_stats_publish(int64_t now_us)
+{
+    ws_message_t msg;
+
+    print_stats_sent_us = now_us;
+    // Nobody subscribed - SUB: sends a fresh snapshot later
+    if (!ws_topic_wanted(MSG_TYPE_STATS)) return;
+    print_stats_build(&msg);
+    ws_broadcast_traced(&msg, serial_line_rx_us, trace_now());
+}
+
+// ============================================================================
+// SERIAL LINE DISPATCH
+// ============================================================================
+
+static void parse_and_broadcast_line(const char *line, size_t len)
+{
+    parsed_line_t parsed;
+    
+    METRIC_INC(serial_lines);
+    size_t backlog_end = log_backlog_append(line, len);
+
+    // Every line goes to the log stream, batched with its neighbours
+    if (ws_topic_wanted(MSG_TYPE_LOG)) {
+        log_batch_add(line, len, backlog_end);
+    } else {
+        log_backlog_mark_live(backlog_end);
+    }
+    
+    parse_serial_line(line, len, &parsed);
+    if (parsed.incomplete) {
+        METRIC_INC(parse_errors);
+    }
+    mesh_cache_line(line, len);
+
+    // Hand acknowledgements to the G-code sender in the order they arrived
+    if ((parsed.present & (LINE_FIELD_OK | LINE_FIELD_RESEND)) && gcode_event_queue) {
+        gcode_event_t ev = {
+            .type = (parsed.present & LINE_FIELD_RESEND) ? GCODE_EVENT_RESEND : GCODE_EVENT_OK,
+            .line = parsed.resend_line,
+            .log_pos = backlog_end,
+        };
+        if (xQueueSend(gcode_event_queue, &ev, 0) != pdTRUE) {
+            ESP_LOGW(TAG, "[GCODE] Event queue full, ok credit lost");
+        }
+        if (gcode_sender_task_handle) {
+            xTaskNotifyGive(gcode_sender_task_handle);
+        }
+    }
+
+    if (parsed.present & LINE_FIELD_NO_M154) {
+        autoreport_position_unsupported();
+    }
+    recorder_note_error(line, len);
+
+    if ((parsed.present & ~(LINE_FIELD_OK | LINE_FIELD_RESEND | LINE_FIELD_NO_M154)) == 0) {
+        return;  // Nothing that touches printer state
+    }
+    
+    int64_t now_us = esp_timer_get_time();
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    parsed.changed = printer_state_apply(&parsed);
+    if (parsed.changed) {
+        printer_state_publish();
+    }
+    bool stats_due = print_stats_apply(parsed.present, now_us);
+    xSemaphoreGive(printer_state_mutex);
+    recorder_note_progress(parsed.changed);
+
+    ESP_LOGD(TAG, "[PARSE] present=0x%04x changed=0x%04x",
+             (unsigned)parsed.present, (unsigned)parsed.changed);
+
+    // One message per topic at most, and only if it moved past its deadband.
+    // Broadcasting takes ws_clients_mutex, so it stays outside printer_state_mutex.
+    telemetry_topics_publish(parsed.present);
+    if (stats_due) {
+        print_stats_publish(now_us);
+    }
+}
+
+#if ENABLE_PARSER_BENCHMARK || ENABLE_BENCH_ENDPOINT
+// ============================================================================
+// PARSER MICRO-BENCHMARK
+// ============================================================================
+
+// Representative Core One traffic: auto-reports, M114, M73 and plain replies
+static const char *const parser_benchmark_lines[] = {
+    "ok",
+    "T:215.32/215.00 B:60.05/60.00 X:45.12/45.00 A:41.90/0.00 C@:31.40 @:127 B@:64 HBR@:89",
+    "ok T:215.10/215.00 B:59.98/60.00 X:45.00/45.00 A:41.88/0.00 C@:31.41 @:120 B@:60 HBR@:89",
+    "X:108.67 Y:90.41 Z:2.20 E:1234.56 Count A:24936 B:3858 Z:23331",
+    "M73 Progress: 42%; Time left: 1h 23m; Change: 16m;",
+    "echo:busy: processing",
+    "ok",
+    "E0:3200 RPM PRN1:5100 RPM E0@:51 PRN1@:128",
+};
+#define PARSER_BENCHMARK_LINE_COUNT (sizeof(parser_benchmark_lines) / sizeof(parser_benchmark_lines[0]))
+#endif
+
+#if ENABLE_PARSER_BENCHMARK
+
+// The pre-tokenizer strstr/sscanf cascade, kept only as the benchmark baseline
+static void legacy_sscanf_parse_line(const char *line, parsed_line_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (strstr(line, "T:") && strstr(line, "B:")) {
+        const char *t_pos = strstr(line, "T:");
+        const char *b_pos = strstr(line, "B:");
+        if (sscanf(t_pos, "T:%f/%f", &out->temps.nozzle_current, &out->temps.nozzle_target) == 2 &&
+            sscanf(b_pos, "B:%f/%f", &out->temps.bed_current, &out->temps.bed_target) == 2) {
+            out->present |= LINE_FIELD_NOZZLE_TEMP | LINE_FIELD_BED_TEMP;
+        }
+        const char *x_pos = strstr(line, "X:");
+        if (x_pos && sscanf(x_pos, "X:%f/%f", &out->temps.heatbreak_current, &out->temps.heatbreak_target) == 2) {
+            out->present |= LINE_FIELD_HEATBREAK_TEMP;
+        }
+        const char *c_pos = strstr(line, "C@:");
+        if (c_pos && sscanf(c_pos, "C@:%f", &out->temps.chamber_current) == 1) {
+            out->present |= LINE_FIELD_CHAMBER_TEMP;
+        }
+        const char *nozzle_pwr = strstr(line, "@:");
+        const char *bed_pwr = strstr(line, "B@:");
+        const char *hb_pwr = strstr(line, "HBR@:");
+        if (nozzle_pwr && sscanf(nozzle_pwr, "@:%d", &out->power.nozzle_pwm) == 1) {
+            out->present |= LINE_FIELD_NOZZLE_PWM;
+        }
+        if (bed_pwr && sscanf(bed_pwr, "B@:%d", &out->power.bed_pwm) == 1) {
+            out->present |= LINE_FIELD_BED_PWM;
+        }
+        if (hb_pwr && sscanf(hb_pwr, "HBR@:%d", &out->power.heatbreak_pwm) == 1) {
+            out->present |= LINE_FIELD_HEATBREAK_PWM;
+        }
+    }
+
+    if (strstr(line, "Progress:") &&
+        sscanf(line, "%*[^P]Progress: %d%%", &out->progress.percent) == 1) {
+        out->present |= LINE_FIELD_PROGRESS;
+    }
+
+    const char *time_str = strstr(line, "Time left:");
+    if (time_str) {
+        int hours = 0, mins = 0;
+        if (sscanf(time_str, "Time left: %dh %dm", &hours, &mins) == 2) {
+            out->progress.time_left_mins = hours * 60 + mins;
+        } else if (sscanf(time_str, "Time left: %dm", &mins) == 1) {
+            out->progress.time_left_mins = mins;
+        }
+        out->present |= LINE_FIELD_TIME_LEFT;
+    }
+
+    const char *change_str = strstr(line, "Change:");
+    if (change_str) {
+        int hours = 0, mins = 0;
+        if (sscanf(change_str, "Change: %dh %dm", &hours, &mins) == 2) {
+            out->progress.change_mins = hours * 60 + mins;
+        } else if (sscanf(change_str, "Change: %dm", &mins) == 1) {
+            out->progress.change_mins = mins;
+        }
+        out->present |= LINE_FIELD_CHANGE_TIME;
+    }
+
+    if (strstr(line, "X:") && strstr(line, "Y:") && strstr(line, "Z:") && strstr(line, "E:")) {
+        char temp_line[SERIAL_LINE_BUFFER_SIZE];
+        strncpy(temp_line, line, sizeof(temp_line) - 1);
+        temp_line[sizeof(temp_line) - 1] = '\0';
+        char *count_pos = strstr(temp_line, "Count");
+        if (count_pos) *count_pos = '\0';
+        if (sscanf(temp_line, "%*[^X]X:%f Y:%f Z:%f E:%f", &out->position.x, &out->position.y,
+                   &out->position.z, &out->position.e) == 4) {
+            out->present |= LINE_FIELD_POSITION;
+        }
+    }
+
+    if (strstr(line, "Done printing file")) {
+        out->present |= LINE_FIELD_PRINT_DONE;
+    }
+    if (strcmp(line, "ok") == 0 || strncmp(line, "ok ", 3) == 0) {
+        out->present |= LINE_FIELD_OK;
+    }
+}
+
+// The snprintf temperature frame the JSON writer replaced, same baseline role
+static void legacy_snprintf_temperature(char *json, const temp_state_t *temps)
+{
+    snprintf(json, WS_MAX_PAYLOAD_SIZE,
+        "{\"type\":\"temperature\","
+        "\"nozzle\":{\"current\":%.1f,\"target\":%.1f},"
+        "\"bed\":{\"current\":%.1f,\"target\":%.1f},"
+        "\"heatbreak\":{\"current\":%.1f,\"target\":%.1f},"
+        "\"chamber\":{\"current\":%.1f}}",
+        temps->nozzle_current, temps->nozzle_target,
+        temps->bed_current, temps->bed_target,
+        temps->heatbreak_current, temps->heatbreak_target,
+        temps->chamber_current);
+}
+
+static void run_builder_benchmark(void)
+{
+    static ws_message_t msg;
+    parsed_line_t parsed;
+    const char *line = parser_benchmark_lines[1];
+
+    parse_serial_line(line, strlen(line), &parsed);
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+        legacy_snprintf_temperature(msg.json_payload, &parsed.temps);
+    }
+    uint32_t legacy = (esp_cpu_get_cycle_count() - start) / PARSER_BENCHMARK_ITERATIONS;
+
+    start = esp_cpu_get_cycle_count();
+    for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+        telemetry_build_message(&msg, TELEMETRY_TOPIC_TEMPERATURE, &parsed.temps);
+    }
+    uint32_t writer = (esp_cpu_get_cycle_count() - start) / PARSER_BENCHMARK_ITERATIONS;
+
+    start = esp_cpu_get_cycle_count();
+    for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+        telemetry_build_message(&msg, TELEMETRY_TOPIC_POSITION, &parsed.position);
+    }
+    uint32_t position = (esp_cpu_get_cycle_count() - start) / PARSER_BENCHMARK_ITERATIONS;
+
+    ESP_LOGI(TAG, "[BENCH] Temperature frame: snprintf %u cycles, JSON writer %u cycles (both encodings); "
+             "position frame %u cycles", (unsigned)legacy, (unsigned)writer, (unsigned)position);
+}
+
+static void run_parser_benchmark(void)
+{
+    size_t lens[PARSER_BENCHMARK_LINE_COUNT];
+    for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+        lens[i] = strlen(parser_benchmark_lines[i]);
+    }
+
+    parsed_line_t parsed;
+    volatile uint32_t sink = 0;  // keep the compiler from dropping the work
+    const uint32_t total_lines = PARSER_BENCHMARK_ITERATIONS * PARSER_BENCHMARK_LINE_COUNT;
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+        for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+            legacy_sscanf_parse_line(parser_benchmark_lines[i], &parsed);
+            sink += parsed.present;
+        }
+    }
+    uint32_t legacy_cycles = esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+        for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+            parse_serial_line(parser_benchmark_lines[i], lens[i], &parsed);
+            sink += parsed.present;
+        }
+    }
+    uint32_t tokenizer_cycles = esp_cpu_get_cycle_count() - start;
+
+    ESP_LOGI(TAG, "[BENCH] Parser over %u lines: sscanf %u cycles/line, tokenizer %u cycles/line (%.1fx)",
+             (unsigned)total_lines,
+             (unsigned)(legacy_cycles / total_lines),
+             (unsigned)(tokenizer_cycles / total_lines),
+             tokenizer_cycles ? (double)legacy_cycles / tokenizer_cycles : 0.0);
+
+    for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+        start = esp_cpu_get_cycle_count();
+        for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+            legacy_sscanf_parse_line(parser_benchmark_lines[i], &parsed);
+        }
+        uint32_t legacy = (esp_cpu_get_cycle_count() - start) / PARSER_BENCHMARK_ITERATIONS;
+
+        start = esp_cpu_get_cycle_count();
+        for (int iter = 0; iter < PARSER_BENCHMARK_ITERATIONS; iter++) {
+            parse_serial_line(parser_benchmark_lines[i], lens[i], &parsed);
+        }
+        uint32_t tokenizer = (esp_cpu_get_cycle_count() - start) / PARSER_BENCHMARK_ITERATIONS;
+
+        ESP_LOGI(TAG, "[BENCH]   %6u -> %5u cycles  %.40s", (unsigned)legacy, (unsigned)tokenizer,
+                 parser_benchmark_lines[i]);
+    }
+    (void)sink;
+
+    run_builder_benchmark();
+}
+#endif // ENABLE_PARSER_BENCHMARK
+
+// ============================================================================
+// SERIAL RX RING (USB callback -> parser task)
+// ============================================================================
+
+// Producer side - runs in the CDC-ACM driver task, must stay short
+static void serial_rx_ring_write(const uint8_t *data, size_t len)
+{
+    size_t head = atomic_load_explicit(&serial_rx_ring.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&serial_rx_ring.tail, memory_order_acquire);
+    size_t space = SERIAL_RX_RING_SIZE - (head - tail);
+
+    if (len > space) {
+        // Parser has fallen behind - keep what fits, account for the rest
+        atomic_fetch_add_explicit(&serial_rx_ring.dropped_bytes, (unsigned)(len - space),
+                                  memory_order_relaxed);
+        len = space;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    size_t offset = head & (SERIAL_RX_RING_SIZE - 1);
+    size_t first = SERIAL_RX_RING_SIZE - offset;
+    if (first > len) first = len;
+    memcpy(&serial_rx_ring.buf[offset], data, first);
+    memcpy(&serial_rx_ring.buf[0], data + first, len - first);
+
+    atomic_store_explicit(&serial_rx_ring.head, head + len, memory_order_release);
+
+    unsigned k = atomic_load_explicit(&serial_rx_ring.stamps, memory_order_relaxed);
+    serial_rx_ring.stamp_end[k % SERIAL_RX_STAMPS] = (uint32_t)(head + len);
+    serial_rx_ring.stamp_us[k % SERIAL_RX_STAMPS] = trace_now();
+    atomic_store_explicit(&serial_rx_ring.stamps, k + 1, memory_order_release);
+
+    size_t used = head + len - tail;
+    if (used > atomic_load_explicit(&serial_rx_ring.high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&serial_rx_ring.high_water, used, memory_order_relaxed);
+    }
+}
+
+// Capture producer - also runs in the CDC-ACM driver task. A record is
+// written whole or not at all; the writer task empties the ring to flash.
+static void serial_capture_ring_put(size_t pos, const void *data, size_t len)
+{
+    size_t offset = pos & (CAPTURE_RING_SIZE - 1);
+    size_t first = CAPTURE_RING_SIZE - offset;
+    if (first > len) first = len;
+    memcpy(&serial_capture_ring.buf[offset], data, first);
+    memcpy(&serial_capture_ring.buf[0], (const uint8_t *)data + first, len - first);
+}
+
+static void serial_capture_record(const uint8_t *data, size_t len)
+{
+    serial_capture_ring_t *r = &serial_capture_ring;
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t need = sizeof(serial_capture_rec_t) + len;
+
+    if (r->bytes + need > CAPTURE_MAX_BYTES) {
+        // File is full - the writer sees the mode change and closes it
+        atomic_store(&serial_capture_mode, SERIAL_CAPTURE_IDLE);
+        if (serial_capture_task_handle) {
+            xTaskNotifyGive(serial_capture_task_handle);
+        }
+        return;
+    }
+    if (need > CAPTURE_RING_SIZE - (head - tail)) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;  // The next record's delta still covers the gap
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    int64_t delta_us = now_us - r->last_us;
+    serial_capture_rec_t rec = {
+        .delta_us = delta_us > UINT32_MAX ? UINT32_MAX : (uint32_t)delta_us,
+        .len = (uint32_t)len,
+    };
+    r->last_us = now_us;
+    serial_capture_ring_put(head, &rec, sizeof(rec));
+    serial_capture_ring_put(head + sizeof(rec), data, len);
+    atomic_store_explicit(&r->head, head + need, memory_order_release);
+    atomic_fetch_add_explicit(&r->records, 1, memory_order_relaxed);
+    r->bytes += need;
+
+    // Wake the writer early rather than on every transfer
+    if (head + need - tail > CAPTURE_RING_SIZE / 2 && serial_capture_task_handle) {
+        xTaskNotifyGive(serial_capture_task_handle);
+    }
+}
+
+// Consumer side - returns the largest contiguous readable span.
+// at_wrap is set when the span runs up to the end of the buffer.
+static size_t serial_rx_ring_peek(const uint8_t **span, bool *at_wrap)
+{
+    size_t tail = atomic_load_explicit(&serial_rx_ring.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&serial_rx_ring.head, memory_order_acquire);
+    size_t used = head - tail;
+    size_t offset = tail & (SERIAL_RX_RING_SIZE - 1);
+    size_t contiguous = SERIAL_RX_RING_SIZE - offset;
+
+    *span = &serial_rx_ring.buf[offset];
+    *at_wrap = (used >= contiguous);
+    return used < contiguous ? used : contiguous;
+}
+
+// Arrival time of the transfer that carried ring position pos. A position
+// older than every remembered transfer gets the oldest one's time.
+static uint32_t serial_rx_stamp_for(size_t pos)
+{
+    unsigned count = atomic_load_explicit(&serial_rx_ring.stamps, memory_order_acquire);
+    unsigned first = count > SERIAL_RX_STAMPS ? count - SERIAL_RX_STAMPS : 0;
+    uint32_t us = 0;
+
+    // The producer may overwrite the oldest entries meanwhile; skip a few
+    first += first ? SERIAL_RX_STAMPS / 4 : 0;
+    for (unsigned k = first; k < count; k++) {
+        us = serial_rx_ring.stamp_us[k % SERIAL_RX_STAMPS];
+        if ((int32_t)(serial_rx_ring.stamp_end[k % SERIAL_RX_STAMPS] - (uint32_t)pos) > 0) {
+            break;
+        }
+    }
+    return us;
+}
+
+static void serial_rx_ring_consume(size_t len)
+{
+    size_t tail = atomic_load_explicit(&serial_rx_ring.tail, memory_order_relaxed);
+    atomic_store_explicit(&serial_rx_ring.tail, tail + len, memory_order_release);
+}
+
+static size_t serial_rx_ring_depth(void)
+{
+    return atomic_load_explicit(&serial_rx_ring.head, memory_order_acquire) -
+           atomic_load_explicit(&serial_rx_ring.tail, memory_order_acquire);
+}
+
+// First '\n' or '\r' in p[0..n), NULL if none. The '\r' search is bounded by
+// the '\n' hit so each byte is scanned at most twice by memchr.
+static const char *serial_find_eol(const char *p, size_t n)
+{
+    const char *nl = memchr(p, '\n', n);
+    const char *cr = memchr(p, '\r', nl ? (size_t)(nl - p) : n);
+    return cr ? cr : nl;
+}
+
+// Append to the carry buffer, force-parsing if a line outgrows it
+static void serial_carry_append(const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t room = SERIAL_LINE_BUFFER_SIZE - 1 - serial_line_pos;
+        size_t n = len < room ? len : room;
+        memcpy(&serial_line_buffer[serial_line_pos], data, n);
+        serial_line_pos += n;
+        data += n;
+        len -= n;
+
+        if (serial_line_pos == SERIAL_LINE_BUFFER_SIZE - 1) {
+            // Buffer overflow - parse what we have and reset
+            serial_line_buffer[serial_line_pos] = '\0';
+            ESP_LOGW(TAG, "Line buffer overflow, forcing parse");
+            METRIC_INC(line_overflows);
+            parse_and_broadcast_line(serial_line_buffer, serial_line_pos);
+            serial_line_pos = 0;
+        }
+    }
+}
+
+// Frame lines in one contiguous ring span and hand them to the parser as
+// views into the ring. Returns bytes consumed: a trailing partial line stays in
+// the ring until the rest arrives, unless the span ends at the wrap point, in
+// which case it is moved to the carry buffer. pos is the ring position of
+// span[0], used to find each line's USB arrival time.
+static size_t serial_frame_span(const char *span, size_t len, bool at_wrap, size_t pos)
+{
+    const char *p = span;
+    const char *end = span + len;
+
+    while (p < end) {
+        const char *eol = serial_find_eol(p, end - p);
+        if (!eol) break;
+
+        serial_line_rx_us = serial_rx_stamp_for(pos + (size_t)(eol - span));
+        if (serial_line_pos > 0) {
+            // Tail of a line that started before the wrap point
+            serial_carry_append(p, eol - p);
+            if (serial_line_pos > 0) {
+                serial_line_buffer[serial_line_pos] = '\0';
+                parse_and_broadcast_line(serial_line_buffer, serial_line_pos);
+                serial_line_pos = 0;
+            }
+        } else if (eol > p) {
+            // Zero-copy: the line is parsed straight out of the ring
+            parse_and_broadcast_line(p, eol - p);
+        }
+        p = eol + 1;
+    }
+
+    size_t partial = end - p;
+    if (partial > 0 &&
+        (at_wrap || serial_line_pos > 0 || partial >= SERIAL_LINE_BUFFER_SIZE - 1)) {
+        serial_carry_append(p, partial);
+        p = end;
+    }
+
+    return p - span;
+}
+
+// Drains the RX ring. Runs on core 0 next to USB so the IN transfer callback
+// only has to memcpy and return before the driver resubmits the transfer.
+static void serial_parser_task(void *arg)
+{
+    ESP_LOGI(TAG, "Serial parser task started");
+
+    while (1) {
+        // Wake periodically as well, so a partly filled log batch and changes
+        // held back by a topic's minimum interval still go out when the printer
+        // goes quiet
+        int batch_due_ms = log_batch_ms_until_due();
+        TickType_t wait = pdMS_TO_TICKS(TOPIC_FLUSH_CHECK_MS);
+        if (batch_due_ms >= 0 && pdMS_TO_TICKS(batch_due_ms) < wait) {
+            wait = pdMS_TO_TICKS(batch_due_ms) > 0 ? pdMS_TO_TICKS(batch_due_ms) : 1;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+        telemetry_topics_flush_pending();
+        telemetry_history_sample(esp_timer_get_time());
+
+        const uint8_t *span;
+        size_t len;
+        bool at_wrap;
+        while ((len = serial_rx_ring_peek(&span, &at_wrap)) > 0) {
+            size_t pos = atomic_load_explicit(&serial_rx_ring.tail, memory_order_relaxed);
+            size_t used = serial_frame_span((const char *)span, len, at_wrap, pos);
+            serial_rx_ring_consume(used);
+            if (used < len) {
+                break;  // Partial line - wait for the rest of it
+            }
+        }
+
+        if (log_batch_ms_until_due() == 0) {
+            log_batch_flush();
+        }
+    }
+}
+
+// ============================================================================
+// USB CDC COMMUNICATION
+// ============================================================================
+
+static bool handle_rx(const uint8_t *data, size_t data_len, void *arg)
+{
+    DEBUG_LOG(TAG, "[USB] RX: %zu bytes", data_len);
+    METRIC_ADD(usb_rx_bytes, (unsigned)data_len);
+    METRIC_INC(usb_rx_transfers);
+
+    int capture_mode = atomic_load(&serial_capture_mode);
+    if (capture_mode == SERIAL_CAPTURE_REPLAYING) {
+        return true;  // The replay is the ring's producer until it finishes
+    }
+    if (capture_mode == SERIAL_CAPTURE_RECORDING) {
+        serial_capture_record(data, data_len);
+    }
+    
+    // Hand the raw bytes to the parser task - no parsing in the USB context
+    serial_rx_ring_write(data, data_len);
+    if (serial_parser_task_handle) {
+        xTaskNotifyGive(serial_parser_task_handle);
+    }
+    
+    return true;
+}
+
+static void handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_ctx)
+{
+    switch (event->type) {
+        case CDC_ACM_HOST_ERROR:
+            ESP_LOGE(TAG, "CDC-ACM error has occurred, err_no = %d", event->data.error);
+            break;
+        case CDC_ACM_HOST_DEVICE_DISCONNECTED:
+            ESP_LOGW(TAG, "Printer disconnected");
+            xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+            printer_connected = false;
+            printer_state_generation++;
+            printer_state_publish();
+            xSemaphoreGive(printer_state_mutex);
+            
+            // Broadcast disconnection status
+            ws_message_t msg;
+            build_status_message(&msg, false);
+            ws_broadcast_message(&msg);
+            
+            xSemaphoreGive(device_disconnected_sem);
+            break;
+        case CDC_ACM_HOST_SERIAL_STATE:
+            ESP_LOGI(TAG, "Serial state notif 0x%04X", event->data.serial_state.val);
+            break;
+        case CDC_ACM_HOST_NETWORK_CONNECTION:
+        default:
+            break;
+    }
+}
+
+// Runs in the CDC driver's task for every enumerated device. Opening has to
+// happen elsewhere, so hand printer_connect_task the address to open.
+static void handle_new_dev(usb_device_handle_t usb_dev)
+{
+    const usb_device_desc_t *desc;
+    usb_device_info_t info;
+
+    if (usb_host_get_device_descriptor(usb_dev, &desc) != ESP_OK) return;
+    if (desc->idVendor != PRUSA_USB_VID || desc->idProduct != PRUSA_USB_PID) return;
+    if (usb_host_device_info(usb_dev, &info) != ESP_OK) return;
+
+    printer_attach_t attach = { .dev_addr = info.dev_addr, .us = esp_timer_get_time() };
+    if (xQueueSend(printer_attach_queue, &attach, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Attach queue full, USB address %u left to the poll", (unsigned)attach.dev_addr);
+    }
+}
+
+// iSerialNumber of an open printer. String descriptors are UTF-16LE; printer
+// serials are plain ASCII, anything else is dropped.
+static void printer_read_serial(cdc_acm_dev_hdl_t dev, char out[PRINTER_SERIAL_MAX_LEN + 1])
+{
+    usb_device_info_t info;
+    size_t n = 0;
+
+    if (cdc_acm_host_device_info_get(dev, &info) == ESP_OK && info.str_desc_serial_num) {
+        const usb_str_desc_t *sd = info.str_desc_serial_num;
+        size_t chars = (sd->bLength - 2) / 2;
+        for (size_t i = 0; i < chars && n < PRINTER_SERIAL_MAX_LEN; i++) {
+            uint16_t c = sd->wData[i];
+            if (c > 0x20 && c < 0x7f && c != '"' && c != '\\') {
+                out[n++] = (char)c;
+            }
+        }
+    }
+    out[n] = '\0';
+}
+
+static void usb_lib_task(void *arg)
+{
+    while (1) {
+        uint32_t event_flags;
+        usb_host_lib_handle_events(portMAX_DELAY, &event_flags);
+        
+        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS) {
+            ESP_LOGI(TAG, "No more USB clients");
+        }
+        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE) {
+            ESP_LOGI(TAG, "All USB devices freed");
+        }
+    }
+}
+
+// ============================================================================
+// REMOTE HTML DOWNLOAD (Preserved from V2)
+// ============================================================================
+
+// Nothing touches flash until the first byte of a 200 body arrives, so a
+// 304 or an error page costs no erase or write.
+typedef struct {
+    FILE *fp;                                      // SPIFFS backend
+    const char *path;                              // SPIFFS backend: opened on the first body byte
+    bool to_partition;                             // Write into webui_partition instead of fp
+    size_t part_offset;                            // Partition backend: where page data goes
+    size_t capacity;                               // Partition backend: room in the slot
+    size_t erased_to;                              // Partition backend: end of the erased range
+    size_t limit;                                  // SPIFFS backend: most bytes to store, 0 for any
+    bool gzip_only;                                // SPIFFS backend: store only a gzip-encoded body
+    size_t len;
+    bool failed;
+    bool gzip;                                     // Server sent Content-Encoding: gzip
+    bool report_progress;                          // Page download: feed html_refresh progress
+    uint64_t hash;                                 // Of the bytes written, for the ETag
+    char etag[HTML_VALIDATOR_MAX_LEN];             // Response validators, empty if not sent
+    char last_modified[40];
+} download_buffer_t;
+
+// FNV-1a, 64 bit. Start from HTML_HASH_INIT.
+#define HTML_HASH_INIT  (0xcbf29ce484222325ULL)
+
+static uint64_t html_hash_update(uint64_t h, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void html_format_etag(char out[24], uint64_t hash)
+{
+    snprintf(out, 24, "\"%016llx\"", (unsigned long long)hash);
+}
+
+// Pin the live page slot, NULL if there is none. Lock-free: a reader that
+// raced a swap drops its reference and looks again.
+static html_slot_t *html_slot_acquire(void)
+{
+    while (1) {
+        int idx = atomic_load(&html_current);
+        if (idx < 0) return NULL;
+        atomic_fetch_add(&html_slots[idx].refs, 1);
+        if (atomic_load(&html_current) == idx) {
+            return &html_slots[idx];
+        }
+        atomic_fetch_sub(&html_slots[idx].refs, 1);
+    }
+}
+
+static void html_slot_release(html_slot_t *slot)
+{
+    if (slot) atomic_fetch_sub(&slot->refs, 1);
+}
+
+// Work out the size, ETag and encoding of a slot file cached by an earlier boot
+static bool html_slot_index(html_slot_t *slot)
+{
+    uint8_t chunk[1024];
+    uint64_t hash = HTML_HASH_INIT;
+    size_t total = 0;
+    size_t n;
+
+    FILE *fp = fopen(slot->path, "rb");
+    if (fp == NULL) return false;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (total == 0) {
+            slot->gzip = n >= 2 && chunk[0] == 0x1f && chunk[1] == 0x8b;
+        }
+        hash = html_hash_update(hash, chunk, n);
+        total += n;
+    }
+    fclose(fp);
+
+    slot->size = total;
+    html_format_etag(slot->etag, hash);
+    if (total > 0) {
+        ESP_LOGI(TAG, "Indexed cached HTML %s: %u bytes%s, ETag %s", slot->path, (unsigned)total,
+                 slot->gzip ? " (gzip)" : "", slot->etag);
+    }
+    return total > 0;
+}
+
+// SPIFFS backend on a PSRAM build: copy the slot into PSRAM so page loads are
+// one send from memory, as with the partition backend, instead of a VFS read
+// loop. The copy is dropped before the slot is rewritten.
+static void html_slot_cache(html_slot_t *slot)
+{
+#if CONFIG_SPIRAM
+    if (mem_tier.psram_bytes == 0 || slot->size == 0 || slot->size > PSRAM_HTML_CACHE_MAX) {
+        return;
+    }
+    uint8_t *copy = heap_caps_malloc(slot->size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (copy == NULL) return;
+
+    FILE *fp = fopen(slot->path, "rb");
+    size_t n = fp != NULL ? fread(copy, 1, slot->size, fp) : 0;
+    if (fp != NULL) fclose(fp);
+    if (n != slot->size) {
+        heap_caps_free(copy);
+        return;
+    }
+    slot->data = copy;
+    ESP_LOGI(TAG, "Cached %s in PSRAM (%u bytes)", slot->path, (unsigned)slot->size);
+#else
+    (void)slot;
+#endif
+}
+
+// Called per received chunk of a page download. Only a /refresh job reports,
+// and no more often than HTML_REFRESH_REPORT_MS.
+static void html_refresh_progress(esp_http_client_handle_t client, size_t len)
+{
+    if (atomic_load(&html_refresh.state) != HTML_REFRESH_RUNNING) {
+        return;
+    }
+    int64_t total = esp_http_client_get_content_length(client);
+    atomic_store(&html_refresh.bytes, (unsigned)len);
+    atomic_store(&html_refresh.total, total > 0 ? (unsigned)total : 0);
+    if (esp_timer_get_time() - html_refresh.last_report_us >= HTML_REFRESH_REPORT_MS * 1000LL) {
+        html_refresh_publish();
+    }
+}
+
+esp_err_t http_event_handler(esp_http_client_event_t *evt)
+{
+    download_buffer_t *output = (download_buffer_t *)evt->user_data;
+
+    switch (evt->event_id) {
+        case HTTP_EVENT_ON_DATA:
+            if (output->failed) return ESP_OK;
+            // Error pages are not worth a flash write; the caller fails on the status
+            if (esp_http_client_get_status_code(evt->client) != 200) return ESP_OK;
+
+            if (output->to_partition && evt->data_len > 0) {
+                if (output->len + evt->data_len > output->capacity) {
+                    ESP_LOGE(TAG, "Page larger than the %u byte web UI slot", (unsigned)output->capacity);
+                    output->failed = true;
+                    return ESP_FAIL;
+                }
+                // Erase sector by sector just ahead of the data
+                size_t end = output->part_offset + output->len + evt->data_len;
+                while (output->erased_to < end) {
+                    esp_err_t err = esp_partition_erase_range(webui_partition, output->erased_to,
+                                                              webui_partition->erase_size);
+                    if (err != ESP_OK) {
+                        ESP_LOGE(TAG, "Web UI partition erase failed: %s", esp_err_to_name(err));
+                        output->failed = true;
+                        return ESP_FAIL;
+                    }
+                    output->erased_to += webui_partition->erase_size;
+                }
+                esp_err_t err = esp_partition_write(webui_partition, output->part_offset + output->len,
+                                                    evt->data, evt->data_len);
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Web UI partition write failed: %s", esp_err_to_name(err));
+                    output->failed = true;
+                    return ESP_FAIL;
+                }
+                output->hash = html_hash_update(output->hash, evt->data, evt->data_len);
+                output->len += evt->data_len;
+                if (output->report_progress) {
+                    html_refresh_progress(evt->client, output->len);
+                }
+                break;
+            }
+
+            // Headers are all in by the first body byte
+            if (output->gzip_only && !output->gzip) {
+                ESP_LOGW(TAG, "Server sent a plain body, not storing it");
+                output->failed = true;
+                return ESP_FAIL;
+            }
+            if (output->limit > 0 && output->len + evt->data_len > output->limit) {
+                ESP_LOGE(TAG, "Body larger than %u bytes, not storing it", (unsigned)output->limit);
                 output->failed = true;
                 return ESP_FAIL;
             }
+            if (output->fp == NULL && output->path != NULL && evt->data_len > 0) {
+                output->fp = fopen(output->path, "wb");
+                if (output->fp == NULL) {
+                    ESP_LOGE(TAG, "Failed to open %s for writing", output->path);
+                }
+            }
+            if (output->fp == NULL) {
+                ESP_LOGE(TAG, "No flash file open - aborting download");
+                output->failed = true;
+                return ESP_FAIL;
+            }
+
+            if (evt->data_len > 0) {
+                size_t written = fwrite(evt->data, 1, evt->data_len, output->fp);
+                if (written != evt->data_len) {
+                    ESP_LOGE(TAG, "Flash write failed: wrote %u of %u bytes",
+                             (unsigned)written, (unsigned)evt->data_len);
+                    output->failed = true;
+                    return ESP_FAIL;
+                }
+                output->hash = html_hash_update(output->hash, evt->data, written);
+                output->len += written;
+                if (output->report_progress) {
+                    html_refresh_progress(evt->client, output->len);
+                }
+            }
+            break;
+
+        case HTTP_EVENT_ON_HEADER:
+            if (strcasecmp(evt->header_key, "Content-Encoding") == 0 &&
+                strstr(evt->header_value, "gzip") != NULL) {
+                output->gzip = true;
+            } else if (strcasecmp(evt->header_key, "ETag") == 0) {
+                snprintf(output->etag, sizeof(output->etag), "%s", evt->header_value);
+            } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+                snprintf(output->last_modified, sizeof(output->last_modified), "%s", evt->header_value);
+            }
+            break;
+
+        case HTTP_EVENT_DISCONNECTED:
+        case HTTP_EVENT_ERROR:
+            if (!output->failed && output->len > 0) {
+                ESP_LOGW(TAG, "HTTP event %d during download at offset %u",
+                         evt->event_id, (unsigned)output->len);
+            }
+            break;
+
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t mount_remote_html_fs(void)
+{
+    if (remote_html_fs_mounted) {
+        ESP_LOGI(TAG, "SPIFFS already mounted at /spiffs");
+        return ESP_OK;
+    }
+
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = "/spiffs",
+        .partition_label = NULL,
+        .max_files = 6,                    // Concurrent page loads plus a download
+        .format_if_mount_failed = true
+    };
+
+    ESP_LOGI(TAG, "Mounting SPIFFS at %s (max_files=%d, format_if_mount_failed=%d)",
+             conf.base_path, conf.max_files, conf.format_if_mount_failed);
+
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount SPIFFS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t total = 0;
+    size_t used = 0;
+    if (esp_spiffs_info(NULL, &total, &used) == ESP_OK) {
+        ESP_LOGI(TAG, "SPIFFS mounted: total=%u bytes, used=%u bytes",
+                 (unsigned)total, (unsigned)used);
+    } else {
+        ESP_LOGW(TAG, "SPIFFS mounted, but esp_spiffs_info() failed");
+    }
+
+    remote_html_fs_mounted = true;
+    ESP_LOGI(TAG, "SPIFFS ready for remote HTML storage");
+    return ESP_OK;
+}
+
+// Map the web UI partition and make the newest valid slot live. False if
+// the partition table predates it.
+static bool webui_partition_init(void)
+{
+    esp_partition_mmap_handle_t handle;
+
+    webui_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                               WEBUI_PARTITION_LABEL);
+    if (webui_partition == NULL) {
+        ESP_LOGW(TAG, "No '%s' partition, keeping the page on SPIFFS", WEBUI_PARTITION_LABEL);
+        return false;
+    }
+    esp_err_t err = esp_partition_mmap(webui_partition, 0, webui_partition->size,
+                                       ESP_PARTITION_MMAP_DATA, (const void **)&webui_map, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map '%s' partition: %s", WEBUI_PARTITION_LABEL, esp_err_to_name(err));
+        webui_partition = NULL;
+        return false;
+    }
+
+    // Slots are whole erase blocks so one can be erased without touching the other
+    webui_slot_size = (webui_partition->size / 2) & ~(size_t)(webui_partition->erase_size - 1);
+    int newest = -1;
+    for (int i = 0; i < 2; i++) {
+        html_slot_t *slot = &html_slots[i];
+        slot->path = NULL;
+        slot->offset = i * webui_slot_size;
+
+        const webui_header_t *hdr = (const webui_header_t *)(webui_map + slot->offset);
+        if (hdr->magic != WEBUI_MAGIC || hdr->length == 0 ||
+            hdr->length > webui_slot_size - WEBUI_HEADER_SIZE) {
+            continue;
+        }
+        slot->data = webui_map + slot->offset + WEBUI_HEADER_SIZE;
+        slot->size = hdr->length;
+        slot->gzip = (hdr->flags & WEBUI_FLAG_GZIP) != 0;
+        slot->sequence = hdr->sequence;
+        html_format_etag(slot->etag, hdr->hash);
+        if (newest < 0 || slot->sequence > html_slots[newest].sequence) {
+            newest = i;
+        }
+    }
+    if (newest >= 0) {
+        atomic_store(&html_current, newest);
+        ESP_LOGI(TAG, "Web UI slot %d live: %u bytes%s, ETag %s", newest,
+                 (unsigned)html_slots[newest].size, html_slots[newest].gzip ? " (gzip)" : "",
+                 html_slots[newest].etag);
+    }
+    ESP_LOGI(TAG, "Web UI partition mapped: %u byte slots", (unsigned)webui_slot_size);
+    return true;
+}
+
+// Pick up the page a previous boot left live, from the web UI partition or
+// else from SPIFFS. Call before the web server starts.
+static void html_slots_init(void)
+{
+    char which[4] = "";
+
+    if (webui_partition_init()) {
+        return;
+    }
+    if (mount_remote_html_fs() != ESP_OK) {
+        return;
+    }
+    remove(REMOTE_HTML_LEGACY_PATH);
+
+    FILE *fp = fopen(REMOTE_HTML_CURRENT_PATH, "rb");
+    if (fp != NULL) {
+        if (fgets(which, sizeof(which), fp) == NULL) which[0] = '\0';
+        fclose(fp);
+    }
+    int idx = which[0] == 'a' ? 0 : which[0] == 'b' ? 1 : -1;
+    if (idx >= 0 && html_slot_index(&html_slots[idx])) {
+        html_slot_cache(&html_slots[idx]);
+        atomic_store(&html_current, idx);
+    }
+}
+
+// Validators of the live page, sent back as If-None-Match/If-Modified-Since
+// so an unchanged page comes back as a bodyless 304.
+static void html_validators_load(char *etag, size_t etag_len, char *last_modified, size_t lm_len)
+{
+    nvs_handle_t nvs;
+
+    etag[0] = '\0';
+    last_modified[0] = '\0';
+    if (nvs_open(REMOTE_HTML_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_str(nvs, "etag", etag, &etag_len) != ESP_OK) {
+        etag[0] = '\0';
+    }
+    if (nvs_get_str(nvs, "last_mod", last_modified, &lm_len) != ESP_OK) {
+        last_modified[0] = '\0';
+    }
+    nvs_close(nvs);
+}
+
+static void html_validators_save(const char *etag, const char *last_modified)
+{
+    nvs_handle_t nvs;
+
+    if (nvs_open(REMOTE_HTML_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Could not open NVS to store page validators");
+        return;
+    }
+    if (etag[0]) {
+        nvs_set_str(nvs, "etag", etag);
+    } else {
+        nvs_erase_key(nvs, "etag");
+    }
+    if (last_modified[0]) {
+        nvs_set_str(nvs, "last_mod", last_modified);
+    } else {
+        nvs_erase_key(nvs, "last_mod");
+    }
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// One client for the page host, kept across fetches so its saved TLS session
+// lets the next fetch resume instead of doing a full handshake. The socket is
+// closed after each fetch; only the handle and session ticket stay. Used
+// under html_mutex only.
+static esp_http_client_handle_t html_fetch_client = NULL;
+
+static esp_http_client_handle_t html_fetch_client_get(const char *url, download_buffer_t *download)
+{
+    if (html_fetch_client == NULL) {
+        esp_http_client_config_t config = {
+            .url = url,
+            .event_handler = http_event_handler,
+            .timeout_ms = 10000,
+            .buffer_size = 4096,
+            .crt_bundle_attach = esp_crt_bundle_attach,
+            .save_client_session = true,
+        };
+        html_fetch_client = esp_http_client_init(&config);
+        if (html_fetch_client == NULL) {
+            return NULL;
+        }
+        // GitHub compresses on request; the body is stored as received and
+        // served to browsers with the same Content-Encoding
+        esp_http_client_set_header(html_fetch_client, "Accept-Encoding", "gzip");
+        // Revalidate at the CDN rather than bypassing it with a query string
+        esp_http_client_set_header(html_fetch_client, "Cache-Control", "no-cache");
+    } else if (esp_http_client_set_url(html_fetch_client, url) != ESP_OK) {
+        return NULL;
+    }
+    esp_http_client_set_user_data(html_fetch_client, download);
+    return html_fetch_client;
+}
+
+static bool download_remote_html_to_flash(const char *url)
+{
+    ESP_LOGI(TAG, "Preparing remote HTML download to flash from: %s", url);
+
+    if (webui_partition == NULL && mount_remote_html_fs() != ESP_OK) {
+        snprintf(last_download_error, sizeof(last_download_error), "SPIFFS mount failed");
+        ESP_LOGE(TAG, "Remote HTML download aborted: SPIFFS mount failed");
+        return false;
+    }
+
+    xSemaphoreTake(html_mutex, portMAX_DELAY);
+
+    // Write the slot that is not live. Readers still streaming it from two
+    // versions ago must finish first.
+    int target = atomic_load(&html_current) == 0 ? 1 : 0;
+    html_slot_t *slot = &html_slots[target];
+    int waited_ms = 0;
+    while (atomic_load(&slot->refs) > 0) {
+        if (waited_ms >= REMOTE_HTML_DRAIN_TIMEOUT_MS) {
+            ESP_LOGE(TAG, "Old HTML slot %d still being served, giving up", target);
+            snprintf(last_download_error, sizeof(last_download_error), "Page slot busy");
+            xSemaphoreGive(html_mutex);
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(50));
+        waited_ms += 50;
+    }
+    if (webui_partition != NULL) {
+        ESP_LOGI(TAG, "Writing remote HTML to web UI slot %d", target);
+        slot->data = NULL;
+    } else {
+        ESP_LOGI(TAG, "Writing remote HTML to %s", slot->path);
+        heap_caps_free((void *)slot->data);
+        slot->data = NULL;
+    }
+    slot->size = 0;
+
+    download_buffer_t download = {
+        .fp = NULL,
+        .path = webui_partition != NULL ? NULL : slot->path,
+        .to_partition = webui_partition != NULL,
+        .part_offset = slot->offset + WEBUI_HEADER_SIZE,
+        .capacity = webui_slot_size - WEBUI_HEADER_SIZE,
+        .erased_to = slot->offset,
+        .len = 0,
+        .failed = false,
+        .gzip = false,
+        .report_progress = true,
+        .hash = HTML_HASH_INIT
+    };
+
+    esp_http_client_handle_t client = html_fetch_client_get(url, &download);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to initialize HTTP client for remote HTML download");
+        snprintf(last_download_error, sizeof(last_download_error), "Failed to initialize HTTP client");
+        xSemaphoreGive(html_mutex);
+        return false;
+    }
+
+    // Only ask for a 304 when there is a live page it would refer to
+    char etag[HTML_VALIDATOR_MAX_LEN];
+    char last_modified[40];
+    html_slot_t *live = html_slot_acquire();
+    if (live != NULL) {
+        html_validators_load(etag, sizeof(etag), last_modified, sizeof(last_modified));
+    } else {
+        etag[0] = '\0';
+        last_modified[0] = '\0';
+    }
+    html_slot_release(live);
+    if (etag[0]) {
+        esp_http_client_set_header(client, "If-None-Match", etag);
+    } else {
+        esp_http_client_delete_header(client, "If-None-Match");
+    }
+    if (last_modified[0]) {
+        esp_http_client_set_header(client, "If-Modified-Since", last_modified);
+    } else {
+        esp_http_client_delete_header(client, "If-Modified-Since");
+    }
+
+    ESP_LOGI(TAG, "HTTP client ready, starting fetch%s", etag[0] || last_modified[0] ? " (conditional)" : "");
+    int64_t fetch_start_us = esp_timer_get_time();
+    esp_err_t err = esp_http_client_perform(client);
+    int status_code = (err == ESP_OK) ? esp_http_client_get_status_code(client) : -1;
+
+    ESP_LOGI(TAG, "HTTP fetch finished in %lld ms: err=%s status=%d bytes=%u failed=%d",
+             (long long)((esp_timer_get_time() - fetch_start_us) / 1000),
+             esp_err_to_name(err), status_code, (unsigned)download.len, download.failed);
+
+    if (download.fp != NULL) {
+        fflush(download.fp);
+        fclose(download.fp);
+        ESP_LOGI(TAG, "Flash file closed after download");
+    }
+    esp_http_client_close(client);
+
+    if (err == ESP_OK && status_code == 304) {
+        snprintf(last_download_error, sizeof(last_download_error), "Not modified");
+        ESP_LOGI(TAG, "Remote HTML not modified, keeping the live page");
+        xSemaphoreGive(html_mutex);
+        return true;
+    }
+
+    bool ok = err == ESP_OK && status_code == 200 && !download.failed && download.len > 0;
+    if (ok && webui_partition != NULL) {
+        // The header makes the slot valid, so it goes in only now
+        int other = 1 - target;
+        webui_header_t hdr = {
+            .magic = WEBUI_MAGIC,
+            .sequence = html_slots[other].sequence + 1,
+            .length = (uint32_t)download.len,
+            .flags = download.gzip ? WEBUI_FLAG_GZIP : 0,
+            .hash = download.hash,
+        };
+        esp_err_t hdr_err = esp_partition_write(webui_partition, slot->offset, &hdr, sizeof(hdr));
+        if (hdr_err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write web UI slot header: %s", esp_err_to_name(hdr_err));
+            download.failed = true;
+            ok = false;
+        } else {
+            slot->sequence = hdr.sequence;
+            slot->data = webui_map + slot->offset + WEBUI_HEADER_SIZE;
+        }
+    }
+
+    if (ok) {
+        slot->size = download.len;
+        slot->gzip = download.gzip;
+        html_format_etag(slot->etag, download.hash);
+        if (webui_partition == NULL) {
+            html_slot_cache(slot);
+        }
+
+        // Publish: new page loads see this slot, ones in flight finish the old one
+        atomic_store(&html_current, target);
+        if (webui_partition == NULL) {
+            FILE *cur = fopen(REMOTE_HTML_CURRENT_PATH, "wb");
+            if (cur != NULL) {
+                fputs(target == 0 ? "a" : "b", cur);
+                fclose(cur);
+            }
+        }
+        html_validators_save(download.etag, download.last_modified);
+
+        snprintf(last_download_error, sizeof(last_download_error),
+                 "Success! Downloaded %u bytes%s", (unsigned)download.len, download.gzip ? " (gzip)" : "");
+        ESP_LOGI(TAG, "HTML saved to flash successfully (%u bytes%s, ETag %s) in slot %d",
+                 (unsigned)download.len, download.gzip ? ", gzip" : "", slot->etag, target);
+        xSemaphoreGive(html_mutex);
+        return true;
+    }
+
+    // The live slot is untouched, so a failed refresh keeps serving the old page
+    if (webui_partition == NULL && download.len > 0) {
+        remove(slot->path);
+    }
+    if (err == ESP_OK) {
+        snprintf(last_download_error, sizeof(last_download_error), "HTTP %d, len=%u", status_code, (unsigned)download.len);
+        ESP_LOGE(TAG, "Download failed: HTTP %d", status_code);
+    } else {
+        snprintf(last_download_error, sizeof(last_download_error), "Failed: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Download error: %s", esp_err_to_name(err));
+    }
+
+    xSemaphoreGive(html_mutex);
+    return false;
+}
+
+// ============================================================================
+// SERIAL CAPTURE AND REPLAY
+// CAPTURE:START records every IN transfer to CAPTURE_PATH until CAPTURE:STOP
+// or CAPTURE_MAX_BYTES. REPLAY:<speed> feeds the file back into the RX ring
+// with the printer unplugged, so parser, broadcast and send all see it as
+// live traffic; the summary is logged and sent to SUB:debug clients.
+// ============================================================================
+
+// Writer task: empties serial_capture_ring into the open capture file
+static void serial_capture_task(void *arg)
+{
+    FILE *fp = (FILE *)arg;
+    serial_capture_ring_t *r = &serial_capture_ring;
+    bool write_failed = false;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CAPTURE_FLUSH_MS));
+        bool stopping = atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_RECORDING;
+
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (head != tail && !write_failed) {
+            size_t offset = tail & (CAPTURE_RING_SIZE - 1);
+            size_t len = head - tail;
+            if (len > CAPTURE_RING_SIZE - offset) len = CAPTURE_RING_SIZE - offset;
+            if (fwrite(&r->buf[offset], 1, len, fp) != len) {
+                write_failed = true;
+                atomic_store(&serial_capture_mode, SERIAL_CAPTURE_IDLE);
+            }
+            tail += len;
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+        }
+        if (stopping || write_failed) break;
+    }
+
+    fclose(fp);
+    if (write_failed) {
+        ESP_LOGE(TAG, "[CAPTURE] Write to %s failed, capture truncated", CAPTURE_PATH);
+    }
+    ESP_LOGI(TAG, "[CAPTURE] Stopped: %u transfers, %u bytes, %u dropped",
+             atomic_load(&r->records), (unsigned)r->bytes, atomic_load(&r->dropped));
+    serial_capture_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+static esp_err_t serial_capture_start(void)
+{
+    serial_capture_ring_t *r = &serial_capture_ring;
+    const serial_capture_hdr_t hdr = { .magic = CAPTURE_MAGIC };
+
+    if (atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_IDLE || serial_capture_task_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (mount_remote_html_fs() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    FILE *fp = fopen(CAPTURE_PATH, "wb");
+    if (fp == NULL) {
+        return ESP_FAIL;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        fclose(fp);
+        return ESP_FAIL;
+    }
+
+    // Nothing produces while idle, so the ring can be emptied from here
+    atomic_store(&r->tail, atomic_load(&r->head));
+    atomic_store(&r->dropped, 0);
+    atomic_store(&r->records, 0);
+    r->bytes = sizeof(hdr);
+    r->last_us = esp_timer_get_time();
+
+    if (xTaskCreatePinnedToCore(serial_capture_task, "capture", CAPTURE_TASK_STACK, fp, 2,
+                                &serial_capture_task_handle, 1) != pdPASS) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    atomic_store(&serial_capture_mode, SERIAL_CAPTURE_RECORDING);
+    ESP_LOGI(TAG, "[CAPTURE] Recording USB RX to %s (max %u bytes)", CAPTURE_PATH, (unsigned)CAPTURE_MAX_BYTES);
+    return ESP_OK;
+}
+
+// Ends a capture or a replay; the task reports and exits on its own
+static void serial_capture_stop(void)
+{
+    atomic_store(&serial_capture_mode, SERIAL_CAPTURE_IDLE);
+    if (serial_capture_task_handle) {
+        xTaskNotifyGive(serial_capture_task_handle);
+    }
+}
+
+static unsigned serial_replay_ws_frames(atomic_uint counters[MSG_TYPE_COUNT])
+{
+    unsigned total = 0;
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        total += atomic_load_explicit(&counters[t], memory_order_relaxed);
+    }
+    return total;
+}
+
+// Producer of serial_rx_ring for the length of the replay. Paced replays
+// sleep to each record's scaled arrival time; an unpaced one only waits for
+// ring space, so the parser and the WS path set the rate.
+static void serial_replay_task(void *arg)
+{
+    FILE *fp = (FILE *)arg;
+    uint32_t speed = serial_replay_speed;
+    uint8_t chunk[REPLAY_CHUNK_SIZE];
+    serial_capture_rec_t rec;
+    unsigned records = 0;
+    size_t bytes = 0;
+    bool truncated = false;
+
+    unsigned lines_before = atomic_load(&metrics.serial_lines);
+    unsigned rx_dropped_before = atomic_load(&serial_rx_ring.dropped_bytes);
+    unsigned ws_sent_before = serial_replay_ws_frames(metrics.ws_frames_sent);
+    unsigned ws_dropped_before = serial_replay_ws_frames(metrics.ws_frames_dropped);
+    int64_t start_us = esp_timer_get_time();
+    int64_t yielded_us = start_us;
+    uint64_t capture_us = 0;
+
+    while (atomic_load(&serial_capture_mode) == SERIAL_CAPTURE_REPLAYING && !truncated &&
+           fread(&rec, sizeof(rec), 1, fp) == 1) {
+        capture_us += rec.delta_us;
+        if (speed > 0) {
+            int64_t wait_us = start_us + (int64_t)(capture_us / speed) - esp_timer_get_time();
+            if (wait_us >= 1000LL * portTICK_PERIOD_MS) {
+                vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+            }
+        }
+
+        for (size_t left = rec.len; left > 0;) {
+            size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+            if (fread(chunk, 1, n, fp) != n) {
+                truncated = true;
+                break;
+            }
+            // The parser preempts on the notify, so space is short only
+            // while it waits on a lock; never overrun it when unpaced
+            int64_t now_us = esp_timer_get_time();
+            while (speed == 0 && SERIAL_RX_RING_SIZE - serial_rx_ring_depth() < n) {
+                vTaskDelay(1);
+                now_us = yielded_us = esp_timer_get_time();
+            }
+            if (now_us - yielded_us >= REPLAY_YIELD_MS * 1000LL) {
+                vTaskDelay(1);
+                yielded_us = esp_timer_get_time();
+            }
+            serial_rx_ring_write(chunk, n);
+            xTaskNotifyGive(serial_parser_task_handle);
+            left -= n;
+            bytes += n;
+        }
+        records++;
+    }
+    fclose(fp);
+
+    // Let the parser finish; a trailing partial line stays in the ring
+    for (size_t depth = serial_rx_ring_depth(); depth > 0; depth = serial_rx_ring_depth()) {
+        vTaskDelay(1);
+        if (serial_rx_ring_depth() == depth) break;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    unsigned lines = atomic_load(&metrics.serial_lines) - lines_before;
+    unsigned rx_dropped = atomic_load(&serial_rx_ring.dropped_bytes) - rx_dropped_before;
+    unsigned ws_sent = serial_replay_ws_frames(metrics.ws_frames_sent) - ws_sent_before;
+    unsigned ws_dropped = serial_replay_ws_frames(metrics.ws_frames_dropped) - ws_dropped_before;
+    unsigned lines_per_s = elapsed_us > 0 ? (unsigned)((uint64_t)lines * 1000000 / elapsed_us) : 0;
+
+    if (truncated) {
+        ESP_LOGW(TAG, "[REPLAY] %s ends inside a record", CAPTURE_PATH);
+    }
+    ESP_LOGI(TAG, "[REPLAY] %s: %u transfers, %u bytes, %u lines in %u ms (%u lines/s), "
+             "rx dropped %u bytes, ws sent %u dropped %u",
+             speed ? "Paced" : "Max speed", records, (unsigned)bytes, lines,
+             (unsigned)(elapsed_us / 1000), lines_per_s, rx_dropped, ws_sent, ws_dropped);
+
+    ws_message_t msg;
+    snprintf(msg.json_payload, WS_MAX_PAYLOAD_SIZE,
+             "{\"type\":\"replay\",\"speed\":%u,\"transfers\":%u,\"bytes\":%u,\"lines\":%u,\"ms\":%u,"
+             "\"lines_per_s\":%u,\"rx_dropped\":%u,\"ws_sent\":%u,\"ws_dropped\":%u}",
+             (unsigned)speed, records, (unsigned)bytes, lines, (unsigned)(elapsed_us / 1000),
+             lines_per_s, rx_dropped, ws_sent, ws_dropped);
+    msg.type = MSG_TYPE_DEBUG;
+    msg.bin_len = 0;
+    ws_broadcast_message(&msg);
+
+    atomic_store(&serial_capture_mode, SERIAL_CAPTURE_IDLE);
+    serial_capture_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+// speed 1..REPLAY_SPEED_MAX times real time, 0 for as fast as the pipeline goes
+static esp_err_t serial_replay_start(uint32_t speed)
+{
+    serial_capture_hdr_t hdr;
+
+    if (speed > REPLAY_SPEED_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_IDLE || serial_capture_task_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (g_prusa_dev != NULL) {
+        return ESP_ERR_INVALID_STATE;  // Two producers on serial_rx_ring
+    }
+    if (mount_remote_html_fs() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    FILE *fp = fopen(CAPTURE_PATH, "rb");
+    if (fp == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC) {
+        fclose(fp);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    serial_replay_speed = speed;
+    atomic_store(&serial_capture_mode, SERIAL_CAPTURE_REPLAYING);
+    if (xTaskCreatePinnedToCore(serial_replay_task, "replay", REPLAY_TASK_STACK, fp, REPLAY_TASK_PRIORITY,
+                                &serial_capture_task_handle, pipe_placement[PIPE_PARSE].core) != pdPASS) {
+        atomic_store(&serial_capture_mode, SERIAL_CAPTURE_IDLE);
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    if (speed > 0) {
+        ESP_LOGI(TAG, "[REPLAY] Replaying %s at %ux", CAPTURE_PATH, (unsigned)speed);
+    } else {
+        ESP_LOGI(TAG, "[REPLAY] Replaying %s at max speed", CAPTURE_PATH);
+    }
+    return ESP_OK;
+}
+
+// ============================================================================
+// STATIC WEB ASSETS
+// Third-party scripts the page needs, kept on SPIFFS so it also works on a
+// network without internet. Names carry the version; a new version is a new
+// entry here and a new URL in the page.
+// ============================================================================
+
+typedef struct {
+    const char *name;                              // Served as /assets/<name>
+    const char *url;                               // Upstream copy, also the fallback
+} web_asset_t;
+
+static const web_asset_t web_assets[] = {
+    { "chart-4.4.0.min.js",       "https://cdn.jsdelivr.net/npm/chart.js@4.4.0/dist/chart.umd.min.js" },
+    { "html2canvas-1.4.1.min.js", "https://cdn.jsdelivr.net/npm/html2canvas@1.4.1/dist/html2canvas.min.js" },
+};
+
+#define WEB_ASSET_COUNT (sizeof(web_assets) / sizeof(web_assets[0]))
+
+static void web_asset_path(const web_asset_t *asset, char *out, size_t len, bool temp)
+{
+    snprintf(out, len, "/spiffs/%s%s", asset->name, temp ? ".tmp" : "");
+}
+
+// SPIFFS is 256 KB and also holds capture.bin and the macros, so an asset
+// is only stored gzip-encoded, and only in the space above the reserve; a
+// download that outgrows it is dropped and /assets/ keeps redirecting to
+// the CDN. Returns how many bytes the asset may take, 0 for none.
+static size_t web_asset_room(const web_asset_t *asset)
+{
+    size_t total = 0;
+    size_t used = 0;
+
+    if (esp_spiffs_info(NULL, &total, &used) != ESP_OK) {
+        return 0;
+    }
+    size_t room = total > used + WEB_ASSET_SPIFFS_RESERVE ? total - used - WEB_ASSET_SPIFFS_RESERVE : 0;
+    if (room == 0) {
+        ESP_LOGW(TAG, "[ASSET] Not storing %s: %u of %u SPIFFS bytes free", asset->name,
+                 (unsigned)(total - used), (unsigned)total);
+        return 0;
+    }
+    return room < WEB_ASSET_MAX_BYTES ? room : WEB_ASSET_MAX_BYTES;
+}
+
+// Fetch one asset gzip-encoded and move it into place only once complete
+static bool web_asset_download(const web_asset_t *asset)
+{
+    char path[64];
+    char temp[64];
+
+    size_t room = web_asset_room(asset);
+    if (room == 0) {
+        return false;
+    }
+    web_asset_path(asset, path, sizeof(path), false);
+    web_asset_path(asset, temp, sizeof(temp), true);
+
+    FILE *fp = fopen(temp, "wb");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "[ASSET] Failed to open %s for writing", temp);
+        return false;
+    }
+
+    download_buffer_t download = {
+        .fp = fp,
+        .limit = room,
+        .gzip_only = true,
+        .len = 0,
+        .failed = false,
+        .gzip = false,
+        .hash = HTML_HASH_INIT
+    };
+    esp_http_client_config_t config = {
+        .url = asset->url,
+        .event_handler = http_event_handler,
+        .user_data = &download,
+        .timeout_ms = 10000,
+        .buffer_size = 4096,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    esp_err_t err = ESP_FAIL;
+    int status_code = -1;
+    if (client != NULL) {
+        esp_http_client_set_header(client, "Accept-Encoding", "gzip");
+        err = esp_http_client_perform(client);
+        status_code = (err == ESP_OK) ? esp_http_client_get_status_code(client) : -1;
+        esp_http_client_cleanup(client);
+    }
+    fclose(fp);
+
+    if (err == ESP_OK && status_code == 200 && !download.failed && download.len > 0) {
+        remove(path);
+        if (rename(temp, path) == 0) {
+            ESP_LOGI(TAG, "[ASSET] Stored %s (%u bytes, gzip)", asset->name, (unsigned)download.len);
+            return true;
+        }
+    }
+    ESP_LOGW(TAG, "[ASSET] Download of %s failed: %s, HTTP %d", asset->name, esp_err_to_name(err),
+             status_code);
+    remove(temp);
+    return false;
+}
+
+// Fetch any asset not on flash yet. Stored ones never change, so this costs
+// nothing once they are all present. A plain copy left by older firmware is
+// removed to give its space back.
+static void web_assets_sync(void)
+{
+    char path[64];
+
+    if (mount_remote_html_fs() != ESP_OK) {
+        return;
+    }
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+        web_asset_path(&web_assets[i], path, sizeof(path), false);
+        FILE *fp = fopen(path, "rb");
+        if (fp != NULL) {
+            uint8_t magic[2] = { 0 };
+            size_t n = fread(magic, 1, sizeof(magic), fp);
+            fclose(fp);
+            if (n == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b) {
+                continue;
+            }
+            remove(path);
+        }
+        web_asset_download(&web_assets[i]);
+    }
+}
+
+void download_html_from_github(void)
+{
+    ESP_LOGI(TAG, "Downloading HTML from GitHub...");
+    snprintf(last_download_error, sizeof(last_download_error), "Starting download...");
+    download_remote_html_to_flash(REMOTE_HTML_URL);
+    web_assets_sync();
+}
+
+// ============================================================================
+// BOOT METRICS
+// Startup runs in parallel stages; each records when it first completed.
+// ============================================================================
+
+typedef struct {
+    int64_t wifi_assoc_us;                     // First association with the AP
+    int64_t ip_us;                             // First IP address
+    int64_t server_us;                         // httpd accepting connections
+    int64_t first_serve_us;                    // First page sent to a browser
+    int64_t page_us;                           // Boot page download finished
+    int64_t printer_us;                        // Printer first opened over CDC-ACM
+} boot_metrics_t;
+
+static boot_metrics_t boot_metrics;
+
+// Record a stage the first time it happens. Each field has one writer task.
+static void boot_metric_mark(int64_t *stage, const char *name)
+{
+    if (*stage != 0) {
+        return;
+    }
+    *stage = esp_timer_get_time();
+    ESP_LOGI(TAG, "[BOOT] %s after %lld ms", name, (long long)(*stage / 1000));
+}
+
+// ============================================================================
+// WIFI INITIALIZATION (Preserved from V2)
+// ============================================================================
+
+// The first attempt after boot or a drop goes straight to the AP that last
+// gave us an IP: its BSSID and channel come from NVS, so the driver probes
+// one channel instead of scanning all of them. WIFI_FAST_CONNECT_TRIES
+// failures there fall back to a full scan. All wifi_conn state is touched by
+// the default event loop task only, apart from the counters.
+#define WIFI_AP_CACHE_MAGIC         (0x57494631)   // "WIF1"
+
+typedef struct {
+    uint32_t magic;
+    char ssid[33];                             // The cache is ignored once WIFI_SSID changes
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_ap_cache_t;
+
+static struct {
+    wifi_ap_cache_t ap;                        // Last AP that gave us an IP
+    bool have_ap;
+    wifi_ap_cache_t joined;                    // AP of the current association
+    bool fast;                                 // Current attempt targets the cached AP
+    bool up;                                   // Got an IP since the last disconnect
+    int fast_failures;                         // Consecutive failed fast attempts
+    int64_t attempt_us;                        // esp_wifi_connect() of the current attempt
+    int64_t assoc_us;                          // Associated in this attempt, 0 = not yet
+    int64_t down_us;                           // Lost the connection, 0 = not since boot
+    atomic_uint connects_fast;
+    atomic_uint connects_scan;
+    atomic_uint last_connect_ms;               // Attempt to IP
+    atomic_uint last_outage_ms;                // Disconnect to IP, after a drop
+    esp_timer_handle_t retry_timer;            // Next attempt after a failed scan
+} wifi_conn;
+
+static void wifi_ap_cache_load(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(wifi_conn.ap);
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(nvs, "ap", &wifi_conn.ap, &len) == ESP_OK && len == sizeof(wifi_conn.ap) &&
+        wifi_conn.ap.magic == WIFI_AP_CACHE_MAGIC && strcmp(wifi_conn.ap.ssid, WIFI_SSID) == 0) {
+        wifi_conn.have_ap = true;
+        ESP_LOGI(TAG, "[WIFI] Cached AP %02x:%02x:%02x:%02x:%02x:%02x on channel %u",
+                 wifi_conn.ap.bssid[0], wifi_conn.ap.bssid[1], wifi_conn.ap.bssid[2],
+                 wifi_conn.ap.bssid[3], wifi_conn.ap.bssid[4], wifi_conn.ap.bssid[5],
+                 (unsigned)wifi_conn.ap.channel);
+    }
+    nvs_close(nvs);
+}
+
+// Only written when the AP or channel changed, so a steady network costs no
+// flash writes
+static void wifi_ap_cache_save(const wifi_ap_cache_t *ap)
+{
+    nvs_handle_t nvs;
+
+    if (wifi_conn.have_ap && memcmp(&wifi_conn.ap, ap, sizeof(*ap)) == 0) {
+        return;
+    }
+    wifi_conn.ap = *ap;
+    wifi_conn.have_ap = true;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Could not open NVS to cache the AP");
+        return;
+    }
+    nvs_set_blob(nvs, "ap", ap, sizeof(*ap));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+static void wifi_connect_attempt(void)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = WIFI_SSID,
+            .password = WIFI_PASS,
+        },
+    };
+
+    wifi_conn.fast = wifi_conn.have_ap && wifi_conn.fast_failures < WIFI_FAST_CONNECT_TRIES;
+    if (wifi_conn.fast) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, wifi_conn.ap.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = wifi_conn.ap.channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    wifi_conn.attempt_us = esp_timer_get_time();
+    wifi_conn.assoc_us = 0;
+    esp_wifi_connect();
+}
+
+static void wifi_event_handler(void* arg, esp_event_base_t event_base,
+                                int32_t event_id, void* event_data)
+{
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        wifi_connect_attempt();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+        wifi_conn.assoc_us = esp_timer_get_time();
+        memset(&wifi_conn.joined, 0, sizeof(wifi_conn.joined));
+        wifi_conn.joined.magic = WIFI_AP_CACHE_MAGIC;
+        snprintf(wifi_conn.joined.ssid, sizeof(wifi_conn.joined.ssid), "%s", WIFI_SSID);
+        memcpy(wifi_conn.joined.bssid, event->bssid, sizeof(wifi_conn.joined.bssid));
+        wifi_conn.joined.channel = event->channel;
+        boot_metric_mark(&boot_metrics.wifi_assoc_us, "WiFi associated");
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        // Clear the connected bit so callers waiting on it know we lost IP
+        if (wifi_event_group) {
+            xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        }
+        if (wifi_conn.up) {
+            // A drop: the AP that just served us is the best first guess
+            wifi_conn.up = false;
+            wifi_conn.down_us = esp_timer_get_time();
+            wifi_conn.fast_failures = 0;
+            ESP_LOGI(TAG, "Disconnected from WiFi (reason %d), reconnecting", event->reason);
+        } else if (wifi_conn.fast) {
+            wifi_conn.fast_failures++;
+            ESP_LOGI(TAG, "Fast connect to the cached AP failed (reason %d)%s", event->reason,
+                     wifi_conn.fast_failures >= WIFI_FAST_CONNECT_TRIES ? ", falling back to a full scan" : "");
+        } else {
+            // Brief backoff before retrying to avoid hammering the WiFi stack
+            // on boot when the router may not be ready yet. From a timer: a
+            // delay here would hold up every other handler on the loop.
+            ESP_LOGI(TAG, "WiFi connect failed (reason %d), retrying in %d ms", event->reason,
+                     WIFI_SCAN_RETRY_MS);
+            esp_timer_start_once(wifi_conn.retry_timer, (uint64_t)WIFI_SCAN_RETRY_MS * 1000);
+            return;
+        }
+        wifi_connect_attempt();
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        int64_t now_us = esp_timer_get_time();
+        int64_t assoc_us = wifi_conn.assoc_us ? wifi_conn.assoc_us : now_us;
+        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        ESP_LOGI(TAG, "[WIFI] %s connect: associated after %lld ms, IP %lld ms later",
+                 wifi_conn.fast ? "Fast" : "Scan",
+                 (long long)((assoc_us - wifi_conn.attempt_us) / 1000),
+                 (long long)((now_us - assoc_us) / 1000));
+        if (wifi_conn.down_us != 0) {
+            atomic_store(&wifi_conn.last_outage_ms, (unsigned)((now_us - wifi_conn.down_us) / 1000));
+            ESP_LOGI(TAG, "[WIFI] Back after %u ms offline", atomic_load(&wifi_conn.last_outage_ms));
+        }
+        atomic_store(&wifi_conn.last_connect_ms, (unsigned)((now_us - wifi_conn.attempt_us) / 1000));
+        atomic_fetch_add(wifi_conn.fast ? &wifi_conn.connects_fast : &wifi_conn.connects_scan, 1);
+        wifi_conn.up = true;
+        wifi_conn.fast_failures = 0;
+        if (wifi_conn.assoc_us != 0) {
+            wifi_ap_cache_save(&wifi_conn.joined);
+        }
+        boot_metric_mark(&boot_metrics.ip_us, "IP address");
+        // Signal waiters that WiFi is fully up
+        if (wifi_event_group) {
+            xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        }
+    }
+}
+
+// No attempt is in flight while the timer runs, so the event handler is not
+// touching wifi_conn at the same time
+static void wifi_retry_timer_cb(void *arg)
+{
+    wifi_connect_attempt();
+}
+
+// WIFI_STATIC_IP instead of DHCP; the netif then reports IP on association
+static void wifi_static_ip_apply(esp_netif_t *netif)
+{
+    esp_netif_ip_info_t ip_info = {0};
+    esp_netif_dns_info_t dns = {0};
+
+    if (esp_netif_str_to_ip4(WIFI_STATIC_IP, &ip_info.ip) != ESP_OK ||
+        esp_netif_str_to_ip4(WIFI_STATIC_NETMASK, &ip_info.netmask) != ESP_OK ||
+        esp_netif_str_to_ip4(WIFI_STATIC_GATEWAY, &ip_info.gw) != ESP_OK) {
+        ESP_LOGE(TAG, "[WIFI] Bad static address settings, keeping DHCP");
+        return;
+    }
+    esp_netif_dhcpc_stop(netif);
+    esp_netif_set_ip_info(netif, &ip_info);
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    if (esp_netif_str_to_ip4(WIFI_STATIC_DNS, (esp_ip4_addr_t *)&dns.ip.u_addr.ip4) != ESP_OK) {
+        dns.ip.u_addr.ip4.addr = ip_info.gw.addr;
+    }
+    esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+    ESP_LOGI(TAG, "[WIFI] Static address %s", WIFI_STATIC_IP);
+}
+
+static void wifi_init_sta(void)
+{
+    const esp_timer_create_args_t retry_args = {
+        .callback = wifi_retry_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_retry",
+    };
+
+    wifi_event_group = xEventGroupCreateStatic(&rtos_objects.wifi_events);
+    ESP_ERROR_CHECK(esp_timer_create(&retry_args, &wifi_conn.retry_timer));
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    esp_netif_t *netif = esp_netif_create_default_wifi_sta();
+    if (WIFI_STATIC_IP[0]) {
+        wifi_static_ip_apply(netif);
+    }
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_GOT_IP,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_got_ip));
+
+    // The attempts themselves set the config, starting from STA_START
+    wifi_ap_cache_load();
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+
+    ESP_LOGI(TAG, "WiFi initialization finished. Connecting to %s%s...", WIFI_SSID,
+             wifi_conn.have_ap ? " (fast connect)" : "");
+}
+
+// ============================================================================
+// SYNTHETIC TELEMETRY SOURCE
+// Drives ws_broadcast_traced() the way the parser does, with no printer. Each
+// event is a numbered {"type":"synth"} frame through the broadcast ring, which
+// a client must receive in full, plus a temperature update to its state slot,
+// which may be conflated. Frames are traced, so TRACE:1 clients get the
+// device-side latency of every one.
+// ============================================================================
+
+static atomic_uint ws_synth_rate;              // Frames per second, 0 = stopped
+static atomic_uint ws_synth_pad;               // Filler bytes per synth frame
+static TaskHandle_t ws_synth_task_handle = NULL;
+
+static void ws_synth_task(void *arg)
+{
+    ws_message_t msg;
+    temp_state_t temps = { .nozzle_target = 215.0f, .bed_target = 60.0f };
+    uint32_t seq = 0;
+    uint32_t credit = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        uint32_t rate = atomic_load(&ws_synth_rate);
+        if (rate == 0) {
+            if (seq > 0) {
+                ESP_LOGI(TAG, "[SYNTH] Stopped after %u frames", (unsigned)seq);
+            }
+            seq = 0;
+            credit = 0;
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            last_wake = xTaskGetTickCount();
+            continue;
+        }
+
+        // Whole frames due this tick; the remainder carries over
+        vTaskDelayUntil(&last_wake, 1);
+        credit += rate;
+        uint32_t due = credit / configTICK_RATE_HZ;
+        credit %= configTICK_RATE_HZ;
+
+        size_t pad = atomic_load(&ws_synth_pad);
+        while (due-- > 0) {
+            uint32_t now = trace_now();
+            json_writer_t w;
+            json_init(&w, msg.json_payload, WS_MAX_PAYLOAD_SIZE);
+            json_lit(&w, "{\"type\":\"synth\",\"seq\":");
+            json_uint(&w, seq);
+            json_lit(&w, ",\"pad\":\"");
+            size_t fill = w.cap - w.len - 2;
+            if (fill > pad) fill = pad;
+            memset(&w.buf[w.len], 'x', fill);
+            w.len += fill;
+            json_lit(&w, "\"}");
+            json_end(&w);
+            msg.type = MSG_TYPE_DEBUG;
+            msg.bin_len = 0;
+            ws_broadcast_traced(&msg, now, now);
+
+            temps.nozzle_current = 200.0f + (float)(seq % 150) / 10.0f;
+            temps.bed_current = 59.0f + (float)(seq % 20) / 10.0f;
+            telemetry_build_message(&msg, TELEMETRY_TOPIC_TEMPERATURE, &temps);
+            ws_broadcast_traced(&msg, now, now);
+            seq++;
+        }
+    }
+}
+
+// rate 0 stops; the task is created on first use and then parks
+static esp_err_t ws_synth_set(uint32_t rate, uint32_t pad)
+{
+    if (rate > WS_SYNTH_MAX_RATE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    atomic_store(&ws_synth_pad, pad);
+    atomic_store(&ws_synth_rate, rate);
+    if (ws_synth_task_handle == NULL) {
+        if (rate == 0) {
+            return ESP_OK;
+        }
+        if (xTaskCreatePinnedToCore(ws_synth_task, "ws_synth", WS_SYNTH_TASK_STACK, NULL,
+                                    pipe_placement[PIPE_PARSE].priority, &ws_synth_task_handle,
+                                    pipe_placement[PIPE_PARSE].core) != pdPASS) {
+            atomic_store(&ws_synth_rate, 0);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xTaskNotifyGive(ws_synth_task_handle);
+    if (rate > 0) {
+        ESP_LOGI(TAG, "[SYNTH] %u frames/s, %u pad bytes", (unsigned)rate, (unsigned)pad);
+    }
+    return ESP_OK;
+}
+
+// ============================================================================
+// TASK STATISTICS
+// FreeRTOS run-time counters and stack high-water marks, sampled every
+// MONITOR_INTERVAL_MS by the housekeeping pass. CPU % is of one core over the last sample interval.
+// ============================================================================
+
+// task_stat_t is in printer_protocol.h, with the frame builder
+typedef struct {
+    task_stat_t tasks[TASK_STATS_MAX];
+    int count;
+    uint16_t core_load_x10[portNUM_PROCESSORS]; // 100% minus that core's idle task
+    uint32_t samples;
+} task_stats_t;
+
+static task_stats_t task_stats;                // Protected by task_stats_mutex
+static SemaphoreHandle_t task_stats_mutex = NULL;
+
+// Previous run-time counters, by handle. Housekeeping only.
+static TaskStatus_t task_stats_raw[TASK_STATS_MAX];
+static struct {
+    TaskHandle_t handle;
+    uint32_t run_time;
+} task_stats_prev[TASK_STATS_MAX];
+static int task_stats_prev_count = 0;
+static uint32_t task_stats_prev_total = 0;
+
+static void task_stats_sample(void)
+{
+    static task_stats_t next;                  // Housekeeping only; too big for the stack
+    uint32_t total = 0;
+    UBaseType_t n = uxTaskGetSystemState(task_stats_raw, TASK_STATS_MAX, &total);
+    uint32_t elapsed = total - task_stats_prev_total;
+
+    if (n == 0) {
+        return;  // More tasks than TASK_STATS_MAX
+    }
+    memset(&next, 0, sizeof(next));
+
+    for (UBaseType_t i = 0; i < n; i++) {
+        const TaskStatus_t *t = &task_stats_raw[i];
+        uint32_t delta = 0;
+        for (int k = 0; k < task_stats_prev_count; k++) {
+            if (task_stats_prev[k].handle == t->xHandle) {
+                delta = t->ulRunTimeCounter - task_stats_prev[k].run_time;
+                break;
+            }
+        }
+
+        task_stat_t *out = &next.tasks[next.count++];
+        snprintf(out->name, sizeof(out->name), "%s", t->pcTaskName);
+        out->core = t->xCoreID < portNUM_PROCESSORS ? (int)t->xCoreID : -1;
+        out->priority = t->uxCurrentPriority;
+        out->cpu_x10 = elapsed ? (uint16_t)((uint64_t)delta * 1000 / elapsed) : 0;
+        out->stack_free = t->usStackHighWaterMark;
+
+        // ESP-IDF names the per-core idle tasks IDLE0, IDLE1
+        if (strncmp(t->pcTaskName, "IDLE", 4) == 0 && out->core >= 0) {
+            next.core_load_x10[out->core] = out->cpu_x10 < 1000 ? 1000 - out->cpu_x10 : 0;
+        }
+
+        task_stats_prev[i].handle = t->xHandle;
+        task_stats_prev[i].run_time = t->ulRunTimeCounter;
+    }
+    task_stats_prev_count = (int)n;
+    task_stats_prev_total = total;
+
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    next.samples = task_stats.samples + 1;
+    task_stats = next;
+    xSemaphoreGive(task_stats_mutex);
+}
+
+static void task_stats_snapshot(task_stats_t *out)
+{
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    *out = task_stats;
+    xSemaphoreGive(task_stats_mutex);
+}
+
+// Send the latest sample to SUB:debug clients, as many frames as it takes
+// (task_stats_frame()). Each part takes at least one task, so this ends.
+static void task_stats_publish(void)
+{
+    static task_stats_t snap;                  // Housekeeping only
+    ws_message_t msg;
+
+    if (!ws_topic_wanted(MSG_TYPE_DEBUG)) {
+        return;
+    }
+    task_stats_snapshot(&snap);
+
+    int i = 0;
+    for (int part = 0; i < snap.count; part++) {
+        task_stats_frame(msg.json_payload, sizeof(msg.json_payload), part, snap.core_load_x10,
+                         portNUM_PROCESSORS, snap.tasks, snap.count, &i);
+        msg.type = MSG_TYPE_DEBUG;
+        msg.bin_len = 0;
+        ws_broadcast_message(&msg);
+    }
+}
+
+// ============================================================================
+// PIPELINE PLACEMENT
+// Which core each pipeline stage runs on, and at what priority, picked by a
+// profile saved in NVS. Tasks are pinned as they are created, so a new
+// profile takes effect at the next boot. A boot runs a single profile, so the
+// trace histograms since boot and the pipeline tasks' mean CPU are that
+// profile's: they are saved as its report every PLACEMENT_SAVE_INTERVAL_MS
+// and before a switch, and GET /api/placement lists them side by side.
+// ============================================================================
+
+typedef struct {
+    const char *name;
+    pipe_slot_t stages[PIPE_STAGE_COUNT];      // Indexed by pipe_stage_t
+} placement_profile_t;
+
+// WiFi runs on core 0 (CONFIG_ESP_WIFI_TASK_PINNED_TO_CORE_0); lwIP floats
+static const placement_profile_t placement_profiles[] = {
+    // USB and parsing on core 0, networking and G-code on core 1
+    { "split",   { { 0, USB_HOST_TASK_PRIORITY }, { 0, SERIAL_PARSER_TASK_PRIORITY }, { 1, 5 }, { 1, 5 }, { 1, 6 } } },
+    // The whole serial side on core 0, so an 'ok' reaches the sender on the core that parsed it
+    { "serial",  { { 0, USB_HOST_TASK_PRIORITY }, { 0, SERIAL_PARSER_TASK_PRIORITY }, { 1, 5 }, { 1, 5 }, { 0, 6 } } },
+    // Only USB shares core 0 with WiFi
+    { "network", { { 0, USB_HOST_TASK_PRIORITY }, { 1, SERIAL_PARSER_TASK_PRIORITY }, { 1, 5 }, { 1, 5 }, { 1, 6 } } },
+    // Set stage by stage through POST /api/placement; starts as "split"
+    { "custom",  { { 0, USB_HOST_TASK_PRIORITY }, { 0, SERIAL_PARSER_TASK_PRIORITY }, { 1, 5 }, { 1, 5 }, { 1, 6 } } },
+};
+#define PLACEMENT_PROFILE_COUNT     (sizeof(placement_profiles) / sizeof(placement_profiles[0]))
+#define PLACEMENT_CUSTOM            (PLACEMENT_PROFILE_COUNT - 1)
+
+static const char *const pipe_stage_names[PIPE_STAGE_COUNT] = {
+    "usb", "parse", "fanout", "http", "gcode"
+};
+
+// Tasks whose CPU counts towards each stage
+static const char *const pipe_stage_tasks[PIPE_STAGE_COUNT][2] = {
+    { "usb_lib", "USB-CDC" }, { "serial_parser" }, { "ws_sender" }, { "httpd" }, { "gcode_sender" }
+};
+
+// One profile's measurements, as saved in NVS under "r<profile>"
+typedef struct {
+    pipe_slot_t stages[PIPE_STAGE_COUNT];      // As applied; custom may differ between reports
+    uint32_t uptime_s;
+    uint32_t frames;                           // Frames traced from USB to send
+    uint32_t p50_us[TRACE_STAGE_COUNT];
+    uint32_t p99_us[TRACE_STAGE_COUNT];
+    uint16_t cpu_x10[PIPE_STAGE_COUNT];        // Mean percent of a core, tenths
+    uint16_t core_load_x10[portNUM_PROCESSORS];
+} placement_report_t;
+
+// Protected by task_stats_mutex, like the samples it sums
+static struct {
+    uint8_t profile;                           // Index into placement_profiles
+    pipe_slot_t custom[PIPE_STAGE_COUNT];      // Stages of the custom profile
+    uint32_t samples;
+    uint32_t cpu_sum_x10[PIPE_STAGE_COUNT];
+    uint32_t core_sum_x10[portNUM_PROCESSORS];
+} placement;
+
+static bool placement_slot_valid(const pipe_slot_t *slot)
+{
+    return slot->core < portNUM_PROCESSORS && slot->priority > 0 && slot->priority < configMAX_PRIORITIES;
+}
+
+// Before any pipeline task starts. A missing or damaged entry means "split".
+static void placement_load(void)
+{
+    nvs_handle_t nvs;
+
+    placement.profile = 0;
+    memcpy(placement.custom, placement_profiles[PLACEMENT_CUSTOM].stages, sizeof(placement.custom));
+    if (nvs_open(PLACEMENT_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        pipe_slot_t custom[PIPE_STAGE_COUNT];
+        size_t len = sizeof(custom);
+        bool valid = nvs_get_blob(nvs, "custom", custom, &len) == ESP_OK && len == sizeof(custom);
+        for (int s = 0; valid && s < PIPE_STAGE_COUNT; s++) {
+            valid = placement_slot_valid(&custom[s]);
+        }
+        if (valid) {
+            memcpy(placement.custom, custom, sizeof(custom));
+        }
+        uint8_t profile;
+        if (nvs_get_u8(nvs, "profile", &profile) == ESP_OK && profile < PLACEMENT_PROFILE_COUNT) {
+            placement.profile = profile;
+        }
+        nvs_close(nvs);
+    }
+
+    memcpy(pipe_placement, placement.profile == PLACEMENT_CUSTOM ? placement.custom :
+           placement_profiles[placement.profile].stages, sizeof(pipe_placement));
+    ESP_LOGI(TAG, "[PLACEMENT] Profile %s: usb %u/%u, parse %u/%u, fanout %u/%u, http %u/%u, gcode %u/%u "
+             "(core/priority)", placement_profiles[placement.profile].name,
+             pipe_placement[PIPE_USB].core, pipe_placement[PIPE_USB].priority,
+             pipe_placement[PIPE_PARSE].core, pipe_placement[PIPE_PARSE].priority,
+             pipe_placement[PIPE_FANOUT].core, pipe_placement[PIPE_FANOUT].priority,
+             pipe_placement[PIPE_HTTP].core, pipe_placement[PIPE_HTTP].priority,
+             pipe_placement[PIPE_GCODE].core, pipe_placement[PIPE_GCODE].priority);
+}
+
+// After each task_stats_sample(). The first sample has no interval to measure.
+static void placement_sample(void)
+{
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    if (task_stats.samples > 1) {
+        for (int i = 0; i < task_stats.count; i++) {
+            const task_stat_t *t = &task_stats.tasks[i];
+            for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+                for (int k = 0; k < 2 && pipe_stage_tasks[s][k]; k++) {
+                    if (strcmp(t->name, pipe_stage_tasks[s][k]) == 0) {
+                        placement.cpu_sum_x10[s] += t->cpu_x10;
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < portNUM_PROCESSORS; c++) {
+            placement.core_sum_x10[c] += task_stats.core_load_x10[c];
+        }
+        placement.samples++;
+    }
+    xSemaphoreGive(task_stats_mutex);
+}
+
+// The running profile's report so far
+static void placement_report_live(placement_report_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    memcpy(r->stages, pipe_placement, sizeof(r->stages));
+    r->uptime_s = (uint32_t)(esp_timer_get_time() / 1000000);
+    r->frames = atomic_load_explicit(&trace_hists[TRACE_RX_TO_SEND].count, memory_order_relaxed);
+    for (int st = 0; st < TRACE_STAGE_COUNT; st++) {
+        r->p50_us[st] = trace_percentile((trace_stage_t)st, 50);
+        r->p99_us[st] = trace_percentile((trace_stage_t)st, 99);
+    }
+
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    if (placement.samples) {
+        for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+            r->cpu_x10[s] = (uint16_t)(placement.cpu_sum_x10[s] / placement.samples);
+        }
+        for (int c = 0; c < portNUM_PROCESSORS; c++) {
+            r->core_load_x10[c] = (uint16_t)(placement.core_sum_x10[c] / placement.samples);
+        }
+    }
+    xSemaphoreGive(task_stats_mutex);
+}
+
+static bool placement_report_load(unsigned profile, placement_report_t *r)
+{
+    nvs_handle_t nvs;
+    char key[4] = { 'r', (char)('0' + profile), '\0' };
+    size_t len = sizeof(*r);
+
+    if (nvs_open(PLACEMENT_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    bool ok = nvs_get_blob(nvs, key, r, &len) == ESP_OK && len == sizeof(*r);
+    nvs_close(nvs);
+    return ok;
+}
+
+// Keeps the running profile's report, once it has seen enough traffic to say
+// something - a boot without a printer does not overwrite a real run
+static void placement_report_save(void)
+{
+    placement_report_t r;
+    nvs_handle_t nvs;
+    char key[4] = { 'r', (char)('0' + placement.profile), '\0' };
+
+    placement_report_live(&r);
+    if (r.frames < PLACEMENT_MIN_FRAMES) {
+        return;
+    }
+    if (nvs_open(PLACEMENT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "[PLACEMENT] Could not open NVS to save the report");
+        return;
+    }
+    nvs_set_blob(nvs, key, &r, sizeof(r));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// The profile, and the custom stages, the next boot applies
+static esp_err_t placement_store(uint8_t profile, const pipe_slot_t custom[PIPE_STAGE_COUNT])
+{
+    nvs_handle_t nvs;
+
+    esp_err_t err = nvs_open(PLACEMENT_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_u8(nvs, "profile", profile);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, "custom", custom, sizeof(pipe_slot_t) * PIPE_STAGE_COUNT);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+// ============================================================================
+// SYSTEM MONITOR
+// Runs in ws_sender_task when the housekeeping timer asks for it.
+// ============================================================================
+
+static void monitor_report(void)
+{
+    static ws_sender_stats_t last_sender_stats;
+    uint16_t core_load_x10[portNUM_PROCESSORS];
+
+    task_stats_sample();
+    placement_sample();
+    task_stats_publish();
+    // Catches job start/end and clients dropped by timeouts
+    autoreport_update(false);
+    wifi_latency_update();
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    memcpy(core_load_x10, task_stats.core_load_x10, sizeof(core_load_x10));
+    xSemaphoreGive(task_stats_mutex);
+    DEBUG_LOG(TAG, "[MONITOR] CPU load: core0 %u.%u%%, core1 %u.%u%%",
+             core_load_x10[0] / 10, core_load_x10[0] % 10,
+             core_load_x10[1] / 10, core_load_x10[1] % 10);
+    
+    // Memory stats
+    size_t free_heap = esp_get_free_heap_size();
+    size_t min_free_heap = esp_get_minimum_free_heap_size();
+    DEBUG_LOG(TAG, "[MONITOR] Free heap: %zu bytes, Min: %zu bytes", free_heap, min_free_heap);
+    
+    // WebSocket client status
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    int active_clients = 0;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (ws_clients[i].active) {
+            active_clients++;
+            DEBUG_LOG(TAG, "[MONITOR] Client %d: fd=%d, lag=%u/%u bytes, overruns=%u",
+                     i, ws_clients[i].fd, (unsigned)(ws_ring.head - ws_clients[i].cursor),
+                     (unsigned)WS_BROADCAST_RING_SIZE, (unsigned)ws_clients[i].overruns);
+        }
+    }
+    DEBUG_LOG(TAG, "[MONITOR] Broadcast ring: %u/%u bytes, %u frames written",
+             (unsigned)(ws_ring.head - ws_ring.tail), (unsigned)WS_BROADCAST_RING_SIZE,
+             (unsigned)ws_ring.frames);
+    DEBUG_LOG(TAG, "[MONITOR] State slots: status=%u temp=%u power=%u pos=%u progress=%u stats=%u updates",
+             (unsigned)ws_state_slots[WS_SLOT_STATUS].updates,
+             (unsigned)ws_state_slots[WS_SLOT_TEMPERATURE].updates,
+             (unsigned)ws_state_slots[WS_SLOT_POWER].updates,
+             (unsigned)ws_state_slots[WS_SLOT_POSITION].updates,
+             (unsigned)ws_state_slots[WS_SLOT_PROGRESS].updates,
+             (unsigned)ws_state_slots[WS_SLOT_STATS].updates);
+    xSemaphoreGive(ws_clients_mutex);
+
+    // WebSocket send rates since the last report
+    ws_sender_stats_t now_stats = ws_sender_stats;
+    uint32_t d_frames = now_stats.frames - last_sender_stats.frames;
+    uint32_t d_bytes = now_stats.bytes - last_sender_stats.bytes;
+    uint32_t d_us = now_stats.send_us - last_sender_stats.send_us;
+    DEBUG_LOG(TAG, "[MONITOR] WS send: %u msg/s, %u bytes/s, avg %u us/send, errors %u",
+             (unsigned)(d_frames * 1000 / MONITOR_INTERVAL_MS),
+             (unsigned)((uint64_t)d_bytes * 1000 / MONITOR_INTERVAL_MS),
+             (unsigned)(d_frames ? d_us / d_frames : 0), (unsigned)now_stats.errors);
+    last_sender_stats = now_stats;
+    
+    DEBUG_LOG(TAG, "[MONITOR] Active clients: %d, Printer: %s", 
+             active_clients, printer_connected ? "connected" : "disconnected");
+
+    // Telemetry topic suppression stats
+    for (int t = 0; t < TELEMETRY_TOPIC_COUNT; t++) {
+        DEBUG_LOG(TAG, "[MONITOR] Topic %s: sent=%u suppressed=%u",
+                 telemetry_schema[t].name, (unsigned)telemetry_topics[t].sent_count,
+                 (unsigned)telemetry_topics[t].suppressed_count);
+    }
+
+    // Serial RX ring status
+    DEBUG_LOG(TAG, "[MONITOR] Serial RX ring: %u/%u bytes, high-water %u, dropped %u",
+             (unsigned)serial_rx_ring_depth(), (unsigned)SERIAL_RX_RING_SIZE,
+             (unsigned)atomic_load(&serial_rx_ring.high_water),
+             atomic_load(&serial_rx_ring.dropped_bytes));
+
+    // G-code window (read unlocked - counters only, owned by the sender task)
+    DEBUG_LOG(TAG, "[MONITOR] G-code: next N%u, in flight %u/%d, sent %u, resent %u, timeouts %u",
+             (unsigned)gcode_window.next_line,
+             (unsigned)(gcode_window.send_pos - gcode_window.acked), GCODE_WINDOW_SIZE,
+             (unsigned)gcode_window.sent, (unsigned)gcode_window.resends,
+             (unsigned)gcode_window.timeouts);
+    DEBUG_LOG(TAG, "[MONITOR] G-code priority: sent %u, failed %u, untracked %u, "
+             "tx %u/%u us, ok %u/%u us (last/max)",
+             (unsigned)gcode_window.priority.sent, (unsigned)gcode_window.priority.failed,
+             (unsigned)gcode_window.priority.untracked,
+             (unsigned)gcode_window.priority.last_tx_us, (unsigned)gcode_window.priority.max_tx_us,
+             (unsigned)gcode_window.priority.last_ok_us, (unsigned)gcode_window.priority.max_ok_us);
+
+    // WiFi status
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        DEBUG_LOG(TAG, "[MONITOR] WiFi RSSI: %d dBm", ap_info.rssi);
+    }
+}
+
+// Ping every client, evicting those that never answered the previous ping.
+// Pings go out after ws_clients_mutex is released, like every other send.
+static void ws_keepalive(void)
+{
+    struct {
+        int slot;
+        int fd;
+        bool sse;
+    } pings[WS_MAX_CLIENTS];
+    int evicted[WS_MAX_CLIENTS];
+    int count = 0;
+    int evicted_count = 0;
+
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (!ws_clients[i].active) continue;
+        if (ws_clients[i].sse) {
+            // No pongs on an event stream: a comment line keeps proxies from
+            // timing it out, and a failed write finds the dead ones
+            pings[count].slot = i;
+            pings[count].fd = ws_clients[i].fd;
+            pings[count].sse = true;
+            count++;
+        } else if (ws_clients[i].ping_pending) {
+            // Previous ping never got a pong - client is dead
+            ESP_LOGW(TAG, "No pong from client %d (fd=%d), evicting", i, ws_clients[i].fd);
+            evicted[evicted_count++] = ws_clients[i].fd;
+            ws_clients[i].active = false;
+            ws_clients[i].fd = -1;
+            ws_clients[i].ping_pending = false;
+        } else {
+            // Set before the send, so a fast pong cannot arrive ahead of it
+            ws_clients[i].ping_pending = true;
+            ws_clients[i].ping_sent_us = trace_now();
+            pings[count].slot = i;
+            pings[count].fd = ws_clients[i].fd;
+            pings[count].sse = false;
+            count++;
+        }
+    }
+    xSemaphoreGive(ws_clients_mutex);
+
+    for (int k = 0; k < evicted_count; k++) {
+        ws_client_close_evicted(evicted[k]);
+    }
+    for (int k = 0; k < count; k++) {
+        esp_err_t ret;
+        if (pings[k].sse) {
+            ret = sse_send(pings[k].fd, SSE_KEEPALIVE, strlen(SSE_KEEPALIVE));
+        } else {
+            httpd_ws_frame_t ping_pkt;
+            memset(&ping_pkt, 0, sizeof(httpd_ws_frame_t));
+            ping_pkt.type = HTTPD_WS_TYPE_PING;
+            ping_pkt.payload = NULL;
+            ping_pkt.len = 0;
+            ret = httpd_ws_send_frame_async(server, pings[k].fd, &ping_pkt);
+        }
+        if (ret == ESP_OK) {
+            DEBUG_LOG(TAG, "[MONITOR] Ping sent to client %d", pings[k].slot);
+            continue;
+        }
+        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+        int i = pings[k].slot;
+        bool evict = ws_clients[i].active && ws_clients[i].fd == pings[k].fd;
+        if (evict) {
+            ESP_LOGW(TAG, "Ping failed for client %d (fd=%d), evicting", i, pings[k].fd);
+            ws_clients[i].active = false;
+            ws_clients[i].fd = -1;
+            ws_clients[i].ping_pending = false;
+        }
+        xSemaphoreGive(ws_clients_mutex);
+        if (evict) ws_client_close_evicted(pings[k].fd);
+    }
+}
+
+// ============================================================================
+// MDNS ADVERTISEMENT
+// The state summary rides in the TXT records, so one browse shows a whole
+// farm without a request to any device. Temperatures are whole degrees:
+// finer values would change on every report.
+// ============================================================================
+
+typedef struct {
+    char conn[2];
+    char print[2];
+    char pct[4];
+    char noz[6];
+    char bed[6];
+} mdns_txt_state_t;
+
+static mdns_txt_state_t mdns_txt_current;       // ws_sender_task only, after mdns_services_start()
+static int64_t mdns_txt_updated_us;
+static bool mdns_services_up;
+
+static void mdns_txt_state_read(mdns_txt_state_t *st)
+{
+    printer_snapshot_t snap;
+
+    printer_state_read(&snap);
+    bool printing = snap.connected && snap.progress.percent < 100 && snap.progress.time_left_mins > 0;
+    snprintf(st->conn, sizeof(st->conn), "%d", snap.connected ? 1 : 0);
+    snprintf(st->print, sizeof(st->print), "%d", printing ? 1 : 0);
+    snprintf(st->pct, sizeof(st->pct), "%d", snap.connected ? snap.progress.percent : 0);
+    snprintf(st->noz, sizeof(st->noz), "%d", (int)lroundf(snap.temps.nozzle_current));
+    snprintf(st->bed, sizeof(st->bed), "%d", (int)lroundf(snap.temps.bed_current));
+}
+
+// TXT items for both services; the strings are static or in st
+static size_t mdns_txt_items(const mdns_txt_state_t *st, mdns_txt_item_t *items)
+{
+    size_t n = 0;
+    items[n++] = (mdns_txt_item_t){ "fw", FIRMWARE_VERSION };
+    items[n++] = (mdns_txt_item_t){ "conn", st->conn };
+    items[n++] = (mdns_txt_item_t){ "print", st->print };
+    items[n++] = (mdns_txt_item_t){ "pct", st->pct };
+    items[n++] = (mdns_txt_item_t){ "noz", st->noz };
+    items[n++] = (mdns_txt_item_t){ "bed", st->bed };
+    items[n++] = (mdns_txt_item_t){ "ws", "/ws" };
+    items[n++] = (mdns_txt_item_t){ "sse", "/events" };
+    return n;
+}
+
+static void mdns_services_start(void)
+{
+    mdns_txt_item_t items[8];
+
+    mdns_txt_state_read(&mdns_txt_current);
+    size_t n = mdns_txt_items(&mdns_txt_current, items);
+    if (mdns_service_add(NULL, "_http", "_tcp", 80, items, n) != ESP_OK ||
+        mdns_service_add(NULL, "_prusa-ws", "_tcp", 80, items, n) != ESP_OK) {
+        ESP_LOGW(TAG, "[MDNS] Service registration failed");
+        return;
+    }
+    mdns_txt_updated_us = esp_timer_get_time();
+    mdns_services_up = true;
+}
+
+// From housekeeping: re-announce when the summary changed, rate limited
+static void mdns_txt_update(void)
+{
+    mdns_txt_state_t st;
+    mdns_txt_item_t items[8];
+
+    if (!mdns_services_up) return;
+    mdns_txt_state_read(&st);
+    if (memcmp(&st, &mdns_txt_current, sizeof(st)) == 0) return;
+    if (esp_timer_get_time() - mdns_txt_updated_us < (int64_t)MDNS_TXT_MIN_INTERVAL_MS * 1000) return;
+
+    mdns_txt_current = st;
+    mdns_txt_updated_us = esp_timer_get_time();
+    size_t n = mdns_txt_items(&mdns_txt_current, items);
+    mdns_service_txt_set("_http", "_tcp", items, (uint8_t)n);
+    mdns_service_txt_set("_prusa-ws", "_tcp", items, (uint8_t)n);
+    DEBUG_LOG(TAG, "[MDNS] TXT conn=%s print=%s pct=%s noz=%s bed=%s",
+              st.conn, st.print, st.pct, st.noz, st.bed);
+}
+
+// ============================================================================
+// HOUSEKEEPING SCHEDULER
+// One one-shot esp_timer, re-armed for whichever job is due next, so an idle
+// bridge only wakes for the LED, the monitor and the mDNS check. Jobs run in the
+// esp_timer task and must not block: the LED toggles in place, the rest only
+// flags work for ws_sender_task, which already wakes for frames and does all
+// the network sends.
+// ============================================================================
+
+#define HOUSEKEEPING_MONITOR        (1u << 0)  // Task stats, autoreport rate, monitor report
+#define HOUSEKEEPING_KEEPALIVE      (1u << 1)  // Pings and eviction of silent clients
+#define HOUSEKEEPING_MDNS           (1u << 2)  // mDNS TXT state summary
+#define HOUSEKEEPING_PLACEMENT      (1u << 3)  // Placement report to NVS
+
+typedef struct {
+    void (*run)(void);
+    uint32_t (*period_ms)(void);
+    int64_t due_us;
+} housekeeping_job_t;
+
+static atomic_uint housekeeping_pending;
+static esp_timer_handle_t housekeeping_timer;
+
+static void housekeeping_request_monitor(void)
+{
+    atomic_fetch_or(&housekeeping_pending, HOUSEKEEPING_MONITOR | HOUSEKEEPING_KEEPALIVE);
+    if (ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+}
+
+static uint32_t housekeeping_monitor_period_ms(void)
+{
+    return MONITOR_INTERVAL_MS;
+}
+
+static void housekeeping_request_mdns(void)
+{
+    atomic_fetch_or(&housekeeping_pending, HOUSEKEEPING_MDNS);
+    if (ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+}
+
+static uint32_t housekeeping_mdns_period_ms(void)
+{
+    return MDNS_TXT_CHECK_MS;
+}
+
+static void housekeeping_request_placement(void)
+{
+    atomic_fetch_or(&housekeeping_pending, HOUSEKEEPING_PLACEMENT);
+    if (ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+}
+
+static uint32_t housekeeping_placement_period_ms(void)
+{
+    return PLACEMENT_SAVE_INTERVAL_MS;
+}
+
+// The recorder samples in its own task, which may be busy with a flash write
+static void housekeeping_request_recorder(void)
+{
+    if (recorder_task_handle) {
+        xTaskNotify(recorder_task_handle, RECORDER_WORK_SAMPLE, eSetBits);
+    }
+}
+
+static uint32_t housekeeping_recorder_period_ms(void)
+{
+    return RECORDER_SAMPLE_INTERVAL_S * 1000;
+}
+
+static housekeeping_job_t housekeeping_jobs[] = {
+    { .run = led_toggle,                     .period_ms = led_period_ms },
+    { .run = housekeeping_request_monitor,   .period_ms = housekeeping_monitor_period_ms },
+    { .run = housekeeping_request_mdns,      .period_ms = housekeeping_mdns_period_ms },
+    { .run = housekeeping_request_recorder,  .period_ms = housekeeping_recorder_period_ms },
+    // Not due at boot: there is nothing to report yet
+    { .run = housekeeping_request_placement, .period_ms = housekeeping_placement_period_ms,
+      .due_us = (int64_t)PLACEMENT_SAVE_INTERVAL_MS * 1000 },
+};
+
+static void housekeeping_timer_cb(void *arg)
+{
+    int64_t now_us = esp_timer_get_time();
+    int64_t next_us = INT64_MAX;
+
+    for (size_t i = 0; i < sizeof(housekeeping_jobs) / sizeof(housekeeping_jobs[0]); i++) {
+        housekeeping_job_t *job = &housekeeping_jobs[i];
+        if (job->due_us <= now_us) {
+            job->run();
+            // From now, not from the missed due time - never catches up
+            job->due_us = now_us + (int64_t)job->period_ms() * 1000;
+        }
+        if (job->due_us < next_us) next_us = job->due_us;
+    }
+    esp_timer_start_once(housekeeping_timer, (uint64_t)(next_us - now_us));
+}
+
+static void housekeeping_start(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = housekeeping_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "housekeeping",
+    };
+
+    led_init();
+    ESP_ERROR_CHECK(esp_timer_create(&args, &housekeeping_timer));
+    esp_timer_start_once(housekeeping_timer, 0);    // Every job is due at once
+}
+
+// Flagged work, from ws_sender_task between passes over the clients
+static void housekeeping_run(void)
+{
+    unsigned work = atomic_exchange(&housekeeping_pending, 0);
+
+    if (work & HOUSEKEEPING_MONITOR) {
+        monitor_report();
+    }
+    if (work & HOUSEKEEPING_KEEPALIVE) {
+        ws_keepalive();
+    }
+    if (work & HOUSEKEEPING_MDNS) {
+        mdns_txt_update();
+    }
+    if (work & HOUSEKEEPING_PLACEMENT) {
+        placement_report_save();
+    }
+}
+
+// ============================================================================
+// G-CODE COMMAND QUEUE SENDER TASK
+// Streams numbered, checksummed lines with up to GCODE_WINDOW_SIZE waiting for
+// 'ok'. The printer executes them in order, so G29 still completes before the
+// next command runs; the window only keeps its command buffer fed.
+// ============================================================================
+
+// Latency entry for an opcode; the last entry collects any overflow
+static gcode_latency_t *gcode_latency_for(const char *cmd)
+{
+    char opcode[8];
+
+    gcode_opcode(cmd, opcode);
+    for (int i = 0; i < gcode_latency_count; i++) {
+        if (strcmp(gcode_latency[i].code, opcode) == 0) {
+            return &gcode_latency[i];
+        }
+    }
+
+    gcode_latency_t *entry = &gcode_latency[GCODE_LATENCY_OPCODES];
+    if (gcode_latency_count < GCODE_LATENCY_OPCODES) {
+        entry = &gcode_latency[gcode_latency_count++];
+        strcpy(entry->code, opcode);
+    } else if (entry->code[0] == '\0') {
+        strcpy(entry->code, "other");
+    }
+    return entry;
+}
+
+static void gcode_latency_record(const char *cmd, int64_t rtt_us)
+{
+    gcode_latency_t *entry = gcode_latency_for(cmd);
+    uint32_t us = rtt_us > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt_us;
+    int bucket = 0;
+
+    while (bucket < GCODE_LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) != 0) bucket++;
+
+    if (entry->count == 0 || us < entry->min_us) entry->min_us = us;
+    if (us > entry->max_us) entry->max_us = us;
+    entry->sum_us += us;
+    entry->count++;
+    entry->hist[bucket]++;
+}
+
+// Upper edge of the bucket holding the 99th percentile
+static uint32_t gcode_latency_p99(const gcode_latency_t *entry)
+{
+    uint32_t need = entry->count - entry->count / 100;
+    uint32_t seen = 0;
+
+    for (int k = 0; k < GCODE_LATENCY_BUCKETS; k++) {
+        seen += entry->hist[k];
+        if (seen >= need) {
+            uint64_t edge = (2ULL << k) - 1;
+            return edge < entry->max_us ? (uint32_t)edge : entry->max_us;
+        }
+    }
+    return entry->max_us;
+}
+
+// Runs in the USB host client task once the transfer is on the wire. A lost
+// line is not retried here: the printer asks for it with Resend:, or the
+// 'ok' timeout catches it, exactly as for a line it failed to receive.
+static void gcode_tx_done(esp_err_t status, void *arg)
+{
+    if (status == ESP_OK) {
+        METRIC_ADD(usb_tx_bytes, (unsigned)(uintptr_t)arg);
+        METRIC_INC(usb_tx_transfers);
+    } else {
+        METRIC_INC(usb_tx_failed);
+    }
+    // A freed transfer may be what the sender is waiting for
+    if (gcode_sender_task_handle) {
+        xTaskNotifyGive(gcode_sender_task_handle);
+    }
+}
+
+// Hand a GCODE#id: reply to the WS sender. The lines stay in the serial log
+// backlog; only their range is queued.
+static void gcode_post_result(const gcode_line_t *line, size_t log_start, size_t log_end, bool timed_out)
+{
+    gcode_result_t res = {
+        .fd = line->reply_fd,
+        .request_id = line->request_id,
+        .log_start = log_start,
+        .log_end = log_end,
+        .elapsed_ms = (uint32_t)((esp_timer_get_time() - line->sent_us) / 1000),
+        .timed_out = timed_out,
+    };
+
+    strncpy(res.cmd, line->cmd, GCODE_CMD_MAX_LEN - 1);
+    if (xQueueSend(gcode_result_queue, &res, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "[GCODE] Result queue full, dropping reply to #%u", (unsigned)line->request_id);
+        return;
+    }
+    if (ws_sender_task_handle) {
+        xTaskNotifyGive(ws_sender_task_handle);
+    }
+}
+
+// The printer has acknowledged a line (log_end is just past its 'ok'), or
+// the window gave up on it. A timed-out line only owes its requester a reply.
+static void gcode_line_completed(void *ctx, const gcode_line_t *line, size_t log_start, size_t log_end,
+                                 bool timed_out)
+{
+    if (line->reply_fd >= 0) {
+        gcode_post_result(line, log_start, log_end, timed_out);
+    }
+    if (timed_out) return;
+
+    int64_t now_us = esp_timer_get_time();
+    gcode_latency_record(line->cmd, now_us - line->sent_us);
+
+    if (line->from_stream) {
+        uint32_t acked = atomic_fetch_add(&gcode_stream.acked, 1) + 1;
+        bool done = !atomic_load(&gcode_stream.receiving) &&
+                    acked == atomic_load(&gcode_stream.lines);
+        if (done || now_us - gcode_stream.last_report_us > (int64_t)GCODE_STREAM_REPORT_MS * 1000) {
+            if (now_us > gcode_stream.rate_us) {
+                atomic_store(&gcode_stream.rate, (unsigned)((int64_t)(acked - gcode_stream.rate_acked) *
+                                                            1000000 / (now_us - gcode_stream.rate_us)));
+            }
+            gcode_stream.rate_acked = acked;
+            gcode_stream.rate_us = now_us;
+            gcode_stream_publish();
+        }
+    }
+
+    // A finished levelling run replaces the mesh. G29 P<n> only probes points.
+    if (strncmp(line->cmd, "G80", 3) == 0 ||
+        (strncmp(line->cmd, "G29", 3) == 0 && strstr(line->cmd, " P") == NULL)) {
+        mesh_request_refresh(true);
+    }
+}
+
+// gcode_window_ops_t for the device: gcode_tx_mutex, esp_timer, the serial
+// log backlog, gcode_event_queue / gcode_queue and the CDC-ACM OUT endpoint
+
+static void gcode_tx_lock(void *ctx)
+{
+    xSemaphoreTake(gcode_tx_mutex, portMAX_DELAY);
+}
+
+static void gcode_tx_unlock(void *ctx)
+{
+    xSemaphoreGive(gcode_tx_mutex);
+}
+
+static int64_t gcode_window_now_us(void *ctx)
+{
+    return esp_timer_get_time();
+}
+
+static size_t gcode_window_log_head(void *ctx)
+{
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    size_t head = serial_log_backlog.head;
+    xSemaphoreGive(log_backlog_mutex);
+    return head;
+}
+
+static bool gcode_window_next_event(void *ctx, gcode_event_t *ev)
+{
+    return xQueueReceive(gcode_event_queue, ev, 0) == pdTRUE;
+}
+
+static bool gcode_window_next_cmd(void *ctx, gcode_cmd_t *cmd)
+{
+    return xQueueReceive(gcode_queue, cmd, 0) == pdTRUE;
+}
+
+// On failure (usually all OUT transfers still queued) the window frames the
+// lines again on the next wakeup
+static int gcode_window_transmit(void *ctx, const uint8_t *data, size_t len, uint32_t first, uint32_t lines)
+{
+    esp_err_t err = cdc_acm_host_data_tx_async(gcode_sender_dev, data, len, gcode_tx_done,
+                                               (void *)(uintptr_t)len);
+    if (err != ESP_OK) {
+        if (err != ESP_ERR_NO_MEM) {
+            ESP_LOGE(TAG, "[GCODE] Failed to send %u line(s) from N%u (%s)", (unsigned)lines,
+                     (unsigned)first, esp_err_to_name(err));
+        }
+        return err;
+    }
+    METRIC_ADD(usb_tx_lines, lines);
+    DEBUG_LOG(TAG, "[GCODE] Sent N%u..N%u (in flight %u)", (unsigned)first, (unsigned)(first + lines - 1),
+             (unsigned)(gcode_window_in_flight(&gcode_window) + lines));
+    return ESP_OK;
+}
+
+static int gcode_window_transmit_now(void *ctx, const uint8_t *data, size_t len)
+{
+    cdc_acm_dev_hdl_t dev = g_prusa_dev;
+
+    if (!dev) return ESP_ERR_INVALID_STATE;
+    return cdc_acm_host_data_tx_blocking(dev, data, len, USB_TX_TIMEOUT_MS);
+}
+
+static void gcode_window_timeout(void *ctx, const gcode_line_t *oldest)
+{
+    ESP_LOGW(TAG, "[GCODE] Timeout (%u ms) waiting for ok after N%u: %s",
+             (unsigned)oldest->timeout_ms, (unsigned)oldest->line, oldest->cmd);
+    gcode_latency_for(oldest->cmd)->timeouts++;
+}
+
+static void gcode_window_resend(void *ctx, uint32_t line, bool renumbered)
+{
+    if (renumbered) {
+        ESP_LOGE(TAG, "[GCODE] Cannot resend line %u (window %u..%u), restarting numbering",
+                 (unsigned)line, (unsigned)gcode_window.acked, (unsigned)gcode_window.next_line);
+    } else {
+        ESP_LOGW(TAG, "[GCODE] Printer requested resend from line %u", (unsigned)line);
+    }
+}
+
+// Before gcode_sender_task and the first priority command
+static void gcode_window_setup(void)
+{
+    static const gcode_window_ops_t ops = {
+        .lock = gcode_tx_lock,
+        .unlock = gcode_tx_unlock,
+        .now_us = gcode_window_now_us,
+        .log_head = gcode_window_log_head,
+        .next_event = gcode_window_next_event,
+        .next_cmd = gcode_window_next_cmd,
+        .transmit = gcode_window_transmit,
+        .transmit_now = gcode_window_transmit_now,
+        .completed = gcode_line_completed,
+        .timeout = gcode_window_timeout,
+        .resend = gcode_window_resend,
+    };
+
+    gcode_window_init(&gcode_window, &ops);
+}
+
+_Static_assert(GCODE_TX_BATCH_SIZE <= USB_OUT_TRANSFER_SIZE, "G-code batch must fit one OUT transfer");
+
+// M112 (kill), M108 (break heating wait), M410 (quickstop) and M876 (host
+// prompt response) must not wait behind a G29 in the window
+static bool gcode_is_priority(const char *cmd)
+{
+    static const char *const priority_cmds[] = { "M112", "M108", "M410", "M876" };
+
+    while (*cmd == ' ') cmd++;
+    for (size_t i = 0; i < sizeof(priority_cmds) / sizeof(priority_cmds[0]); i++) {
+        if (strncasecmp(cmd, priority_cmds[i], 4) == 0 && !(cmd[4] >= '0' && cmd[4] <= '9')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write a priority command straight to the printer, ahead of the window
+static esp_err_t gcode_send_priority(const char *cmd, int64_t received_us)
+{
+    int len = (int)strcspn(cmd, ";\r\n");
+
+    if (!g_prusa_dev) return ESP_ERR_INVALID_STATE;
+
+    esp_err_t err = gcode_window_send_priority(&gcode_window, cmd, received_us);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "[GCODE] Priority command sent: %.*s (%u us)", len, cmd,
+                 (unsigned)gcode_window.priority.last_tx_us);
+    } else {
+        ESP_LOGE(TAG, "[GCODE] Priority command failed: %.*s (%s)", len, cmd, esp_err_to_name(err));
+    }
+    return err;
+}
+
+static void gcode_sender_task(void *arg)
+{
+    gcode_cmd_t cmd;
+
+    ESP_LOGI(TAG, "G-code sender task started (window %d)", GCODE_WINDOW_SIZE);
+
+    while (1) {
+        // Printer (re)connected - anything it acknowledged before is stale
+        if (g_prusa_dev != gcode_sender_dev) {
+            gcode_sender_dev = g_prusa_dev;
+            xQueueReset(gcode_event_queue);
+            gcode_window_restart(&gcode_window);
+            if (gcode_sender_dev) {
+                ESP_LOGI(TAG, "[GCODE] Line numbering reset for new printer session");
+            }
+        }
+
+        gcode_window_service(&gcode_window, gcode_sender_dev != NULL);  // Failures retried on the next wakeup
+        if (!gcode_sender_dev) {
+            while (xQueueReceive(gcode_queue, &cmd, 0) == pdTRUE) {
+                ESP_LOGW(TAG, "[GCODE] Printer not connected, dropping: %s", cmd.cmd);
+            }
+        }
+
+        // Woken by new commands, printer acknowledgements, or the poll timeout
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(GCODE_SENDER_POLL_MS));
+    }
+}
+
+// ============================================================================
+// G-CODE MACROS
+// A stored macro runs like a POST /print upload read from SPIFFS instead of
+// the network: one line at a time into gcode_queue, held back by the window's
+// credits, with progress in the status frame's stream object. The browser
+// only starts it, so a sleeping tab or a WiFi stall cannot cut it short.
+// ============================================================================
+
+// Normalise one uploaded line in place and queue it, blocking while the
+// printer holds all credits. Comments and blank lines never reach the wire.
+static esp_err_t gcode_stream_line(char *line)
+{
+    while (atomic_load(&gcode_stream.paused) && !atomic_load(&gcode_stream.stop)) {
+        vTaskDelay(pdMS_TO_TICKS(SPOOL_PAUSE_POLL_MS));
+    }
+    if (atomic_load(&gcode_stream.stop)) return ESP_ERR_NOT_FINISHED;
+
+    char *end = line + strcspn(line, ";\r");
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    while (line < end && (*line == ' ' || *line == '\t')) line++;
+    if (line == end) return ESP_OK;
+    if (end - line >= GCODE_CMD_MAX_LEN) return ESP_ERR_INVALID_SIZE;
+    *end = '\0';
+
+    while (!gcode_enqueue(line, true, pdMS_TO_TICKS(1000))) {
+        if (!g_prusa_dev) return ESP_ERR_INVALID_STATE;
+        if (atomic_load(&gcode_stream.stop)) return ESP_ERR_NOT_FINISHED;
+    }
+    atomic_fetch_add(&gcode_stream.lines, 1);
+    return ESP_OK;
+}
+
+// n new bytes were read into gcode_stream.buf after the fill kept from
+// before. Hands over every complete line and moves the partial tail to the
+// front; at the end of the input the tail is the last line.
+static esp_err_t gcode_stream_consume(size_t *fill, size_t n, bool last)
+{
+    char *buf = gcode_stream.buf;
+    esp_err_t err = ESP_OK;
+    size_t start = 0;
+
+    for (size_t i = *fill; i < *fill + n && err == ESP_OK; i++) {
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            err = gcode_stream_line(buf + start);
+            start = i + 1;
+        }
+    }
+    *fill += n;
+    memmove(buf, buf + start, *fill - start);
+    *fill -= start;
+
+    if (err == ESP_OK && *fill == gcode_stream.buf_size) {
+        err = ESP_ERR_INVALID_SIZE;
+    } else if (err == ESP_OK && last && *fill > 0) {
+        buf[*fill] = '\0';
+        err = gcode_stream_line(buf);  // Last line without a newline
+    }
+    return err;
+}
+
+// Caller owns gcode_stream.busy
+static void gcode_stream_reset(size_t total, const char *macro)
+{
+    atomic_store(&gcode_stream.bytes, 0);
+    atomic_store(&gcode_stream.lines, 0);
+    atomic_store(&gcode_stream.acked, 0);
+    atomic_store(&gcode_stream.total, (unsigned)total);
+    atomic_store(&gcode_stream.stop, false);
+    atomic_store(&gcode_stream.paused, false);
+    atomic_store(&gcode_stream.rate, 0);
+    snprintf(gcode_stream.macro, sizeof(gcode_stream.macro), "%s", macro);
+    gcode_stream.spool = false;
+    gcode_stream.start_us = esp_timer_get_time();
+    gcode_stream.rate_acked = 0;
+    gcode_stream.rate_us = gcode_stream.start_us;
+    gcode_stream.end_us = 0;
+    gcode_stream.last_report_us = 0;
+    atomic_store(&gcode_stream.receiving, true);
+}
+
+static bool macro_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > MACRO_NAME_MAX || strcmp(name, "STOP") == 0) return false;
+    return strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-") == len;
+}
+
+static void macro_path(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, MACRO_PATH_PREFIX "%s" MACRO_PATH_SUFFIX, name);
+}
+
+// The macro name of a SPIFFS directory entry into name, false if it is not one
+static bool macro_entry_name(const char *entry, char *name)
+{
+    const char *prefix = MACRO_PATH_PREFIX + sizeof("/spiffs/") - 1;
+    size_t len = strlen(entry);
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = sizeof(MACRO_PATH_SUFFIX) - 1;
+
+    if (len <= prefix_len + suffix_len || len - prefix_len - suffix_len > MACRO_NAME_MAX ||
+        strncmp(entry, prefix, prefix_len) != 0 ||
+        strcmp(entry + len - suffix_len, MACRO_PATH_SUFFIX) != 0) {
+        return false;
+    }
+    memcpy(name, entry + prefix_len, len - prefix_len - suffix_len);
+    name[len - prefix_len - suffix_len] = '\0';
+    return true;
+}
+
+static bool macro_running(const char *name)
+{
+    return atomic_load(&gcode_stream.busy) && strcmp(gcode_stream.macro, name) == 0;
+}
+
+static void macro_task(void *arg)
+{
+    FILE *fp = arg;
+    size_t fill = 0;
+    size_t r = 0;
+    esp_err_t err = ESP_OK;
+
+    ESP_LOGI(TAG, "[MACRO] %s started (%u bytes)", gcode_stream.macro, atomic_load(&gcode_stream.total));
+
+    while (err == ESP_OK && (r = fread(gcode_stream.buf + fill, 1, gcode_stream.buf_size - fill, fp)) > 0) {
+        atomic_fetch_add(&gcode_stream.bytes, (unsigned)r);
+        err = gcode_stream_consume(&fill, r, false);
+        if (esp_timer_get_time() - gcode_stream.last_report_us > (int64_t)GCODE_STREAM_REPORT_MS * 1000) {
+            gcode_stream_publish();
+        }
+    }
+    if (err == ESP_OK) {
+        err = ferror(fp) ? ESP_FAIL : gcode_stream_consume(&fill, 0, true);
+    }
+    fclose(fp);
+
+    gcode_stream.end_us = esp_timer_get_time();
+    atomic_store(&gcode_stream.receiving, false);
+
+    unsigned lines = atomic_load(&gcode_stream.lines);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "[MACRO] %s queued: %u lines", gcode_stream.macro, lines);
+    } else {
+        ESP_LOGW(TAG, "[MACRO] %s aborted after %u lines: %s", gcode_stream.macro, lines,
+                 err == ESP_ERR_NOT_FINISHED ? "stopped" : esp_err_to_name(err));
+    }
+    gcode_stream_publish();
+    atomic_store(&gcode_stream.busy, false);
+    vTaskDelete(NULL);
+}
+
+// MACRO:<name> - run a stored macro. Fails while an upload or another macro
+// is being fed.
+static esp_err_t macro_run(const char *name)
+{
+    char path[64];
+    struct stat st;
+
+    if (!macro_name_valid(name)) return ESP_ERR_INVALID_ARG;
+    if (!g_prusa_dev) return ESP_ERR_INVALID_STATE;
+    if (mount_remote_html_fs() != ESP_OK) return ESP_FAIL;
+    macro_path(path, sizeof(path), name);
+    FILE *fp = stat(path, &st) == 0 ? fopen(path, "r") : NULL;
+    if (fp == NULL) return ESP_ERR_NOT_FOUND;
+    if (atomic_exchange(&gcode_stream.busy, true)) {
+        fclose(fp);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    gcode_stream_reset((size_t)st.st_size, name);
+    if (xTaskCreatePinnedToCore(macro_task, "macro", MACRO_TASK_STACK, fp, 5, NULL,
+                                pipe_placement[PIPE_GCODE].core) != pdPASS) {
+        fclose(fp);
+        atomic_store(&gcode_stream.receiving, false);
+        atomic_store(&gcode_stream.busy, false);
+        return ESP_ERR_NO_MEM;
+    }
+    gcode_stream_publish();
+    return ESP_OK;
+}
+
+// MACRO:STOP - no further lines of the running macro or upload. The few
+// already queued or in the window still run.
+static void macro_stop(void)
+{
+    if (atomic_load(&gcode_stream.busy)) {
+        atomic_store(&gcode_stream.stop, true);
+    }
+}
+
+// ============================================================================
+// STORE-AND-FORWARD SPOOL
+// A job uploaded to the spool partition is checked against its CRC once more
+// and then fed like an upload, read from flash instead of the network. The
+// upload window is the read-ahead: a flash read takes microseconds, so
+// gcode_queue and the G-code window stay full whatever WiFi does. Pause holds
+// the next line back; cancel also takes the queued lines back out.
+// ============================================================================
+
+static uint32_t spool_hdr_crc(const spool_hdr_t *hdr)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)hdr, offsetof(spool_hdr_t, hdr_crc));
+}
+
+// CRC-32 of len bytes of the stored job, read through buf
+static esp_err_t spool_data_crc(uint32_t len, char *buf, size_t size, uint32_t *crc)
+{
+    *crc = 0;
+    for (uint32_t off = 0; off < len; ) {
+        size_t n = len - off < size ? len - off : size;
+        esp_err_t err = esp_partition_read(spool.part, spool.part->erase_size + off, buf, n);
+        if (err != ESP_OK) return err;
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *)buf, n);
+        off += n;
+    }
+    return ESP_OK;
+}
+
+// Find the partition and the job left in it, if any. Its data is checked
+// when it is started, not here.
+static void spool_init(void)
+{
+    spool_hdr_t hdr;
+
+    spool.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                          SPOOL_PARTITION_LABEL);
+    if (spool.part == NULL) {
+        ESP_LOGW(TAG, "No '%s' partition, store-and-forward printing disabled", SPOOL_PARTITION_LABEL);
+        return;
+    }
+    atomic_store(&spool.state, SPOOL_EMPTY);
+    if (esp_partition_read(spool.part, 0, &hdr, sizeof(hdr)) != ESP_OK || hdr.magic != SPOOL_MAGIC ||
+        hdr.hdr_crc != spool_hdr_crc(&hdr) || hdr.len > spool.part->size - spool.part->erase_size) {
+        return;
+    }
+    spool.len = hdr.len;
+    spool.crc = hdr.crc;
+    memcpy(spool.name, hdr.name, sizeof(spool.name));
+    spool.name[SPOOL_NAME_MAX] = '\0';
+    atomic_store(&spool.state, SPOOL_READY);
+    ESP_LOGI(TAG, "[SPOOL] Stored job %s, %u bytes", spool.name, (unsigned)spool.len);
+}
+
+static void spool_feed_task(void *arg)
+{
+    char *buf = gcode_stream.buf;
+    uint32_t crc;
+    uint32_t off = 0;
+    size_t fill = 0;
+    esp_err_t err = spool_data_crc(spool.len, buf, gcode_stream.buf_size, &crc);
+
+    if (err == ESP_OK && crc != spool.crc) {
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "[SPOOL] %s verified, feeding %u bytes", spool.name, (unsigned)spool.len);
+        gcode_stream.start_us = esp_timer_get_time();
+        gcode_stream.rate_us = gcode_stream.start_us;
+    }
+
+    while (err == ESP_OK && off < spool.len) {
+        size_t want = gcode_stream.buf_size - fill;
+        size_t n = spool.len - off < want ? spool.len - off : want;
+        err = esp_partition_read(spool.part, spool.part->erase_size + off, buf + fill, n);
+        if (err != ESP_OK) break;
+        off += n;
+        atomic_fetch_add(&gcode_stream.bytes, (unsigned)n);
+        err = gcode_stream_consume(&fill, n, off == spool.len);
+        if (esp_timer_get_time() - gcode_stream.last_report_us > (int64_t)GCODE_STREAM_REPORT_MS * 1000) {
+            gcode_stream_publish();
+        }
+    }
+
+    unsigned dropped = 0;
+    if (err == ESP_ERR_NOT_FINISHED) {
+        // Lines never sent are not owed an 'ok'; done is acked == lines
+        dropped = gcode_queue_drop_stream();
+        atomic_fetch_sub(&gcode_stream.lines, dropped);
+    }
+    gcode_stream.end_us = esp_timer_get_time();
+    atomic_store(&gcode_stream.receiving, false);
+
+    unsigned lines = atomic_load(&gcode_stream.lines);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "[SPOOL] %s queued: %u lines", spool.name, lines);
+    } else if (err == ESP_ERR_NOT_FINISHED) {
+        ESP_LOGW(TAG, "[SPOOL] %s cancelled after %u lines, %u queued lines dropped", spool.name, lines, dropped);
+    } else if (err == ESP_ERR_INVALID_CRC) {
+        ESP_LOGE(TAG, "[SPOOL] %s fails its CRC check, not printed", spool.name);
+    } else {
+        ESP_LOGW(TAG, "[SPOOL] %s aborted after %u lines: %s", spool.name, lines, esp_err_to_name(err));
+    }
+    gcode_stream_publish();
+    // A corrupt job cannot be started again; a good one can be reprinted
+    atomic_store(&spool.state, err == ESP_ERR_INVALID_CRC ? SPOOL_EMPTY : SPOOL_READY);
+    atomic_store(&gcode_stream.busy, false);
+    vTaskDelete(NULL);
+}
+
+// SPOOL:START - print the stored job. Fails while an upload, a macro or
+// another job is being fed.
+static esp_err_t spool_start(void)
+{
+    int ready = SPOOL_READY;
+
+    if (spool.part == NULL) return ESP_ERR_NOT_SUPPORTED;
+    if (!g_prusa_dev) return ESP_ERR_INVALID_STATE;
+    if (!atomic_compare_exchange_strong(&spool.state, &ready, SPOOL_FEEDING)) return ESP_ERR_NOT_FOUND;
+    if (atomic_exchange(&gcode_stream.busy, true)) {
+        atomic_store(&spool.state, SPOOL_READY);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    gcode_stream_reset(spool.len, "");
+    gcode_stream.spool = true;
+    if (xTaskCreatePinnedToCore(spool_feed_task, "spool", SPOOL_TASK_STACK, NULL, 5, NULL,
+                                pipe_placement[PIPE_GCODE].core) != pdPASS) {
+        atomic_store(&gcode_stream.receiving, false);
+        atomic_store(&gcode_stream.busy, false);
+        atomic_store(&spool.state, SPOOL_READY);
+        return ESP_ERR_NO_MEM;
+    }
+    gcode_stream_publish();
+    return ESP_OK;
+}
+
+// SPOOL:PAUSE / SPOOL:RESUME. A pause takes effect once the printer has run
+// the lines already buffered; nothing is sent to park the head.
+static esp_err_t spool_pause(bool pause)
+{
+    if (!atomic_load(&gcode_stream.busy) || !gcode_stream.spool) return ESP_ERR_INVALID_STATE;
+    atomic_store(&gcode_stream.paused, pause);
+    gcode_stream_publish();
+    return ESP_OK;
+}
+
+// SPOOL:CANCEL - stop feeding; spool_feed_task drops what is still queued
+static esp_err_t spool_cancel(void)
+{
+    if (!atomic_load(&gcode_stream.busy) || !gcode_stream.spool) return ESP_ERR_INVALID_STATE;
+    atomic_store(&gcode_stream.stop, true);
+    return ESP_OK;
+}
+
+// ============================================================================
+// WEBSOCKET MESSAGE SENDER TASK
+// ============================================================================
+
+// Streams one large message as WebSocket fragments from a fixed buffer.
+// Only used from ws_sender_task, so the buffer can be static.
+typedef struct {
+    int fd;
+    httpd_ws_type_t type;
+    bool started;
+    bool deflate;                              // The client takes WS_BIN_DEFLATE records
+    bool compressing;                          // buf is input to ws_deflate, not a fragment
+    esp_err_t err;
+    size_t len;
+    size_t total;
+    uint8_t buf[WS_HISTORY_CHUNK_SIZE];
+} ws_stream_t;
+
+static ws_stream_t ws_bulk_stream;
+
+#if ENABLE_WS_DEFLATE
+_Static_assert(WS_DEFLATE_MIN_SIZE <= WS_HISTORY_CHUNK_SIZE,
+               "Compression is decided on the first fragment");
+
+// Compressor of the bulk stream, one frame at a time like the stream itself
+static ws_deflate_t ws_deflate;
+#define WS_DEFLATE_STATIC_BYTES     (sizeof(ws_deflate))
+#else
+#define WS_DEFLATE_STATIC_BYTES     (0)
+#endif
+
+// Scratch of the bulk frames ws_sender_task streams. It sends one at a time,
+// so the log backlog, result and mesh senders share it.
+static union {
+    struct {
+        uint8_t line[SERIAL_LOG_BACKLOG_LINE_MAX];
+        char escaped[SERIAL_LOG_BACKLOG_LINE_MAX * 6];
+    } log;
+    int16_t z_um[MESH_GRID_SIZE][MESH_GRID_SIZE];
+} ws_sender_scratch;
+
+static void ws_stream_send(ws_stream_t *st, const uint8_t *data, size_t len, bool final)
+{
+    if (st->err != ESP_OK) return;
+
+    httpd_ws_frame_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = st->started ? HTTPD_WS_TYPE_CONTINUE : st->type;
+    pkt.fragmented = true;
+    pkt.final = final;
+    pkt.payload = (uint8_t *)data;
+    pkt.len = len;
+    st->err = httpd_ws_send_frame_async(server, st->fd, &pkt);
+    st->started = true;
+    st->total += len;
+}
+
+#if ENABLE_WS_DEFLATE
+static bool ws_stream_deflate_emit(void *ctx, const uint8_t *data, size_t len, bool final)
+{
+    ws_stream_t *st = ctx;
+    ws_stream_send(st, data, len, final);
+    return st->err == ESP_OK;
+}
+
+// Turn the frame under way into a WS_BIN_DEFLATE record. Nothing of it has
+// been sent yet: all of it is still in buf.
+static void ws_stream_deflate_start(ws_stream_t *st)
+{
+    const uint8_t hdr[2] = { WS_BIN_DEFLATE, st->type == HTTPD_WS_TYPE_BINARY };
+
+    st->type = HTTPD_WS_TYPE_BINARY;
+    st->compressing = true;
+    ws_deflate_begin(&ws_deflate, hdr, sizeof(hdr), ws_stream_deflate_emit, st);
+}
+#endif
+
+static void ws_stream_flush(ws_stream_t *st, bool final)
+{
+    if (st->err != ESP_OK) return;
+
+#if ENABLE_WS_DEFLATE
+    if (!st->started && !st->compressing && st->deflate && st->len >= WS_DEFLATE_MIN_SIZE) {
+        ws_stream_deflate_start(st);
+    }
+    if (st->compressing) {
+        ws_deflate_write(&ws_deflate, st->buf, st->len);
+        st->len = 0;
+        if (final) {
+            ws_deflate_finish(&ws_deflate);
+            st->compressing = false;
+            METRIC_ADD(ws_deflate_in_bytes, ws_deflate.in_total);
+            METRIC_ADD(ws_deflate_out_bytes, ws_deflate.out_total);
+            DEBUG_LOG(TAG, "[WS] Deflated %u bytes to %u for fd=%d",
+                     (unsigned)ws_deflate.in_total, (unsigned)ws_deflate.out_total, st->fd);
+        }
+        return;
+    }
+#endif
+    ws_stream_send(st, st->buf, st->len, final);
+    st->len = 0;
+}
+
+static void ws_stream_write(ws_stream_t *st, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0 && st->err == ESP_OK) {
+        size_t n = sizeof(st->buf) - st->len;
+        if (n > len) n = len;
+        memcpy(&st->buf[st->len], p, n);
+        st->len += n;
+        p += n;
+        len -= n;
+        if (st->len == sizeof(st->buf)) {
+            ws_stream_flush(st, false);
+        }
+    }
+}
+
+static void ws_stream_puts(ws_stream_t *st, const char *str)
+{
+    ws_stream_write(st, str, strlen(str));
+}
+
+static const char *const ws_history_field_names[HIST_FIELD_COUNT] = {
+    [HIST_NOZZLE]        = "nozzle",
+    [HIST_NOZZLE_TARGET] = "nozzleTarget",
+    [HIST_BED]           = "bed",
+    [HIST_BED_TARGET]    = "bedTarget",
+    [HIST_HEATBREAK]     = "heatbreak",
+    [HIST_CHAMBER]       = "chamber",
+    [HIST_NOZZLE_PWM]    = "nozzlePwm",
+    [HIST_BED_PWM]       = "bedPwm",
+    [HIST_HEATBREAK_PWM] = "heatbreakPwm",
+};
+
+static void ws_stream_begin(ws_stream_t *st, int fd, httpd_ws_type_t type)
+{
+    st->fd = fd;
+    st->type = type;
+    st->started = false;
+    st->deflate = false;
+    st->compressing = false;
+#if ENABLE_WS_DEFLATE
+    int client_id = ws_client_find(fd);
+    if (client_id >= 0) {
+        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+        st->deflate = ws_clients[client_id].deflate;
+        xSemaphoreGive(ws_clients_mutex);
+    }
+#endif
+    st->err = ESP_OK;
+    st->len = 0;
+    st->total = 0;
+}
+
+// Send the whole telemetry history to one client: a WS_BIN_HISTORY record for
+// prusa-bin clients, otherwise columnar JSON with integer values
+// {"type":"history","intervalMs":2000,"tempScale":10,"count":N,"nozzle":[...],...}
+static esp_err_t ws_send_history(int fd, bool binary)
+{
+    ws_stream_t *st = &ws_bulk_stream;
+    history_sample_t block[32];
+    uint32_t first, count;
+    char num[48];
+
+    telemetry_history_range(&first, &count);
+    if (count == 0) {
+        return ESP_OK;
+    }
+    // A PSRAM ring holds hours more; the page graphs the last hour
+    if (count > TELEMETRY_HISTORY_SAMPLES) {
+        first += count - TELEMETRY_HISTORY_SAMPLES;
+        count = TELEMETRY_HISTORY_SAMPLES;
+    }
+
+    ws_stream_begin(st, fd, binary ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT);
+
+    if (binary) {
+        uint8_t hdr[6];
+        hdr[0] = WS_BIN_HISTORY;
+        hdr[1] = (uint8_t)TELEMETRY_HISTORY_INTERVAL_MS;
+        hdr[2] = (uint8_t)(TELEMETRY_HISTORY_INTERVAL_MS >> 8);
+        hdr[3] = (uint8_t)count;
+        hdr[4] = (uint8_t)(count >> 8);
+        hdr[5] = HIST_FIELD_COUNT;
+        ws_stream_write(st, hdr, sizeof(hdr));
+
+        // Samples are little-endian int16 in memory already
+        for (uint32_t k = 0; k < count && st->err == ESP_OK; k += 32) {
+            uint32_t n = count - k < 32 ? count - k : 32;
+            telemetry_history_copy(first + k, n, block);
+            ws_stream_write(st, block, n * sizeof(history_sample_t));
+        }
+    } else {
+        snprintf(num, sizeof(num), "{\"type\":\"history\",\"intervalMs\":%d,",
+                 TELEMETRY_HISTORY_INTERVAL_MS);
+        ws_stream_puts(st, num);
+        snprintf(num, sizeof(num), "\"tempScale\":10,\"count\":%u", (unsigned)count);
+        ws_stream_puts(st, num);
+
+        // One pass over the ring per column
+        for (int f = 0; f < HIST_FIELD_COUNT && st->err == ESP_OK; f++) {
+            snprintf(num, sizeof(num), ",\"%s\":[", ws_history_field_names[f]);
+            ws_stream_puts(st, num);
+            for (uint32_t k = 0; k < count && st->err == ESP_OK; k += 32) {
+                uint32_t n = count - k < 32 ? count - k : 32;
+                telemetry_history_copy(first + k, n, block);
+                for (uint32_t j = 0; j < n; j++) {
+                    int len = snprintf(num, sizeof(num), (k + j) ? ",%d" : "%d", block[j].v[f]);
+                    ws_stream_write(st, num, len);
+                }
+            }
+            ws_stream_puts(st, "]");
+        }
+        ws_stream_puts(st, "}");
+    }
+
+    ws_stream_flush(st, true);
+    if (st->err == ESP_OK) {
+        DEBUG_LOG(TAG, "[WS] History sent to fd=%d: %u samples, %u bytes",
+                 fd, (unsigned)count, (unsigned)st->total);
+    }
+    return st->err;
+}
+
+static esp_err_t ws_stream_emit(void *ctx, const char *text, size_t len)
+{
+    ws_stream_t *st = ctx;
+    ws_stream_write(st, text, len);
+    return st->err;
+}
+
+// Answer a HISTORY: query with samples [from, to) downsampled to points
+// buckets, JSON only: {"type":"historyBuckets","intervalMs":2000,"start":S,
+// "end":E,"points":N,"fields":[...],"buckets":[[seq,n,min...,max...,avg...],...]}
+static esp_err_t ws_send_history_query(int fd, uint32_t from, uint32_t to, uint32_t points)
+{
+    ws_stream_t *st = &ws_bulk_stream;
+    uint32_t start, end;
+    char num[64];
+
+    telemetry_history_clip(from, to, &start, &end);
+    if (points > end - start) points = end - start;
+
+    ws_stream_begin(st, fd, HTTPD_WS_TYPE_TEXT);
+    snprintf(num, sizeof(num), "{\"type\":\"historyBuckets\",\"intervalMs\":%d,",
+             TELEMETRY_HISTORY_INTERVAL_MS);
+    ws_stream_puts(st, num);
+    snprintf(num, sizeof(num), "\"start\":%u,\"end\":%u,\"points\":%u,\"fields\":[",
+             (unsigned)start, (unsigned)end, (unsigned)points);
+    ws_stream_puts(st, num);
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        snprintf(num, sizeof(num), "%s\"%s\"", f ? "," : "", ws_history_field_names[f]);
+        ws_stream_puts(st, num);
+    }
+    ws_stream_puts(st, "],\"buckets\":[");
+    if (points > 0) {
+        history_downsample(start, end, points, ws_stream_emit, st);
+    }
+    ws_stream_puts(st, "]}");
+    ws_stream_flush(st, true);
+    return st->err;
+}
+
+// Replay the serial log backlog to one client as a single logs frame, the
+// same {"type":"logs","lines":[...]} shape the live batcher produces
+static esp_err_t ws_send_log_backlog(int fd, size_t end)
+{
+    uint8_t *line = ws_sender_scratch.log.line;
+    char *escaped = ws_sender_scratch.log.escaped;
+    ws_stream_t *st = &ws_bulk_stream;
+    int lines = 0;
+
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    size_t pos = serial_log_backlog.replay;
+    xSemaphoreGive(log_backlog_mutex);
+
+    if (end - pos > SERIAL_LOG_BACKLOG_SIZE || pos == end) {
+        return ESP_OK;
+    }
+
+    ws_stream_begin(st, fd, HTTPD_WS_TYPE_TEXT);
+
+    ws_stream_puts(st, LOG_BATCH_PREFIX);
+    int len;
+    while (st->err == ESP_OK && (len = log_backlog_read(&pos, end, line)) >= 0) {
+        size_t n = json_escape(escaped, sizeof(ws_sender_scratch.log.escaped), (const char *)line, len);
+        ws_stream_puts(st, lines ? ",\"" : "\"");
+        ws_stream_write(st, escaped, n);
+        ws_stream_puts(st, "\"");
+        lines++;
+    }
+    ws_stream_puts(st, LOG_BATCH_SUFFIX);
+    ws_stream_flush(st, true);
+
+    if (st->err == ESP_OK) {
+        DEBUG_LOG(TAG, "[WS] Log backlog sent to fd=%d: %d lines, %u bytes",
+                 fd, lines, (unsigned)st->total);
+    }
+    return st->err;
+}
+
+// Reply to GCODE#id: as
+// {"type":"result","id":N,"cmd":"...","lines":[...],"elapsed_ms":N}
+// Bare "ok", busy notices and temperature autoreports are left out.
+static esp_err_t ws_send_result(const gcode_result_t *res)
+{
+    uint8_t *line = ws_sender_scratch.log.line;
+    char *escaped = ws_sender_scratch.log.escaped;
+    ws_stream_t *st = &ws_bulk_stream;
+    char num[96];
+    int lines = 0;
+
+    if (ws_client_find(res->fd) < 0) {
+        return ESP_OK;  // Requester went away
+    }
+
+    xSemaphoreTake(log_backlog_mutex, portMAX_DELAY);
+    bool truncated = serial_log_backlog.head - res->log_start >
+                     serial_log_backlog.head - serial_log_backlog.tail;
+    xSemaphoreGive(log_backlog_mutex);
+
+    ws_stream_begin(st, res->fd, HTTPD_WS_TYPE_TEXT);
+
+    size_t n = json_escape(escaped, sizeof(ws_sender_scratch.log.escaped), res->cmd, strlen(res->cmd));
+    snprintf(num, sizeof(num), "{\"type\":\"result\",\"id\":%u,\"cmd\":\"", (unsigned)res->request_id);
+    ws_stream_puts(st, num);
+    ws_stream_write(st, escaped, n);
+    ws_stream_puts(st, "\",\"lines\":[");
+
+    size_t pos = res->log_start;
+    int len;
+    while (st->err == ESP_OK && (len = log_backlog_read(&pos, res->log_end, line)) >= 0) {
+        const char *l = (const char *)line;
+        if ((len == 2 && strncmp(l, "ok", 2) == 0) ||
+            (len >= 2 && strncmp(l, "T:", 2) == 0) ||
+            (len >= 3 && strncmp(l, " T:", 3) == 0) ||
+            (len >= 9 && strncmp(l, "echo:busy", 9) == 0)) {
+            continue;
+        }
+        n = json_escape(escaped, sizeof(ws_sender_scratch.log.escaped), l, len);
+        ws_stream_puts(st, lines ? ",\"" : "\"");
+        ws_stream_write(st, escaped, n);
+        ws_stream_puts(st, "\"");
+        lines++;
+    }
+
+    snprintf(num, sizeof(num), "],\"elapsed_ms\":%u%s%s}", (unsigned)res->elapsed_ms,
+             res->timed_out ? ",\"timeout\":true" : "", truncated ? ",\"truncated\":true" : "");
+    ws_stream_puts(st, num);
+    ws_stream_flush(st, true);
+
+    if (st->err == ESP_OK) {
+        DEBUG_LOG(TAG, "[WS] Result #%u sent to fd=%d: %d lines, %u ms",
+                 (unsigned)res->request_id, res->fd, lines, (unsigned)res->elapsed_ms);
+    }
+    return st->err;
+}
+
+// Send the cached bed mesh as
+// {"type":"mesh","generation":N,"rows":21,"cols":21,"scale":1000,"z":[[...],...]}
+// with rows in report order. Returns the generation sent, 0 if none is cached.
+static uint32_t ws_send_mesh(int fd, esp_err_t *err)
+{
+    int16_t (*z_um)[MESH_GRID_SIZE] = ws_sender_scratch.z_um;
+    ws_stream_t *st = &ws_bulk_stream;
+    char num[96];
+
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    uint32_t generation = mesh_cache.generation;
+    memcpy(z_um, mesh_cache.z_um, sizeof(ws_sender_scratch.z_um));
+    xSemaphoreGive(printer_state_mutex);
+
+    *err = ESP_OK;
+    if (generation == 0) {
+        return 0;
+    }
+
+    ws_stream_begin(st, fd, HTTPD_WS_TYPE_TEXT);
+
+    snprintf(num, sizeof(num), "{\"type\":\"mesh\",\"generation\":%u,\"rows\":%d,\"cols\":%d,\"scale\":1000,\"z\":[",
+             (unsigned)generation, MESH_GRID_SIZE, MESH_GRID_SIZE);
+    ws_stream_puts(st, num);
+    for (int r = 0; r < MESH_GRID_SIZE; r++) {
+        ws_stream_puts(st, r ? ",[" : "[");
+        for (int c = 0; c < MESH_GRID_SIZE; c++) {
+            int len = snprintf(num, sizeof(num), c ? ",%d" : "%d", z_um[r][c]);
+            ws_stream_write(st, num, len);
+        }
+        ws_stream_puts(st, "]");
+    }
+    ws_stream_puts(st, "]}");
+    ws_stream_flush(st, true);
+
+    *err = st->err;
+    return generation;
+}
+
+// Copy a JSON frame into out with an "_trace" member before its closing brace:
+// device-side age since USB arrival, time spent queued, and the device uptime
+// at send so the page can work out the network and browser part. Returns the
+// new length, or 0 if it does not fit.
+static size_t ws_trace_annotate(const ws_message_t *msg, size_t len, char *out, size_t cap)
+{
+    if (len < 2 || msg->json_payload[len - 1] != '}') return 0;
+
+    uint32_t now = trace_now();
+    memcpy(out, msg->json_payload, len - 1);
+    int n = snprintf(out + len - 1, cap - (len - 1),
+                     ",\"_trace\":{\"age_us\":%u,\"queued_us\":%u,\"tx_ms\":%u}}",
+                     (unsigned)(now - msg->trace.rx_us), (unsigned)(now - msg->trace.enqueued_us),
+                     (unsigned)(esp_timer_get_time() / 1000));
+    if (n < 0 || (size_t)n >= cap - (len - 1)) return 0;
+    return len - 1 + (size_t)n;
+}
+
+// Send each state slot updated since the last pass as one datagram: the
+// header, then the slot's prusa-bin record. Frames without a binary form
+// (status during a page refresh) were never marked. Runs in ws_sender_task.
+static void udp_telemetry_flush(void)
+{
+    uint8_t dgram[UDP_TELEMETRY_HDR_SIZE + WS_BIN_MAX_PAYLOAD];
+
+    while (udp_telemetry.sock >= 0) {
+        size_t len = 0;
+        bool more = false;
+        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+        if (udp_telemetry.pending) {
+            more = true;
+            int slot = __builtin_ctz(udp_telemetry.pending);
+            udp_telemetry.pending &= ~(1u << slot);
+            const ws_state_slot_t *s = &ws_state_slots[slot];
+            if (s->msg.bin_len == 0) {
+                // Overwritten by a JSON-only frame since it was marked
+                xSemaphoreGive(ws_clients_mutex);
+                continue;
+            }
+            uint32_t seq = udp_telemetry.seq++;
+            dgram[0] = (uint8_t)UDP_TELEMETRY_MAGIC;
+            dgram[1] = (uint8_t)(UDP_TELEMETRY_MAGIC >> 8);
+            dgram[2] = UDP_TELEMETRY_VERSION;
+            dgram[3] = 0;
+            bin_put_i32(&dgram[4], (int32_t)seq);
+            memcpy(&dgram[UDP_TELEMETRY_HDR_SIZE], s->msg.bin_payload, s->msg.bin_len);
+            len = UDP_TELEMETRY_HDR_SIZE + s->msg.bin_len;
+        }
+        xSemaphoreGive(ws_clients_mutex);
+        if (!more) break;
+
+        // A full lwIP queue loses this update only; the sequence number tells
+        // listeners about the gap and the next change carries the new value
+        if (sendto(udp_telemetry.sock, dgram, len, MSG_DONTWAIT,
+                   (const struct sockaddr *)&udp_telemetry.group, sizeof(udp_telemetry.group)) < 0) {
+            METRIC_INC(udp_send_errors);
+        } else {
+            METRIC_INC(udp_datagrams);
+        }
+    }
+}
+
+#if ENABLE_UDP_TELEMETRY
+static void udp_telemetry_start(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "[UDP] Cannot create telemetry socket: errno %d", errno);
+        return;
+    }
+    uint8_t ttl = UDP_TELEMETRY_TTL;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    memset(&udp_telemetry.group, 0, sizeof(udp_telemetry.group));
+    udp_telemetry.group.sin_family = AF_INET;
+    udp_telemetry.group.sin_port = htons(UDP_TELEMETRY_PORT);
+    udp_telemetry.group.sin_addr.s_addr = inet_addr(UDP_TELEMETRY_GROUP);
+
+    // Listeners joining now get the current state at once
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    udp_telemetry.sock = sock;
+    for (int slot = 0; slot < WS_SLOT_COUNT; slot++) {
+        if (ws_state_slots[slot].updates > 0 && ws_state_slots[slot].msg.bin_len > 0) {
+            udp_telemetry.pending |= 1u << slot;
+        }
+    }
+    xSemaphoreGive(ws_clients_mutex);
+    ESP_LOGI(TAG, "[UDP] Telemetry multicast to %s:%d", UDP_TELEMETRY_GROUP, UDP_TELEMETRY_PORT);
+}
+#endif
+
+static void ws_sender_task(void *arg)
+{
+    static char trace_json[WS_TRACE_FRAME_SIZE];        // Only this task uses it
+    static ws_message_t msg;                            // Off the stack, for the housekeeping work
+    int consecutive_errors[WS_MAX_CLIENTS] = {0};
+    bool backlog = false;
+
+    while (1) {
+        // Sleep until a producer queues a frame, unless the last pass stopped
+        // on the fairness budget with frames still waiting. The housekeeping
+        // timer's MONITOR_INTERVAL_MS notification doubles as the safety net.
+        if (!backlog) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        backlog = false;
+        housekeeping_run();
+        udp_telemetry_flush();
+
+        // Command results are small and someone is waiting on them
+        gcode_result_t result;
+        while (gcode_result_queue && xQueueReceive(gcode_result_queue, &result, 0) == pdTRUE) {
+            if (ws_send_result(&result) != ESP_OK) {
+                ws_sender_stats.errors++;
+                ESP_LOGW(TAG, "Failed to send result #%u to fd=%d", (unsigned)result.request_id, result.fd);
+            }
+        }
+
+        // Round-robin so one busy client cannot starve the others
+        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+            for (int burst = 0; burst < WS_SENDER_BURST_PER_CLIENT; burst++) {
+
+                // Take mutex only long enough to copy the next frame out of the ring
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+
+                if (!ws_clients[i].active || ws_clients[i].paused) {
+                    xSemaphoreGive(ws_clients_mutex);
+                    break;
+                }
+
+                // History goes first - it is older than anything in the ring or slots
+                if (ws_clients[i].history_pending) {
+                    ws_clients[i].history_pending = false;
+                    int fd = ws_clients[i].fd;
+                    bool binary = ws_clients[i].binary;
+                    xSemaphoreGive(ws_clients_mutex);
+
+                    esp_err_t ret = ws_send_history(fd, binary);
+                    if (ret != ESP_OK) {
+                        ws_sender_stats.errors++;
+                        ESP_LOGW(TAG, "Failed to send history to client %d: %s", i, esp_err_to_name(ret));
+                    }
+                    continue;
+                }
+                if (ws_clients[i].history_points) {
+                    uint32_t points = ws_clients[i].history_points;
+                    uint32_t from = ws_clients[i].history_from;
+                    uint32_t to = ws_clients[i].history_to;
+                    int fd = ws_clients[i].fd;
+                    ws_clients[i].history_points = 0;
+                    xSemaphoreGive(ws_clients_mutex);
+
+                    esp_err_t ret = ws_send_history_query(fd, from, to, points);
+                    if (ret != ESP_OK) {
+                        ws_sender_stats.errors++;
+                        ESP_LOGW(TAG, "Failed to send history query to client %d: %s", i, esp_err_to_name(ret));
+                    }
+                    continue;
+                }
+                if (ws_clients[i].log_backlog_pending) {
+                    ws_clients[i].log_backlog_pending = false;
+                    int fd = ws_clients[i].fd;
+                    size_t end = ws_clients[i].log_backlog_end;
+                    xSemaphoreGive(ws_clients_mutex);
+
+                    esp_err_t ret = ws_send_log_backlog(fd, end);
+                    if (ret != ESP_OK) {
+                        ws_sender_stats.errors++;
+                        ESP_LOGW(TAG, "Failed to send log backlog to client %d: %s", i, esp_err_to_name(ret));
+                    }
+                    continue;
+                }
+                // Generation is read without printer_state_mutex - a stale value
+                // only delays the send until the cache's own notification
+                if ((ws_clients[i].topics & WS_TOPIC_BIT(MSG_TYPE_MESH)) &&
+                    mesh_cache.generation != 0 &&
+                    ws_clients[i].mesh_generation != mesh_cache.generation) {
+                    int fd = ws_clients[i].fd;
+                    xSemaphoreGive(ws_clients_mutex);
+
+                    esp_err_t ret;
+                    uint32_t generation = ws_send_mesh(fd, &ret);
+                    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                    if (ws_clients[i].active && ws_clients[i].fd == fd) {
+                        ws_clients[i].mesh_generation = generation;
+                    }
+                    xSemaphoreGive(ws_clients_mutex);
+                    if (ret != ESP_OK) {
+                        ws_sender_stats.errors++;
+                        ESP_LOGW(TAG, "Failed to send mesh to client %d: %s", i, esp_err_to_name(ret));
+                    }
+                    continue;
+                }
+
+                size_t len = ws_client_next_frame(i, &msg);
+                int fd = ws_clients[i].fd;
+                bool sse = ws_clients[i].sse;
+                size_t event_id = ws_clients[i].cursor;
+                bool traced = ws_clients[i].trace && msg.trace.rx_us != 0;
+                bool binary = ws_clients[i].binary && msg.bin_len > 0 && !traced;
+
+                // Release mutex BEFORE any network send - may block on TCP but won't block USB RX
+                xSemaphoreGive(ws_clients_mutex);
+
+                if (len == 0) break;
+
+                esp_err_t ret;
+                size_t sent_len;
+                int64_t t0 = esp_timer_get_time();
+                if (sse) {
+                    // Never traced, so trace_json is free to hold the event
+                    sent_len = sse_event_format(&msg, len, event_id, trace_json, sizeof(trace_json));
+                    ret = sent_len ? sse_send(fd, trace_json, sent_len) : ESP_OK;
+                } else {
+                    httpd_ws_frame_t ws_pkt;
+                    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+                    if (binary) {
+                        ws_pkt.payload = msg.bin_payload;
+                        ws_pkt.len = msg.bin_len;
+                        ws_pkt.type = HTTPD_WS_TYPE_BINARY;
+                    } else {
+                        size_t traced_len = traced ? ws_trace_annotate(&msg, len, trace_json, sizeof(trace_json)) : 0;
+                        ws_pkt.payload = traced_len ? (uint8_t *)trace_json : (uint8_t *)msg.json_payload;
+                        ws_pkt.len = traced_len ? traced_len : len;
+                        ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+                    }
+                    ret = httpd_ws_send_frame_async(server, fd, &ws_pkt);
+                    sent_len = ws_pkt.len;
+                }
+                ws_sender_stats.send_us += (uint32_t)(esp_timer_get_time() - t0);
+
+                if (ret == ESP_OK) {
+                    consecutive_errors[i] = 0;
+                    ws_sender_stats.frames++;
+                    ws_sender_stats.bytes += sent_len;
+                    METRIC_INC(ws_frames_sent[msg.type]);
+                    if (msg.trace.rx_us) {
+                        uint32_t sent_us = trace_now();
+                        trace_record(TRACE_ENQUEUE_TO_SEND, sent_us - msg.trace.enqueued_us);
+                        trace_record(TRACE_RX_TO_SEND, sent_us - msg.trace.rx_us);
+                    }
+                    if (burst == WS_SENDER_BURST_PER_CLIENT - 1) {
+                        backlog = true;  // Budget used up - come back after the others
+                    }
+                    continue;
+                }
+
+                // Mutex is only needed again on the error path
+                consecutive_errors[i]++;
+                ws_sender_stats.errors++;
+                ESP_LOGW(TAG, "Failed to send to client %d: %s (consec=%d)",
+                         i, esp_err_to_name(ret), consecutive_errors[i]);
+
+                if (consecutive_errors[i] >= 3) {
+                    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                    bool evict = ws_clients[i].active && ws_clients[i].fd == fd;
+                    if (evict) {
+                        ESP_LOGW(TAG, "Evicting dead client %d (fd=%d)", i, fd);
+                        ws_clients[i].active = false;
+                        ws_clients[i].fd = -1;
+                        ws_clients[i].ping_pending = false;
+                    }
+                    xSemaphoreGive(ws_clients_mutex);
+                    if (evict) ws_client_close_evicted(fd);
+                    consecutive_errors[i] = 0;
+                }
+                break;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// HTTP/WEBSOCKET HANDLERS
+// ============================================================================
+
+// Queue the current state of the given topics for one client
+static void ws_send_snapshot(int client_id, uint32_t topics)
+{
+    ws_message_t msg;
+    printer_snapshot_t snap;
+
+    printer_state_read(&snap);
+    if (topics & WS_TOPIC_BIT(MSG_TYPE_STATUS)) {
+        build_status_message(&msg, snap.connected);
+        ws_unicast_message(client_id, &msg);
+    }
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        if (topics & WS_TOPIC_BIT(telemetry_schema[id].msg_type)) {
+            telemetry_build_message(&msg, id, telemetry_snapshot_state(&snap, id));
+            ws_unicast_message(client_id, &msg);
+        }
+    }
+    if (topics & WS_TOPIC_BIT(MSG_TYPE_STATS)) {
+        print_stats_build(&msg);
+        ws_unicast_message(client_id, &msg);
+    }
+}
+
+// Parse a comma-separated topic list ("temperature,progress", "all", "")
+static uint32_t ws_parse_topics(const char *list)
+{
+    static const struct {
+        const char *name;
+        uint32_t bits;
+    } names[] = {
+        { "status",      WS_TOPIC_BIT(MSG_TYPE_STATUS) },
+        { "temperature", WS_TOPIC_BIT(MSG_TYPE_TEMPERATURE) },
+        { "progress",    WS_TOPIC_BIT(MSG_TYPE_PROGRESS) },
+        { "position",    WS_TOPIC_BIT(MSG_TYPE_POSITION) },
+        { "power",       WS_TOPIC_BIT(MSG_TYPE_POWER) },
+        { "log",         WS_TOPIC_BIT(MSG_TYPE_LOG) },
+        { "error",       WS_TOPIC_BIT(MSG_TYPE_ERROR) },
+        { "mesh",        WS_TOPIC_BIT(MSG_TYPE_MESH) },
+        { "stats",       WS_TOPIC_BIT(MSG_TYPE_STATS) },
+        { "debug",       WS_TOPIC_BIT(MSG_TYPE_DEBUG) },
+        { "all",         WS_TOPICS_DEFAULT },
+    };
+    uint32_t topics = 0;
+    const char *p = list;
+
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        bool known = false;
+        for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+            if (strlen(names[n].name) == len && strncmp(p, names[n].name, len) == 0) {
+                topics |= names[n].bits;
+                known = true;
+                break;
+            }
+        }
+        if (!known && len > 0) {
+            ESP_LOGW(TAG, "Unknown topic '%.*s' in SUB", (int)len, p);
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    return topics;
+}
+
+// Session options settled before CONNECT, kept as which of these static
+// markers sess_ctx points at; never freed
+#define WS_SESSION_BINARY           (1u << 0)  // Offered WS_BINARY_SUBPROTOCOL
+#define WS_SESSION_DEFLATE          (1u << 1)  // Sent DEFLATE: with our dictionary id
+static uint8_t ws_session_markers[4];
+
+static void ws_session_ctx_keep(void *ctx)
+{
+    // Static marker - nothing to free
+}
+
+static unsigned ws_session_flags(const httpd_req_t *req)
+{
+    return req->sess_ctx ? (unsigned)((const uint8_t *)req->sess_ctx - ws_session_markers) : 0;
+}
+
+static void ws_session_flag_set(httpd_req_t *req, unsigned flag)
+{
+    req->sess_ctx = &ws_session_markers[ws_session_flags(req) | flag];
+    req->free_ctx = ws_session_ctx_keep;
+}
+
+// Length of one line of G-code text with its comment, line ending and
+// trailing blanks left off
+static size_t gcode_text_line_len(const char *line)
+{
+    size_t len = strcspn(line, ";\r\n");
+
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    return len;
+}
+
+// Split a block of G-code text into commands and submit them. Priority
+// commands go out at once; the rest is queued as one batch of at most
+// capacity commands, so a macro runs without interleaving. A block with more
+// than that is refused whole, before any of it is sent. A reply_fd >= 0
+// gets the batch's reply, tagged with request_id.
+static void gcode_submit_text(char *cmd, gcode_cmd_t *batch, size_t capacity, int reply_fd,
+                              uint32_t request_id)
+{
+    size_t count = 0;
+
+    for (const char *line = cmd; line && *line; ) {
+        if (gcode_text_line_len(line) > 0 && !gcode_is_priority(line)) count++;
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    if (count > capacity) {
+        ESP_LOGW(TAG, "G-code batch of %u commands is longer than %u, dropping it",
+                 (unsigned)count, (unsigned)capacity);
+        return;
+    }
+
+    count = 0;
+    while (cmd && *cmd) {
+        char *next = strchr(cmd, '\n');
+        if (next) *next++ = '\0';
+
+        size_t len = gcode_text_line_len(cmd);
+        cmd[len] = '\0';
+
+        if (len == 0) {
+            // Blank or comment-only line
+        } else if (gcode_is_priority(cmd)) {
+            gcode_send_priority(cmd, esp_timer_get_time());
+        } else {
+            gcode_cmd_t *c = &batch[count++];
+            memset(c, 0, sizeof(*c));
+            strncpy(c->cmd, cmd, GCODE_CMD_MAX_LEN - 1);
+            c->reply_fd = -1;
+            c->request_id = request_id;
+        }
+        cmd = next;
+    }
+    if (count == 0) return;
+
+    if (reply_fd >= 0) {
+        batch[0].reply_begin = true;
+        batch[count - 1].reply_fd = reply_fd;
+    }
+    if (!gcode_enqueue_batch(batch, count, pdMS_TO_TICKS(100))) {
+        ESP_LOGW(TAG, "G-code queue full, dropping %u command(s) starting with: %s",
+                 (unsigned)count, batch[0].cmd);
+    } else {
+        DEBUG_LOG(TAG, "[GCODE] Queued %u command(s) starting with: %s", (unsigned)count, batch[0].cmd);
+    }
+}
+
+// GCODE: frame from a client, optionally GCODE#<id>: for a tagged reply
+static void ws_handle_gcode(int fd, char *payload)
+{
+    static gcode_cmd_t batch[GCODE_QUEUE_SIZE];   // httpd task only
+    uint32_t request_id = 0;
+    bool want_reply = false;
+    char *cmd = payload + 6;  // Skip "GCODE:" prefix
+
+    if (payload[5] == '#') {
+        char *colon;
+        request_id = (uint32_t)strtoul(cmd, &colon, 10);
+        if (colon == cmd || *colon != ':') {
+            ESP_LOGW(TAG, "Malformed GCODE# frame from fd=%d", fd);
+            return;
+        }
+        want_reply = true;
+        cmd = colon + 1;
+    }
+
+    if (!g_prusa_dev) {
+        ESP_LOGW(TAG, "G-code received but printer not connected");
+        return;
+    }
+    gcode_submit_text(cmd, batch, GCODE_QUEUE_SIZE, want_reply ? fd : -1, request_id);
+}
+
+// ============================================================================
+// HTTP SOCKET BUDGET
+// httpd only knows sessions, not what they are for: with every socket held by
+// idle keep-alives a WebSocket upgrade is refused at accept, before ws_handler
+// runs. Every session is tracked from open_fn to close_fn with the time of its
+// last received byte, and each new one makes room by closing the idle HTTP
+// session heard from longest ago. httpd's own lru_purge_enable stays off: it
+// cannot tell a WebSocket, or an upload held back by the printer, from an
+// idle keep-alive.
+// ============================================================================
+
+static uint32_t socket_now_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static socket_entry_t *socket_entry(int fd)
+{
+    for (int i = 0; i < SOCKET_LIMIT_MAX; i++) {
+        if (atomic_load(&socket_budget.sessions[i].fd) == fd) return &socket_budget.sessions[i];
+    }
+    return NULL;
+}
+
+// The default httpd receive, noting when the session was last heard from
+static int socket_recv(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags)
+{
+    int ret = recv(sockfd, buf, buf_len, flags);
+
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? HTTPD_SOCK_ERR_TIMEOUT
+                                                                          : HTTPD_SOCK_ERR_FAIL;
+    }
+    socket_entry_t *e = socket_entry(sockfd);
+    if (e != NULL) atomic_store(&e->last_ms, socket_now_ms());
+    return ret;
+}
+
+// An upload handed to its own task keeps its socket until it is done,
+// however long the printer holds it back
+static void socket_hold(int fd, bool held)
+{
+    socket_entry_t *e = socket_entry(fd);
+    if (e != NULL) atomic_store(&e->held, held);
+}
+
+// Close the idle HTTP session heard from longest ago, other than keep.
+// httpd task only. False if every other session is busy or a client's.
+static bool socket_purge_idle(httpd_handle_t hd, int keep)
+{
+    uint32_t now = socket_now_ms();
+    uint32_t idlest = SOCKET_IDLE_MS;
+    int victim = -1;
+
+    for (int i = 0; i < SOCKET_LIMIT_MAX; i++) {
+        socket_entry_t *e = &socket_budget.sessions[i];
+        int fd = atomic_load(&e->fd);
+        uint32_t idle = now - atomic_load(&e->last_ms);
+        if (fd < 0 || fd == keep || atomic_load(&e->held) || idle < idlest) continue;
+        // Upgraded sockets and SSE streams are clients, not keep-alives
+        if (httpd_ws_get_fd_info(hd, fd) == HTTPD_WS_CLIENT_WEBSOCKET || ws_client_find(fd) >= 0) continue;
+        idlest = idle;
+        victim = fd;
+    }
+    if (victim < 0 || httpd_sess_trigger_close(hd, victim) != ESP_OK) return false;
+
+    // Gone from the count now; close_fn follows once httpd gets to it
+    socket_entry_t *e = socket_entry(victim);
+    if (e != NULL) atomic_store(&e->fd, -1);
+    atomic_fetch_sub(&socket_budget.open, 1);
+    atomic_fetch_add(&socket_budget.purged, 1);
+    DEBUG_LOG(TAG, "[SOCK] Purged idle fd=%d after %u ms", victim, (unsigned)idlest);
+    return true;
+}
+
+// open_fn: runs in the httpd task for every accepted connection
+static esp_err_t socket_session_open(httpd_handle_t hd, int sockfd)
+{
+    socket_entry_t *e = socket_entry(-1);
+    if (e == NULL) return ESP_OK;              // Only while purged sessions are still closing
+
+    atomic_store(&e->last_ms, socket_now_ms());
+    atomic_store(&e->held, false);
+    atomic_store(&e->fd, sockfd);
+    httpd_sess_set_recv_override(hd, sockfd, socket_recv);
+
+    int open = atomic_fetch_add(&socket_budget.open, 1) + 1;
+    if (open > atomic_load(&socket_budget.open_peak)) atomic_store(&socket_budget.open_peak, open);
+    while (socket_budget.limit - atomic_load(&socket_budget.open) < SOCKET_SPARE) {
+        if (!socket_purge_idle(hd, sockfd)) break;
+    }
+    return ESP_OK;
+}
+
+// From close_fn, for every session httpd closes
+static void socket_session_closed(int sockfd)
+{
+    socket_entry_t *e = socket_entry(sockfd);
+    if (e != NULL) {
+        atomic_store(&e->fd, -1);
+        atomic_fetch_sub(&socket_budget.open, 1);
+    }
+}
+
+// Size the socket table to the internal heap left at boot, within what lwIP
+// can give httpd. WebSocket slots take what is left after SOCKET_HTTP_MIN.
+static void socket_budget_init(void)
+{
+    size_t heap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    int afford = heap > SOCKET_HEAP_RESERVE ? (int)((heap - SOCKET_HEAP_RESERVE) / SOCKET_HEAP_COST) : 0;
+
+    socket_budget.limit = afford < SOCKET_LIMIT_MIN ? SOCKET_LIMIT_MIN
+                        : afford > SOCKET_LIMIT_MAX ? SOCKET_LIMIT_MAX : afford;
+    socket_budget.ws_limit = socket_budget.limit - SOCKET_HTTP_MIN < WS_MAX_CLIENTS
+                           ? socket_budget.limit - SOCKET_HTTP_MIN : WS_MAX_CLIENTS;
+    for (int i = 0; i < SOCKET_LIMIT_MAX; i++) {
+        atomic_store(&socket_budget.sessions[i].fd, -1);
+    }
+    ESP_LOGI(TAG, "Socket budget: %d sockets (%d affordable, lwIP allows %d), %d WebSocket slots",
+             socket_budget.limit, afford, SOCKET_LIMIT_MAX, socket_budget.ws_limit);
+}
+
+// GET /events: the WebSocket stream as Server-Sent Events, for read-only
+// consumers that cannot or will not speak WebSocket. ?topics= takes a SUB:
+// list. Only the response head goes out here; ws_sender_task writes the
+// events once a client slot is claimed, and the session close frees it.
+static esp_err_t events_get_handler(httpd_req_t *req)
+{
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-store\r\n"
+        "Access-Control-Allow-Origin: *\r\n\r\n";
+    char last_id[32];
+    char query[128];
+    char list[96];
+    char retry[32];
+    uint32_t topics = SSE_TOPICS;
+
+    bool have_id = httpd_req_get_hdr_value_str(req, "Last-Event-ID", last_id, sizeof(last_id)) == ESP_OK;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "topics", list, sizeof(list)) == ESP_OK) {
+        topics = ws_parse_topics(list);
+    }
+
+    int fd = httpd_req_to_sockfd(req);
+    int n = snprintf(retry, sizeof(retry), "retry: %d\n\n", SSE_RETRY_MS);
+    if (sse_send(fd, head, sizeof(head) - 1) != ESP_OK || sse_send(fd, retry, n) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (sse_client_add(fd, topics, have_id ? last_id : NULL) < 0) {
+        // The head is already out, so say why in the stream and close it
+        static const char full[] = "event: error\ndata: {\"type\":\"error\",\"message\":\"No free client slot\"}\n\n";
+        sse_send(fd, full, sizeof(full) - 1);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Frees the client slot of any session httpd closes, so a reused fd never
+// gets a stream meant for the connection before it
+static void ws_session_close(httpd_handle_t hd, int sockfd)
+{
+    ws_client_remove(sockfd);
+    socket_session_closed(sockfd);
+    close(sockfd);
+}
+
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        ESP_LOGI(TAG, "WebSocket handshake request");
+
+        // Remember the subprotocol on the session until CONNECT arrives
+        char proto[64];
+        if (httpd_req_get_hdr_value_str(req, "Sec-WebSocket-Protocol", proto, sizeof(proto)) == ESP_OK &&
+            strstr(proto, WS_BINARY_SUBPROTOCOL) != NULL) {
+            ws_session_flag_set(req, WS_SESSION_BINARY);
+        }
+        return ESP_OK;
+    }
+    
+    httpd_ws_frame_t ws_pkt;
+    uint8_t stack_buf[WS_RX_STACK_BUF_SIZE];
+    uint8_t *buf = stack_buf;
+    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+
+    // max_len = 0 only fills in the frame length, so the buffer can fit it
+    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "httpd_ws_recv_frame failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if (ws_pkt.len > WS_RX_MAX_FRAME_SIZE) {
+        ESP_LOGW(TAG, "WebSocket frame of %u bytes exceeds %d, closing", (unsigned)ws_pkt.len,
+                 WS_RX_MAX_FRAME_SIZE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (ws_pkt.len >= sizeof(stack_buf)) {
+        buf = malloc(ws_pkt.len + 1);
+        if (!buf) {
+            ESP_LOGE(TAG, "No memory for %u byte WebSocket frame", (unsigned)ws_pkt.len);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    ws_pkt.payload = buf;
+    if (ws_pkt.len > 0) {
+        ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "httpd_ws_recv_frame failed: %s", esp_err_to_name(ret));
+            if (buf != stack_buf) free(buf);
+            return ret;
+        }
+    }
+    
+    int fd = httpd_req_to_sockfd(req);
+    
+    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
+        buf[ws_pkt.len] = '\0';
+        ESP_LOGI(TAG, "Received WebSocket packet (%u bytes): %.*s", (unsigned)ws_pkt.len,
+                 ws_pkt.len > 64 ? 64 : (int)ws_pkt.len, buf);
+        
+        // Check if it's a connection handshake
+        if (strcmp((char *)buf, "CONNECT") == 0) {
+            unsigned flags = ws_session_flags(req);
+            int client_id = ws_client_add(fd, flags & WS_SESSION_BINARY, flags & WS_SESSION_DEFLATE);
+            if (client_id >= 0) {
+                // Send current printer state to new client
+                ws_send_snapshot(client_id, WS_TOPICS_ALL);
+            }
+        }
+        // Bed mesh: MESH resends the cached grid, MESH:REFRESH re-queries the printer
+        else if (strncmp((char *)buf, "MESH", 4) == 0) {
+            int client_id = ws_client_find(fd);
+            bool refresh = strcmp((char *)buf, "MESH:REFRESH") == 0;
+            if (client_id >= 0) {
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                ws_clients[client_id].mesh_generation = 0;
+                xSemaphoreGive(ws_clients_mutex);
+                if (ws_sender_task_handle) {
+                    xTaskNotifyGive(ws_sender_task_handle);
+                }
+            }
+            if (refresh || mesh_cache.generation == 0) {
+                mesh_request_refresh(refresh);
+            }
+        }
+        // HISTORY:<points>[:<from>[:<to>]] - history samples [from, to) in at
+        // most points min/max/avg buckets, streamed by ws_sender_task
+        else if (strncmp((char *)buf, "HISTORY:", 8) == 0) {
+            int client_id = ws_client_find(fd);
+            char *rest;
+            uint32_t points = (uint32_t)strtoul((char *)buf + 8, &rest, 10);
+            uint32_t from = 0;
+            uint32_t to = UINT32_MAX;
+            if (*rest == ':') {
+                from = (uint32_t)strtoul(rest + 1, &rest, 10);
+                if (*rest == ':') to = (uint32_t)strtoul(rest + 1, NULL, 10);
+            }
+            if (points == 0) {
+                ESP_LOGW(TAG, "Bad HISTORY query from fd=%d", fd);
+            } else if (client_id >= 0) {
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                ws_clients[client_id].history_points =
+                    (uint16_t)(points < HISTORY_QUERY_MAX_POINTS ? points : HISTORY_QUERY_MAX_POINTS);
+                ws_clients[client_id].history_from = from;
+                ws_clients[client_id].history_to = to;
+                xSemaphoreGive(ws_clients_mutex);
+                if (ws_sender_task_handle) {
+                    xTaskNotifyGive(ws_sender_task_handle);
+                }
+            }
+        }
+        // TRACE:1 / TRACE:0 - add pipeline timestamps to this client's JSON frames
+        else if (strncmp((char *)buf, "TRACE:", 6) == 0) {
+            int client_id = ws_client_find(fd);
+            if (client_id >= 0) {
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                ws_clients[client_id].trace = buf[6] == '1';
+                xSemaphoreGive(ws_clients_mutex);
+                ESP_LOGI(TAG, "Client %d latency trace %s", client_id, buf[6] == '1' ? "on" : "off");
+            }
+        }
+#if ENABLE_WS_DEFLATE
+        // DEFLATE:<id> - the page holds the preset dictionary with this
+        // FNV-1a and can inflate WS_BIN_DEFLATE records. Sent before CONNECT,
+        // so the history that follows it is already compressed.
+        else if (strncmp((char *)buf, "DEFLATE:", 8) == 0) {
+            uint32_t id = (uint32_t)strtoul((char *)buf + 8, NULL, 16);
+            if (id != ws_deflate_dict_id()) {
+                ESP_LOGW(TAG, "DEFLATE from fd=%d with dictionary %08x, ours is %08x - not compressing",
+                         fd, (unsigned)id, (unsigned)ws_deflate_dict_id());
+            } else {
+                ws_session_flag_set(req, WS_SESSION_DEFLATE);
+                int client_id = ws_client_find(fd);
+                if (client_id >= 0) {
+                    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                    ws_clients[client_id].deflate = true;
+                    xSemaphoreGive(ws_clients_mutex);
+                }
+            }
+        }
+#endif
+        // LOG:<tag>=<level> - runtime log level, e.g. LOG:USB=warn or LOG:wifi=error
+        else if (strncmp((char *)buf, "LOG:", 4) == 0) {
+            char *tag = (char *)buf + 4;
+            char *eq = strchr(tag, '=');
+            esp_log_level_t level;
+            if (eq == NULL || !log_level_parse(eq + 1, &level)) {
+                ESP_LOGW(TAG, "Bad LOG command from fd=%d", fd);
+            } else {
+                *eq = '\0';
+                esp_err_t err = log_tag_level_set(tag, level);
+                if (err == ESP_OK) {
+                    ESP_LOGI(TAG, "Log level of %s set to %s", tag, eq + 1);
+                } else {
+                    ESP_LOGW(TAG, "Log level of %s not set: %s", tag, esp_err_to_name(err));
+                }
+            }
+        }
+        // SYNTH:<frames/s>[:<pad bytes>] - synthetic telemetry for load tests, SYNTH:0 stops
+        else if (strncmp((char *)buf, "SYNTH:", 6) == 0) {
+            char *rest;
+            uint32_t rate = (uint32_t)strtoul((char *)buf + 6, &rest, 10);
+            uint32_t pad = *rest == ':' ? (uint32_t)strtoul(rest + 1, NULL, 10) : 0;
+            esp_err_t err = ws_synth_set(rate, pad);
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "%s from fd=%d failed: %s", (char *)buf, fd, esp_err_to_name(err));
+            }
+        }
+        // CAPTURE:START / CAPTURE:STOP - record raw USB RX to flash
+        // REPLAY:1, REPLAY:10, REPLAY:MAX / REPLAY:STOP - play it back, printer unplugged
+        else if (strncmp((char *)buf, "CAPTURE:", 8) == 0 || strncmp((char *)buf, "REPLAY:", 7) == 0) {
+            bool replay = buf[0] == 'R';
+            const char *arg = (const char *)buf + (replay ? 7 : 8);
+            esp_err_t err = ESP_ERR_INVALID_ARG;
+            if (strcmp(arg, "STOP") == 0) {
+                serial_capture_stop();
+                err = ESP_OK;
+            } else if (!replay && strcmp(arg, "START") == 0) {
+                err = serial_capture_start();
+            } else if (replay && strcmp(arg, "MAX") == 0) {
+                err = serial_replay_start(0);
+            } else if (replay && arg[0] >= '1' && arg[0] <= '9') {
+                err = serial_replay_start((uint32_t)strtoul(arg, NULL, 10));
+            }
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "%s from fd=%d failed: %s", (char *)buf, fd, esp_err_to_name(err));
+            }
+        }
+        // PAUSE / RESUME - a background tab stops its stream. Nothing queues
+        // up meanwhile: RESUME skips the ring to its head and sends one
+        // snapshot of the current state instead of the missed frames.
+        else if (strcmp((char *)buf, "PAUSE") == 0 || strcmp((char *)buf, "RESUME") == 0) {
+            int client_id = ws_client_find(fd);
+            bool pause = buf[0] == 'P';
+            if (client_id >= 0) {
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                ws_client_t *client = &ws_clients[client_id];
+                bool changed = client->paused != pause;
+                size_t skipped = 0;
+                uint32_t topics = client->topics;
+                client->paused = pause;
+                if (pause) {
+                    client->state_pending = 0;
+                } else if (changed) {
+                    skipped = ws_ring.head - client->cursor;
+                    client->cursor = ws_ring.head;
+                    client->lag_warned = false;
+                }
+                xSemaphoreGive(ws_clients_mutex);
+                if (changed) {
+                    ESP_LOGI(TAG, "Client %d %s", client_id, pause ? "paused" : "resumed");
+                    if (!pause) {
+                        DEBUG_LOG(TAG, "[WS] Client %d skipped %u ring bytes", client_id, (unsigned)skipped);
+                        ws_send_snapshot(client_id, topics);
+                    }
+                    autoreport_update(false);
+                    wifi_latency_update();
+                }
+            }
+        }
+        // Topic subscription, e.g. SUB:temperature,progress
+        else if (strncmp((char *)buf, "SUB:", 4) == 0) {
+            int client_id = ws_client_find(fd);
+            if (client_id < 0) {
+                ESP_LOGW(TAG, "SUB from fd=%d before CONNECT, ignoring", fd);
+            } else {
+                uint32_t topics = ws_parse_topics((char *)buf + 4);
+                xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+                uint32_t added = topics & ~ws_clients[client_id].topics;
+                ws_clients[client_id].topics = topics;
+                // Drop state already queued for topics the client no longer wants
+                for (int type = 0; type < MSG_TYPE_COUNT; type++) {
+                    int slot = ws_state_slot_for((message_type_t)type);
+                    if (slot >= 0 && !(topics & WS_TOPIC_BIT(type))) {
+                        ws_clients[client_id].state_pending &= ~(1u << slot);
+                    }
+                }
+                if (!(topics & (WS_TOPIC_BIT(MSG_TYPE_TEMPERATURE) | WS_TOPIC_BIT(MSG_TYPE_POWER)))) {
+                    ws_clients[client_id].history_pending = false;
+                }
+                if (!(topics & WS_TOPIC_BIT(MSG_TYPE_LOG))) {
+                    ws_clients[client_id].log_backlog_pending = false;
+                }
+                xSemaphoreGive(ws_clients_mutex);
+                ESP_LOGI(TAG, "Client %d subscribed to topics 0x%02x", client_id, (unsigned)topics);
+                // Newly added topics may have been skipped while nobody wanted them
+                ws_send_snapshot(client_id, added);
+            }
+        }
+        // MACRO:<name> runs a stored macro on the device, MACRO:STOP ends it
+        else if (strncmp((char *)buf, "MACRO:", 6) == 0) {
+            const char *name = (const char *)buf + 6;
+            esp_err_t err = ESP_OK;
+            if (strcmp(name, "STOP") == 0) {
+                macro_stop();
+            } else {
+                err = macro_run(name);
+            }
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "%s from fd=%d failed: %s", (char *)buf, fd, esp_err_to_name(err));
+            }
+        }
+        // SPOOL:START / PAUSE / RESUME / CANCEL drive the job in the spool partition
+        else if (strncmp((char *)buf, "SPOOL:", 6) == 0) {
+            const char *action = (const char *)buf + 6;
+            esp_err_t err = ESP_ERR_INVALID_ARG;
+            if (strcmp(action, "START") == 0) {
+                err = spool_start();
+            } else if (strcmp(action, "PAUSE") == 0 || strcmp(action, "RESUME") == 0) {
+                err = spool_pause(action[0] == 'P');
+            } else if (strcmp(action, "CANCEL") == 0) {
+                err = spool_cancel();
+            }
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "%s from fd=%d failed: %s", (char *)buf, fd, esp_err_to_name(err));
+            }
+        }
+        // Check if it's a G-code command
+        // GCODE:<cmd>, or GCODE#<id>:<cmd> to get the reply back as a result frame.
+        // Several commands may be sent in one frame, separated by newlines.
+        else if (strncmp((char *)buf, "GCODE:", 6) == 0 || strncmp((char *)buf, "GCODE#", 6) == 0) {
+            ws_handle_gcode(fd, (char *)buf);
+        }
+    } else if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE) {
+        ESP_LOGI(TAG, "WebSocket close frame received from fd=%d", fd);
+        ws_client_remove(fd);
+    } else if (ws_pkt.type == HTTPD_WS_TYPE_PING) {
+        // Respond to ping with pong
+        httpd_ws_frame_t pong_pkt;
+        memset(&pong_pkt, 0, sizeof(httpd_ws_frame_t));
+        pong_pkt.type = HTTPD_WS_TYPE_PONG;
+        pong_pkt.len = 0;
+        httpd_ws_send_frame_async(server, fd, &pong_pkt);
+        DEBUG_LOG(TAG, "[WS] Ping received from fd=%d, sent pong", fd);
+    } else if (ws_pkt.type == HTTPD_WS_TYPE_PONG) {
+        // Client responded to our keepalive ping - clear the pending flag
+        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+            if (ws_clients[i].active && ws_clients[i].fd == fd) {
+                if (ws_clients[i].ping_pending) {
+                    uint32_t rtt_us = trace_now() - ws_clients[i].ping_sent_us;
+                    atomic_store_explicit(&metrics.ws_ping_rtt_us, rtt_us, memory_order_relaxed);
+                    trace_record(TRACE_PING_RTT, rtt_us);
+                }
+                ws_clients[i].ping_pending = false;
+                break;
+            }
+        }
+        xSemaphoreGive(ws_clients_mutex);
+        DEBUG_LOG(TAG, "[WS] Pong received from fd=%d, client alive", fd);
+    }
+    
+    if (buf != stack_buf) free(buf);
+    return ESP_OK;
+}
+
+// True if the request's If-None-Match lists etag
+static bool html_etag_matches(httpd_req_t *req, const char *etag)
+{
+    char inm[128];
+
+    if (etag[0] == '\0' ||
+        httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) != ESP_OK) {
+        return false;
+    }
+    return strstr(inm, etag) != NULL || strcmp(inm, "*") == 0;
+}
+
+static bool html_client_accepts_gzip(httpd_req_t *req)
+{
+    char accept[128];
+
+    return httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept, sizeof(accept)) == ESP_OK &&
+           strstr(accept, "gzip") != NULL;
+}
+
+// Validator headers, then 304 if the browser already has this version.
+// Returns true if the response has been sent.
+static bool html_send_validators(httpd_req_t *req, const char *etag)
+{
+    // no-cache: keep a copy but revalidate every load - the page changes on /refresh
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    httpd_resp_set_hdr(req, "ETag", etag);
+
+    if (html_etag_matches(req, etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return true;
+    }
+    return false;
+}
+
+static void send_embedded_html(httpd_req_t *req)
+{
+    if (embedded_html_etag[0] == '\0') {
+        html_format_etag(embedded_html_etag,
+                         html_hash_update(HTML_HASH_INIT, webpage_start, webpage_end - webpage_start));
+    }
+    if (html_send_validators(req, embedded_html_etag)) {
+        ESP_LOGI(TAG, "Embedded HTML not modified (304)");
+        return;
+    }
+    httpd_resp_send(req, (const char *)webpage_start, webpage_end - webpage_start);
+}
+
+// Never blocks on other page loads or on a download in progress: the live
+// slot is pinned for the duration of the send and swapped underneath freely
+static esp_err_t root_get_handler(httpd_req_t *req)
+{
+    boot_metric_mark(&boot_metrics.first_serve_us, "First page served");
+    httpd_resp_set_type(req, "text/html; charset=utf-8");
+    
+#if ENABLE_REMOTE_HTML
+    ESP_LOGI(TAG, "Root request received, checking SPIFFS HTML cache");
+    html_slot_t *slot = html_slot_acquire();
+    FILE *fp = NULL;
+    if (slot == NULL) {
+        ESP_LOGW(TAG, "No cached HTML, serving embedded fallback");
+    } else if (slot->gzip && !html_client_accepts_gzip(req)) {
+        ESP_LOGW(TAG, "Client does not accept gzip, serving embedded fallback");
+    } else if (slot->data != NULL) {
+        // Mapped flash: one send, no copy into a buffer and no VFS
+        if (html_send_validators(req, slot->etag)) {
+            ESP_LOGI(TAG, "Remote HTML not modified (304)");
+        } else {
+            ESP_LOGI(TAG, "Serving remote HTML from %s (%zu bytes%s)",
+                     webui_partition != NULL ? "web UI partition" : "PSRAM",
+                     slot->size, slot->gzip ? ", gzip" : "");
+            if (slot->gzip) {
+                httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+            }
+            httpd_resp_send(req, (const char *)slot->data, slot->size);
+        }
+        html_slot_release(slot);
+        return ESP_OK;
+    } else {
+        fp = fopen(slot->path, "rb");
+        if (fp == NULL) {
+            ESP_LOGW(TAG, "Cannot open %s, serving embedded fallback", slot->path);
+        }
+    }
+
+    if (fp != NULL && html_send_validators(req, slot->etag)) {
+        ESP_LOGI(TAG, "Remote HTML not modified (304)");
+        fclose(fp);
+    } else if (fp != NULL) {
+        ESP_LOGI(TAG, "Serving remote HTML from %s (%zu bytes%s) in chunks",
+                 slot->path, slot->size, slot->gzip ? ", gzip" : "");
+        if (slot->gzip) {
+            httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        }
+
+        char chunk[HTML_CHUNK_SIZE];
+        size_t bytes_read = 0;
+        esp_err_t send_err = ESP_OK;
+
+        while ((bytes_read = fread(chunk, 1, sizeof(chunk), fp)) > 0 && send_err == ESP_OK) {
+            send_err = httpd_resp_send_chunk(req, chunk, bytes_read);
+        }
+        fclose(fp);
+
+        if (send_err == ESP_OK) {
+            ESP_LOGI(TAG, "Completed serving remote HTML from flash");
+            httpd_resp_send_chunk(req, NULL, 0);
+        } else {
+            ESP_LOGE(TAG, "Chunked send failed while serving flash HTML");
+        }
+    } else {
+        send_embedded_html(req);
+    }
+    html_slot_release(slot);
+#else
+    ESP_LOGI(TAG, "Serving embedded HTML");
+    send_embedded_html(req);
+#endif
+    
+    return ESP_OK;
+}
+
+// Runs one /refresh job so the TLS download never blocks the httpd task.
+// Progress and the outcome go out in status frames.
+static void html_refresh_task(void *arg)
+{
+    ESP_LOGI(TAG, "Refreshing HTML from %s", REMOTE_HTML_URL);
+    bool refresh_ok = download_remote_html_to_flash(REMOTE_HTML_URL);
+    web_assets_sync();
+    html_slot_t *slot = html_slot_acquire();
+    size_t html_size = slot ? slot->size : 0;
+    html_slot_release(slot);
+    ESP_LOGI(TAG, "Refresh download result: %s (html size=%u)",
+             refresh_ok ? "success" : "failure", (unsigned)html_size);
+
+    if (refresh_ok) {
+        atomic_store(&html_refresh.bytes, (unsigned)html_size);
+    }
+    atomic_store(&html_refresh.state, refresh_ok ? HTML_REFRESH_DONE : HTML_REFRESH_FAILED);
+    html_refresh_publish();
+    vTaskDelete(NULL);
+}
+
+static esp_err_t refresh_get_handler(httpd_req_t *req)
+{
+#if ENABLE_REMOTE_HTML
+    ESP_LOGI(TAG, "Refresh endpoint requested");
+
+    // One job at a time; a second request just reports the running one
+    int expected = atomic_load(&html_refresh.state);
+    bool started = false;
+    if (expected != HTML_REFRESH_RUNNING &&
+        atomic_compare_exchange_strong(&html_refresh.state, &expected, HTML_REFRESH_RUNNING)) {
+        atomic_store(&html_refresh.bytes, 0);
+        atomic_store(&html_refresh.total, 0);
+        if (xTaskCreatePinnedToCore(html_refresh_task, "html_refresh", HTML_REFRESH_TASK_STACK,
+                                    NULL, 4, NULL, 1) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start refresh task");
+            snprintf(last_download_error, sizeof(last_download_error), "Failed to start refresh task");
+            atomic_store(&html_refresh.state, HTML_REFRESH_FAILED);
+            html_refresh_publish();
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to start refresh");
+            return ESP_FAIL;
+        }
+        started = true;
+        html_refresh_publish();
+    }
+
+    char response[1024];
+    snprintf(response, sizeof(response),
+        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
+        "<meta http-equiv='refresh' content='1;url=/'/>"
+        "<style>body{font-family:monospace;background:#0f0f0f;color:#4CAF50;"
+        "padding:40px;text-align:center;}</style></head><body>"
+        "<h2>HTML Refresh %s</h2>"
+        "<p>Progress is shown on the monitor page.</p>"
+        "<p>Redirecting...</p>"
+        "</body></html>",
+        started ? "Started" : "Already Running");
+    
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "text/html; charset=utf-8");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate");
+    httpd_resp_sendstr(req, response);
+#else
+    const char *disabled_msg = 
+        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
+        "<style>body{font-family:monospace;background:#0f0f0f;color:#e0e0e0;"
+        "padding:40px;max-width:600px;margin:0 auto;}</style></head><body>"
+        "<h2 style='color:#f44336;'>Remote HTML Disabled</h2>"
+        "<p>Remote HTML fetching is currently disabled in firmware.</p>"
+        "<p>Set ENABLE_REMOTE_HTML to 1 and recompile to enable.</p>"
+        "<p><a href='/' style='color:#4CAF50;'>Back to Monitor</a></p>"
+        "</body></html>";
+    
+    httpd_resp_set_type(req, "text/html; charset=utf-8");
+    httpd_resp_sendstr(req, disabled_msg);
+#endif
+    return ESP_OK;
+}
+
+// /assets/<name>: the stored gzip copy with a year-long immutable lifetime,
+// or a redirect to the CDN while there is none (or the client cannot take gzip)
+static esp_err_t assets_get_handler(httpd_req_t *req)
+{
+    const char *name = req->uri + strlen("/assets/");
+    size_t name_len = strcspn(name, "?#");
+    const web_asset_t *asset = NULL;
+
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+        if (strlen(web_assets[i].name) == name_len && strncmp(web_assets[i].name, name, name_len) == 0) {
+            asset = &web_assets[i];
+            break;
+        }
+    }
+    if (asset == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such asset");
+    }
+
+    char path[64];
+    char chunk[HTML_CHUNK_SIZE];
+    web_asset_path(asset, path, sizeof(path), false);
+    FILE *fp = remote_html_fs_mounted ? fopen(path, "rb") : NULL;
+    size_t n = fp ? fread(chunk, 1, sizeof(chunk), fp) : 0;
+    bool gzip = n >= 2 && (uint8_t)chunk[0] == 0x1f && (uint8_t)chunk[1] == 0x8b;
+
+    if (!gzip || !html_client_accepts_gzip(req)) {
+        if (fp) fclose(fp);
+        httpd_resp_set_status(req, "302 Found");
+        httpd_resp_set_hdr(req, "Location", asset->url);
+        httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    char cache_control[64];
+    snprintf(cache_control, sizeof(cache_control), "public, max-age=%d, immutable", WEB_ASSET_MAX_AGE_S);
+    httpd_resp_set_type(req, "application/javascript");
+    httpd_resp_set_hdr(req, "Cache-Control", cache_control);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+
+    esp_err_t err = ESP_OK;
+    while (n > 0 && err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, chunk, n);
+        n = fread(chunk, 1, sizeof(chunk), fp);
+    }
+    fclose(fp);
+    if (err == ESP_OK) {
+        httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
+
+static esp_err_t version_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; charset=utf-8");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_sendstr(req, FIRMWARE_VERSION);
+    return ESP_OK;
+}
+
+static esp_err_t reboot_get_handler(httpd_req_t *req)
+{
+    const char *reboot_msg =
+        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
+        "<meta http-equiv='refresh' content='15;url=/'/>"
+        "<style>body{font-family:monospace;background:#0f0f0f;color:#4CAF50;"
+        "padding:40px;text-align:center;}</style></head><body>"
+        "<h2>Rebooting...</h2>"
+        "<p>The device is restarting. Redirecting in 15 seconds...</p>"
+        "</body></html>";
+
+    httpd_resp_set_type(req, "text/html; charset=utf-8");
+    httpd_resp_sendstr(req, reboot_msg);
+
+    ESP_LOGI(TAG, "Reboot requested via /reboot endpoint");
+    recorder_sync();    // Written well within the delay
+    vTaskDelay(pdMS_TO_TICKS(500));
+    esp_restart();
+
+    return ESP_OK;
+}
+
+// Runs the request detached from the httpd task, which stays free for
+// WebSocket traffic while the upload is held back by the printer
+static void gcode_stream_task(void *arg)
+{
+    httpd_req_t *req = (httpd_req_t *)arg;
+    char *buf = gcode_stream.buf;
+    size_t remaining = req->content_len;
+    size_t fill = 0;
+    int timeouts = 0;
+    esp_err_t err = ESP_OK;
+
+    ESP_LOGI(TAG, "[STREAM] Upload started (%u bytes)", (unsigned)req->content_len);
+
+    while (remaining > 0 && err == ESP_OK) {
+        size_t want = gcode_stream.buf_size - fill;
+        int r = httpd_req_recv(req, buf + fill, want < remaining ? want : remaining);
+        if (r == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < GCODE_STREAM_RECV_RETRIES) {
+            continue;
+        }
+        if (r <= 0) {
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        timeouts = 0;
+        remaining -= r;
+        atomic_fetch_add(&gcode_stream.bytes, (unsigned)r);
+        err = gcode_stream_consume(&fill, r, remaining == 0);
+
+        if (esp_timer_get_time() - gcode_stream.last_report_us > (int64_t)GCODE_STREAM_REPORT_MS * 1000) {
+            gcode_stream_publish();
+        }
+    }
+
+    gcode_stream.end_us = esp_timer_get_time();
+    atomic_store(&gcode_stream.receiving, false);
+
+    unsigned bytes = atomic_load(&gcode_stream.bytes);
+    unsigned lines = atomic_load(&gcode_stream.lines);
+    if (err == ESP_OK) {
+        char response[96];
+        snprintf(response, sizeof(response), "{\"bytes\":%u,\"lines\":%u}", bytes, lines);
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_sendstr(req, response);
+        ESP_LOGI(TAG, "[STREAM] Upload complete: %u bytes, %u lines", bytes, lines);
+    } else if (err == ESP_ERR_INVALID_SIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Line too long");
+        ESP_LOGW(TAG, "[STREAM] Aborted after %u lines: line too long", lines);
+    } else if (err == ESP_ERR_INVALID_STATE) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Printer disconnected");
+        ESP_LOGW(TAG, "[STREAM] Aborted after %u lines: printer disconnected", lines);
+    } else if (err == ESP_ERR_NOT_FINISHED) {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Stopped");
+        ESP_LOGW(TAG, "[STREAM] Stopped after %u lines", lines);
+    } else {
+        ESP_LOGW(TAG, "[STREAM] Aborted after %u of %u bytes: receive failed",
+                 bytes, (unsigned)req->content_len);
+    }
+
+    socket_hold(httpd_req_to_sockfd(req), false);
+    httpd_req_async_handler_complete(req);
+    gcode_stream_publish();
+    atomic_store(&gcode_stream.busy, false);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t print_post_handler(httpd_req_t *req)
+{
+    httpd_req_t *async_req = NULL;
+
+    if (!g_prusa_dev) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_sendstr(req, "Printer not connected");
+    }
+    if (req->content_len == 0) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+    }
+    if (atomic_exchange(&gcode_stream.busy, true)) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Upload already in progress");
+    }
+
+    gcode_stream_reset(req->content_len, "");
+
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        atomic_store(&gcode_stream.receiving, false);
+        atomic_store(&gcode_stream.busy, false);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Busy");
+    }
+    socket_hold(httpd_req_to_sockfd(async_req), true);
+    if (xTaskCreatePinnedToCore(gcode_stream_task, "gcode_stream", 4096, async_req, 5, NULL,
+                                pipe_placement[PIPE_GCODE].core) != pdPASS) {
+        httpd_resp_send_err(async_req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        socket_hold(httpd_req_to_sockfd(async_req), false);
+        httpd_req_async_handler_complete(async_req);
+        atomic_store(&gcode_stream.receiving, false);
+        atomic_store(&gcode_stream.busy, false);
+    }
+    return ESP_OK;
+}
+
+// Per-opcode G-code round trips (sent to 'ok') as JSON
+static esp_err_t gcode_latency_get_handler(httpd_req_t *req)
+{
+    char chunk[256];
+    esp_err_t err;
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    snprintf(chunk, sizeof(chunk),
+             "{\"window\":%d,\"sent\":%u,\"resends\":%u,\"timeouts\":%u,\"opcodes\":[",
+             GCODE_WINDOW_SIZE, (unsigned)gcode_window.sent, (unsigned)gcode_window.resends,
+             (unsigned)gcode_window.timeouts);
+    err = httpd_resp_send_chunk(req, chunk, HTTPD_RESP_USE_STRLEN);
+
+    bool first = true;
+    for (int i = 0; i <= GCODE_LATENCY_OPCODES && err == ESP_OK; i++) {
+        gcode_latency_t entry;
+
+        // Copy out so the sender is not held up by a slow socket
+        gcode_window_lock(&gcode_window);
+        bool used = i < gcode_latency_count || (i == GCODE_LATENCY_OPCODES && gcode_latency[i].count);
+        if (used) entry = gcode_latency[i];
+        gcode_window_unlock(&gcode_window);
+        if (!used) continue;
+
+        snprintf(chunk, sizeof(chunk),
+                 "%s{\"code\":\"%s\",\"count\":%u,\"timeouts\":%u,\"min_us\":%u,"
+                 "\"avg_us\":%u,\"p99_us\":%u,\"max_us\":%u,\"timeout_ms\":%u}",
+                 first ? "" : ",", entry.code, (unsigned)entry.count, (unsigned)entry.timeouts,
+                 (unsigned)entry.min_us,
+                 entry.count ? (unsigned)(entry.sum_us / entry.count) : 0u,
+                 (unsigned)gcode_latency_p99(&entry), (unsigned)entry.max_us,
+                 (unsigned)gcode_timeout_for(entry.code));
+        err = httpd_resp_send_chunk(req, chunk, HTTPD_RESP_USE_STRLEN);
+        first = false;
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
+
+// ============================================================================
+// REST API
+// Plain JSON for pollers (Home Assistant, Grafana, MES) that do not want to
+// hold a WebSocket open.
+// ============================================================================
+
+// Last /api/state document. Only the httpd task touches it, so it needs no
+// lock; it is rebuilt when printer_state_generation has moved on.
+static char api_state_json[640];
+static size_t api_state_len = 0;
+static uint32_t api_state_generation = 0;
+static bool api_state_valid = false;
+static char api_state_etag[16];
+
+static void api_state_rebuild(void)
+{
+    printer_snapshot_t snap;
+
+    printer_state_read(&snap);
+    if (api_state_valid && snap.generation == api_state_generation) {
+        return;
+    }
+
+    json_writer_t w;
+    json_init(&w, api_state_json, sizeof(api_state_json));
+    json_lit(&w, "{\"generation\":");
+    json_uint(&w, snap.generation);
+    json_lit(&w, ",\"connected\":");
+    json_bool(&w, snap.connected);
+    json_lit(&w, ",\"serial\":");
+    json_str(&w, snap.serial, sizeof(snap.serial), 0);
+    for (int id = 0; id < TELEMETRY_TOPIC_COUNT; id++) {
+        json_lit(&w, ",\"");
+        json_raw(&w, telemetry_schema[id].name, telemetry_schema[id].name_len);
+        json_lit(&w, "\":{");
+        telemetry_json_members(&w, id, telemetry_snapshot_state(&snap, id), true);
+        json_lit(&w, "}");
+    }
+    json_lit(&w, "}");
+    api_state_len = json_end(&w);
+    snprintf(api_state_etag, sizeof(api_state_etag), "\"s%u\"", (unsigned)snap.generation);
+    api_state_generation = snap.generation;
+    api_state_valid = true;
+}
+
+static esp_err_t api_state_get_handler(httpd_req_t *req)
+{
+    api_state_rebuild();
+
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", api_state_etag);
+    if (html_etag_matches(req, api_state_etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, api_state_json, api_state_len);
+}
+
+static const char *const api_history_field_names[HIST_FIELD_COUNT] = {
+    "nozzle", "nozzle_target", "bed", "bed_target", "heatbreak", "chamber",
+    "nozzle_pwm", "bed_pwm", "heatbreak_pwm"
+};
+
+// Query parameter as a number: 1 if read, 0 if absent, -1 if malformed
+static int api_query_uint(const char *query, const char *key, uint32_t *out)
+{
+    char value[12];
+    char *end;
+
+    if (httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK) return 0;
+    unsigned long v = strtoul(value, &end, 10);
+    if (end == value || *end != '\0') return -1;
+    *out = (uint32_t)v;
+    return 1;
+}
+
+static int api_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Query parameter as text, percent-decoded with '+' as a space: 1 if read,
+// 0 if absent, -1 if malformed, holding a NUL or longer than size - 1
+static int api_query_text(const char *query, const char *key, char *out, size_t size)
+{
+    char raw[160];                             // Room for a 47-byte name fully escaped
+    size_t n = 0;
+
+    esp_err_t err = httpd_query_key_value(query, key, raw, sizeof(raw));
+    if (err == ESP_ERR_NOT_FOUND) return 0;
+    if (err != ESP_OK) return -1;
+    for (const char *p = raw; *p; p++) {
+        int c = (unsigned char)*p;
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%') {
+            int hi = api_hex_digit(p[1]);
+            int lo = hi < 0 ? -1 : api_hex_digit(p[2]);
+            if (lo < 0 || (hi | lo) == 0) return -1;
+            c = hi << 4 | lo;
+            p += 2;
+        }
+        if (n + 1 >= size) return -1;
+        out[n++] = (char)c;
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+static esp_err_t api_history_emit(void *ctx, const char *text, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, text, len);
+}
+
+// GET /api/history?points=<n>[&from=<seq>][&to=<seq>]: samples [from, to)
+// downsampled to at most n buckets, each [seq, samples, min..., max..., avg...]
+// over the fields
+static esp_err_t api_history_downsampled(httpd_req_t *req, uint32_t from, uint32_t to, uint32_t points)
+{
+    char chunk[256];
+    uint32_t start, end;
+
+    telemetry_history_clip(from, to, &start, &end);
+    if (points > end - start) points = end - start;
+
+    int n = snprintf(chunk, sizeof(chunk),
+                     "{\"interval_ms\":%d,\"start\":%u,\"end\":%u,\"points\":%u,\"fields\":[",
+                     TELEMETRY_HISTORY_INTERVAL_MS, (unsigned)start, (unsigned)end, (unsigned)points);
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        n += snprintf(chunk + n, sizeof(chunk) - n, "%s\"%s\"", f ? "," : "", api_history_field_names[f]);
+    }
+    n += snprintf(chunk + n, sizeof(chunk) - n, "],\"buckets\":[");
+    esp_err_t err = httpd_resp_send_chunk(req, chunk, n);
+
+    if (err == ESP_OK && points > 0) {
+        err = history_downsample(start, end, points, api_history_emit, req);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
+
+// GET /api/history[?since=<seq>]: samples from the telemetry ring, oldest
+// first. Sequence numbers count samples since boot; pass back "next" as
+// "since" to get only what is new. The mutex is held per batch only.
+static esp_err_t api_history_get_handler(httpd_req_t *req)
+{
+    history_sample_t batch[API_HISTORY_BATCH];
+    char chunk[512];
+    uint32_t first, count;
+    uint32_t since = 0;
+    uint32_t points = 0;
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    bool have_since = false;
+    esp_err_t err;
+
+    char query[64];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        int got_since = api_query_uint(query, "since", &since);
+        int got_points = api_query_uint(query, "points", &points);
+        if (got_since < 0 || got_points < 0 || api_query_uint(query, "from", &from) < 0 ||
+            api_query_uint(query, "to", &to) < 0 || (got_points && points == 0)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "since, from and to must be sample numbers, points above 0");
+            return ESP_FAIL;
+        }
+        have_since = got_since > 0;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    if (points > 0) {
+        return api_history_downsampled(req, from, to,
+                                       points < HISTORY_QUERY_MAX_POINTS ? points : HISTORY_QUERY_MAX_POINTS);
+    }
+
+    telemetry_history_range(&first, &count);
+    uint32_t next = first + count;
+    uint32_t start = first;
+    if (have_since && since > first) {
+        start = since < next ? since : next;
+    }
+
+    int n = snprintf(chunk, sizeof(chunk),
+                     "{\"interval_ms\":%d,\"first\":%u,\"start\":%u,\"next\":%u,\"fields\":[",
+                     TELEMETRY_HISTORY_INTERVAL_MS, (unsigned)first, (unsigned)start, (unsigned)next);
+    for (int f = 0; f < HIST_FIELD_COUNT; f++) {
+        n += snprintf(chunk + n, sizeof(chunk) - n, "%s\"%s\"", f ? "," : "", api_history_field_names[f]);
+    }
+    n += snprintf(chunk + n, sizeof(chunk) - n, "],\"samples\":[");
+    err = httpd_resp_send_chunk(req, chunk, n);
+
+    // Temperatures go out in degC, PWM as reported
+    for (uint32_t seq = start; seq < next && err == ESP_OK; ) {
+        uint32_t take = next - seq < API_HISTORY_BATCH ? next - seq : API_HISTORY_BATCH;
+        telemetry_history_copy(seq, take, batch);
+
+        n = 0;
+        for (uint32_t k = 0; k < take; k++) {
+            const int16_t *v = batch[k].v;
+            n += snprintf(chunk + n, sizeof(chunk) - n,
+                          "%s[%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%d,%d,%d]",
+                          seq + k == start ? "" : ",",
+                          v[HIST_NOZZLE] / 10.0f, v[HIST_NOZZLE_TARGET] / 10.0f,
+                          v[HIST_BED] / 10.0f, v[HIST_BED_TARGET] / 10.0f,
+                          v[HIST_HEATBREAK] / 10.0f, v[HIST_CHAMBER] / 10.0f,
+                          v[HIST_NOZZLE_PWM], v[HIST_BED_PWM], v[HIST_HEATBREAK_PWM]);
+            if (n >= (int)sizeof(chunk) - 96) {
+                err = httpd_resp_send_chunk(req, chunk, n);
+                n = 0;
+                if (err != ESP_OK) break;
+            }
+        }
+        if (n > 0 && err == ESP_OK) {
+            err = httpd_resp_send_chunk(req, chunk, n);
+        }
+        seq += take;
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
 
-            if (evt->data_len > 0) {
-                size_t written = fwrite(evt->data, 1, evt->data_len, output->fp);
-                if (written != evt->data_len) {
-                    ESP_LOGE(TAG, "Flash write failed: wrote %u of %u bytes",
-                             (unsigned)written, (unsigned)evt->data_len);
-                    output->failed = true;
-                    return ESP_FAIL;
+// GET /api/recorder[?from=<unix>&to=<unix>]: records from the flash recorder,
+// oldest first. The sector index skips straight to the range; records made
+// before the clock was set carry "uptime" seconds and only come without one.
+static esp_err_t api_recorder_get_handler(httpd_req_t *req)
+{
+    static const char *const type_names[REC_TYPE_COUNT] = {
+        "none", "sample", "job_start", "job_end", "printer_error", "boot"
+    };
+    recorder_index_t index[RECORDER_MAX_SECTORS];
+    recorder_page_t page;
+    char chunk[512];
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    bool ranged = false;
+    esp_err_t err;
+
+    if (recorder.mutex == NULL) {
+        httpd_resp_set_status(req, "404 Not Found");
+        return httpd_resp_sendstr(req, "No recorder partition");
+    }
+
+    char query[48];
+    char value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK) {
+            from = (uint32_t)strtoul(value, NULL, 10);
+            ranged = true;
+        }
+        if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK) {
+            to = (uint32_t)strtoul(value, NULL, 10);
+            ranged = true;
+        }
+    }
+
+    xSemaphoreTake(recorder.mutex, portMAX_DELAY);
+    memcpy(index, recorder.index, recorder.sectors * sizeof(index[0]));
+    uint32_t next_seq = recorder.next_seq;
+    xSemaphoreGive(recorder.mutex);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    err = httpd_resp_send_chunk(req, "{\"records\":[", 12);
+
+    // Sectors in write order: the oldest is the one the head will erase next
+    uint32_t head_sector = (next_seq % recorder.pages) / recorder.pages_per_sector;
+    bool first = true;
+    int n = 0;
+    for (uint32_t k = 1; k <= recorder.sectors && err == ESP_OK; k++) {
+        uint32_t s = (head_sector + k) % recorder.sectors;
+        if (index[s].seq == RECORDER_SECTOR_EMPTY) continue;
+        if (ranged && index[s].t_first > to) break;
+        // The next sector starting before from means none of this one is wanted
+        uint32_t ns = (s + 1) % recorder.sectors;
+        if (ranged && k < recorder.sectors && index[ns].seq != RECORDER_SECTOR_EMPTY &&
+            index[ns].seq > index[s].seq && index[ns].t_first < from) {
+            continue;
+        }
+
+        for (uint32_t pg = 0; pg < recorder.pages_per_sector && err == ESP_OK; pg++) {
+            uint32_t page_no = s * recorder.pages_per_sector + pg;
+            if (esp_partition_read(recorder.part, page_no * RECORDER_PAGE_SIZE, &page, sizeof(page)) != ESP_OK ||
+                !recorder_page_valid(&page, page_no) || page.hdr.seq >= next_seq) {
+                // Blank, torn, or already being overwritten
+                continue;
+            }
+            for (size_t r = 0; r < RECORDER_RECS_PER_PAGE; r++) {
+                const recorder_rec_t *rec = &page.recs[r];
+                bool uptime = rec->flags & REC_FLAG_UPTIME;
+                if (rec->type == REC_NONE || rec->type >= REC_TYPE_COUNT) continue;
+                if (ranged && (uptime || rec->t < from || rec->t > to)) continue;
+
+                n += snprintf(chunk + n, sizeof(chunk) - n, "%s{\"%s\":%u,\"type\":\"%s\"",
+                              first ? "" : ",", uptime ? "uptime" : "t", (unsigned)rec->t, type_names[rec->type]);
+                first = false;
+                const uint8_t *d = rec->data;
+                int16_t v[4];
+                for (int i = 0; i < 4; i++) {
+                    v[i] = (int16_t)(d[2 * i] | (d[2 * i + 1] << 8));
+                }
+                switch (rec->type) {
+                    case REC_SAMPLE:
+                        n += snprintf(chunk + n, sizeof(chunk) - n,
+                                      ",\"nozzle\":%.1f,\"nozzle_target\":%.1f,\"bed\":%.1f,\"bed_target\":%.1f",
+                                      v[0] / 10.0f, v[1] / 10.0f, v[2] / 10.0f, v[3] / 10.0f);
+                        if (rec->arg != REC_NO_JOB) {
+                            n += snprintf(chunk + n, sizeof(chunk) - n, ",\"percent\":%u", rec->arg);
+                        }
+                        break;
+                    case REC_JOB_START:
+                        n += snprintf(chunk + n, sizeof(chunk) - n, ",\"percent\":%u,\"time_left_mins\":%d",
+                                      rec->arg, v[0]);
+                        break;
+                    case REC_JOB_END:
+                        n += snprintf(chunk + n, sizeof(chunk) - n, ",\"percent\":%u", rec->arg);
+                        break;
+                    case REC_PRINTER_ERROR: {
+                        char text[2 * sizeof(rec->data) + 1];
+                        text[json_escape(text, sizeof(text) - 1, (const char *)rec->data, sizeof(rec->data))] = '\0';
+                        n += snprintf(chunk + n, sizeof(chunk) - n, ",\"text\":\"%s\"", text);
+                        break;
+                    }
+                    case REC_BOOT:
+                        n += snprintf(chunk + n, sizeof(chunk) - n, ",\"reset_reason\":%u", rec->arg);
+                        break;
+                }
+                n += snprintf(chunk + n, sizeof(chunk) - n, "}");
+                if (n >= (int)sizeof(chunk) - 160) {
+                    err = httpd_resp_send_chunk(req, chunk, n);
+                    n = 0;
+                    if (err != ESP_OK) break;
                 }
-                output->len += written;
             }
-            break;
+        }
+    }
+    if (n > 0 && err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, chunk, n);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
+
+// One report as {"profile":..,"live":..,"uptime":..,"frames":..,"stages":{..},
+// "latency_us":{"<trace stage>":[p50,p99],..},"cpu":{"<stage>":%,..},"cores":[%,..]}
+static int placement_report_json(char *buf, size_t size, unsigned profile, bool live,
+                                 const placement_report_t *r)
+{
+    json_writer_t w;
+
+    json_init(&w, buf, size);
+    json_lit(&w, "{\"profile\":");
+    json_str(&w, placement_profiles[profile].name, strlen(placement_profiles[profile].name), 0);
+    json_lit(&w, ",\"live\":");
+    json_bool(&w, live);
+    json_lit(&w, ",\"uptime\":");
+    json_uint(&w, r->uptime_s);
+    json_lit(&w, ",\"frames\":");
+    json_uint(&w, r->frames);
+    json_lit(&w, ",\"stages\":{");
+    for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+        if (s) json_lit(&w, ",");
+        json_lit(&w, "\"");
+        json_raw(&w, pipe_stage_names[s], strlen(pipe_stage_names[s]));
+        json_lit(&w, "\":{\"core\":");
+        json_uint(&w, r->stages[s].core);
+        json_lit(&w, ",\"priority\":");
+        json_uint(&w, r->stages[s].priority);
+        json_lit(&w, "}");
+    }
+    json_lit(&w, "},\"latency_us\":{");
+    for (int st = 0; st < TRACE_STAGE_COUNT; st++) {
+        if (st) json_lit(&w, ",");
+        json_lit(&w, "\"");
+        json_raw(&w, trace_stage_names[st], strlen(trace_stage_names[st]));
+        json_lit(&w, "\":[");
+        json_uint(&w, r->p50_us[st]);
+        json_lit(&w, ",");
+        json_uint(&w, r->p99_us[st]);
+        json_lit(&w, "]");
+    }
+    json_lit(&w, "},\"cpu\":{");
+    for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+        if (s) json_lit(&w, ",");
+        json_lit(&w, "\"");
+        json_raw(&w, pipe_stage_names[s], strlen(pipe_stage_names[s]));
+        json_lit(&w, "\":");
+        json_fixed(&w, r->cpu_x10[s] / 10.0f, 1);
+    }
+    json_lit(&w, "},\"cores\":[");
+    for (int c = 0; c < portNUM_PROCESSORS; c++) {
+        if (c) json_lit(&w, ",");
+        json_fixed(&w, r->core_load_x10[c] / 10.0f, 1);
+    }
+    json_lit(&w, "]}");
+    return (int)json_end(&w);
+}
+
+// GET /api/placement: the running profile, what each profile would apply, and
+// the report of every profile measured so far, the running one live
+static esp_err_t api_placement_get_handler(httpd_req_t *req)
+{
+    placement_report_t report;
+    char chunk[768];
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    // Every profile as {"<stage>":[core,priority],..}
+    json_writer_t w;
+    json_init(&w, chunk, sizeof(chunk));
+    json_lit(&w, "{\"profile\":\"");
+    json_raw(&w, placement_profiles[placement.profile].name, strlen(placement_profiles[placement.profile].name));
+    json_lit(&w, "\",\"profiles\":{");
+    for (unsigned p = 0; p < PLACEMENT_PROFILE_COUNT; p++) {
+        const pipe_slot_t *stages = p == PLACEMENT_CUSTOM ? placement.custom : placement_profiles[p].stages;
+        if (p) json_lit(&w, ",");
+        json_lit(&w, "\"");
+        json_raw(&w, placement_profiles[p].name, strlen(placement_profiles[p].name));
+        json_lit(&w, "\":{");
+        for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+            if (s) json_lit(&w, ",");
+            json_lit(&w, "\"");
+            json_raw(&w, pipe_stage_names[s], strlen(pipe_stage_names[s]));
+            json_lit(&w, "\":[");
+            json_uint(&w, stages[s].core);
+            json_lit(&w, ",");
+            json_uint(&w, stages[s].priority);
+            json_lit(&w, "]");
+        }
+        json_lit(&w, "}");
+    }
+    json_lit(&w, "},\"reports\":[");
+    int n = (int)json_end(&w);
+    esp_err_t err = httpd_resp_send_chunk(req, chunk, n);
+
+    bool first = true;
+    for (unsigned p = 0; p < PLACEMENT_PROFILE_COUNT && err == ESP_OK; p++) {
+        bool live = p == placement.profile;
+        if (live) {
+            placement_report_live(&report);
+        } else if (!placement_report_load(p, &report)) {
+            continue;
+        }
+        chunk[0] = ',';
+        n = placement_report_json(chunk + !first, sizeof(chunk) - 1, p, live, &report);
+        err = httpd_resp_send_chunk(req, chunk, n + !first);
+        first = false;
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
+
+// POST /api/placement?profile=<name>[&<stage>=<core>:<priority>...]: stage
+// values set the custom profile. Saves the running profile's report, stores
+// the choice and restarts, since tasks are pinned as they are created.
+static esp_err_t api_placement_post_handler(httpd_req_t *req)
+{
+    char query[128];
+    char value[12];
+    unsigned profile = PLACEMENT_PROFILE_COUNT;
+    pipe_slot_t custom[PIPE_STAGE_COUNT];
+
+    memcpy(custom, placement.custom, sizeof(custom));
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing profile");
+    }
+    if (httpd_query_key_value(query, "profile", value, sizeof(value)) == ESP_OK) {
+        for (unsigned p = 0; p < PLACEMENT_PROFILE_COUNT; p++) {
+            if (strcmp(value, placement_profiles[p].name) == 0) profile = p;
+        }
+    }
+    if (profile == PLACEMENT_PROFILE_COUNT) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown profile");
+    }
+    for (int s = 0; s < PIPE_STAGE_COUNT; s++) {
+        if (httpd_query_key_value(query, pipe_stage_names[s], value, sizeof(value)) != ESP_OK) continue;
+        unsigned core, priority;
+        char extra;
+        if (profile != PLACEMENT_CUSTOM || sscanf(value, "%u:%u%c", &core, &priority, &extra) != 2 ||
+            core > UINT8_MAX || priority > UINT8_MAX) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Stages are <core>:<priority>, custom only");
+        }
+        custom[s] = (pipe_slot_t){ .core = (uint8_t)core, .priority = (uint8_t)priority };
+        if (!placement_slot_valid(&custom[s])) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Core or priority out of range");
+        }
+    }
+
+    placement_report_save();
+    if (placement_store((uint8_t)profile, custom) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Could not save to NVS");
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, "{\"restart\":true}");
+
+    ESP_LOGI(TAG, "[PLACEMENT] Profile %s stored, restarting", placement_profiles[profile].name);
+    recorder_sync();
+    vTaskDelay(pdMS_TO_TICKS(500));
+    esp_restart();
+    return ESP_OK;
+}
+
+// Name of a macro from ?name=, false and a 400 sent if it is missing or bad
+static bool macro_query_name(httpd_req_t *req, char *name, size_t size)
+{
+    char query[64];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        api_query_text(query, "name", name, size) != 1 || !macro_name_valid(name)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "name must be 1-16 of A-Z a-z 0-9 _ -");
+        return false;
+    }
+    return true;
+}
+
+// GET /api/macros - {"macros":[{"name":"purge","bytes":312},...],"running":"purge"}
+// with "running" null while no macro is being fed
+static esp_err_t api_macros_get_handler(httpd_req_t *req)
+{
+    char chunk[96];
+    char name[MACRO_NAME_MAX + 1];
+    char path[64];
+    struct stat st;
+    esp_err_t err;
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    err = httpd_resp_send_chunk(req, "{\"macros\":[", HTTPD_RESP_USE_STRLEN);
+    DIR *dir = mount_remote_html_fs() == ESP_OK ? opendir("/spiffs") : NULL;
+    bool first = true;
+    struct dirent *entry;
+    while (dir != NULL && err == ESP_OK && (entry = readdir(dir)) != NULL) {
+        if (!macro_entry_name(entry->d_name, name)) continue;
+        macro_path(path, sizeof(path), name);
+        if (stat(path, &st) != 0) continue;
+        snprintf(chunk, sizeof(chunk), "%s{\"name\":\"%s\",\"bytes\":%u}",
+                 first ? "" : ",", name, (unsigned)st.st_size);
+        err = httpd_resp_send_chunk(req, chunk, HTTPD_RESP_USE_STRLEN);
+        first = false;
+    }
+    if (dir != NULL) closedir(dir);
+
+    bool running = atomic_load(&gcode_stream.busy) && gcode_stream.macro[0];
+    snprintf(chunk, sizeof(chunk), running ? "],\"running\":\"%s\"}" : "],\"running\":null}",
+             gcode_stream.macro);
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, chunk, HTTPD_RESP_USE_STRLEN);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
 
-        case HTTP_EVENT_DISCONNECTED:
-        case HTTP_EVENT_ERROR:
-            if (!output->failed && output->len > 0) {
-                ESP_LOGW(TAG, "HTTP event %d during download at offset %u",
-                         evt->event_id, (unsigned)output->len);
-            }
-            break;
+static int macro_count(void)
+{
+    char name[MACRO_NAME_MAX + 1];
+    int count = 0;
+    DIR *dir = opendir("/spiffs");
+    struct dirent *entry;
 
-        default:
-            break;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (macro_entry_name(entry->d_name, name)) count++;
     }
-    return ESP_OK;
+    if (dir != NULL) closedir(dir);
+    return count;
 }
 
-static esp_err_t mount_remote_html_fs(void)
+// POST /api/macros?name=<name> - store the body as a macro, replacing any of
+// that name. Comments are kept; they are stripped as the macro runs.
+static esp_err_t api_macros_post_handler(httpd_req_t *req)
 {
-    if (remote_html_fs_mounted) {
-        ESP_LOGI(TAG, "SPIFFS already mounted at /spiffs");
-        return ESP_OK;
+    char name[MACRO_NAME_MAX + 1];
+    char path[64];
+    char tmp[64];
+    struct stat st;
+
+    if (!macro_query_name(req, name, sizeof(name))) return ESP_OK;
+    if (req->content_len == 0 || req->content_len > MACRO_MAX_BYTES) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Macro must be 1 byte to 16 KB");
+    }
+    if (macro_running(name)) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Macro is running");
+    }
+    if (mount_remote_html_fs() != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Storage unavailable");
+    }
+    macro_path(path, sizeof(path), name);
+    if (stat(path, &st) != 0 && macro_count() >= MACRO_MAX_COUNT) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Too many macros");
+    }
+    // SPIFFS names are short: the temporary one drops the suffix
+    snprintf(tmp, sizeof(tmp), MACRO_PATH_PREFIX "%s.tmp", name);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Storage unavailable");
     }
 
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = "/spiffs",
-        .partition_label = NULL,
-        .max_files = 4,
-        .format_if_mount_failed = true
-    };
+    char chunk[512];
+    size_t received = 0;
+    bool ok = true;
+    while (ok && received < req->content_len) {
+        int r = httpd_req_recv(req, chunk, sizeof(chunk));
+        if (r == HTTPD_SOCK_ERR_TIMEOUT) continue;
+        if (r <= 0) {
+            ok = false;
+            break;
+        }
+        ok = fwrite(chunk, 1, r, fp) == (size_t)r;
+        received += r;
+    }
+    ok = fclose(fp) == 0 && ok;
 
-    ESP_LOGI(TAG, "Mounting SPIFFS at %s (max_files=%d, format_if_mount_failed=%d)",
-             conf.base_path, conf.max_files, conf.format_if_mount_failed);
+    if (ok) {
+        remove(path);
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok) {
+        remove(tmp);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Upload failed or storage full");
+    }
+    ESP_LOGI(TAG, "[MACRO] Stored %s, %u bytes", name, (unsigned)received);
+    snprintf(chunk, sizeof(chunk), "{\"name\":\"%s\",\"bytes\":%u}", name, (unsigned)received);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, chunk);
+}
 
-    esp_err_t err = esp_vfs_spiffs_register(&conf);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to mount SPIFFS: %s", esp_err_to_name(err));
-        return err;
+// DELETE /api/macros?name=<name>
+static esp_err_t api_macros_delete_handler(httpd_req_t *req)
+{
+    char name[MACRO_NAME_MAX + 1];
+    char path[64];
+
+    if (!macro_query_name(req, name, sizeof(name))) return ESP_OK;
+    if (macro_running(name)) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Macro is running");
+    }
+    macro_path(path, sizeof(path), name);
+    if (mount_remote_html_fs() != ESP_OK || remove(path) != 0) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such macro");
     }
+    ESP_LOGI(TAG, "[MACRO] Deleted %s", name);
+    httpd_resp_set_status(req, "204 No Content");
+    return httpd_resp_send(req, NULL, 0);
+}
 
-    size_t total = 0;
-    size_t used = 0;
-    if (esp_spiffs_info(NULL, &total, &used) == ESP_OK) {
-        ESP_LOGI(TAG, "SPIFFS mounted: total=%u bytes, used=%u bytes",
-                 (unsigned)total, (unsigned)used);
+static const char *const spool_state_names[] = { "empty", "uploading", "ready", "printing" };
+
+// GET /api/spool - {"state":"ready","name":"benchy.gcode","bytes":123456,
+// "crc":"1a2b3c4d","capacity":1765376}; the job's fields only when one is stored
+static esp_err_t api_spool_get_handler(httpd_req_t *req)
+{
+    char name[2 * SPOOL_NAME_MAX + 1];
+    char response[192];
+
+    if (spool.part == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No spool partition");
+    }
+    int state = atomic_load(&spool.state);
+    size_t capacity = spool.part->size - spool.part->erase_size;
+    if (state == SPOOL_READY || state == SPOOL_FEEDING) {
+        name[json_escape(name, sizeof(name) - 1, spool.name, sizeof(spool.name))] = '\0';
+        snprintf(response, sizeof(response),
+                 "{\"state\":\"%s\",\"name\":\"%s\",\"bytes\":%u,\"crc\":\"%08x\",\"capacity\":%u}",
+                 spool_state_names[state], name, (unsigned)spool.len, (unsigned)spool.crc, (unsigned)capacity);
     } else {
-        ESP_LOGW(TAG, "SPIFFS mounted, but esp_spiffs_info() failed");
+        snprintf(response, sizeof(response), "{\"state\":\"%s\",\"capacity\":%u}",
+                 spool_state_names[state], (unsigned)capacity);
     }
-
-    remote_html_fs_mounted = true;
-    ESP_LOGI(TAG, "SPIFFS ready for remote HTML storage");
-    return ESP_OK;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_sendstr(req, response);
 }
 
-static bool download_remote_html_to_flash(const char *url)
+typedef struct {
+    httpd_req_t *req;
+    uint32_t expect_crc;
+    bool check_crc;                            // ?crc= was given
+} spool_upload_t;
+
+static spool_upload_t spool_upload;            // Owned by the request in SPOOL_UPLOADING
+
+// Writes the body to the spool partition detached from the httpd task: the
+// erases alone take seconds for a large job
+static void spool_upload_task(void *arg)
 {
-    ESP_LOGI(TAG, "Preparing remote HTML download to flash from: %s", url);
+    httpd_req_t *req = spool_upload.req;
+    char buf[SPOOL_UPLOAD_CHUNK];
+    size_t data = spool.part->erase_size;
+    size_t erased_to = data;
+    size_t received = 0;
+    uint32_t crc = 0;
+    int timeouts = 0;
+    const char *fail = NULL;
+
+    // The old job goes first, so a failed upload cannot leave it half overwritten
+    esp_err_t err = esp_partition_erase_range(spool.part, 0, spool.part->erase_size);
+    if (err != ESP_OK) fail = "Flash erase failed";
+
+    while (fail == NULL && received < req->content_len) {
+        int r = httpd_req_recv(req, buf, sizeof(buf));
+        if (r == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < GCODE_STREAM_RECV_RETRIES) {
+            continue;
+        }
+        if (r <= 0) {
+            fail = "Receive failed";
+            break;
+        }
+        timeouts = 0;
+        while (erased_to < data + received + r) {
+            size_t n = spool.part->size - erased_to < SPOOL_ERASE_CHUNK ? spool.part->size - erased_to
+                                                                       : SPOOL_ERASE_CHUNK;
+            if (esp_partition_erase_range(spool.part, erased_to, n) != ESP_OK) {
+                fail = "Flash erase failed";
+                break;
+            }
+            erased_to += n;
+        }
+        if (fail == NULL && esp_partition_write(spool.part, data + received, buf, r) != ESP_OK) {
+            fail = "Flash write failed";
+        }
+        crc = esp_rom_crc32_le(crc, (const uint8_t *)buf, r);
+        received += r;
+    }
 
-    if (mount_remote_html_fs() != ESP_OK) {
-        snprintf(last_download_error, sizeof(last_download_error), "SPIFFS mount failed");
-        ESP_LOGE(TAG, "Remote HTML download aborted: SPIFFS mount failed");
-        return false;
+    uint32_t stored_crc = 0;
+    if (fail == NULL && spool_upload.check_crc && crc != spool_upload.expect_crc) {
+        fail = "CRC mismatch";
+    } else if (fail == NULL && (spool_data_crc(received, buf, sizeof(buf), &stored_crc) != ESP_OK ||
+                                stored_crc != crc)) {
+        fail = "Flash verify failed";
     }
 
-    xSemaphoreTake(html_mutex, portMAX_DELAY);
-    ESP_LOGI(TAG, "Writing remote HTML to %s", REMOTE_HTML_FLASH_PATH);
+    if (fail == NULL) {
+        spool_hdr_t hdr = { .magic = SPOOL_MAGIC, .len = received, .crc = crc };
+        memcpy(hdr.name, spool.name, sizeof(hdr.name));
+        hdr.hdr_crc = spool_hdr_crc(&hdr);
+        if (esp_partition_write(spool.part, 0, &hdr, sizeof(hdr)) != ESP_OK) {
+            fail = "Flash write failed";
+        }
+    }
 
-    FILE *fp = fopen(REMOTE_HTML_FLASH_PATH, "wb");
-    if (fp == NULL) {
-        ESP_LOGE(TAG, "Failed to open %s for writing", REMOTE_HTML_FLASH_PATH);
-        snprintf(last_download_error, sizeof(last_download_error), "Failed to open flash file");
-        xSemaphoreGive(html_mutex);
-        return false;
+    if (fail == NULL) {
+        spool.len = received;
+        spool.crc = crc;
+        atomic_store(&spool.state, SPOOL_READY);
+        snprintf(buf, sizeof(buf), "{\"bytes\":%u,\"crc\":\"%08x\"}", (unsigned)received, (unsigned)crc);
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_sendstr(req, buf);
+        ESP_LOGI(TAG, "[SPOOL] Stored %s, %u bytes, crc %08x", spool.name, (unsigned)received, (unsigned)crc);
+    } else {
+        atomic_store(&spool.state, SPOOL_EMPTY);
+        if (strcmp(fail, "CRC mismatch") == 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, fail);
+        } else if (strcmp(fail, "Receive failed") != 0) {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, fail);
+        }
+        ESP_LOGW(TAG, "[SPOOL] Upload of %s failed after %u bytes: %s", spool.name, (unsigned)received, fail);
     }
+    socket_hold(httpd_req_to_sockfd(req), false);
+    httpd_req_async_handler_complete(req);
+    vTaskDelete(NULL);
+}
 
-    ESP_LOGI(TAG, "Flash file opened for write successfully");
+// ?name= of a spool upload into name, which keeps its default if there is
+// none. False if it is empty, malformed or has control characters.
+static bool spool_name_from_query(const char *query, char name[SPOOL_NAME_MAX + 1])
+{
+    char value[SPOOL_NAME_MAX + 1];
+    int found = api_query_text(query, "name", value, sizeof(value));
 
-    download_buffer_t download = {
-        .fp = fp,
-        .len = 0,
-        .failed = false
-    };
+    if (found == 0) return true;
+    if (found < 0 || value[0] == '\0') return false;
+    for (const char *p = value; *p; p++) {
+        if ((unsigned char)*p < 0x20 || *p == 0x7f) return false;
+    }
+    memcpy(name, value, sizeof(value));
+    return true;
+}
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .event_handler = http_event_handler,
-        .user_data = &download,
-        .timeout_ms = 10000,
-        .buffer_size = 4096,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-    };
+// POST /api/spool?name=<file>&crc=<hex> - store the body as the job to print,
+// replacing the last one. With crc= the upload is refused unless its CRC-32
+// matches; either way what reached flash is read back and checked.
+static esp_err_t api_spool_post_handler(httpd_req_t *req)
+{
+    char query[192];
+    char crc_hex[16];
+    char name[SPOOL_NAME_MAX + 1] = "job.gcode";
+    int state = SPOOL_EMPTY;
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client for remote HTML download");
-        fclose(fp);
-        remove(REMOTE_HTML_TEMP_PATH);
-        snprintf(last_download_error, sizeof(last_download_error), "Failed to initialize HTTP client");
-        xSemaphoreGive(html_mutex);
-        return false;
+    if (spool.part == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No spool partition");
+    }
+    if (req->content_len == 0) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+    }
+    if (req->content_len > spool.part->size - spool.part->erase_size) {
+        return httpd_resp_send_err(req, HTTPD_413_CONTENT_TOO_LARGE, "Job larger than the spool partition");
+    }
+    // Decoded, so "my%20part.gcode" is listed as "my part.gcode"
+    bool has_query = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK;
+    if (has_query && !spool_name_from_query(query, name)) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "name must be 1-47 printable characters");
+    }
+    if (!atomic_compare_exchange_strong(&spool.state, &state, SPOOL_UPLOADING) &&
+        (state != SPOOL_READY || !atomic_compare_exchange_strong(&spool.state, &state, SPOOL_UPLOADING))) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, state == SPOOL_FEEDING ? "Job is printing" : "Upload already in progress");
     }
+    memcpy(spool.name, name, sizeof(spool.name));
+    spool_upload.check_crc = has_query && httpd_query_key_value(query, "crc", crc_hex, sizeof(crc_hex)) == ESP_OK;
+    spool_upload.expect_crc = spool_upload.check_crc ? (uint32_t)strtoul(crc_hex, NULL, 16) : 0;
 
-    ESP_LOGI(TAG, "HTTP client initialized, starting fetch");
-    esp_err_t err = esp_http_client_perform(client);
-    int status_code = (err == ESP_OK) ? esp_http_client_get_status_code(client) : -1;
+    if (httpd_req_async_handler_begin(req, &spool_upload.req) != ESP_OK) {
+        atomic_store(&spool.state, SPOOL_EMPTY);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Busy");
+    }
+    socket_hold(httpd_req_to_sockfd(spool_upload.req), true);
+    if (xTaskCreatePinnedToCore(spool_upload_task, "spool_upload", SPOOL_TASK_STACK, NULL, 4, NULL,
+                                pipe_placement[PIPE_GCODE].core) != pdPASS) {
+        httpd_resp_send_err(spool_upload.req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        socket_hold(httpd_req_to_sockfd(spool_upload.req), false);
+        httpd_req_async_handler_complete(spool_upload.req);
+        atomic_store(&spool.state, SPOOL_EMPTY);
+    }
+    return ESP_OK;
+}
 
-    ESP_LOGI(TAG, "HTTP fetch finished: err=%s status=%d bytes=%u failed=%d",
-             esp_err_to_name(err), status_code, (unsigned)download.len, download.failed);
+// DELETE /api/spool - forget the stored job
+static esp_err_t api_spool_delete_handler(httpd_req_t *req)
+{
+    int state = SPOOL_READY;
 
-    fflush(fp);
-    fclose(fp);
-    esp_http_client_cleanup(client);
-    ESP_LOGI(TAG, "Flash file closed after download");
+    if (spool.part == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No spool partition");
+    }
+    if (!atomic_compare_exchange_strong(&spool.state, &state, SPOOL_UPLOADING)) {
+        if (state == SPOOL_EMPTY) return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No stored job");
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, state == SPOOL_FEEDING ? "Job is printing" : "Upload in progress");
+    }
+    esp_err_t err = esp_partition_erase_range(spool.part, 0, spool.part->erase_size);
+    atomic_store(&spool.state, err == ESP_OK ? SPOOL_EMPTY : SPOOL_READY);
+    if (err != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Flash erase failed");
+    }
+    ESP_LOGI(TAG, "[SPOOL] Deleted %s", spool.name);
+    httpd_resp_set_status(req, "204 No Content");
+    return httpd_resp_send(req, NULL, 0);
+}
 
-    if (err == ESP_OK && status_code == 200 && !download.failed && download.len > 0) {
-        cached_html_size = download.len;
-        snprintf(last_download_error, sizeof(last_download_error),
-                 "Success! Downloaded %u bytes", (unsigned)download.len);
-        ESP_LOGI(TAG, "HTML saved to flash successfully (%u bytes) at %s",
-                 (unsigned)download.len, REMOTE_HTML_FLASH_PATH);
-        xSemaphoreGive(html_mutex);
-        return true;
+// GET /capture - the last serial capture, to keep or load into another unit
+static esp_err_t capture_get_handler(httpd_req_t *req)
+{
+    if (atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_IDLE || serial_capture_task_handle) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Capture or replay running");
+    }
+    FILE *fp = mount_remote_html_fs() == ESP_OK ? fopen(CAPTURE_PATH, "rb") : NULL;
+    if (fp == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No capture");
     }
 
-    remove(REMOTE_HTML_FLASH_PATH);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"capture.bin\"");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    char chunk[1024];
+    size_t n;
+    esp_err_t err = ESP_OK;
+    while (err == ESP_OK && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        err = httpd_resp_send_chunk(req, chunk, n);
+    }
+    fclose(fp);
     if (err == ESP_OK) {
-        snprintf(last_download_error, sizeof(last_download_error), "HTTP %d, len=%u", status_code, (unsigned)download.len);
-        ESP_LOGE(TAG, "Download failed: HTTP %d", status_code);
-    } else {
-        snprintf(last_download_error, sizeof(last_download_error), "Failed: %s", esp_err_to_name(err));
-        ESP_LOGE(TAG, "Download error: %s", esp_err_to_name(err));
+        err = httpd_resp_send_chunk(req, NULL, 0);
     }
-
-    xSemaphoreGive(html_mutex);
-    return false;
+    return err;
 }
 
-void download_html_from_github(void)
+// POST /capture - replace the capture with one recorded elsewhere
+static esp_err_t capture_post_handler(httpd_req_t *req)
 {
-    ESP_LOGI(TAG, "Downloading HTML from GitHub...");
-    snprintf(last_download_error, sizeof(last_download_error), "Starting download...");
-    download_remote_html_to_flash(REMOTE_HTML_URL);
-}
+    serial_capture_hdr_t hdr;
 
-// ============================================================================
-// WIFI INITIALIZATION (Preserved from V2)
-// ============================================================================
+    if (atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_IDLE || serial_capture_task_handle) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Capture or replay running");
+    }
+    if (req->content_len < sizeof(hdr) || req->content_len > CAPTURE_MAX_BYTES) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad capture size");
+    }
+    FILE *fp = mount_remote_html_fs() == ESP_OK ? fopen(CAPTURE_PATH ".tmp", "wb") : NULL;
+    if (fp == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Storage unavailable");
+    }
 
-static void wifi_event_handler(void* arg, esp_event_base_t event_base,
-                                int32_t event_id, void* event_data)
-{
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        // Clear the connected bit so callers waiting on it know we lost IP
-        if (wifi_event_group) {
-            xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+    char chunk[1024];
+    size_t received = 0;
+    bool ok = true;
+    while (ok && received < req->content_len) {
+        int r = httpd_req_recv(req, chunk, sizeof(chunk));
+        if (r == HTTPD_SOCK_ERR_TIMEOUT) continue;
+        if (r <= 0) {
+            ok = false;
+            break;
         }
-        // Brief backoff before retrying to avoid hammering the WiFi stack
-        // on boot when the router may not be ready yet
-        ESP_LOGI(TAG, "Disconnected from WiFi, retrying in 1s...");
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        esp_wifi_connect();
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
-        // Signal waiters that WiFi is fully up
-        if (wifi_event_group) {
-            xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        if (received == 0) {
+            memcpy(&hdr, chunk, r < (int)sizeof(hdr) ? (size_t)r : sizeof(hdr));
+            if (r < (int)sizeof(hdr) || hdr.magic != CAPTURE_MAGIC) {
+                ok = false;
+                break;
+            }
         }
+        ok = fwrite(chunk, 1, r, fp) == (size_t)r;
+        received += r;
     }
-}
+    fclose(fp);
 
-static void wifi_init_sta(void)
-{
-    wifi_event_group = xEventGroupCreate();
+    if (ok) {
+        remove(CAPTURE_PATH);
+        ok = rename(CAPTURE_PATH ".tmp", CAPTURE_PATH) == 0;
+    }
+    if (!ok) {
+        remove(CAPTURE_PATH ".tmp");
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Upload failed or not a capture");
+    }
+    ESP_LOGI(TAG, "[CAPTURE] Uploaded capture, %u bytes", (unsigned)received);
+    return httpd_resp_sendstr(req, "OK");
+}
 
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+// ============================================================================
+// MQTT PUBLISHER
+// Republishes the WebSocket stream to a broker. mqtt_reader is one more ring
+// reader, so frames go out as built: state types retained on
+// <prefix>/<type> (status, temperature, ...), log batches on <prefix>/log.
+// Change suppression and conflation are the ones the page gets. G-code
+// published to <prefix>/gcode joins gcode_queue like a GCODE: frame.
+// ============================================================================
 
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+#if ENABLE_MQTT
+// Included here rather than at the top: ENABLE_MQTT is defined below the includes
+#include "mqtt_client.h"
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
+static esp_mqtt_client_handle_t mqtt_client;
+static gcode_cmd_t mqtt_gcode_batch[MQTT_GCODE_BATCH];   // MQTT task only
+static char mqtt_command[MQTT_COMMAND_MAX_LEN + 1];
+static ws_message_t mqtt_msg;                             // mqtt_publish_task only
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASS,
-        },
-    };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+#define MQTT_STATIC_BYTES   (sizeof(mqtt_gcode_batch) + sizeof(mqtt_command) + sizeof(mqtt_msg))
 
-    ESP_LOGI(TAG, "WiFi initialization finished. Connecting to %s...", WIFI_SSID);
+static void mqtt_topic(char *topic, const char *suffix)
+{
+    snprintf(topic, MQTT_TOPIC_MAX_LEN, "%s/%s", MQTT_TOPIC_PREFIX, suffix);
 }
 
-// ============================================================================
-// SYSTEM MONITORING TASK
-// ============================================================================
-
-static void system_monitor_task(void *arg)
+// Start reading from the ring head. Slots that were never filled stay
+// unsent: an empty retained payload would clear the broker's copy.
+static void mqtt_reader_activate(bool active)
 {
-    while (1) {
-        vTaskDelay(pdMS_TO_TICKS(2000)); // Simple delay - never tries to catch up on missed ticks
-        
-        // Memory stats
-        size_t free_heap = esp_get_free_heap_size();
-        size_t min_free_heap = esp_get_minimum_free_heap_size();
-        DEBUG_LOG(TAG, "[MONITOR] Free heap: %zu bytes, Min: %zu bytes", free_heap, min_free_heap);
-        
-        // WebSocket client status
-        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-        int active_clients = 0;
-        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-            if (ws_clients[i].active) {
-                active_clients++;
-                UBaseType_t queue_depth = uxQueueMessagesWaiting(ws_clients[i].message_queue);
-                UBaseType_t queue_spaces = uxQueueSpacesAvailable(ws_clients[i].message_queue);
-                DEBUG_LOG(TAG, "[MONITOR] Client %d: fd=%d, queue=%d/%d", 
-                         i, ws_clients[i].fd, queue_depth, queue_depth + queue_spaces);
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    memset(&mqtt_reader, 0, sizeof(mqtt_reader));
+    if (active) {
+        mqtt_reader.active = true;
+        mqtt_reader.topics = MQTT_READER_TOPICS;
+        mqtt_reader.cursor = ws_ring.head;
+        for (int slot = 0; slot < WS_SLOT_COUNT; slot++) {
+            if (ws_state_slots[slot].updates > 0 &&
+                (mqtt_reader.topics & WS_TOPIC_BIT(ws_state_slots[slot].msg.type))) {
+                mqtt_reader.state_pending |= 1u << slot;
             }
         }
-        xSemaphoreGive(ws_clients_mutex);
-        
-        DEBUG_LOG(TAG, "[MONITOR] Active clients: %d, Printer: %s", 
-                 active_clients, printer_connected ? "connected" : "disconnected");
-        
-        // WiFi status
-        wifi_ap_record_t ap_info;
-        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
-            DEBUG_LOG(TAG, "[MONITOR] WiFi RSSI: %d dBm", ap_info.rssi);
-        }
+    }
+    xSemaphoreGive(ws_clients_mutex);
+    if (active && mqtt_task_handle) {
+        xTaskNotifyGive(mqtt_task_handle);
+    }
+}
 
-        // Ping all active clients - only if no ping already pending
-        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-            if (ws_clients[i].active) {
-                if (ws_clients[i].ping_pending) {
-                    // Previous ping never got a pong - client is dead
-                    ESP_LOGW(TAG, "No pong from client %d (fd=%d), evicting", i, ws_clients[i].fd);
-                    ws_clients[i].active = false;
-                    ws_clients[i].fd = -1;
-                    ws_clients[i].ping_pending = false;
-                    xQueueReset(ws_clients[i].message_queue);
-                } else {
-                    httpd_ws_frame_t ping_pkt;
-                    memset(&ping_pkt, 0, sizeof(httpd_ws_frame_t));
-                    ping_pkt.type = HTTPD_WS_TYPE_PING;
-                    ping_pkt.payload = NULL;
-                    ping_pkt.len = 0;
-                    esp_err_t ret = httpd_ws_send_frame_async(server, ws_clients[i].fd, &ping_pkt);
-                    if (ret != ESP_OK) {
-                        ESP_LOGW(TAG, "Ping failed for client %d (fd=%d), evicting", i, ws_clients[i].fd);
-                        ws_clients[i].active = false;
-                        ws_clients[i].fd = -1;
-                        xQueueReset(ws_clients[i].message_queue);
-                    } else {
-                        ws_clients[i].ping_pending = true;
-                        DEBUG_LOG(TAG, "[MONITOR] Ping sent to client %d", i);
-                    }
-                }
+static void mqtt_publish_task(void *arg)
+{
+    char topic[MQTT_TOPIC_MAX_LEN];
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (1) {
+            size_t len = 0;
+            xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+            if (mqtt_reader.active) {
+                len = ws_reader_next_frame(&mqtt_reader, MQTT_READER_ID, &mqtt_msg);
+            }
+            xSemaphoreGive(ws_clients_mutex);
+            if (len == 0) break;
+
+            // QoS 0: a lost sample is replaced by the next one, and the
+            // retained copy on the broker stays the latest value
+            mqtt_topic(topic, msg_type_names[mqtt_msg.type]);
+            bool retain = ws_state_slot_for(mqtt_msg.type) >= 0;
+            if (esp_mqtt_client_publish(mqtt_client, topic, mqtt_msg.json_payload, (int)len, 0, retain) < 0) {
+                METRIC_INC(mqtt_publish_errors);
+            } else {
+                METRIC_INC(mqtt_published[mqtt_msg.type]);
             }
         }
-        xSemaphoreGive(ws_clients_mutex);
     }
 }
 
-// ============================================================================
-// G-CODE COMMAND QUEUE SENDER TASK
-// Sends one command at a time, waits for 'ok' before sending next.
-// This ensures commands like G29 fully complete before G29 T is sent.
-// ============================================================================
-
-static void gcode_sender_task(void *arg)
+static void mqtt_handle_command(esp_mqtt_event_handle_t event)
+{
+    char topic[MQTT_TOPIC_MAX_LEN];
+
+    mqtt_topic(topic, "gcode");
+    if (event->topic_len != (int)strlen(topic) || strncmp(event->topic, topic, event->topic_len) != 0) {
+        return;
+    }
+    // Commands are small; one spread over several fragments is refused
+    // rather than reassembled
+    if (event->data_len != event->total_data_len || event->data_len > MQTT_COMMAND_MAX_LEN) {
+        ESP_LOGW(TAG, "[MQTT] Dropping %d byte G-code message", event->total_data_len);
+        return;
+    }
+    if (!g_prusa_dev) {
+        ESP_LOGW(TAG, "[MQTT] G-code received but printer not connected");
+        return;
+    }
+    memcpy(mqtt_command, event->data, event->data_len);
+    mqtt_command[event->data_len] = '\0';
+    METRIC_INC(mqtt_commands);
+    gcode_submit_text(mqtt_command, mqtt_gcode_batch, MQTT_GCODE_BATCH, -1, 0);
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    char topic[MQTT_TOPIC_MAX_LEN];
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(TAG, "[MQTT] Connected to %s", MQTT_BROKER_URI);
+            METRIC_INC(mqtt_connects);
+            mqtt_topic(topic, "availability");
+            esp_mqtt_client_publish(mqtt_client, topic, "online", 0, 1, 1);
+            mqtt_topic(topic, "gcode");
+            esp_mqtt_client_subscribe(mqtt_client, topic, 0);
+            mqtt_reader_activate(true);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGW(TAG, "[MQTT] Disconnected, the client retries by itself");
+            mqtt_reader_activate(false);
+            break;
+        case MQTT_EVENT_DATA:
+            mqtt_handle_command(event);
+            break;
+        default:
+            break;
+    }
+}
+
+static void mqtt_start(void)
 {
-    gcode_cmd_t cmd;
-
-    ESP_LOGI(TAG, "G-code sender task started");
-
-    // Drain any 'ok' signals the printer may have sent during boot/connect
-    // before we start processing queued commands. If these are left in the
-    // semaphore they will cause the first real command to skip its ok-wait
-    // and fire the next command prematurely.
-    if (gcode_ok_sem) {
-        while (xSemaphoreTake(gcode_ok_sem, 0) == pdTRUE) {}
-        ESP_LOGI(TAG, "[GCODE] Cleared stale ok signals");
+    static char will_topic[MQTT_TOPIC_MAX_LEN];
+    mqtt_topic(will_topic, "availability");
+
+    esp_mqtt_client_config_t cfg = {
+        .broker.address.uri = MQTT_BROKER_URI,
+        .credentials.username = MQTT_USERNAME[0] ? MQTT_USERNAME : NULL,
+        .credentials.authentication.password = MQTT_PASSWORD[0] ? MQTT_PASSWORD : NULL,
+        .session.last_will = {
+            .topic = will_topic,
+            .msg = "offline",
+            .qos = 1,
+            .retain = 1,
+        },
+        .buffer.size = MQTT_BUFFER_SIZE,
+    };
+    mqtt_client = esp_mqtt_client_init(&cfg);
+    if (!mqtt_client) {
+        ESP_LOGE(TAG, "[MQTT] Client init failed");
+        return;
+    }
+    mqtt_task_handle = xTaskCreateStaticPinnedToCore(mqtt_publish_task, "mqtt_publish", MQTT_TASK_STACK,
+        NULL, 4, task_stacks.mqtt_publish, &task_tcbs.mqtt_publish, 1);
+    esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    esp_err_t err = esp_mqtt_client_start(mqtt_client);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[MQTT] Client start failed: %s", esp_err_to_name(err));
     }
+}
+#else
+#define MQTT_STATIC_BYTES   (0)
+#endif
 
-    while (1) {
-        // Wait for a command to arrive in the queue
-        if (xQueueReceive(gcode_queue, &cmd, portMAX_DELAY) != pdTRUE) {
-            continue;
-        }
+// ============================================================================
+// MEMORY BUDGET
+// Fixed RAM of each subsystem, taken from the objects themselves so the
+// report cannot drift from the code. Logged at boot, exported by /metrics,
+// and the total is held to STATIC_RAM_BUDGET_BYTES at compile time. Heap
+// users left: httpd, lwIP/WiFi, the CDC driver and the on-demand tasks.
+// ============================================================================
 
-        if (!g_prusa_dev) {
-            ESP_LOGW(TAG, "[GCODE] Printer not connected, dropping: %s", cmd.cmd);
-            continue;
-        }
+// Function-local statics are counted by their declared sizes: ws_sender_task's
+// trace_json and msg, ws_handle_gcode's batch, recorder_task's partial page and
+// the three task_stats_t copies (sampler, publisher, /metrics). PSRAM builds
+// allocate the bulk buffers at boot instead (MEMORY TIERS), so they drop out
+// of this table.
+#define MEMORY_BUDGET_TABLE(X) \
+    X("ws_fanout",     sizeof(ws_clients) + sizeof(ws_ring) + sizeof(ws_ring_buf) + \
+                       sizeof(ws_state_slots) + \
+                       sizeof(ws_bulk_stream) + sizeof(ws_sender_scratch) + WS_TRACE_FRAME_SIZE + \
+                       WS_DEFLATE_STATIC_BYTES + \
+                       sizeof(ws_message_t) + sizeof(mqtt_reader) + sizeof(udp_telemetry)) \
+    X("mqtt",          MQTT_STATIC_BYTES) \
+    X("serial_rx",     sizeof(serial_rx_ring) + sizeof(serial_line_buffer)) \
+    X("serial_log",    sizeof(serial_log_backlog) + MEM_BULK_STATIC(SERIAL_LOG_BACKLOG_SIZE) + sizeof(log_batch)) \
+    X("capture",       sizeof(serial_capture_ring)) \
+    X("gcode",         sizeof(gcode_window) + sizeof(gcode_latency) + \
+                       GCODE_QUEUE_SIZE * sizeof(gcode_cmd_t) + MEM_BULK_STATIC(GCODE_STREAM_CHUNK_SIZE) + \
+                       sizeof(spool) + sizeof(spool_upload)) \
+    X("printer_state", sizeof(printer_state_published) + sizeof(mesh_cache) + sizeof(telemetry_history) + \
+                       MEM_BULK_STATIC(TELEMETRY_HISTORY_SAMPLES * sizeof(history_sample_t))) \
+    X("debug_log",     sizeof(log_ring)) \
+    X("task_stats",    sizeof(task_stats) + sizeof(task_stats_raw) + 3 * sizeof(task_stats_t) + \
+                       sizeof(placement) + sizeof(pipe_placement)) \
+    X("metrics",       sizeof(metrics) + sizeof(trace_hists)) \
+    X("rest_api",      sizeof(api_state_json) + sizeof(socket_budget)) \
+    X("recorder",      sizeof(recorder) + sizeof(recorder_page_t)) \
+    X("task_stacks",   sizeof(task_stacks) + sizeof(task_tcbs)) \
+    X("rtos_objects",  sizeof(rtos_objects))
 
-        // Send the command to the printer
-        char cmdline[GCODE_CMD_MAX_LEN + 2];
-        snprintf(cmdline, sizeof(cmdline), "%s\n", cmd.cmd);
+typedef struct {
+    const char *name;
+    size_t bytes;
+} memory_budget_entry_t;
 
-        esp_err_t err = cdc_acm_host_data_tx_blocking(g_prusa_dev,
-            (uint8_t *)cmdline, strlen(cmdline), USB_TX_TIMEOUT_MS);
+#define MEMORY_BUDGET_ENTRY(name, bytes)    { name, bytes },
+#define MEMORY_BUDGET_SUM(name, bytes)      + (bytes)
 
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "[GCODE] Failed to send: %s (%s)", cmd.cmd, esp_err_to_name(err));
-            continue;
-        }
+static const memory_budget_entry_t memory_budget[] = { MEMORY_BUDGET_TABLE(MEMORY_BUDGET_ENTRY) };
+#define MEMORY_BUDGET_TOTAL                 (0 MEMORY_BUDGET_TABLE(MEMORY_BUDGET_SUM))
+#define MEMORY_BUDGET_COUNT                 (sizeof(memory_budget) / sizeof(memory_budget[0]))
 
-        ESP_LOGI(TAG, "[GCODE] Sent: %s", cmd.cmd);
+_Static_assert(MEMORY_BUDGET_TOTAL <= STATIC_RAM_BUDGET_BYTES,
+               "Static buffers exceed STATIC_RAM_BUDGET_BYTES - shrink one or raise the budget");
 
-        // Wait for 'ok' from printer before sending next command
-        // Timeout is generous to allow for long operations like G29
-        if (xSemaphoreTake(gcode_ok_sem, pdMS_TO_TICKS(GCODE_OK_TIMEOUT_MS)) != pdTRUE) {
-            ESP_LOGW(TAG, "[GCODE] Timeout waiting for ok after: %s", cmd.cmd);
-            // Clear any backed-up ok signals and continue
-            while (xSemaphoreTake(gcode_ok_sem, 0) == pdTRUE) {}
-        } else {
-            DEBUG_LOG(TAG, "[GCODE] ok received, sending next command");
-            // Drain any extra ok signals (some commands produce multiple)
-            while (xSemaphoreTake(gcode_ok_sem, pdMS_TO_TICKS(50)) == pdTRUE) {}
-        }
+static void memory_budget_log(void)
+{
+    for (size_t i = 0; i < MEMORY_BUDGET_COUNT; i++) {
+        ESP_LOGI(TAG, "[MEM] %-14s %6u bytes", memory_budget[i].name, (unsigned)memory_budget[i].bytes);
     }
+    ESP_LOGI(TAG, "[MEM] Static total %u of %u bytes budgeted; heap free %u, largest internal block %u",
+             (unsigned)MEMORY_BUDGET_TOTAL, (unsigned)STATIC_RAM_BUDGET_BYTES,
+             (unsigned)esp_get_free_heap_size(),
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
 }
 
 // ============================================================================
-// WEBSOCKET MESSAGE SENDER TASK
+// METRICS
 // ============================================================================
 
-static void ws_sender_task(void *arg)
+// GET /metrics in the Prometheus text format. Counters are loaded relaxed;
+// the client table is copied under its mutex, never held across a send.
+static esp_err_t metrics_get_handler(httpd_req_t *req)
 {
-    ws_message_t msg;
-    uint32_t send_count = 0;
-    uint32_t error_count = 0;
-    int consecutive_errors[WS_MAX_CLIENTS] = {0};
+    char chunk[512];
+    int n;
+    esp_err_t err;
+
+#define METRICS_EMIT(...) do { \
+        n = snprintf(chunk, sizeof(chunk), __VA_ARGS__); \
+        if (err == ESP_OK) err = httpd_resp_send_chunk(req, chunk, n < (int)sizeof(chunk) ? n : (int)sizeof(chunk) - 1); \
+    } while (0)
+#define METRICS_LOAD(counter) ((unsigned)atomic_load_explicit(&metrics.counter, memory_order_relaxed))
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    err = ESP_OK;
+
+    METRICS_EMIT("# TYPE prusa_usb_rx_bytes_total counter\nprusa_usb_rx_bytes_total %u\n"
+                 "# TYPE prusa_usb_rx_transfers_total counter\nprusa_usb_rx_transfers_total %u\n"
+                 "# TYPE prusa_serial_lines_total counter\nprusa_serial_lines_total %u\n"
+                 "# TYPE prusa_serial_parse_errors_total counter\nprusa_serial_parse_errors_total %u\n"
+                 "# TYPE prusa_serial_line_overflows_total counter\nprusa_serial_line_overflows_total %u\n",
+                 METRICS_LOAD(usb_rx_bytes), METRICS_LOAD(usb_rx_transfers), METRICS_LOAD(serial_lines),
+                 METRICS_LOAD(parse_errors), METRICS_LOAD(line_overflows));
+    METRICS_EMIT("# TYPE prusa_usb_tx_bytes_total counter\nprusa_usb_tx_bytes_total %u\n"
+                 "# TYPE prusa_usb_tx_transfers_total counter\nprusa_usb_tx_transfers_total %u\n"
+                 "# TYPE prusa_usb_tx_lines_total counter\nprusa_usb_tx_lines_total %u\n"
+                 "# TYPE prusa_usb_tx_failed_total counter\nprusa_usb_tx_failed_total %u\n",
+                 METRICS_LOAD(usb_tx_bytes), METRICS_LOAD(usb_tx_transfers), METRICS_LOAD(usb_tx_lines),
+                 METRICS_LOAD(usb_tx_failed));
+    METRICS_EMIT("# TYPE prusa_serial_rx_dropped_bytes_total counter\nprusa_serial_rx_dropped_bytes_total %u\n"
+                 "# TYPE prusa_serial_rx_ring_high_water_bytes gauge\nprusa_serial_rx_ring_high_water_bytes %u\n"
+                 "# TYPE prusa_printer_connected gauge\nprusa_printer_connected %d\n"
+                 "# TYPE prusa_printer_state_read_retries_total counter\nprusa_printer_state_read_retries_total %u\n",
+                 (unsigned)atomic_load(&serial_rx_ring.dropped_bytes),
+                 (unsigned)atomic_load(&serial_rx_ring.high_water), printer_connected ? 1 : 0,
+                 (unsigned)atomic_load(&printer_state_published.read_retries));
+
+    METRICS_EMIT("# TYPE prusa_ws_frames_sent_total counter\n");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        METRICS_EMIT("prusa_ws_frames_sent_total{type=\"%s\"} %u\n", msg_type_names[t], METRICS_LOAD(ws_frames_sent[t]));
+    }
+    METRICS_EMIT("# TYPE prusa_ws_frames_dropped_total counter\n");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        METRICS_EMIT("prusa_ws_frames_dropped_total{type=\"%s\"} %u\n", msg_type_names[t], METRICS_LOAD(ws_frames_dropped[t]));
+    }
+#if ENABLE_WS_DEFLATE
+    METRICS_EMIT("# TYPE prusa_ws_deflate_bytes_total counter\n"
+                 "prusa_ws_deflate_bytes_total{stage=\"in\"} %u\n"
+                 "prusa_ws_deflate_bytes_total{stage=\"out\"} %u\n",
+                 METRICS_LOAD(ws_deflate_in_bytes), METRICS_LOAD(ws_deflate_out_bytes));
+#endif
+    int ws_used = 0;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (ws_clients[i].active) ws_used++;    // A racy count is fine for a gauge
+    }
+    METRICS_EMIT("# TYPE prusa_http_sockets gauge\n"
+                 "prusa_http_sockets{state=\"open\"} %d\n"
+                 "prusa_http_sockets{state=\"peak\"} %d\n"
+                 "prusa_http_sockets{state=\"limit\"} %d\n"
+                 "# TYPE prusa_ws_client_slots gauge\n"
+                 "prusa_ws_client_slots{state=\"used\"} %d\n"
+                 "prusa_ws_client_slots{state=\"limit\"} %d\n"
+                 "# TYPE prusa_http_sockets_purged_total counter\nprusa_http_sockets_purged_total %u\n"
+                 "# TYPE prusa_ws_evicted_sockets_closed_total counter\nprusa_ws_evicted_sockets_closed_total %u\n",
+                 atomic_load(&socket_budget.open), atomic_load(&socket_budget.open_peak), socket_budget.limit,
+                 ws_used, socket_budget.ws_limit,
+                 atomic_load(&socket_budget.purged), atomic_load(&socket_budget.ws_closed));
+#if ENABLE_UDP_TELEMETRY
+    METRICS_EMIT("# TYPE prusa_udp_datagrams_total counter\nprusa_udp_datagrams_total %u\n"
+                 "# TYPE prusa_udp_send_errors_total counter\nprusa_udp_send_errors_total %u\n"
+                 "# TYPE prusa_udp_conflated_total counter\nprusa_udp_conflated_total %u\n",
+                 METRICS_LOAD(udp_datagrams), METRICS_LOAD(udp_send_errors), METRICS_LOAD(udp_conflated));
+#endif
+#if ENABLE_MQTT
+    METRICS_EMIT("# TYPE prusa_mqtt_published_total counter\n");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        METRICS_EMIT("prusa_mqtt_published_total{type=\"%s\"} %u\n", msg_type_names[t], METRICS_LOAD(mqtt_published[t]));
+    }
+    METRICS_EMIT("# TYPE prusa_mqtt_publish_errors_total counter\nprusa_mqtt_publish_errors_total %u\n"
+                 "# TYPE prusa_mqtt_commands_total counter\nprusa_mqtt_commands_total %u\n"
+                 "# TYPE prusa_mqtt_connects_total counter\nprusa_mqtt_connects_total %u\n"
+                 "# TYPE prusa_mqtt_connected gauge\nprusa_mqtt_connected %d\n",
+                 METRICS_LOAD(mqtt_publish_errors), METRICS_LOAD(mqtt_commands), METRICS_LOAD(mqtt_connects),
+                 mqtt_reader.active ? 1 : 0);
+#endif
+    METRICS_EMIT("# TYPE prusa_recorder_pages_total counter\nprusa_recorder_pages_total %u\n"
+                 "# TYPE prusa_recorder_flash_bytes_total counter\nprusa_recorder_flash_bytes_total %u\n"
+                 "# TYPE prusa_recorder_erases_total counter\nprusa_recorder_erases_total %u\n"
+                 "# TYPE prusa_recorder_write_errors_total counter\nprusa_recorder_write_errors_total %u\n"
+                 "# TYPE prusa_recorder_dropped_records_total counter\nprusa_recorder_dropped_records_total %u\n"
+                 "# TYPE prusa_recorder_buffered_bytes gauge\nprusa_recorder_buffered_bytes %u\n",
+                 METRICS_LOAD(recorder_pages), METRICS_LOAD(recorder_pages) * RECORDER_PAGE_SIZE,
+                 METRICS_LOAD(recorder_erases), METRICS_LOAD(recorder_write_errors), METRICS_LOAD(recorder_dropped),
+                 (unsigned)recorder_buffered_bytes());
+    METRICS_EMIT("# TYPE prusa_printer_attaches_total counter\nprusa_printer_attaches_total %u\n"
+                 "# TYPE prusa_printer_attach_latency_us gauge\nprusa_printer_attach_latency_us %u\n",
+                 METRICS_LOAD(printer_attaches), METRICS_LOAD(printer_attach_us));
+    METRICS_EMIT("# TYPE prusa_log_lines_total counter\nprusa_log_lines_total %u\n"
+                 "# TYPE prusa_log_dropped_total counter\nprusa_log_dropped_total %u\n",
+                 METRICS_LOAD(log_lines), METRICS_LOAD(log_dropped));
+    METRICS_EMIT("# TYPE prusa_ws_send_errors_total counter\nprusa_ws_send_errors_total %u\n",
+                 (unsigned)ws_sender_stats.errors);
+    METRICS_EMIT("# TYPE prusa_topic_suppressed_total counter\n");
+    for (int t = 0; t < TELEMETRY_TOPIC_COUNT; t++) {
+        METRICS_EMIT("prusa_topic_suppressed_total{topic=\"%s\"} %u\n",
+                     telemetry_schema[t].name, (unsigned)telemetry_topics[t].suppressed_count);
+    }
 
-    while (1) {
-        // Process one message per client per loop iteration
-        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    struct { bool active; uint32_t lag; uint32_t overruns; } clients[WS_MAX_CLIENTS];
+    unsigned transports[2] = { 0, 0 };    // WebSocket, SSE
+    xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        clients[i].active = ws_clients[i].active;
+        transports[ws_clients[i].sse ? 1 : 0] += ws_clients[i].active;
+        clients[i].lag = (uint32_t)(ws_ring.head - ws_clients[i].cursor);
+        clients[i].overruns = ws_clients[i].overruns;
+    }
+    xSemaphoreGive(ws_clients_mutex);
+    METRICS_EMIT("# TYPE prusa_ws_clients gauge\nprusa_ws_clients{transport=\"ws\"} %u\n"
+                 "prusa_ws_clients{transport=\"sse\"} %u\n", transports[0], transports[1]);
+    METRICS_EMIT("# TYPE prusa_ws_client_lag_bytes gauge\n");
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (clients[i].active) {
+            METRICS_EMIT("prusa_ws_client_lag_bytes{client=\"%d\"} %u\n", i, (unsigned)clients[i].lag);
+        }
+    }
+    METRICS_EMIT("# TYPE prusa_ws_client_overruns_total counter\n");
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (clients[i].active) {
+            METRICS_EMIT("prusa_ws_client_overruns_total{client=\"%d\"} %u\n", i, (unsigned)clients[i].overruns);
+        }
+    }
 
-            // Step 1: Take mutex only long enough to dequeue a message and read the fd
-            xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+    METRICS_EMIT("# TYPE prusa_trace_latency_us histogram\n");
+    for (int st = 0; st < TRACE_STAGE_COUNT; st++) {
+        unsigned cumulative = 0;
+        for (int k = 0; k < TRACE_BUCKETS; k++) {
+            cumulative += (unsigned)atomic_load_explicit(&trace_hists[st].hist[k], memory_order_relaxed);
+            METRICS_EMIT("prusa_trace_latency_us_bucket{stage=\"%s\",le=\"%llu\"} %u\n",
+                         trace_stage_names[st], (unsigned long long)(2ULL << k) - 1, cumulative);
+        }
+        METRICS_EMIT("prusa_trace_latency_us_bucket{stage=\"%s\",le=\"+Inf\"} %u\n"
+                     "prusa_trace_latency_us_count{stage=\"%s\"} %u\n",
+                     trace_stage_names[st], cumulative, trace_stage_names[st], cumulative);
+    }
+    METRICS_EMIT("# TYPE prusa_trace_latency_p50_us gauge\n");
+    for (int st = 0; st < TRACE_STAGE_COUNT; st++) {
+        METRICS_EMIT("prusa_trace_latency_p50_us{stage=\"%s\"} %u\n",
+                     trace_stage_names[st], (unsigned)trace_percentile((trace_stage_t)st, 50));
+    }
+    METRICS_EMIT("# TYPE prusa_trace_latency_p99_us gauge\n");
+    for (int st = 0; st < TRACE_STAGE_COUNT; st++) {
+        METRICS_EMIT("prusa_trace_latency_p99_us{stage=\"%s\"} %u\n",
+                     trace_stage_names[st], (unsigned)trace_percentile((trace_stage_t)st, 99));
+    }
 
-            if (!ws_clients[i].active) {
-                xSemaphoreGive(ws_clients_mutex);
-                continue;
-            }
+    static task_stats_t tasks;                 // httpd task only; too big for its stack
+    task_stats_snapshot(&tasks);
+    METRICS_EMIT("# TYPE prusa_core_load_percent gauge\n");
+    for (int c = 0; c < portNUM_PROCESSORS; c++) {
+        METRICS_EMIT("prusa_core_load_percent{core=\"%d\"} %u.%u\n",
+                     c, tasks.core_load_x10[c] / 10, tasks.core_load_x10[c] % 10);
+    }
+    METRICS_EMIT("# TYPE prusa_task_cpu_percent gauge\n");
+    for (int t = 0; t < tasks.count; t++) {
+        METRICS_EMIT("prusa_task_cpu_percent{task=\"%s\",core=\"%d\"} %u.%u\n", tasks.tasks[t].name,
+                     tasks.tasks[t].core, tasks.tasks[t].cpu_x10 / 10, tasks.tasks[t].cpu_x10 % 10);
+    }
+    METRICS_EMIT("# TYPE prusa_task_stack_free_bytes gauge\n");
+    for (int t = 0; t < tasks.count; t++) {
+        METRICS_EMIT("prusa_task_stack_free_bytes{task=\"%s\"} %u\n",
+                     tasks.tasks[t].name, (unsigned)tasks.tasks[t].stack_free);
+    }
 
-            bool got_msg = (xQueueReceive(ws_clients[i].message_queue, &msg, 0) == pdTRUE);
-            int fd = ws_clients[i].fd;
+    // G-code window counters are owned by the sender task; reads are unlocked
+    METRICS_EMIT("# TYPE prusa_gcode_sent_total counter\nprusa_gcode_sent_total %u\n"
+                 "# TYPE prusa_gcode_resends_total counter\nprusa_gcode_resends_total %u\n"
+                 "# TYPE prusa_gcode_ok_timeouts_total counter\nprusa_gcode_ok_timeouts_total %u\n"
+                 "# TYPE prusa_gcode_queue_depth gauge\nprusa_gcode_queue_depth %u\n",
+                 (unsigned)gcode_window.sent, (unsigned)gcode_window.resends, (unsigned)gcode_window.timeouts,
+                 gcode_queue ? (unsigned)uxQueueMessagesWaiting(gcode_queue) : 0u);
+
+    int rssi = 0;
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        rssi = ap_info.rssi;
+    }
+    METRICS_EMIT("# TYPE prusa_heap_free_bytes gauge\nprusa_heap_free_bytes %u\n"
+                 "# TYPE prusa_heap_min_free_bytes gauge\nprusa_heap_min_free_bytes %u\n"
+                 "# TYPE prusa_wifi_rssi_dbm gauge\nprusa_wifi_rssi_dbm %d\n"
+                 "# TYPE prusa_uptime_seconds gauge\nprusa_uptime_seconds %lld\n",
+                 (unsigned)esp_get_free_heap_size(), (unsigned)esp_get_minimum_free_heap_size(),
+                 rssi, (long long)(esp_timer_get_time() / 1000000));
+    METRICS_EMIT("# TYPE prusa_wifi_connects_total counter\n"
+                 "prusa_wifi_connects_total{path=\"fast\"} %u\n"
+                 "prusa_wifi_connects_total{path=\"scan\"} %u\n"
+                 "# TYPE prusa_wifi_last_connect_ms gauge\nprusa_wifi_last_connect_ms %u\n"
+                 "# TYPE prusa_wifi_last_outage_ms gauge\nprusa_wifi_last_outage_ms %u\n",
+                 atomic_load(&wifi_conn.connects_fast), atomic_load(&wifi_conn.connects_scan),
+                 atomic_load(&wifi_conn.last_connect_ms), atomic_load(&wifi_conn.last_outage_ms));
+    METRICS_EMIT("# TYPE prusa_wifi_power_save gauge\nprusa_wifi_power_save %d\n"
+                 "# TYPE prusa_wifi_power_save_switches_total counter\nprusa_wifi_power_save_switches_total %u\n"
+                 "# TYPE prusa_ws_ping_rtt_us gauge\nprusa_ws_ping_rtt_us %u\n",
+                 atomic_load(&wifi_ps_mode) != WIFI_PS_NONE,
+                 METRICS_LOAD(wifi_ps_switches), METRICS_LOAD(ws_ping_rtt_us));
+    METRICS_EMIT("# TYPE prusa_heap_largest_free_block_bytes gauge\nprusa_heap_largest_free_block_bytes %u\n",
+                 (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+    METRICS_EMIT("# TYPE prusa_static_ram_bytes gauge\n");
+    for (size_t i = 0; i < MEMORY_BUDGET_COUNT; i++) {
+        METRICS_EMIT("prusa_static_ram_bytes{subsystem=\"%s\"} %u\n",
+                     memory_budget[i].name, (unsigned)memory_budget[i].bytes);
+    }
+    METRICS_EMIT("# TYPE prusa_psram_bytes gauge\nprusa_psram_bytes %u\n"
+                 "# TYPE prusa_psram_free_bytes gauge\nprusa_psram_free_bytes %u\n",
+                 (unsigned)mem_tier.psram_bytes, (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    METRICS_EMIT("# TYPE prusa_bulk_buffer_bytes gauge\n"
+                 "prusa_bulk_buffer_bytes{buffer=\"log_backlog\"} %u\n"
+                 "prusa_bulk_buffer_bytes{buffer=\"history\"} %u\n"
+                 "prusa_bulk_buffer_bytes{buffer=\"upload\"} %u\n",
+                 (unsigned)serial_log_backlog.size,
+                 (unsigned)(telemetry_history.capacity * sizeof(history_sample_t)),
+                 (unsigned)gcode_stream.buf_size);
+
+#undef METRICS_LOAD
+#undef METRICS_EMIT
 
-            // Release mutex BEFORE any network send - this is the critical change
-            xSemaphoreGive(ws_clients_mutex);
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
 
-            if (!got_msg) continue;
+#if ENABLE_BENCH_ENDPOINT
+// ============================================================================
+// HOT-PATH BENCHMARK ENDPOINT
+// GET /bench[?iterations=<n>] runs the canned Core One lines through the
+// tokenizer, parse_and_broadcast_line(), each frame builder, json_escape()
+// and the broadcast path, and reports cycles per operation, net heap blocks
+// and stack high-water per stage. Each stage runs in a task of its own, so
+// the high-water mark is the stage's alone. Refused while a printer, capture
+// or replay is feeding the parser: the dispatch stage stands in for the
+// parser task, and its canned readings reach clients until the next report.
+// ============================================================================
 
-            // Step 2: Send without holding the mutex - may block on TCP but won't block USB RX
-            httpd_ws_frame_t ws_pkt;
-            memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-            ws_pkt.payload = (uint8_t *)msg.json_payload;
-            ws_pkt.len = strlen(msg.json_payload);
-            ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+typedef struct {
+    ws_message_t msg;
+    char escaped[WS_MAX_PAYLOAD_SIZE];
+    parsed_line_t parsed[PARSER_BENCHMARK_LINE_COUNT];
+    size_t lens[PARSER_BENCHMARK_LINE_COUNT];
+    bool dispatchable[PARSER_BENCHMARK_LINE_COUNT];
+    print_stats_t stats;
+} bench_ctx_t;
 
-            esp_err_t ret = httpd_ws_send_frame_async(server, fd, &ws_pkt);
+typedef struct {
+    const char *name;
+    uint32_t (*run)(bench_ctx_t *ctx, uint32_t iterations);    // Returns operations done
+} bench_stage_t;
 
-            // Step 3: Take mutex again only to update error state
-            xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
+typedef struct {
+    const bench_stage_t *stage;
+    bench_ctx_t *ctx;
+    uint32_t iterations;
+    TaskHandle_t requester;
+    uint32_t ops;
+    uint32_t cycles;
+    int32_t net_blocks;
+    uint32_t stack_used;
+#ifdef CONFIG_HEAP_USE_HOOKS
+    uint32_t allocs;
+    uint32_t alloc_bytes;
+#endif
+} bench_run_t;
 
-            if (ret != ESP_OK) {
-                consecutive_errors[i]++;
-                error_count++;
-                ESP_LOGW(TAG, "Failed to send to client %d: %s (consec=%d)",
-                         i, esp_err_to_name(ret), consecutive_errors[i]);
+#ifdef CONFIG_HEAP_USE_HOOKS
+// Heap hooks see every allocation in the system; only the stage task's count
+static TaskHandle_t volatile bench_stage_task_handle;
+static bench_run_t *volatile bench_hook_run;
 
-                if (consecutive_errors[i] >= 3) {
-                    ESP_LOGW(TAG, "Evicting dead client %d (fd=%d)", i, ws_clients[i].fd);
-                    ws_clients[i].active = false;
-                    ws_clients[i].fd = -1;
-                    ws_clients[i].ping_pending = false;
-                    xQueueReset(ws_clients[i].message_queue);
-                    consecutive_errors[i] = 0;
-                }
-            } else {
-                consecutive_errors[i] = 0;
-                send_count++;
-            }
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    bench_run_t *run = bench_hook_run;
+    if (run && xTaskGetCurrentTaskHandle() == bench_stage_task_handle) {
+        run->allocs++;
+        run->alloc_bytes += size;
+    }
+}
+#endif
 
-            xSemaphoreGive(ws_clients_mutex);
-        }
+static uint32_t bench_tokenizer(bench_ctx_t *ctx, uint32_t iterations)
+{
+    parsed_line_t parsed;
 
-        // Small delay to prevent busy-waiting
-        vTaskDelay(pdMS_TO_TICKS(10));
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+            parse_serial_line(parser_benchmark_lines[i], ctx->lens[i], &parsed);
+        }
     }
+    return iterations * PARSER_BENCHMARK_LINE_COUNT;
 }
 
-// ============================================================================
-// HTTP/WEBSOCKET HANDLERS
-// ============================================================================
+// Lines that would credit the G-code sender or start a job are left out
+static uint32_t bench_dispatch(bench_ctx_t *ctx, uint32_t iterations)
+{
+    uint32_t ops = 0;
 
-static esp_err_t ws_handler(httpd_req_t *req)
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+            if (!ctx->dispatchable[i]) continue;
+            parse_and_broadcast_line(parser_benchmark_lines[i], ctx->lens[i]);
+            ops++;
+        }
+    }
+    return ops;
+}
+
+static uint32_t bench_build_temperature(bench_ctx_t *ctx, uint32_t iterations)
 {
-    if (req->method == HTTP_GET) {
-        ESP_LOGI(TAG, "WebSocket handshake request");
-        return ESP_OK;
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        telemetry_build_message(&ctx->msg, TELEMETRY_TOPIC_TEMPERATURE, &ctx->parsed[1].temps);
     }
-    
-    httpd_ws_frame_t ws_pkt;
-    uint8_t buf[128];
-    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.payload = buf;
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
-    
-    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, sizeof(buf));
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "httpd_ws_recv_frame failed: %s", esp_err_to_name(ret));
-        return ret;
+    return iterations;
+}
+
+static uint32_t bench_build_position(bench_ctx_t *ctx, uint32_t iterations)
+{
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        telemetry_build_message(&ctx->msg, TELEMETRY_TOPIC_POSITION, &ctx->parsed[3].position);
     }
-    
-    int fd = httpd_req_to_sockfd(req);
-    
-    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
-        buf[ws_pkt.len] = '\0';
-        ESP_LOGI(TAG, "Received WebSocket packet: %s", buf);
-        
-        // Check if it's a connection handshake
-        if (strcmp((char *)buf, "CONNECT") == 0) {
-            int client_id = ws_client_add(fd);
-            if (client_id >= 0) {
-                // Send current printer state to new client
-                ws_message_t msg;
-                
-                // Send status
-                xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
-                build_status_message(&msg, printer_connected);
-                xQueueSend(ws_clients[client_id].message_queue, &msg, 0);
-                
-                // Send current temperatures
-                build_temperature_message(&msg, &current_temps);
-                xQueueSend(ws_clients[client_id].message_queue, &msg, 0);
-                
-                // Send current progress
-                build_progress_message(&msg, &current_progress);
-                xQueueSend(ws_clients[client_id].message_queue, &msg, 0);
-                
-                // Send current position
-                build_position_message(&msg, &current_position);
-                xQueueSend(ws_clients[client_id].message_queue, &msg, 0);
-                
-                // Send current power
-                build_power_message(&msg, &current_power);
-                xQueueSend(ws_clients[client_id].message_queue, &msg, 0);
-                
-                xSemaphoreGive(printer_state_mutex);
-            }
-        }
-        // Check if it's a G-code command
-        else if (strncmp((char *)buf, "GCODE:", 6) == 0) {
-            char *cmd = (char *)buf + 6;  // Skip "GCODE:" prefix
+    return iterations;
+}
 
-            if (g_prusa_dev) {
-                gcode_cmd_t gcode_cmd;
-                strncpy(gcode_cmd.cmd, cmd, GCODE_CMD_MAX_LEN - 1);
-                gcode_cmd.cmd[GCODE_CMD_MAX_LEN - 1] = '\0';
+static uint32_t bench_build_progress(bench_ctx_t *ctx, uint32_t iterations)
+{
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        telemetry_build_message(&ctx->msg, TELEMETRY_TOPIC_PROGRESS, &ctx->parsed[4].progress);
+    }
+    return iterations;
+}
 
-                if (xQueueSend(gcode_queue, &gcode_cmd, pdMS_TO_TICKS(100)) != pdTRUE) {
-                    ESP_LOGW(TAG, "G-code queue full, dropping: %s", cmd);
-                } else {
-                    DEBUG_LOG(TAG, "[GCODE] Queued: %s", cmd);
-                }
-            } else {
-                ESP_LOGW(TAG, "G-code received but printer not connected");
-            }
-        }
-    } else if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE) {
-        ESP_LOGI(TAG, "WebSocket close frame received from fd=%d", fd);
-        ws_client_remove(fd);
-    } else if (ws_pkt.type == HTTPD_WS_TYPE_PING) {
-        // Respond to ping with pong
-        httpd_ws_frame_t pong_pkt;
-        memset(&pong_pkt, 0, sizeof(httpd_ws_frame_t));
-        pong_pkt.type = HTTPD_WS_TYPE_PONG;
-        pong_pkt.len = 0;
-        httpd_ws_send_frame_async(server, fd, &pong_pkt);
-        DEBUG_LOG(TAG, "[WS] Ping received from fd=%d, sent pong", fd);
-    } else if (ws_pkt.type == HTTPD_WS_TYPE_PONG) {
-        // Client responded to our keepalive ping - clear the pending flag
-        xSemaphoreTake(ws_clients_mutex, portMAX_DELAY);
-        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
-            if (ws_clients[i].active && ws_clients[i].fd == fd) {
-                ws_clients[i].ping_pending = false;
-                break;
-            }
-        }
-        xSemaphoreGive(ws_clients_mutex);
-        DEBUG_LOG(TAG, "[WS] Pong received from fd=%d, client alive", fd);
+static uint32_t bench_build_power(bench_ctx_t *ctx, uint32_t iterations)
+{
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        telemetry_build_message(&ctx->msg, TELEMETRY_TOPIC_POWER, &ctx->parsed[1].power);
     }
-    
-    return ESP_OK;
+    return iterations;
 }
 
-static esp_err_t root_get_handler(httpd_req_t *req)
+static uint32_t bench_build_stats(bench_ctx_t *ctx, uint32_t iterations)
 {
-    xSemaphoreTake(html_mutex, portMAX_DELAY);
-    
-    httpd_resp_set_type(req, "text/html; charset=utf-8");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate, max-age=0");
-    httpd_resp_set_hdr(req, "Pragma", "no-cache");
-    
-#if ENABLE_REMOTE_HTML
-    ESP_LOGI(TAG, "Root request received, checking SPIFFS HTML cache");
-    if (mount_remote_html_fs() == ESP_OK) {
-        FILE *fp = fopen(REMOTE_HTML_FLASH_PATH, "rb");
-        if (fp != NULL) {
-            ESP_LOGI(TAG, "Serving remote HTML from flash (%zu bytes cached) in chunks", cached_html_size);
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        build_stats_message(&ctx->msg, &ctx->stats, iter * 1000);
+    }
+    return iterations;
+}
 
-            #define HTML_CHUNK_SIZE 4096
-            char chunk[HTML_CHUNK_SIZE];
-            size_t bytes_read = 0;
-            esp_err_t send_err = ESP_OK;
+static uint32_t bench_json_escape(bench_ctx_t *ctx, uint32_t iterations)
+{
+    static const char line[] = "echo:Unknown command: \"M9999\"\tC:\\gcode\\part.bco";
 
-            while ((bytes_read = fread(chunk, 1, sizeof(chunk), fp)) > 0 && send_err == ESP_OK) {
-                send_err = httpd_resp_send_chunk(req, chunk, bytes_read);
-            }
-            fclose(fp);
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        json_escape(ctx->escaped, sizeof(ctx->escaped), line, sizeof(line) - 1);
+    }
+    return iterations;
+}
 
-            if (send_err == ESP_OK) {
-                ESP_LOGI(TAG, "Completed serving remote HTML from flash");
-                httpd_resp_send_chunk(req, NULL, 0);
-            } else {
-                ESP_LOGE(TAG, "Chunked send failed while serving flash HTML");
-            }
-        } else {
-            ESP_LOGW(TAG, "No cached HTML file at %s, serving embedded fallback", REMOTE_HTML_FLASH_PATH);
-            httpd_resp_send(req, (const char *)webpage_start, webpage_end - webpage_start);
-        }
-    } else {
-        ESP_LOGW(TAG, "Flash storage unavailable, serving embedded fallback");
-        httpd_resp_send(req, (const char *)webpage_start, webpage_end - webpage_start);
+// Debug frames: only clients that asked for them pay for the fan-out
+static uint32_t bench_broadcast(bench_ctx_t *ctx, uint32_t iterations)
+{
+    ctx->msg.type = MSG_TYPE_DEBUG;
+    ctx->msg.bin_len = 0;
+    strcpy(ctx->msg.json_payload, "{\"type\":\"debug\",\"bench\":\"broadcast\"}");
+    for (uint32_t iter = 0; iter < iterations; iter++) {
+        ws_broadcast_message(&ctx->msg);
     }
-#else
-    ESP_LOGI(TAG, "Serving embedded HTML");
-    httpd_resp_send(req, (const char *)webpage_start, webpage_end - webpage_start);
-#endif
-    
-    xSemaphoreGive(html_mutex);
-    return ESP_OK;
+    return iterations;
 }
 
-static esp_err_t refresh_get_handler(httpd_req_t *req)
+static const bench_stage_t bench_stages[] = {
+    { "tokenizer",         bench_tokenizer },
+    { "dispatch",          bench_dispatch },
+    { "build_temperature", bench_build_temperature },
+    { "build_position",    bench_build_position },
+    { "build_progress",    bench_build_progress },
+    { "build_power",       bench_build_power },
+    { "build_stats",       bench_build_stats },
+    { "json_escape",       bench_json_escape },
+    { "broadcast",         bench_broadcast },
+};
+#define BENCH_STAGE_COUNT (sizeof(bench_stages) / sizeof(bench_stages[0]))
+
+static void bench_stage_task(void *arg)
 {
-#if ENABLE_REMOTE_HTML
-    ESP_LOGI(TAG, "Refresh endpoint requested");
-    // Add timestamp to URL to bust GitHub's CDN cache
-    char url_with_timestamp[512];
-    int64_t timestamp = esp_timer_get_time();
-    snprintf(url_with_timestamp, sizeof(url_with_timestamp), 
-             "%s?t=%lld", REMOTE_HTML_URL, (long long)timestamp);
-    
-    ESP_LOGI(TAG, "Downloading HTML with cache-busting: %s", url_with_timestamp);
-    bool refresh_ok = download_remote_html_to_flash(url_with_timestamp);
-    ESP_LOGI(TAG, "Refresh download result: %s (cached_html_size=%u)",
-             refresh_ok ? "success" : "failure", (unsigned)cached_html_size);
-    
-    char response[1024];
-    snprintf(response, sizeof(response),
-        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
-        "<meta http-equiv='refresh' content='1;url=/'/>"
-        "<style>body{font-family:monospace;background:#0f0f0f;color:#4CAF50;"
-        "padding:40px;text-align:center;}</style></head><body>"
-        "<h2>HTML Refresh Complete</h2>"
-        "<p>New size: %zu bytes</p>"
-        "<p>Redirecting...</p>"
-        "</body></html>",
-        cached_html_size);
-    
-    httpd_resp_set_type(req, "text/html; charset=utf-8");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate");
-    httpd_resp_sendstr(req, response);
-#else
-    const char *disabled_msg = 
-        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
-        "<style>body{font-family:monospace;background:#0f0f0f;color:#e0e0e0;"
-        "padding:40px;max-width:600px;margin:0 auto;}</style></head><body>"
-        "<h2 style='color:#f44336;'>Remote HTML Disabled</h2>"
-        "<p>Remote HTML fetching is currently disabled in firmware.</p>"
-        "<p>Set ENABLE_REMOTE_HTML to 1 and recompile to enable.</p>"
-        "<p><a href='/' style='color:#4CAF50;'>Back to Monitor</a></p>"
-        "</body></html>";
-    
-    httpd_resp_set_type(req, "text/html; charset=utf-8");
-    httpd_resp_sendstr(req, disabled_msg);
+    bench_run_t *run = arg;
+    multi_heap_info_t before, after;
+
+    heap_caps_get_info(&before, MALLOC_CAP_DEFAULT);
+#ifdef CONFIG_HEAP_USE_HOOKS
+    bench_stage_task_handle = xTaskGetCurrentTaskHandle();
+    bench_hook_run = run;
 #endif
-    return ESP_OK;
+    uint32_t start = esp_cpu_get_cycle_count();
+    run->ops = run->stage->run(run->ctx, run->iterations);
+    run->cycles = esp_cpu_get_cycle_count() - start;
+#ifdef CONFIG_HEAP_USE_HOOKS
+    bench_hook_run = NULL;
+#endif
+    heap_caps_get_info(&after, MALLOC_CAP_DEFAULT);
+
+    run->net_blocks = (int32_t)(after.allocated_blocks - before.allocated_blocks);
+    run->stack_used = BENCH_STAGE_STACK - uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t);
+    xTaskNotifyGive(run->requester);
+    vTaskDelete(NULL);
 }
 
-static esp_err_t version_get_handler(httpd_req_t *req)
+static void bench_prepare(bench_ctx_t *ctx)
 {
-    httpd_resp_set_type(req, "text/plain; charset=utf-8");
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_sendstr(req, FIRMWARE_VERSION);
-    return ESP_OK;
+    memset(ctx, 0, sizeof(*ctx));
+    for (size_t i = 0; i < PARSER_BENCHMARK_LINE_COUNT; i++) {
+        ctx->lens[i] = strlen(parser_benchmark_lines[i]);
+        parse_serial_line(parser_benchmark_lines[i], ctx->lens[i], &ctx->parsed[i]);
+        ctx->dispatchable[i] =
+            !(ctx->parsed[i].present & (LINE_FIELD_OK | LINE_FIELD_RESEND | LINE_FIELDS_PROGRESS));
+    }
+
+    // A job twelve layers in, so every stats field has something to format
+    print_stats_init(&ctx->stats);
+    print_stats_update(&ctx->stats, LINE_FIELDS_PROGRESS, &ctx->parsed[3].position,
+                       &ctx->parsed[1].power, &ctx->parsed[4].progress, 0);
+    ctx->stats.layers = 12;
+    ctx->stats.layer_z = 2.4f;
+    ctx->stats.extruded_mm = 1234.5f;
 }
 
-static esp_err_t reboot_get_handler(httpd_req_t *req)
+// GET /bench[?iterations=<n>] - see the section comment. The stages run on
+// the httpd task's core at the parser's priority, so the server is busy for
+// the whole run.
+static esp_err_t bench_get_handler(httpd_req_t *req)
 {
-    const char *reboot_msg =
-        "<!DOCTYPE html><html><head><meta charset='UTF-8'>"
-        "<meta http-equiv='refresh' content='15;url=/'/>"
-        "<style>body{font-family:monospace;background:#0f0f0f;color:#4CAF50;"
-        "padding:40px;text-align:center;}</style></head><body>"
-        "<h2>Rebooting...</h2>"
-        "<p>The device is restarting. Redirecting in 15 seconds...</p>"
-        "</body></html>";
+    char query[32];
+    uint32_t iterations = BENCH_ITERATIONS;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        api_query_uint(query, "iterations", &iterations) < 0) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad iterations");
+    }
+    if (iterations == 0 || iterations > BENCH_MAX_ITERATIONS) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "iterations out of range");
+    }
+    if (g_prusa_dev != NULL || atomic_load(&serial_capture_mode) != SERIAL_CAPTURE_IDLE ||
+        serial_capture_task_handle) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "Printer, capture or replay feeding the parser");
+    }
+
+    bench_ctx_t *ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+    bench_prepare(ctx);
+
+    // The dispatch stage overwrites the printer state; put it back afterwards
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    temp_state_t temps = current_temps;
+    position_state_t position = current_position;
+    power_state_t power = current_power;
+    xSemaphoreGive(printer_state_mutex);
 
-    httpd_resp_set_type(req, "text/html; charset=utf-8");
-    httpd_resp_sendstr(req, reboot_msg);
+    bench_run_t runs[BENCH_STAGE_COUNT];
+    bool ok = true;
+    for (size_t i = 0; i < BENCH_STAGE_COUNT && ok; i++) {
+        runs[i] = (bench_run_t){
+            .stage = &bench_stages[i],
+            .ctx = ctx,
+            .iterations = iterations,
+            .requester = xTaskGetCurrentTaskHandle(),
+        };
+        TaskHandle_t handle;
+        ok = xTaskCreatePinnedToCore(bench_stage_task, "bench", BENCH_STAGE_STACK, &runs[i],
+                                     SERIAL_PARSER_TASK_PRIORITY, &handle, xPortGetCoreID()) == pdPASS;
+        if (ok) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
 
-    ESP_LOGI(TAG, "Reboot requested via /reboot endpoint");
-    vTaskDelay(pdMS_TO_TICKS(500));
-    esp_restart();
+    xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+    current_temps = temps;
+    current_position = position;
+    current_power = power;
+    printer_state_publish();
+    xSemaphoreGive(printer_state_mutex);
+    free(ctx);
 
-    return ESP_OK;
+    if (!ok) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Stage task failed");
+    }
+
+    char chunk[256];
+    int n = snprintf(chunk, sizeof(chunk), "{\"cpu_mhz\":%d,\"iterations\":%u,\"stages\":[",
+                     CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, (unsigned)iterations);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    esp_err_t err = httpd_resp_send_chunk(req, chunk, n);
+    for (size_t i = 0; i < BENCH_STAGE_COUNT && err == ESP_OK; i++) {
+        const bench_run_t *run = &runs[i];
+        n = snprintf(chunk, sizeof(chunk),
+                     "%s{\"name\":\"%s\",\"ops\":%u,\"cycles_per_op\":%u,\"net_blocks\":%d,"
+#ifdef CONFIG_HEAP_USE_HOOKS
+                     "\"allocs\":%u,\"alloc_bytes\":%u,"
+#endif
+                     "\"stack_bytes\":%u}",
+                     i ? "," : "", run->stage->name, (unsigned)run->ops,
+                     (unsigned)(run->ops ? run->cycles / run->ops : 0), (int)run->net_blocks,
+#ifdef CONFIG_HEAP_USE_HOOKS
+                     (unsigned)run->allocs, (unsigned)run->alloc_bytes,
+#endif
+                     (unsigned)run->stack_used);
+        err = httpd_resp_send_chunk(req, chunk, n);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, "]}", 2);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
 }
+#endif // ENABLE_BENCH_ENDPOINT
 
 static void start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = 80;
     config.stack_size = 8192;
-    config.max_open_sockets = WS_MAX_CLIENTS + 2;  // WS clients + HTTP requests
-    config.core_id = 1;  // Pin HTTP server to Core 1, keep Core 0 free for USB/printer
+    socket_budget_init();
+    config.max_open_sockets = socket_budget.limit;
+    config.core_id = pipe_placement[PIPE_HTTP].core;  // Core 1 by default, keeps core 0 for USB/printer
+    config.task_priority = pipe_placement[PIPE_HTTP].priority;
+    config.max_uri_handlers = 24;
+    config.uri_match_fn = httpd_uri_match_wildcard;  // For /assets/*
+    config.open_fn = socket_session_open;
+    config.close_fn = ws_session_close;
+    sse_epoch = esp_random();
     
     if (httpd_start(&server, &config) == ESP_OK) {
         ESP_LOGI(TAG, "Starting HTTP/WebSocket server");
@@ -1401,6 +9811,15 @@ static void start_webserver(void)
         };
         httpd_register_uri_handler(server, &refresh_uri);
         
+        // Static assets handler
+        httpd_uri_t assets_uri = {
+            .uri = "/assets/*",
+            .method = HTTP_GET,
+            .handler = assets_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &assets_uri);
+
         // Version handler
         httpd_uri_t version_uri = {
             .uri = "/version",
@@ -1419,6 +9838,158 @@ static void start_webserver(void)
         };
         httpd_register_uri_handler(server, &reboot_uri);
 
+        // Streaming G-code upload handler
+        httpd_uri_t print_uri = {
+            .uri = "/print",
+            .method = HTTP_POST,
+            .handler = print_post_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &print_uri);
+
+        // G-code latency profile
+        httpd_uri_t gcode_latency_uri = {
+            .uri = "/api/gcode/latency",
+            .method = HTTP_GET,
+            .handler = gcode_latency_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &gcode_latency_uri);
+
+        // REST snapshot and history for polling integrations
+        httpd_uri_t api_state_uri = {
+            .uri = "/api/state",
+            .method = HTTP_GET,
+            .handler = api_state_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_state_uri);
+
+        httpd_uri_t api_history_uri = {
+            .uri = "/api/history",
+            .method = HTTP_GET,
+            .handler = api_history_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_history_uri);
+
+        httpd_uri_t api_recorder_uri = {
+            .uri = "/api/recorder",
+            .method = HTTP_GET,
+            .handler = api_recorder_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_recorder_uri);
+
+        httpd_uri_t api_placement_uri = {
+            .uri = "/api/placement",
+            .method = HTTP_GET,
+            .handler = api_placement_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_placement_uri);
+
+        httpd_uri_t api_placement_post_uri = {
+            .uri = "/api/placement",
+            .method = HTTP_POST,
+            .handler = api_placement_post_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_placement_post_uri);
+
+        httpd_uri_t api_macros_uri = {
+            .uri = "/api/macros",
+            .method = HTTP_GET,
+            .handler = api_macros_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_macros_uri);
+
+        httpd_uri_t api_macros_post_uri = {
+            .uri = "/api/macros",
+            .method = HTTP_POST,
+            .handler = api_macros_post_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_macros_post_uri);
+
+        httpd_uri_t api_macros_delete_uri = {
+            .uri = "/api/macros",
+            .method = HTTP_DELETE,
+            .handler = api_macros_delete_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_macros_delete_uri);
+
+        httpd_uri_t api_spool_uri = {
+            .uri = "/api/spool",
+            .method = HTTP_GET,
+            .handler = api_spool_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_spool_uri);
+
+        httpd_uri_t api_spool_post_uri = {
+            .uri = "/api/spool",
+            .method = HTTP_POST,
+            .handler = api_spool_post_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_spool_post_uri);
+
+        httpd_uri_t api_spool_delete_uri = {
+            .uri = "/api/spool",
+            .method = HTTP_DELETE,
+            .handler = api_spool_delete_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &api_spool_delete_uri);
+
+#if ENABLE_BENCH_ENDPOINT
+        httpd_uri_t bench_uri = {
+            .uri = "/bench",
+            .method = HTTP_GET,
+            .handler = bench_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &bench_uri);
+#endif
+
+        // Read-only event stream, an alternative to /ws
+        httpd_uri_t events_uri = {
+            .uri = "/events",
+            .method = HTTP_GET,
+            .handler = events_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &events_uri);
+
+        // Prometheus scrape target
+        httpd_uri_t metrics_uri = {
+            .uri = "/metrics",
+            .method = HTTP_GET,
+            .handler = metrics_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &metrics_uri);
+
+        // Serial capture download / upload for REPLAY:
+        httpd_uri_t capture_get_uri = {
+            .uri = "/capture",
+            .method = HTTP_GET,
+            .handler = capture_get_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &capture_get_uri);
+
+        httpd_uri_t capture_post_uri = {
+            .uri = "/capture",
+            .method = HTTP_POST,
+            .handler = capture_post_handler,
+            .user_ctx = NULL
+        };
+        httpd_register_uri_handler(server, &capture_post_uri);
+
         // WebSocket handler
         httpd_uri_t ws_uri = {
             .uri = "/ws",
@@ -1426,7 +9997,8 @@ static void start_webserver(void)
             .handler = ws_handler,
             .user_ctx = NULL,
             .is_websocket = true,
-            .handle_ws_control_frames = true
+            .handle_ws_control_frames = true,
+            .supported_subprotocol = WS_BINARY_SUBPROTOCOL
         };
         httpd_register_uri_handler(server, &ws_uri);
         
@@ -1440,157 +10012,103 @@ static void start_webserver(void)
 // MAIN
 // ============================================================================
 
-void app_main(void)
-{
-    // Setup UART for debug logging on GPIO 8 BEFORE any other initialization
-    uart_config_t uart_config = {
-        .baud_rate = DEBUG_UART_BAUD,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
-    
-    uart_driver_install(DEBUG_UART_NUM, 2048, 0, 0, NULL, 0);
-    uart_param_config(DEBUG_UART_NUM, &uart_config);
-    uart_set_pin(DEBUG_UART_NUM, DEBUG_UART_TX_PIN, UART_PIN_NO_CHANGE, 
-                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    
-    // Redirect ESP_LOG to UART
-    esp_log_set_vprintf(uart_log_vprintf);
-    
-    ESP_LOGI(TAG, "=== Prusa Core One Monitor %s ===", FIRMWARE_VERSION);
-    ESP_LOGI(TAG, "UART debug logging active on GPIO %d @ %d baud", 
-             DEBUG_UART_TX_PIN, DEBUG_UART_BAUD);
-    ESP_LOGI(TAG, "Server-side parsing with real-time push updates");
-    
-    // Create synchronization primitives
-    device_disconnected_sem = xSemaphoreCreateBinary();
-    html_mutex = xSemaphoreCreateMutex();
-    printer_state_mutex = xSemaphoreCreateMutex();
-    assert(device_disconnected_sem && html_mutex && printer_state_mutex);
-    
-    // Initialize USB Host
-    ESP_LOGI(TAG, "Initializing USB Host");
-    const usb_host_config_t host_config = {
-        .skip_phy_setup = false,
-        .intr_flags = ESP_INTR_FLAG_LEVEL1
-    };
-    ESP_ERROR_CHECK(usb_host_install(&host_config));
-    xTaskCreatePinnedToCore(usb_lib_task, "usb_lib", 4096, NULL, USB_HOST_TASK_PRIORITY, NULL, 0);
-    
-    // Install CDC-ACM driver
-    ESP_LOGI(TAG, "Installing CDC-ACM driver");
-    ESP_ERROR_CHECK(cdc_acm_host_install(NULL));
-    
-    const cdc_acm_host_device_config_t dev_config = {
-        .connection_timeout_ms = 1000,
-        .out_buffer_size = 512,
-        .in_buffer_size = 8192,
-        .user_arg = NULL,
-        .event_cb = handle_event,
-        .data_cb = handle_rx
-    };
-    
-    // Initialize NVS and WiFi
-    ESP_ERROR_CHECK(nvs_flash_init());
-    wifi_init_sta();
-    
 #if ENABLE_REMOTE_HTML
-    // Wait until we actually have an IP address before attempting the HTTPS
-    // download. A fixed delay is unreliable — the router may not be ready yet
-    // on a cold boot, causing the TLS attempt to stall for the full timeout
-    // and making the device appear unresponsive.
-    ESP_LOGI(TAG, "Waiting for WiFi IP address (max %ds)...", WIFI_CONNECT_TIMEOUT_MS / 1000);
-    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-                                           WIFI_CONNECTED_BIT,
-                                           pdFALSE,   // don't clear on exit
-                                           pdFALSE,   // any bit (only one)
-                                           pdMS_TO_TICKS(WIFI_CONNECT_TIMEOUT_MS));
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "WiFi connected — starting HTML download");
-    } else {
-        ESP_LOGW(TAG, "WiFi not connected after %ds — skipping HTML download, will use embedded fallback",
-                 WIFI_CONNECT_TIMEOUT_MS / 1000);
+// Page storage and the GitHub download, off the boot path. Until it finishes
+// the server hands out the embedded page.
+static void boot_html_task(void *arg)
+{
+    // Serialised with /refresh, which may already be waiting to download
+    xSemaphoreTake(html_mutex, portMAX_DELAY);
+    html_slots_init();
+    xSemaphoreGive(html_mutex);
+
+    ESP_LOGI(TAG, "Waiting for WiFi IP address before the HTML download...");
+    while (!(xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE,
+                                 pdMS_TO_TICKS(WIFI_CONNECT_TIMEOUT_MS)) & WIFI_CONNECTED_BIT)) {
+        ESP_LOGW(TAG, "Still no WiFi after %ds, serving the %s page meanwhile",
+                 WIFI_CONNECT_TIMEOUT_MS / 1000, atomic_load(&html_current) >= 0 ? "cached" : "embedded");
     }
 
-    // Mount flash storage for the remote HTML before the download starts.
-    ESP_LOGI(TAG, "Free heap before download: %d bytes, free PSRAM: %d bytes",
-             (int)esp_get_free_heap_size(),
-             (int)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
-    ESP_LOGI(TAG, "Remote HTML flash path: %s", REMOTE_HTML_FLASH_PATH);
-    if (mount_remote_html_fs() == ESP_OK) {
-        ESP_LOGI(TAG, "SPIFFS mount pre-check passed, starting remote HTML download");
+    ESP_LOGI(TAG, "Free heap before download: %d bytes", (int)esp_get_free_heap_size());
+    if (webui_partition != NULL || mount_remote_html_fs() == ESP_OK) {
+        ESP_LOGI(TAG, "Page storage ready, starting remote HTML download");
         download_html_from_github();
     }
-#else
-    ESP_LOGI(TAG, "Remote HTML fetching disabled - using embedded HTML only");
+    boot_metric_mark(&boot_metrics.page_us, "Remote page check done");
+    vTaskDelete(NULL);
+}
 #endif
 
-    // Initialize WebSocket client manager (after HTML download to preserve heap)
-    ws_clients_init();
-    
-    // Initialize mDNS
-    ESP_ERROR_CHECK(mdns_init());
-    mdns_hostname_set("coreone");
-    
-    char mdns_name[64];
-    snprintf(mdns_name, sizeof(mdns_name), "Prusa Core One Monitor %s", FIRMWARE_VERSION);
-    mdns_instance_name_set(mdns_name);
-    ESP_LOGI(TAG, "mDNS started: http://coreone.local/");
-    
-    // Start web server
-    start_webserver();
-    
-    // Start WebSocket message sender task - Core 1 (networking, isolated from USB)
-    xTaskCreatePinnedToCore(ws_sender_task, "ws_sender", 4096, NULL, 5, NULL, 1);
+// Opens the printer whenever it appears and waits for it to go away again
+static void printer_connect_task(void *arg)
+{
+    cdc_acm_host_device_config_t dev_config = {
+        .connection_timeout_ms = 1,            // One look at what has enumerated; 0 would wait forever
+        .out_buffer_size = USB_OUT_TRANSFER_SIZE,
+        .out_transfers = USB_OUT_TRANSFERS,
+        .in_buffer_size = USB_IN_TRANSFER_SIZE,
+        .in_transfers = USB_IN_TRANSFERS,
+        .user_arg = NULL,
+        .event_cb = handle_event,
+        .data_cb = handle_rx
+    };
 
-    // Start G-code command queue sender task - Core 1
-    xTaskCreatePinnedToCore(gcode_sender_task, "gcode_sender", 4096, NULL, 6, NULL, 1);
-    
-    // Start LED task - Core 1 (non-critical)
-    xTaskCreatePinnedToCore(led_task, "led_task", 2048, NULL, 3, &led_task_handle, 1);
-    
-    // Start system monitoring task - Core 1 (networking, isolated from USB)
-    xTaskCreatePinnedToCore(system_monitor_task, "sys_monitor", 4096, NULL, 2, NULL, 1);
-    
-    ESP_LOGI(TAG, "=== System Ready ===");
-    ESP_LOGI(TAG, "Access web interface at:");
-    ESP_LOGI(TAG, "  - http://coreone.local/");
-    ESP_LOGI(TAG, "  - WebSocket: ws://coreone.local/ws");
-    ESP_LOGI(TAG, "  - Manual HTML refresh: http://coreone.local/refresh");
-    ESP_LOGI(TAG, "  - Reboot: http://coreone.local/reboot");
-    ESP_LOGI(TAG, "Debug logging: GPIO %d (connect to monitoring device RX)", DEBUG_UART_TX_PIN);
-    
-    // Main USB connection loop
+    // Main USB connection loop. Each attach event names the device to open,
+    // so a second printer or a re-plug cannot be mistaken for the one that
+    // enumerated. Without events, the poll opens the first VID/PID match;
+    // the first one runs straight away for a printer attached at boot.
+    TickType_t attach_wait = 0;
     while (true) {
+        printer_attach_t attach = { 0 };
+        char serial[PRINTER_SERIAL_MAX_LEN + 1];
+
+        if (xQueueReceive(printer_attach_queue, &attach, attach_wait) != pdTRUE) {
+            ESP_LOGD(TAG, "No attach event, polling for the printer");
+        }
+        attach_wait = pdMS_TO_TICKS(PRINTER_ATTACH_POLL_MS);
+        dev_config.dev_addr = attach.dev_addr;
         esp_err_t err = cdc_acm_host_open(PRUSA_USB_VID, PRUSA_USB_PID, 0, 
                                           &dev_config, &g_prusa_dev);
         if (err != ESP_OK) {
             if (err == ESP_ERR_NOT_FOUND) {
-                ESP_LOGD(TAG, "Printer not found, retrying...");
+                // Already gone again, or nothing there to poll
+                ESP_LOGD(TAG, "Printer not attached (USB address %u)", (unsigned)attach.dev_addr);
             } else {
                 ESP_LOGW(TAG, "Failed to open printer: %s", esp_err_to_name(err));
+                vTaskDelay(pdMS_TO_TICKS(PRINTER_OPEN_RETRY_MS));
+                attach_wait = 0;               // Its attach event is used up: retry by polling
             }
-            vTaskDelay(pdMS_TO_TICKS(2000));
             continue;
         }
-        
-        ESP_LOGI(TAG, "Printer connected!");
+
+        // Enumeration-to-open latency, unless the printer was found by the poll
+        if (attach.us) {
+            uint32_t latency_us = (uint32_t)(esp_timer_get_time() - attach.us);
+            atomic_store_explicit(&metrics.printer_attach_us, latency_us, memory_order_relaxed);
+            METRIC_INC(printer_attaches);
+            ESP_LOGI(TAG, "Printer opened %u us after enumeration", (unsigned)latency_us);
+        }
+
+        // From the device that was opened, not from whatever enumerated last
+        printer_read_serial(g_prusa_dev, serial);
+        ESP_LOGI(TAG, "Printer connected! (serial %s)", serial[0] ? serial : "unknown");
+        boot_metric_mark(&boot_metrics.printer_us, "Printer connected");
         cdc_acm_host_desc_print(g_prusa_dev);
         vTaskDelay(pdMS_TO_TICKS(200));
 
         // Drain any 'ok' the printer sent during its startup sequence before
-        // we register as connected — prevents the gcode queue skipping waits.
-        if (gcode_ok_sem) {
-            while (xSemaphoreTake(gcode_ok_sem, 0) == pdTRUE) {}
+        // we register as connected — they must not count as credits.
+        if (gcode_event_queue) {
+            xQueueReset(gcode_event_queue);
             ESP_LOGI(TAG, "Cleared stale ok signals after printer connect");
         }
         
         // Update connection state
         xSemaphoreTake(printer_state_mutex, portMAX_DELAY);
+        memcpy(printer_serial, serial, sizeof(printer_serial));
         printer_connected = true;
+        printer_state_generation++;
+        printer_state_publish();
         xSemaphoreGive(printer_state_mutex);
         
         // Broadcast connection status
@@ -1615,17 +10133,166 @@ void app_main(void)
                 (const uint8_t *)INITIAL_BEEP_COMMAND,
                 strlen(INITIAL_BEEP_COMMAND), USB_TX_TIMEOUT_MS));
             
-            // Enable temperature reporting and progress updates
-            const char *init_cmds = "M155 S2\nM73\n";
-            ESP_LOGI(TAG, "Enabling temperature reporting");
+            // Progress report; autoreport is configured below on every connect
+            const char *init_cmds = "M73\n";
+            ESP_LOGI(TAG, "Requesting progress report");
             ESP_ERROR_CHECK(cdc_acm_host_data_tx_blocking(g_prusa_dev,
                 (const uint8_t *)init_cmds, strlen(init_cmds), USB_TX_TIMEOUT_MS));
             
             initial_chirp_sent = true;
         }
+
+        // Populate the bed mesh cache once per printer connection
+        mesh_request_refresh(true);
+
+        // A power-cycled printer has forgotten its autoreport settings
+        atomic_store(&autoreport_position, true);
+        autoreport_update(true);
         
         // Wait for disconnect
         xSemaphoreTake(device_disconnected_sem, portMAX_DELAY);
         ESP_LOGI(TAG, "Printer disconnected, waiting for reconnection...");
     }
-}
\ No newline at end of file
+}
+
+void app_main(void)
+{
+    // Setup UART for debug logging on GPIO 8 BEFORE any other initialization
+    uart_config_t uart_config = {
+        .baud_rate = DEBUG_UART_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    
+    log_ring_init();
+    uart_driver_install(DEBUG_UART_NUM, 2048, 0, 0, NULL, 0);
+    uart_param_config(DEBUG_UART_NUM, &uart_config);
+    uart_set_pin(DEBUG_UART_NUM, DEBUG_UART_TX_PIN, UART_PIN_NO_CHANGE, 
+                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    
+    // Redirect ESP_LOG to UART through the deferred ring. Lowest priority
+    // above idle: it only ever gets leftover CPU.
+    xTaskCreateStaticPinnedToCore(log_drain_task, "log_drain", LOG_DRAIN_TASK_STACK, NULL, 1,
+                                  task_stacks.log_drain, &task_tcbs.log_drain, 1);
+    esp_log_set_vprintf(log_vprintf);
+    
+    ESP_LOGI(TAG, "=== Prusa Core One Monitor %s ===", FIRMWARE_VERSION);
+    ESP_LOGI(TAG, "UART debug logging active on GPIO %d @ %d baud", 
+             DEBUG_UART_TX_PIN, DEBUG_UART_BAUD);
+    ESP_LOGI(TAG, "Server-side parsing with real-time push updates");
+
+#if ENABLE_PARSER_BENCHMARK
+    run_parser_benchmark();
+#endif
+    
+    // Create synchronization primitives - static, so these cannot fail
+    device_disconnected_sem = xSemaphoreCreateBinaryStatic(&rtos_objects.device_disconnected);
+    printer_attach_queue = xQueueCreateStatic(PRINTER_ATTACH_QUEUE_SIZE, sizeof(printer_attach_t),
+                                              rtos_objects.printer_attach_storage, &rtos_objects.printer_attach);
+    html_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.html);
+    printer_state_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.printer_state);
+    log_backlog_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.log_backlog);
+    task_stats_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.task_stats);
+    autoreport_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.autoreport);
+    wifi_ps_mutex = xSemaphoreCreateMutexStatic(&rtos_objects.wifi_ps);
+    mem_tier_init();
+    memory_budget_log();
+
+    // NVS first: it holds the placement every pipeline task below is pinned by
+    ESP_ERROR_CHECK(nvs_flash_init());
+    placement_load();
+    
+    // Initialize USB Host
+    ESP_LOGI(TAG, "Initializing USB Host");
+    const usb_host_config_t host_config = {
+        .skip_phy_setup = false,
+        .intr_flags = ESP_INTR_FLAG_LEVEL1
+    };
+    ESP_ERROR_CHECK(usb_host_install(&host_config));
+    xTaskCreateStaticPinnedToCore(usb_lib_task, "usb_lib", USB_LIB_TASK_STACK, NULL,
+                                  pipe_placement[PIPE_USB].priority, task_stacks.usb_lib, &task_tcbs.usb_lib,
+                                  pipe_placement[PIPE_USB].core);
+    
+    // Start serial parser task - fed by the RX ring; next to USB in the default profile
+    serial_parser_task_handle = xTaskCreateStaticPinnedToCore(serial_parser_task, "serial_parser",
+        SERIAL_PARSER_TASK_STACK, NULL, pipe_placement[PIPE_PARSE].priority,
+        task_stacks.serial_parser, &task_tcbs.serial_parser, pipe_placement[PIPE_PARSE].core);
+    
+    // Install CDC-ACM driver
+    ESP_LOGI(TAG, "Installing CDC-ACM driver");
+    // Attach callback set at install, so a printer plugged in at boot reports
+    // its serial number too. The rest are the driver's defaults.
+    const cdc_acm_host_driver_config_t cdc_config = {
+        .driver_task_stack_size = 4096,
+        .driver_task_priority = 10,
+        .xCoreID = pipe_placement[PIPE_USB].core,
+        .new_dev_cb = handle_new_dev,
+    };
+    ESP_ERROR_CHECK(cdc_acm_host_install(&cdc_config));
+
+    // Queues and client table first: the printer task and the server both use them
+    ws_clients_init();
+    gcode_window_setup();
+
+    // Start WebSocket message sender task - core 1 by default (networking, isolated from USB)
+    ws_sender_task_handle = xTaskCreateStaticPinnedToCore(ws_sender_task, "ws_sender", WS_SENDER_TASK_STACK,
+        NULL, pipe_placement[PIPE_FANOUT].priority, task_stacks.ws_sender, &task_tcbs.ws_sender,
+        pipe_placement[PIPE_FANOUT].core);
+
+    // Start G-code command queue sender task - core 1 by default
+    gcode_sender_task_handle = xTaskCreateStaticPinnedToCore(gcode_sender_task, "gcode_sender",
+        GCODE_SENDER_TASK_STACK, NULL, pipe_placement[PIPE_GCODE].priority, task_stacks.gcode_sender,
+        &task_tcbs.gcode_sender, pipe_placement[PIPE_GCODE].core);
+
+    // The printer can come up while WiFi is still associating
+    xTaskCreateStaticPinnedToCore(printer_connect_task, "printer_conn", PRINTER_CONNECT_TASK_STACK, NULL, 5,
+                                  task_stacks.printer_connect, &task_tcbs.printer_connect, 0);
+    
+    // Initialize WiFi
+    wifi_init_sta();
+    
+    // Initialize mDNS
+    ESP_ERROR_CHECK(mdns_init());
+    mdns_hostname_set(MDNS_HOSTNAME);
+    
+    char mdns_name[64];
+    snprintf(mdns_name, sizeof(mdns_name), "Prusa Core One Monitor %s", FIRMWARE_VERSION);
+    mdns_instance_name_set(mdns_name);
+    mdns_services_start();
+    ESP_LOGI(TAG, "mDNS started: http://coreone.local/");
+
+    // Needs the network for its clock, not for recording
+    recorder_start();
+    spool_init();
+    
+    // Start web server now; it serves the embedded page until the remote one is ready
+    start_webserver();
+    boot_metric_mark(&boot_metrics.server_us, "Web server started");
+
+#if ENABLE_MQTT
+    mqtt_start();
+#endif
+#if ENABLE_UDP_TELEMETRY
+    udp_telemetry_start();
+#endif
+
+#if ENABLE_REMOTE_HTML
+    xTaskCreatePinnedToCore(boot_html_task, "boot_html", HTML_REFRESH_TASK_STACK, NULL, 4, NULL, 1);
+#else
+    ESP_LOGI(TAG, "Remote HTML fetching disabled - using embedded HTML only");
+#endif
+    
+    // LED blink, task stats, monitor report and keepalive pings
+    housekeeping_start();
+    
+    ESP_LOGI(TAG, "=== System Ready ===");
+    ESP_LOGI(TAG, "Access web interface at:");
+    ESP_LOGI(TAG, "  - http://coreone.local/");
+    ESP_LOGI(TAG, "  - WebSocket: ws://coreone.local/ws");
+    ESP_LOGI(TAG, "  - Manual HTML refresh: http://coreone.local/refresh");
+    ESP_LOGI(TAG, "  - Reboot: http://coreone.local/reboot");
+    ESP_LOGI(TAG, "Debug logging: GPIO %d (connect to monitoring device RX)", DEBUG_UART_TX_PIN);
+}
@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+"""WebSocket fan-out soak test for the Prusa Core One bridge.
+
+Connects N clients to /ws, some of them deliberately slow readers, and turns
+on the device's synthetic telemetry source (SYNTH:<frames/s>:<pad>). Every
+client speaks the page's protocol: CONNECT, SUB:, TRACE:1, and it answers the
+monitor's pings from its read loop, so a reader too slow to pong in time gets
+evicted just like a stalled browser tab.
+
+Reported per client and in total: synth frames delivered and frames/s, frames
+missed (gaps in the sequence: ring overruns), temperature frames (conflated
+in the state slot), evictions and rejected connects, and device-side latency
+percentiles from each frame's _trace.age_us. /metrics is scraped before and
+after for the device's own drop, overrun, eviction and socket purge counters.
+
+    pip install websockets
+    tools/ws_soak.py 192.168.1.50 --clients 4 --slow 1 --rate 200 --duration 60
+
+The exit status is non-zero if a fast client missed frames or was evicted.
+"""
+
+import argparse
+import asyncio
+import json
+import re
+import sys
+import time
+import urllib.request
+
+import websockets
+
+
+class ClientStats:
+    def __init__(self, name, slow):
+        self.name = name
+        self.slow = slow
+        self.synth = 0
+        self.temperature = 0
+        self.missed = 0
+        self.last_seq = None
+        self.latency_us = []
+        self.evictions = 0
+        self.rejected = 0
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def scrape_metrics(host):
+    """Counters of interest from GET /metrics, keyed by full series name."""
+    try:
+        with urllib.request.urlopen(f'http://{host}/metrics', timeout=5) as resp:
+            text = resp.read().decode()
+    except OSError as err:
+        print(f'/metrics unavailable: {err}', file=sys.stderr)
+        return {}
+    wanted = re.compile(r'^(prusa_ws_frames_(?:sent|dropped)_total\{type="(?:debug|temperature)"\}'
+                        r'|prusa_ws_client_overruns_total\{[^}]*\}'
+                        r'|prusa_ws_send_errors_total|prusa_heap_free_bytes|prusa_heap_min_free_bytes'
+                        r'|prusa_http_sockets_purged_total|prusa_ws_evicted_sockets_closed_total)'
+                        r' (\d+)$')
+    values = {}
+    for line in text.splitlines():
+        m = wanted.match(line)
+        if m:
+            values[m.group(1)] = int(m.group(2))
+    return values
+
+
+class Rejected(Exception):
+    """The bridge had no free client slot: CONNECT got no snapshot back."""
+
+
+async def run_client(args, stats, stop):
+    uri = f'ws://{args.host}/ws'
+    while not stop.is_set():
+        try:
+            async with websockets.connect(uri, max_queue=None, ping_interval=None,
+                                          open_timeout=5, close_timeout=1) as ws:
+                await ws.send('CONNECT')
+                await ws.send('SUB:debug,temperature')
+                await ws.send('TRACE:1')
+                stats.last_seq = None
+                await read_frames(args, ws, stats, stop)
+        except websockets.ConnectionClosed:
+            stats.evictions += 1
+        except (Rejected, OSError, asyncio.TimeoutError, websockets.InvalidHandshake):
+            stats.rejected += 1
+        if not stop.is_set():
+            await asyncio.sleep(1)
+
+
+async def read_frames(args, ws, stats, stop):
+    connected = time.monotonic()
+    got_any = False
+    while not stop.is_set():
+        try:
+            frame = await asyncio.wait_for(ws.recv(), timeout=0.5)
+        except asyncio.TimeoutError:
+            if not got_any and time.monotonic() - connected > 3:
+                raise Rejected()
+            continue
+        got_any = True
+        if stats.slow:
+            await asyncio.sleep(args.slow_delay / 1000)
+        if not isinstance(frame, str):
+            continue
+        msg = json.loads(frame)
+        kind = msg.get('type')
+        if kind == 'synth':
+            seq = msg['seq']
+            if stats.last_seq is not None and seq > stats.last_seq + 1:
+                stats.missed += seq - stats.last_seq - 1
+            stats.last_seq = seq
+            stats.synth += 1
+            trace = msg.get('_trace')
+            if trace:
+                stats.latency_us.append(trace['age_us'])
+        elif kind == 'temperature':
+            stats.temperature += 1
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('host', help='bridge address, e.g. 192.168.1.50')
+    parser.add_argument('--clients', type=int, default=4, help='clients in total (default 4)')
+    parser.add_argument('--slow', type=int, default=1, help='of which slow readers (default 1)')
+    parser.add_argument('--slow-delay', type=float, default=50, help='ms a slow reader sleeps per frame')
+    parser.add_argument('--rate', type=int, default=100, help='synthetic frames per second')
+    parser.add_argument('--pad', type=int, default=0, help='filler bytes per synthetic frame')
+    parser.add_argument('--duration', type=float, default=30, help='seconds to run')
+    args = parser.parse_args()
+
+    before = scrape_metrics(args.host)
+    clients = [ClientStats(f'{"slow" if i < args.slow else "fast"}{i}', i < args.slow)
+               for i in range(args.clients)]
+    stop = asyncio.Event()
+    tasks = [asyncio.create_task(run_client(args, c, stop)) for c in clients]
+
+    # A separate short-lived connection drives the source, so it does not
+    # take a client slot for the whole run
+    await asyncio.sleep(2)
+    async with websockets.connect(f'ws://{args.host}/ws', ping_interval=None) as ctl:
+        await ctl.send(f'SYNTH:{args.rate}:{args.pad}')
+    started = time.monotonic()
+    try:
+        await asyncio.sleep(args.duration)
+    finally:
+        async with websockets.connect(f'ws://{args.host}/ws', ping_interval=None) as ctl:
+            await ctl.send('SYNTH:0')
+    elapsed = time.monotonic() - started
+    await asyncio.sleep(1)
+    stop.set()
+    await asyncio.gather(*tasks)
+    after = scrape_metrics(args.host)
+
+    print(f'\n{args.clients} clients ({args.slow} slow, {args.slow_delay:.0f} ms/frame), '
+          f'{args.rate} frames/s, {args.pad} pad bytes, {elapsed:.0f} s')
+    print(f'{"client":8} {"synth":>8} {"fps":>8} {"missed":>7} {"temp":>6} {"evict":>6} {"reject":>6} '
+          f'{"p50 us":>8} {"p90 us":>8} {"p99 us":>8} {"max us":>8}')
+    failed = False
+    all_latency = []
+    for c in clients:
+        all_latency += c.latency_us
+        fps = c.synth / elapsed if elapsed else 0
+        print(f'{c.name:8} {c.synth:8} {fps:8.1f} {c.missed:7} {c.temperature:6} {c.evictions:6} '
+              f'{c.rejected:6} {percentile(c.latency_us, 50):8} {percentile(c.latency_us, 90):8} '
+              f'{percentile(c.latency_us, 99):8} {max(c.latency_us, default=0):8}')
+        if not c.slow and (c.missed or c.evictions):
+            failed = True
+    total = sum(c.synth for c in clients)
+    print(f'{"total":8} {total:8} {total / elapsed if elapsed else 0:8.1f} '
+          f'{sum(c.missed for c in clients):7} {sum(c.temperature for c in clients):6} '
+          f'{sum(c.evictions for c in clients):6} {sum(c.rejected for c in clients):6} '
+          f'{percentile(all_latency, 50):8} {percentile(all_latency, 90):8} '
+          f'{percentile(all_latency, 99):8} {max(all_latency, default=0):8}')
+
+    if before and after:
+        print('\nDevice counters (delta):')
+        for key in sorted(after):
+            if key.startswith('prusa_heap'):
+                print(f'  {key} {after[key]}')
+            else:
+                print(f'  {key} {after[key] - before.get(key, 0)}')
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(asyncio.run(main()))